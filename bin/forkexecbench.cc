@@ -2,14 +2,30 @@
 #include "user.h"
 #include "mtrace.h"
 #include "amd64.h"
+#include "kstats.hh"
+#include "libutil.h"
+#include <fcntl.h>
 #include <stdio.h>
 #include <unistd.h>
 
 #define NITERS 1024
 
+static void
+read_kstats(kstats *out)
+{
+  int fd = open("/dev/kstats", O_RDONLY);
+  if (fd < 0)
+    die("Couldn't open /dev/kstats");
+  if (xread(fd, out, sizeof *out) != sizeof *out)
+    die("Short read from /dev/kstats");
+  close(fd);
+}
+
 static void
 execbench(void)
 {
+  kstats before, after;
+  read_kstats(&before);
   u64 s = rdtsc();
   mtenable("xv6-forkexecbench");
   for (int i = 0; i < NITERS; i++) {
@@ -29,7 +45,14 @@ execbench(void)
   mtdisable("xv6-forkexecbench");
 
   u64 e = rdtsc();
+  read_kstats(&after);
   printf("%lu\n", (e-s) / NITERS);
+
+  kstats ks = after - before;
+  if (ks.exec_count)
+    printf("%lu cycles/exec (%lu of %lu execs cached)\n",
+           ks.exec_cycles / ks.exec_count, ks.exec_image_hit_count,
+           ks.exec_count);
 }
 
 int
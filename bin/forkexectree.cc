@@ -1,6 +1,10 @@
 #include "types.h"
 #include "user.h"
+#include "amd64.h"
+#include "kstats.hh"
+#include "libutil.h"
 
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -8,14 +12,32 @@
 #define NCHILD 2
 #define NDEPTH 5
 
+// Depth of the tree, which has NCHILD^ndepth leaves
+static int ndepth = NDEPTH;
+static kstats ks_before;
+static u64 tsc_before;
+
+static void
+read_kstats(kstats *out)
+{
+  int fd = open("/dev/kstats", O_RDONLY);
+  if (fd < 0)
+    die("forkexectree: open /dev/kstats failed");
+  if (xread(fd, out, sizeof *out) != sizeof *out)
+    die("forkexectree: short read from /dev/kstats");
+  close(fd);
+}
+
 void
 forktree(int depth)
 {
   if (depth == 0) {
     printf("%d: forkexectree\n", getpid());
+    read_kstats(&ks_before);
+    tsc_before = rdtsc();
   }
 
-  if (depth >= NDEPTH)
+  if (depth >= ndepth)
     exit(0);
 
   for (int i = 0; i < NCHILD; i++) {
@@ -26,9 +48,10 @@ forktree(int depth)
 
     if (pid == 0) {
       depth++;
-      char depthbuf[16];
+      char ndepthbuf[16], depthbuf[16];
+      snprintf(ndepthbuf, sizeof(ndepthbuf), "%d", ndepth);
       snprintf(depthbuf, sizeof(depthbuf), "%d", depth);
-      const char *av[] = { "forkexectree", depthbuf, 0 };
+      const char *av[] = { "forkexectree", ndepthbuf, depthbuf, 0 };
       int r = execv("forkexectree", const_cast<char * const *>(av));
       die("forkexectree: exec failed %d", r);
     }
@@ -47,17 +70,28 @@ forktree(int depth)
   if (depth > 0)
     exit(0);
 
+  u64 cycles = rdtsc() - tsc_before;
+  kstats ks_after;
+  read_kstats(&ks_after);
+  kstats ks = ks_after - ks_before;
   printf("%d: forkexectree OK\n", getpid());
+  printf("%lu cycles\n", cycles);
+  printf("%lu placed, %lu on another core, %lu on another node\n",
+         ks.sched_place_count, ks.sched_place_remote_count,
+         ks.sched_place_remote_node_count);
   // halt();
 }
 
+// usage: forkexectree [depth]
 int
 main(int ac, char **av)
 {
-  if (ac == 1) {
-    forktree(0);
+  if (ac > 1)
+    ndepth = atoi(av[1]);
+  if (ac > 2) {
+    forktree(atoi(av[2]));
   } else {
-    forktree(atoi(av[1]));
+    forktree(0);
   }
   return 0;
 }
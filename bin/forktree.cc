@@ -1,11 +1,15 @@
 #include "types.h"
 #include "user.h"
 #include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
 
 #define NCHILD 2
 #define NDEPTH 5
 
+// Depth of the tree, which has NCHILD^ndepth leaves
+static int ndepth = NDEPTH;
+
 void
 forktree(void)
 {
@@ -15,7 +19,7 @@ forktree(void)
 
  next_level:
   //printf(1, "pid %d, depth %d\n", getpid(), depth);
-  if (depth >= NDEPTH)
+  if (depth >= ndepth)
     exit(0);
 
   for (int i = 0; i < NCHILD; i++) {
@@ -44,12 +48,18 @@ forktree(void)
     exit(0);
 
   printf("%d: fork tree OK\n", getpid());
+  int forks = 0;
+  for (int d = 0, n = 1; d < ndepth; d++)
+    forks += (n *= NCHILD);
+  printf("%d forks\n", forks);
   // halt();
 }
 
 int
-main(void)
+main(int ac, char **av)
 {
+  if (ac > 1)
+    ndepth = atoi(av[1]);
   forktree();
   return 0;
 }
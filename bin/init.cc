@@ -43,6 +43,9 @@ static struct {
   { "/dev/kstats",    MAJ_KSTATS},
   { "/dev/kmemstats",    MAJ_KMEMSTATS},
   { "/dev/mfsstats",    MAJ_MFSSTATS},
+  { "/dev/syscallstat", MAJ_SYSCALLSTAT},
+  { "/dev/trace",     MAJ_TRACE},
+  { "/dev/topology",  MAJ_TOPOLOGY},
 };
 #endif
 
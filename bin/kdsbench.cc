@@ -0,0 +1,893 @@
+// Host-side microbenchmarks for the kernel's concurrent data
+// structures.  This compiles radix_array, chainhash, seqcount and
+// bit_spinlock straight out of include/ and runs them on Linux so
+// changes to them can be measured on a large machine without booting
+// a VM.  A kmalloc-style per-core freelist is emulated here since the
+// real one is tied to the kernel's page allocator.
+//
+// To build on Linux:
+//  make HW=linux o.linux/bin/kdsbench
+//
+// Each benchmark runs for a fixed time at each thread count and
+// reports operations per second.  If perf_event_open is permitted,
+// it also reports cycles, instructions, and LLC misses per operation.
+// -f csv writes rows tools/bench-compare understands.
+
+#include "types.h"
+#include "amd64.h"
+#include "compiler.h"
+#include "libutil.h"
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include <algorithm>
+#include <atomic>
+#include <new>
+#include <vector>
+
+//
+// Host versions of the kernel symbols the data structures use
+//
+
+void *kmalloc(u64 nbytes, const char *name);
+void kmfree(void *p, u64 nbytes);
+
+#include "radix_array.hh"
+#include "chainhash.hh"
+#include "seqlock.hh"
+#include "bit_spinlock.hh"
+
+void *
+kmalloc(u64 nbytes, const char *name)
+{
+  void *p;
+  if (posix_memalign(&p, CACHELINE, nbytes))
+    return nullptr;
+  return p;
+}
+
+void
+kmfree(void *p, u64 nbytes)
+{
+  free(p);
+}
+
+void
+getcallerpcs(void *v, uintptr_t pcs[], int n)
+{
+  for (int i = 0; i < n; i++)
+    pcs[i] = 0;
+}
+
+// Host threads cannot disable interrupts, so spinlocks just spin.
+// Lock statistics are not gathered.
+spinlock::spinlock(spinlock &&o) : spinlock(o.name) { }
+
+spinlock &
+spinlock::operator=(spinlock &&o)
+{
+  locked.store(0);
+  name = o.name;
+  return *this;
+}
+
+bool
+spinlock::try_acquire()
+{
+  return locked.exchange(1, std::memory_order_acquire) == 0;
+}
+
+void
+spinlock::acquire()
+{
+  while (locked.exchange(1, std::memory_order_acquire) != 0)
+    nop_pause();
+}
+
+void
+spinlock::release()
+{
+  locked.store(0, std::memory_order_release);
+}
+
+// There is no RCU on the host.  Objects retired while a run is in
+// progress are queued and freed once all of its threads have stopped.
+static std::atomic<rcu_freed*> gc_pending;
+
+void
+gc_delayed(rcu_freed *e)
+{
+  rcu_freed *head = gc_pending.load();
+  do {
+    e->_rcu_next = head;
+  } while (!gc_pending.compare_exchange_weak(head, e));
+}
+
+void gc_begin_epoch() { }
+void gc_end_epoch() { }
+
+static void
+gc_drain()
+{
+  rcu_freed *e = gc_pending.exchange(nullptr);
+  while (e) {
+    rcu_freed *next = e->_rcu_next;
+    e->do_gc();
+    e = next;
+  }
+}
+
+//
+// Benchmark framework
+//
+
+enum { max_threads = NCPU };
+
+struct perf_counters
+{
+  u64 cycles, instructions, llc_misses;
+};
+
+// Per-thread state, padded so threads do not share lines.
+struct thread_state
+{
+  u64 ops __mpalign__;
+  u64 aux;
+  perf_counters pc;
+  int fds[3];
+  __padout__;
+};
+
+struct bench_def
+{
+  const char *name;
+  const char *desc;
+  // Set up shared state for a run with nthreads threads
+  void (*setup)(int nthreads);
+  // Run until stop is set, counting operations in ts->ops
+  void (*run)(int tid, int nthreads, thread_state *ts);
+  // Tear down shared state and print any extra results
+  void (*teardown)(int nthreads, thread_state *ts);
+};
+
+static std::atomic<bool> go __mpalign__;
+static std::atomic<bool> stop;
+static std::atomic<int> ready;
+static __padout__ __attribute__((unused));
+static thread_state tstate[max_threads];
+static bool have_perf = true;
+static bool csv;
+
+// Print a benchmark-specific result line.  These go to stderr in CSV
+// mode to keep the output parseable.
+static void __attribute__((__format__(__printf__, 1, 2)))
+note(const char *fmt, ...)
+{
+  va_list ap;
+  va_start(ap, fmt);
+  vfprintf(csv ? stderr : stdout, fmt, ap);
+  va_end(ap);
+}
+
+// A per-thread random number generator.  (libutil's rnd() starts
+// every thread at the same seed.)
+class bench_rnd
+{
+  u64 s_;
+
+public:
+  bench_rnd(int tid) : s_(tid * 0x9e3779b97f4a7c15ull + 1) { }
+
+  u64 operator()()
+  {
+    s_ = s_ * 6364136223846793005ull + 1442695040888963407ull;
+    return s_ >> 16;
+  }
+};
+
+static int
+perf_open(u32 type, u64 config)
+{
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = type;
+  attr.config = config;
+  attr.disabled = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+// Open this thread's counters.  The first failure disables perf
+// counters for the rest of the process.
+static void
+perf_start(thread_state *ts)
+{
+  static const u64 events[3][2] = {
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+  };
+
+  for (int i = 0; i < 3; i++)
+    ts->fds[i] = -1;
+  if (!have_perf)
+    return;
+  for (int i = 0; i < 3; i++) {
+    ts->fds[i] = perf_open(events[i][0], events[i][1]);
+    if (ts->fds[i] < 0) {
+      have_perf = false;
+      return;
+    }
+  }
+  for (int i = 0; i < 3; i++)
+    ioctl(ts->fds[i], PERF_EVENT_IOC_ENABLE, 0);
+}
+
+static void
+perf_stop(thread_state *ts)
+{
+  u64 *out[3] = { &ts->pc.cycles, &ts->pc.instructions, &ts->pc.llc_misses };
+  for (int i = 0; i < 3; i++) {
+    *out[i] = 0;
+    if (ts->fds[i] < 0)
+      continue;
+    ioctl(ts->fds[i], PERF_EVENT_IOC_DISABLE, 0);
+    if (read(ts->fds[i], out[i], sizeof(u64)) != sizeof(u64))
+      *out[i] = 0;
+    close(ts->fds[i]);
+  }
+}
+
+struct thread_arg
+{
+  const bench_def *b;
+  int tid, nthreads, ncpus;
+};
+
+static void*
+bench_thread(void *a)
+{
+  thread_arg *arg = (thread_arg*)a;
+  thread_state *ts = &tstate[arg->tid];
+
+  setaffinity(arg->tid % arg->ncpus);
+  ts->ops = ts->aux = 0;
+  perf_start(ts);
+  ready++;
+  while (!go.load())
+    nop_pause();
+  arg->b->run(arg->tid, arg->nthreads, ts);
+  perf_stop(ts);
+  return nullptr;
+}
+
+//
+// radix_array
+//
+
+// A radix_array value shaped like vmdesc: a lock bit and a set bit
+// in a flags word, plus a payload.
+struct radix_val
+{
+  enum {
+    FLAG_LOCK_BIT = 0,
+    FLAG_LOCK = 1<<FLAG_LOCK_BIT,
+    FLAG_SET = 1<<1,
+  };
+
+  u64 flags;
+  u64 val;
+
+  radix_val() : flags(0), val(0) { }
+  radix_val(u64 v) : flags(FLAG_SET), val(v) { }
+
+  bit_spinlock get_lock()
+  {
+    return bit_spinlock(&flags, FLAG_LOCK_BIT);
+  }
+
+  bool is_set() const
+  {
+    return flags & FLAG_SET;
+  }
+
+  NEW_DELETE_OPS(radix_val);
+};
+
+// Sized like a user address space in pages
+typedef radix_array<radix_val, (1ULL<<36), 4096> bench_radix;
+
+// Keys each thread owns in the private-region benchmarks
+enum { radix_region = 1 << 24 };
+// Keys shared by all threads in the shared benchmarks
+enum { radix_shared = 1 << 16 };
+// Pages per fill, like a small mmap
+enum { radix_fill_pages = 16 };
+
+static bench_radix *radix;
+
+static void
+radix_setup(int nthreads)
+{
+  radix = new bench_radix();
+}
+
+static void
+radix_setup_shared(int nthreads)
+{
+  radix = new bench_radix();
+  // Populate every other page so lookups see a fully expanded tree
+  for (u64 k = 0; k < radix_shared; k += 2)
+    radix->fill(radix->find(k), radix_val(k));
+}
+
+static void
+radix_teardown(int nthreads, thread_state *ts)
+{
+  delete radix;
+  radix = nullptr;
+}
+
+// Each thread maps and unmaps small ranges of its own region, as
+// concurrent mmap/munmap in separate parts of an address space would.
+static void
+radix_fill_run(int tid, int nthreads, thread_state *ts)
+{
+  bench_rnd rnd(tid);
+  u64 base = (u64)tid * radix_region;
+  u64 ops = 0;
+  while (!stop.load(std::memory_order_relaxed)) {
+    u64 k = base + (rnd() % (radix_region / radix_fill_pages)) *
+      radix_fill_pages;
+    auto begin = radix->find(k), end = radix->find(k + radix_fill_pages);
+    {
+      auto l = radix->acquire(begin, end);
+      radix->fill(begin, end, radix_val(k));
+    }
+    {
+      auto l = radix->acquire(begin, end);
+      radix->unset(begin, end);
+    }
+    ops += 2;
+  }
+  ts->ops = ops;
+}
+
+// Every thread looks up random keys in a shared, populated range, as
+// concurrent page faults in one address space would.
+static void
+radix_lookup_run(int tid, int nthreads, thread_state *ts)
+{
+  bench_rnd rnd(tid);
+  u64 ops = 0, hits = 0;
+  while (!stop.load(std::memory_order_relaxed)) {
+    for (int i = 0; i < 64; i++) {
+      auto it = radix->find(rnd() % radix_shared);
+      if (it.is_set())
+        hits += it->val;
+    }
+    ops += 64;
+  }
+  ts->ops = ops;
+  ts->aux = hits;
+}
+
+// Every thread locks and sets single keys in a shared range, like
+// page faults installing pages.  Collisions make this increasingly
+// contended as threads are added.
+static void
+radix_lock_run(int tid, int nthreads, thread_state *ts)
+{
+  bench_rnd rnd(tid);
+  u64 ops = 0;
+  while (!stop.load(std::memory_order_relaxed)) {
+    auto it = radix->find(rnd() % radix_shared);
+    {
+      auto l = radix->acquire(it);
+      radix->fill(it, radix_val(ops));
+    }
+    ops++;
+  }
+  ts->ops = ops;
+}
+
+//
+// chainhash
+//
+
+enum { chain_buckets = 1 << 12 };
+enum { chain_keys = 1 << 14 };
+
+static chainhash<u64, u64> *chain;
+
+static void
+chain_setup(int nthreads)
+{
+  chain = new chainhash<u64, u64>(chain_buckets);
+  for (u64 k = 0; k < chain_keys; k += 2)
+    chain->insert(k, k);
+}
+
+static void
+chain_teardown(int nthreads, thread_state *ts)
+{
+  delete chain;
+  chain = nullptr;
+  gc_drain();
+}
+
+// 90% lookups, 5% inserts, 5% removes on a shared table, roughly
+// half full, like a busy directory cache.
+static void
+chain_run(int tid, int nthreads, thread_state *ts)
+{
+  bench_rnd rnd(tid);
+  u64 ops = 0;
+  while (!stop.load(std::memory_order_relaxed)) {
+    u64 r = rnd();
+    u64 k = (r >> 8) % chain_keys;
+    u64 v;
+    switch (r % 20) {
+    case 0:
+      chain->insert(k, k);
+      break;
+    case 1:
+      chain->remove(k, k);
+      break;
+    default:
+      if (chain->lookup(k, &v) && v != k)
+        die("kdsbench: chainhash returned %lu for %lu", v, k);
+    }
+    ops++;
+  }
+  ts->ops = ops;
+}
+
+//
+// seqcount
+//
+
+// Data protected by the seqcount.  The writer keeps every word
+// equal, so readers can check for torn reads.
+static struct
+{
+  spinlock lock;
+  seqcount<u32> seq;
+  u64 words[8];
+} seqdata __mpalign__;
+
+static void
+seq_setup(int nthreads)
+{
+  memset(seqdata.words, 0, sizeof(seqdata.words));
+}
+
+// With more than one thread, thread 0 writes continuously and the
+// others read; only reads are counted.  aux counts retries.
+static void
+seq_run(int tid, int nthreads, thread_state *ts)
+{
+  u64 ops = 0, retries = 0;
+
+  if (tid == 0 && nthreads > 1) {
+    for (u64 n = 1; !stop.load(std::memory_order_relaxed); n++) {
+      auto l = seqdata.lock.guard();
+      auto w = seqdata.seq.write_begin();
+      for (auto &word : seqdata.words)
+        word = n;
+    }
+    return;
+  }
+
+  while (!stop.load(std::memory_order_relaxed)) {
+    u64 copy[8];
+    auto r = seqdata.seq.read_begin();
+    for (;;) {
+      for (int i = 0; i < 8; i++)
+        copy[i] = ((volatile u64*)seqdata.words)[i];
+      if (!r.do_retry())
+        break;
+      retries++;
+    }
+    for (int i = 1; i < 8; i++)
+      if (copy[i] != copy[0])
+        die("kdsbench: torn seqcount read");
+    ops++;
+  }
+  ts->ops = ops;
+  ts->aux = retries;
+}
+
+static void
+seq_teardown(int nthreads, thread_state *ts)
+{
+  u64 reads = 0, retries = 0;
+  for (int i = 0; i < nthreads; i++) {
+    reads += ts[i].ops;
+    retries += ts[i].aux;
+  }
+  if (reads)
+    note("#   seqlock: %.4f retries/read\n", (double)retries / reads);
+}
+
+//
+// bit_spinlock
+//
+
+static struct
+{
+  u64 word __mpalign__;
+  u64 counter;
+  __padout__;
+} bitlock;
+
+static void
+bitlock_setup(int nthreads)
+{
+  bitlock.word = 0;
+  bitlock.counter = 0;
+}
+
+// Every thread acquires the same bit lock and bumps a counter.
+static void
+bitlock_run(int tid, int nthreads, thread_state *ts)
+{
+  bit_spinlock l(&bitlock.word, 0);
+  u64 ops = 0;
+  while (!stop.load(std::memory_order_relaxed)) {
+    l.acquire();
+    bitlock.counter++;
+    l.release();
+    ops++;
+  }
+  ts->ops = ops;
+}
+
+// Report how evenly the lock was handed out: the min/max ratio of
+// per-thread acquires and Jain's fairness index (1 is perfectly fair,
+// 1/n means one thread got everything).
+static void
+bitlock_teardown(int nthreads, thread_state *ts)
+{
+  u64 total = 0, lo = ~0ull, hi = 0;
+  double sumsq = 0;
+  for (int i = 0; i < nthreads; i++) {
+    total += ts[i].ops;
+    lo = std::min(lo, ts[i].ops);
+    hi = std::max(hi, ts[i].ops);
+    sumsq += (double)ts[i].ops * ts[i].ops;
+  }
+  if (total != bitlock.counter)
+    die("kdsbench: bit_spinlock lost updates (%lu != %lu)",
+        bitlock.counter, total);
+  if (nthreads > 1 && sumsq > 0)
+    note("#   bitlock: min/max %.3f, fairness %.3f\n",
+           hi ? (double)lo / hi : 0.0,
+           (double)total * total / (nthreads * sumsq));
+}
+
+//
+// kmalloc-style freelists
+//
+
+// The same versioned-pointer freelist kmalloc keeps per CPU per size
+// class.  The version in the top 16 bits defeats ABA.
+struct km_header
+{
+  km_header *next;
+};
+
+struct km_freelist
+{
+  std::atomic<u64> head __mpalign__;
+  __padout__;
+
+  static km_header *ptr(u64 v)
+  {
+    u64 i = v & 0xffffffffffffULL;
+    if (i & (1ULL << 47))
+      i += 0xffffULL << 48;
+    return (km_header*)i;
+  }
+
+  static u64 make(km_header *p, u64 old)
+  {
+    return ((old >> 48) + 1) << 48 | ((u64)p & 0xffffffffffffULL);
+  }
+
+  void push(km_header *h)
+  {
+    u64 old = head.load();
+    do {
+      h->next = ptr(old);
+    } while (!head.compare_exchange_weak(old, make(h, old)));
+  }
+
+  km_header *pop()
+  {
+    u64 old = head.load();
+    km_header *h;
+    do {
+      h = ptr(old);
+      if (!h)
+        return nullptr;
+    } while (!head.compare_exchange_weak(old, make(h->next, old)));
+    return h;
+  }
+};
+
+enum { km_objsize = 128 };
+enum { km_batch = 32 };
+enum { km_chunk = 4096 };
+
+static km_freelist km_lists[max_threads];
+static std::vector<void*> km_chunks;
+static pthread_mutex_t km_chunks_lock = PTHREAD_MUTEX_INITIALIZER;
+// Use one freelist for everyone instead of one per thread
+static bool km_global;
+
+// Carve a new page into objects, like kmalloc's morecore
+static void
+km_morecore(km_freelist *fl)
+{
+  char *p = (char*)kmalloc(km_chunk, "kdsbench");
+  if (!p)
+    die("kdsbench: out of memory");
+  pthread_mutex_lock(&km_chunks_lock);
+  km_chunks.push_back(p);
+  pthread_mutex_unlock(&km_chunks_lock);
+  for (char *q = p; q + km_objsize <= p + km_chunk; q += km_objsize)
+    fl->push((km_header*)q);
+}
+
+static void
+km_setup_local(int nthreads)
+{
+  km_global = false;
+  for (auto &fl : km_lists)
+    fl.head = 0;
+}
+
+static void
+km_setup_global(int nthreads)
+{
+  km_setup_local(nthreads);
+  km_global = true;
+}
+
+static void
+km_teardown(int nthreads, thread_state *ts)
+{
+  for (void *p : km_chunks)
+    kmfree(p, km_chunk);
+  km_chunks.clear();
+}
+
+// Allocate and free batches of objects.  In the local variant each
+// thread uses its own freelist, like kmalloc on separate CPUs; the
+// global variant shows the cost of a single shared list.
+static void
+km_run(int tid, int nthreads, thread_state *ts)
+{
+  km_freelist *fl = &km_lists[km_global ? 0 : tid];
+  km_header *objs[km_batch];
+  u64 ops = 0;
+
+  while (!stop.load(std::memory_order_relaxed)) {
+    for (int i = 0; i < km_batch; i++) {
+      while (!(objs[i] = fl->pop()))
+        km_morecore(fl);
+      // Touch the object like a real caller would
+      ((volatile char*)objs[i])[sizeof(km_header)] = i;
+    }
+    for (int i = km_batch - 1; i >= 0; i--)
+      fl->push(objs[i]);
+    ops += 2 * km_batch;
+  }
+  ts->ops = ops;
+}
+
+//
+// Driver
+//
+
+static const bench_def suite[] = {
+  { "radix-fill", "lock/fill/unset ranges in private regions",
+    radix_setup, radix_fill_run, radix_teardown },
+  { "radix-lookup", "lock-free lookups in a shared range",
+    radix_setup_shared, radix_lookup_run, radix_teardown },
+  { "radix-lock", "single-key range locks in a shared range",
+    radix_setup_shared, radix_lock_run, radix_teardown },
+  { "chainhash", "90/5/5 lookup/insert/remove on a shared table",
+    chain_setup, chain_run, chain_teardown },
+  { "seqlock", "reader throughput against one writer",
+    seq_setup, seq_run, seq_teardown },
+  { "bitlock", "one contended bit_spinlock",
+    bitlock_setup, bitlock_run, bitlock_teardown },
+  { "kmalloc-local", "per-thread freelist alloc/free",
+    km_setup_local, km_run, km_teardown },
+  { "kmalloc-global", "shared freelist alloc/free",
+    km_setup_global, km_run, km_teardown },
+};
+
+struct run_result
+{
+  const char *bench;
+  int threads;
+  int rep;
+  double secs;
+  u64 ops;
+  perf_counters pc;
+};
+
+static void
+print_result(const run_result &r)
+{
+  double tput = r.secs > 0 ? r.ops / r.secs : 0;
+  if (csv) {
+    printf("%s,%d,%d,0,%f,%lu,%f,%lu,%lu,%lu\n", r.bench, r.threads, r.rep,
+           r.secs, r.ops, tput, r.pc.cycles, r.pc.instructions,
+           r.pc.llc_misses);
+    return;
+  }
+  printf("%-15s %4d %14.0f", r.bench, r.threads, tput);
+  if (have_perf && r.ops)
+    printf(" %10.1f %10.1f %10.3f", (double)r.pc.cycles / r.ops,
+           (double)r.pc.instructions / r.ops,
+           (double)r.pc.llc_misses / r.ops);
+  printf("\n");
+}
+
+static void
+run_one(const bench_def &b, int nthreads, int rep, int ncpus, double secs)
+{
+  b.setup(nthreads);
+  go = stop = false;
+  ready = 0;
+
+  std::vector<pthread_t> tids(nthreads);
+  std::vector<thread_arg> args(nthreads);
+  for (int i = 0; i < nthreads; i++) {
+    args[i] = thread_arg{&b, i, nthreads, ncpus};
+    if (pthread_create(&tids[i], nullptr, bench_thread, &args[i]))
+      die("kdsbench: pthread_create failed");
+  }
+  while (ready.load() < nthreads)
+    usleep(1000);
+
+  u64 t0 = now_usec();
+  go = true;
+  usleep((useconds_t)(secs * 1e6));
+  stop = true;
+  u64 t1 = now_usec();
+  for (int i = 0; i < nthreads; i++)
+    pthread_join(tids[i], nullptr);
+
+  run_result res = { b.name, nthreads, rep, (t1 - t0) / 1e6, 0, {} };
+  for (int i = 0; i < nthreads; i++) {
+    res.ops += tstate[i].ops;
+    res.pc.cycles += tstate[i].pc.cycles;
+    res.pc.instructions += tstate[i].pc.instructions;
+    res.pc.llc_misses += tstate[i].pc.llc_misses;
+  }
+  print_result(res);
+  b.teardown(nthreads, tstate);
+}
+
+static std::vector<int>
+parse_threads(char *arg)
+{
+  std::vector<int> out;
+  for (char *tok = arg, *next; tok; tok = next) {
+    next = strchr(tok, ',');
+    if (next)
+      *next++ = 0;
+    int n = atoi(tok);
+    if (n <= 0 || n > max_threads)
+      die("kdsbench: thread count must be 1..%d", max_threads);
+    out.push_back(n);
+  }
+  return out;
+}
+
+static void
+usage(const char *argv0)
+{
+  fprintf(stderr, "Usage: %s [options] [bench...]\n", argv0);
+  fprintf(stderr,
+          "  -t list   Comma-separated thread counts (default: 1,2,4,...,ncpus)\n"
+          "  -d secs   Seconds per run (default: 1)\n"
+          "  -r n      Runs per thread count (default: 1)\n"
+          "  -f fmt    Output format: text (default) or csv\n"
+          "Benchmarks:\n");
+  for (auto &b : suite)
+    fprintf(stderr, "  %-15s %s\n", b.name, b.desc);
+  exit(2);
+}
+
+int
+main(int ac, char **av)
+{
+  std::vector<int> threads;
+  double secs = 1;
+  int reps = 1;
+
+  int opt;
+  while ((opt = getopt(ac, av, "t:d:r:f:")) != -1) {
+    switch (opt) {
+    case 't':
+      threads = parse_threads(optarg);
+      break;
+    case 'd':
+      secs = atof(optarg);
+      if (secs <= 0)
+        usage(av[0]);
+      break;
+    case 'r':
+      reps = atoi(optarg);
+      if (reps <= 0)
+        usage(av[0]);
+      break;
+    case 'f':
+      if (strcmp(optarg, "csv") == 0)
+        csv = true;
+      else if (strcmp(optarg, "text") != 0)
+        usage(av[0]);
+      break;
+    default:
+      usage(av[0]);
+    }
+  }
+
+  int ncpus = std::max(1L, std::min((long)max_threads,
+                                     sysconf(_SC_NPROCESSORS_ONLN)));
+  if (threads.empty()) {
+    for (int n = 1; n < ncpus; n *= 2)
+      threads.push_back(n);
+    threads.push_back(ncpus);
+  }
+
+  std::vector<const bench_def*> benches;
+  for (int i = optind; i < ac; i++) {
+    const bench_def *found = nullptr;
+    for (auto &b : suite)
+      if (strcmp(b.name, av[i]) == 0)
+        found = &b;
+    if (!found)
+      die("kdsbench: unknown benchmark %s", av[i]);
+    benches.push_back(found);
+  }
+  if (benches.empty())
+    for (auto &b : suite)
+      benches.push_back(&b);
+
+  // Probe once so the header matches what the runs will report
+  perf_start(&tstate[0]);
+  perf_stop(&tstate[0]);
+
+  if (csv)
+    printf("bench,cores,rep,status,secs,ops,throughput,cycles,"
+           "instructions,llc_misses\n");
+  else if (have_perf)
+    printf("%-15s %4s %14s %10s %10s %10s\n", "# bench", "thr", "ops/sec",
+           "cycles/op", "instrs/op", "llcmiss/op");
+  else
+    printf("%-15s %4s %14s  (perf counters unavailable)\n", "# bench", "thr",
+           "ops/sec");
+
+  for (auto b : benches)
+    for (int n : threads)
+      for (int i = 0; i < reps; i++)
+        run_one(*b, n, i, ncpus, secs);
+  return 0;
+}
@@ -0,0 +1,179 @@
+// Kernel event tracer.  This enables the kernel's tracepoints, streams
+// the binary trace records from /dev/trace to a file while a command
+// runs (or for a fixed time), and then disables them.  Convert the
+// file to Chrome trace-event JSON with tools/ktrace-json.
+
+#include "types.h"
+#include "user.h"
+#include "pthread.h"
+#include "trace.h"
+#include "libutil.h"
+#include "xsys.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include <atomic>
+#include <vector>
+
+static const struct {
+  const char *name;
+  u32 mask;
+} categories[] = {
+  { "sched", TRACE_SCHED },
+  { "vm", TRACE_VM },
+  { "gc", TRACE_GC },
+  { "refcache", TRACE_REFCACHE },
+  { "ipi", TRACE_IPI },
+  { "futex", TRACE_FUTEX },
+  { "disk", TRACE_DISK },
+  { "all", TRACE_ALL },
+};
+
+static int tracefd, outfd;
+static std::atomic<bool> done;
+static u64 nrecs;
+
+// Copy everything currently in the kernel's rings to the output file,
+// or discard it if keep is false.  Returns the number of records.
+static size_t
+drain(bool keep = true)
+{
+  static trace_rec buf[512];
+  size_t total = 0;
+  int r;
+  while ((r = read(tracefd, buf, sizeof(buf))) > 0) {
+    if (keep)
+      xwrite(outfd, buf, r);
+    total += r / sizeof(buf[0]);
+  }
+  if (r < 0)
+    die("ktrace: read failed");
+  if (keep)
+    nrecs += total;
+  return total;
+}
+
+static void*
+drainer(void *)
+{
+  while (!done.load()) {
+    // Back off while the rings are nearly empty
+    if (drain() < 64)
+      nsleep(10*1000*1000);
+  }
+  return nullptr;
+}
+
+static u32
+parse_mask(char *arg)
+{
+  u32 mask = 0;
+  for (char *tok = arg, *next; tok; tok = next) {
+    next = strchr(tok, ',');
+    if (next)
+      *next++ = 0;
+    bool found = false;
+    for (auto &c : categories) {
+      if (strcmp(tok, c.name) == 0) {
+        mask |= c.mask;
+        found = true;
+      }
+    }
+    if (!found)
+      die("ktrace: unknown category %s", tok);
+  }
+  return mask;
+}
+
+static void
+command(char cmd, u32 mask)
+{
+  char buf[16];
+  snprintf(buf, sizeof(buf), "%c%x", cmd, mask);
+  int n = strlen(buf);
+  if (write(tracefd, buf, n) != n)
+    die("ktrace: write failed");
+}
+
+static void
+usage(const char *argv0)
+{
+  fprintf(stderr, "Usage: %s [options] [command...]\n", argv0);
+  fprintf(stderr, "  -e cats   Comma-separated categories to trace (default: all)\n"
+                  "            sched, vm, gc, refcache, ipi, futex, disk\n"
+                  "  -o file   Write records to FILE (default: /ktrace.out)\n"
+                  "  -d secs   Without a command, trace for SECS seconds (default: 5)\n");
+  exit(2);
+}
+
+int
+main(int ac, char *av[])
+{
+  u32 mask = TRACE_ALL;
+  const char *out = "/ktrace.out";
+  int duration = 5;
+
+  int opt;
+  while ((opt = getopt(ac, av, "e:o:d:")) != -1) {
+    switch (opt) {
+    case 'e':
+      mask = parse_mask(optarg);
+      break;
+    case 'o':
+      out = optarg;
+      break;
+    case 'd':
+      duration = atoi(optarg);
+      if (duration <= 0)
+        die("ktrace: bad -d argument");
+      break;
+    default:
+      usage(av[0]);
+    }
+  }
+
+  tracefd = open("/dev/trace", O_RDWR);
+  if (tracefd < 0)
+    die("ktrace: open /dev/trace failed");
+  unlink(out);
+  outfd = open(out, O_WRONLY|O_CREAT, 0666);
+  if (outfd < 0)
+    die("ktrace: open %s failed", out);
+
+  // Throw away anything a previous trace left behind
+  drain(false);
+  command(TRACE_CMD_START, mask);
+
+  pthread_t tid;
+  xthread_create(&tid, 0, drainer, nullptr);
+
+  if (optind < ac) {
+    int pid = fork();
+    if (pid < 0)
+      die("ktrace: fork failed");
+    if (pid == 0) {
+      std::vector<const char *> args(av + optind, av + ac);
+      args.push_back(nullptr);
+      execv(args[0], const_cast<char * const *>(args.data()));
+      die("ktrace: exec failed");
+    }
+    waitpid(pid, nullptr, 0);
+  } else {
+    sleep(duration);
+  }
+
+  command(TRACE_CMD_STOP, 0);
+  done.store(true);
+  xpthread_join(tid);
+  drain();
+
+  close(outfd);
+  close(tracefd);
+  fprintf(stderr, "ktrace: %lu records written to %s\n", nrecs, out);
+  return 0;
+}
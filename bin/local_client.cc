@@ -11,6 +11,9 @@
 #define CLIENT  "/mysocket"
 #endif
 
+#include "amd64.h"
+#include "local_stream.h"
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -42,7 +45,60 @@ make_named_socket(const char *filename)
   }
   return sock;
 }
-     
+
+// Stream mode.  With bytes <= 0, send -bytes (default 64) byte echo
+// requests and report the round-trip latency.  Otherwise stream
+// nmsg bytes-sized sink requests and report the throughput; the last
+// request asks for an ack so the time covers delivery.
+static void
+stream_client(int nmsg, int bytes)
+{
+  struct sockaddr_un name;
+  struct stream_hdr hdr;
+  bool echo = bytes <= 0;
+  size_t len = echo ? (bytes ? -bytes : 64) : bytes;
+  char *buf;
+  int sock;
+
+  if (len > STREAM_MAXMSG)
+    die ("message too long");
+  buf = (char*)malloc(len);
+  memset(buf, 'x', len);
+
+  sock = socket (PF_LOCAL, SOCK_STREAM, 0);
+  if (sock < 0)
+    die ("socket");
+  name.sun_family = AF_LOCAL;
+  strcpy (name.sun_path, SERVER);
+  if (connect (sock, (struct sockaddr *) &name, SUN_LEN (&name)) < 0)
+    die ("connect");
+
+  hdr.op = echo ? STREAM_ECHO : STREAM_SINK;
+  hdr.len = len;
+  u64 t0 = rdtsc();
+  for (int i = 0; i < nmsg; i++) {
+    hdr.ack = (i == nmsg - 1);
+    if (sendall(sock, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+        sendall(sock, buf, len) != (ssize_t)len)
+      die ("write (client)");
+    if (echo && recvall(sock, buf, len) != (ssize_t)len)
+      die ("read (client)");
+  }
+  if (!echo && nmsg && recvall(sock, buf, 1) != 1)
+    die ("read (client)");
+  u64 t1 = rdtsc();
+
+  if (echo)
+    printf("%lu cycles/roundtrip (%lu bytes)\n",
+           nmsg ? (t1 - t0) / nmsg : 0, len);
+  else
+    printf("%lu bytes/kcycle (%lu byte writes)\n",
+           t1 > t0 ? (u64)nmsg * len * 1000 / (t1 - t0) : 0, len);
+
+  free(buf);
+  close(sock);
+}
+
 int
 main(int argc, char *argv[])
 {
@@ -54,8 +110,13 @@ main(int argc, char *argv[])
   int nbytes;
   int nmsg;
 
+  if (argc >= 3 && strcmp(argv[1], "-s") == 0) {
+    stream_client(atoi(argv[2]), argc >= 4 ? atoi(argv[3]) : 0);
+    return 0;
+  }
+
   if (argc < 2)
-    die("usage: %s nmessages", argv[0]);
+    die("usage: %s nmessages | -s nmessages [bytes]", argv[0]);
 
   nmsg = atoi(argv[1]);
      
@@ -10,6 +10,9 @@
 #define SERVER  "/serversocket"
 #endif
 
+#include "amd64.h"
+#include "local_stream.h"
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -22,13 +25,13 @@
 int sock;
 
 int
-make_named_socket(const char *filename)
+make_named_socket(const char *filename, int type)
 {
   struct sockaddr_un name;
   int sock;
   size_t size;
 
-  sock = socket (PF_LOCAL, SOCK_DGRAM, 0);
+  sock = socket (PF_LOCAL, type, 0);
   if (sock < 0) {
     die ("socket");
   }
@@ -78,7 +81,51 @@ thread(void* x)
   }
 }
 
-     
+// Serve one stream connection.  Each request is a stream_hdr
+// followed by len bytes; echo requests get the bytes back and sink
+// requests get a one-byte ack once all of them have arrived.
+static void*
+stream_thread(void* x)
+{
+  int fd = (uintptr_t)x;
+  char *buf = (char*)malloc(STREAM_MAXMSG);
+  struct stream_hdr hdr;
+
+  while (recvall(fd, &hdr, sizeof(hdr)) == sizeof(hdr)) {
+    if (hdr.len > STREAM_MAXMSG)
+      die ("stream request too long (server)");
+    if (recvall(fd, buf, hdr.len) != (ssize_t)hdr.len)
+      die ("read (server)");
+    if (hdr.op == STREAM_ECHO) {
+      if (sendall(fd, buf, hdr.len) != (ssize_t)hdr.len)
+        die ("write (server)");
+    } else if (hdr.op == STREAM_SINK && hdr.ack) {
+      if (sendall(fd, buf, 1) != 1)
+        die ("write (server)");
+    }
+  }
+  free(buf);
+  close(fd);
+  return nullptr;
+}
+
+static void
+stream_server(void)
+{
+  pthread_t tid;
+
+  sock = make_named_socket (SERVER, SOCK_STREAM);
+  if (listen (sock, 16) < 0)
+    die ("listen");
+
+  while (1) {
+    int fd = accept (sock, nullptr, nullptr);
+    if (fd < 0)
+      die ("accept");
+    pthread_create(&tid, nullptr, stream_thread, (void*)(long)fd);
+  }
+}
+
 int
 main (int argc, char *argv[])
 {
@@ -87,12 +134,17 @@ main (int argc, char *argv[])
      
   unlink (SERVER);
 
+  if (argc >= 2 && strcmp(argv[1], "-s") == 0) {
+    stream_server();
+    return 0;
+  }
+
   if (argc < 2)
-    die("usage: %s nthreads", argv[0]);
+    die("usage: %s nthreads | -s", argv[0]);
 
   nthread = atoi(argv[1]);
      
-  sock = make_named_socket (SERVER);
+  sock = make_named_socket (SERVER, SOCK_DGRAM);
 
   for (int i = 0; i < nthread; i++)
     pthread_create(&tid, nullptr, thread, (void*)(long)i);
@@ -0,0 +1,42 @@
+// Request framing shared by local_client and local_server in
+// SOCK_STREAM mode.
+
+#include <sys/socket.h>
+
+// Largest request payload
+#define STREAM_MAXMSG (1 << 20)
+
+enum { STREAM_ECHO = 1, STREAM_SINK = 2 };
+
+struct stream_hdr
+{
+  unsigned op;                  // STREAM_ECHO or STREAM_SINK
+  unsigned ack : 1;             // SINK: reply with one byte when done
+  unsigned len : 31;            // Payload bytes following the header
+};
+
+static ssize_t
+recvall(int fd, void *buf, size_t n)
+{
+  size_t done = 0;
+  while (done < n) {
+    ssize_t r = recv(fd, (char*)buf + done, n - done, 0);
+    if (r <= 0)
+      return done ? done : r;
+    done += r;
+  }
+  return done;
+}
+
+static ssize_t
+sendall(int fd, const void *buf, size_t n)
+{
+  size_t done = 0;
+  while (done < n) {
+    ssize_t r = send(fd, (const char*)buf + done, n - done, 0);
+    if (r <= 0)
+      return done ? done : r;
+    done += r;
+  }
+  return done;
+}
@@ -1,3 +1,8 @@
+// Run a command with lock statistics enabled and report the lock
+// classes that were contended, most total wait first.  For each class
+// this prints wait and hold time histograms and the call sites that
+// waited longest.  The summary table is also saved to /lockstat.last.
+
 #include "types.h"
 #include "user.h"
 #include <fcntl.h>
@@ -6,6 +11,7 @@
 #include <stdio.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <vector>
 
 static void
@@ -15,10 +21,50 @@ xwrite(int fd, char c)
     die("lockstat: write failed");
 }
 
+static void
+print_hist(const char *what, const u64 *hist)
+{
+  u64 max = 0;
+  for (int i = 0; i < LOCKSTAT_BUCKETS; i++)
+    max = std::max(max, hist[i]);
+  if (max == 0)
+    return;
+
+  printf("  %s cycles:\n", what);
+  for (int i = 0; i < LOCKSTAT_BUCKETS; i++) {
+    if (hist[i] == 0)
+      continue;
+    int bar = (hist[i] * 40 + max - 1) / max;
+    printf("    >= %-12lu %10lu ", i ? 1ul << i : 0ul, hist[i]);
+    for (int j = 0; j < bar; j++)
+      printf("#");
+    printf("\n");
+  }
+}
+
+static void
+print_sites(const struct lockstat &ls)
+{
+  if (ls.sites[0].contends == 0)
+    return;
+
+  printf("  contending call sites:\n");
+  for (int i = 0; i < LOCKSTAT_SITES; i++) {
+    const struct lockstat_site &s = ls.sites[i];
+    if (s.contends == 0)
+      break;
+    printf("    %10lu cycles %8lu contends ", s.wait, s.contends);
+    for (int j = 0; j < LOCKSTAT_DEPTH && s.pcs[j]; j++)
+      printf(" %#lx", s.pcs[j]);
+    printf("\n");
+  }
+}
+
 static void
 stats(void)
 {
   static const u64 sz = sizeof(struct lockstat);
+  std::vector<struct lockstat> all;
   struct lockstat ls;
   int sfd, fd;
   int r;
@@ -27,14 +73,6 @@ stats(void)
   if (fd < 0)
     die("lockstat: open failed");
 
-  unlink("/lockstat.last");
-  sfd = open("/lockstat.last", O_RDWR|O_CREAT, 0666);
-  if (sfd < 0)
-    die("lockstat: open failed");
-
-  printf("## name acquires contends locking locked\n");
-  dprintf(sfd, "## name acquires contends locking locked\n");
-  
   while (1) {
     r = read(fd, &ls, sz);
     if (r < 0)
@@ -43,25 +81,37 @@ stats(void)
       break;
     if (r != sz)
       die("lockstat: unexpected read");
-
-    u64 acquires = 0, contends = 0,
-      locking = 0, locked = 0;
-    
-    for (int i = 0; i < NCPU; i++) {
-      acquires += ls.cpu[i].acquires;
-      contends += ls.cpu[i].contends;
-      locking += ls.cpu[i].locking;
-      locked += ls.cpu[i].locked;
-    }
-    if (contends > 0) {
-      printf("%s %lu %lu %lu %lu\n", 
-             ls.name, acquires, contends, locking, locked);
-      dprintf(sfd, "%s %lu %lu %lu %lu\n",
-             ls.name, acquires, contends, locking, locked);
-    }
+    if (ls.contends > 0)
+      all.push_back(ls);
   }
+  close(fd);
 
+  std::sort(all.begin(), all.end(),
+            [](const struct lockstat &a, const struct lockstat &b) {
+              return a.locking > b.locking;
+            });
+
+  unlink("/lockstat.last");
+  sfd = open("/lockstat.last", O_RDWR|O_CREAT, 0666);
+  if (sfd < 0)
+    die("lockstat: open failed");
+
+  printf("## name acquires contends locking locked\n");
+  dprintf(sfd, "## name acquires contends locking locked\n");
+  for (auto &l : all) {
+    printf("%s %lu %lu %lu %lu\n",
+           l.name, l.acquires, l.contends, l.locking, l.locked);
+    dprintf(sfd, "%s %lu %lu %lu %lu\n",
+            l.name, l.acquires, l.contends, l.locking, l.locked);
+  }
   close(sfd);
+
+  for (auto &l : all) {
+    printf("\n%s\n", l.name);
+    print_hist("wait", l.wait_hist);
+    print_hist("hold", l.hold_hist);
+    print_sites(l);
+  }
 }
 
 int
@@ -87,7 +137,7 @@ main(int ac, char * const av[])
     execv(args[0], const_cast<char * const *>(args.data()));
     die("lockstat: exec failed");
   }
-  
+
   wait(NULL);
   xwrite(fd, '2');
   stats();
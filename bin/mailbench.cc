@@ -3,6 +3,9 @@
 #include "spinbarrier.hh"
 #include "libutil.h"
 #include "xsys.h"
+#if defined(XV6_USER)
+#include "kstats.hh"
+#endif
 
 #include <fcntl.h>
 #include <spawn.h>
@@ -27,6 +30,10 @@ using std::string;
 enum { warmup_secs = 1 };
 enum { duration = 5 };
 
+// Start mail-enqueue on the spawning thread's core rather than
+// letting the kernel place it.
+static bool spawn_local = false;
+
 const char *message =
   "Received: from incoming.csail.mit.edu (incoming.csail.mit.edu [128.30.2.16])\n"
   "        by metroplex (Cyrus v2.2.13-Debian-2.2.13-14+lenny5) with LMTPA;\n"
@@ -97,6 +104,19 @@ xwaitpid(int pid, const char *cmd)
     die("status %d from %s", status, cmd);
 }
 
+#if defined(XV6_USER)
+static void
+read_kstats(kstats *out)
+{
+  int fd = open("/dev/kstats", O_RDONLY);
+  if (fd < 0)
+    die("Couldn't open /dev/kstats");
+  if (xread(fd, out, sizeof *out) != sizeof *out)
+    die("Short read from /dev/kstats");
+  close(fd);
+}
+#endif
+
 static void
 do_mua(int cpu, string spooldir, string msgpath, size_t batch_size)
 {
@@ -119,6 +139,16 @@ do_mua(int cpu, string spooldir, string msgpath, size_t batch_size)
   argv.push_back("user");
   argv.push_back(nullptr);
 
+#if defined(XV6_USER)
+  posix_spawnattr_t attr;
+  posix_spawnattr_init(&attr);
+  if (spawn_local && (errno = posix_spawnattr_setcpu_np(&attr, cpu)))
+    edie("posix_spawnattr_setcpu_np failed");
+  posix_spawnattr_t *attrp = &attr;
+#else
+  posix_spawnattr_t *attrp = nullptr;
+#endif
+
   bar.join();
 
   bool mywarmup = true;
@@ -152,7 +182,7 @@ do_mua(int cpu, string spooldir, string msgpath, size_t batch_size)
         if ((errno = posix_spawn_file_actions_adddup2(&actions, msgfd, 0)))
           edie("posix_spawn_file_actions_adddup2 failed");
       }
-      if ((errno = posix_spawn(&pid, argv[0], &actions, nullptr,
+      if ((errno = posix_spawn(&pid, argv[0], &actions, attrp,
                                const_cast<char *const*>(argv.data()), environ)))
         edie("posix_spawn failed");
       if ((errno = posix_spawn_file_actions_destroy(&actions)))
@@ -230,6 +260,7 @@ usage(const char *argv0)
   fprintf(stderr, "     N      Spool in batches of size N\n");
   fprintf(stderr, "     inf    Spool in unbounded batches\n");
   fprintf(stderr, "  -p        Use delivery process pooling\n");
+  fprintf(stderr, "  -l        Spawn mail-enqueue on the client's core (xv6)\n");
   exit(2);
 }
 
@@ -240,7 +271,7 @@ main(int argc, char **argv)
   size_t batch_size = 0;
   bool pool = false;
   int opt;
-  while ((opt = getopt(argc, argv, "a:b:p")) != -1) {
+  while ((opt = getopt(argc, argv, "a:b:pl")) != -1) {
     switch (opt) {
     case 'a':
       alt_str = optarg;
@@ -254,6 +285,9 @@ main(int argc, char **argv)
     case 'p':
       pool = true;
       break;
+    case 'l':
+      spawn_local = true;
+      break;
     default:
       usage(argv[0]);
     }
@@ -307,9 +341,14 @@ main(int argc, char **argv)
     printf(" --batch-size=inf");
   else
     printf(" --batch-size=%zu", batch_size);
-  printf(" --pool=%s\n", pool ? "true" : "false");
+  printf(" --pool=%s", pool ? "true" : "false");
+  printf(" --spawn-local=%s\n", spawn_local ? "true" : "false");
 
   // Run benchmark
+#if defined(XV6_USER)
+  kstats ks_before, ks_after;
+  read_kstats(&ks_before);
+#endif
   bar.init(nthreads + 1);
 
   std::thread timer(timer_thread);
@@ -350,6 +389,23 @@ main(int argc, char **argv)
     printf("%lu messages/sec\n", messages * 1000000 / usec);
   }
 
+#if defined(XV6_USER)
+  // Includes warmup and the queue manager's shutdown
+  read_kstats(&ks_after);
+  kstats ks = ks_after - ks_before;
+  if (ks.exec_count) {
+    printf("%lu execs\n", ks.exec_count);
+    printf("%lu cycles/exec\n", ks.exec_cycles / ks.exec_count);
+    printf("%lu cached execs\n", ks.exec_image_hit_count);
+  }
+  if (ks.sched_place_count) {
+    printf("%lu placed processes\n", ks.sched_place_count);
+    printf("%lu placed on another core\n", ks.sched_place_remote_count);
+    printf("%lu placed on another node\n",
+           ks.sched_place_remote_node_count);
+  }
+#endif
+
   printf("\n");
   return 0;
 }
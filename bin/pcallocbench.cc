@@ -0,0 +1,180 @@
+// Producer/consumer malloc benchmark.  Producer threads allocate
+// blocks and hand them to consumer threads through per-pair rings;
+// consumers free them.  Every block is freed by a different thread
+// than allocated it, which is the pattern that makes an allocator
+// with purely thread-local free lists grow without bound.  Since
+// every block is freed by the end, the memory still resident after
+// the threads exit is what the allocator failed to return.
+
+#if defined(XV6_USER)
+#include "pthread.h"
+#include "kstats.hh"
+#include "libutil.h"
+#include <fcntl.h>
+#else
+#include <pthread.h>
+#endif
+#include "amd64.h"
+#include "xsys.h"
+#include <atomic>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+enum { RING = 256 };
+
+struct ring
+{
+  std::atomic<uint64_t> head;   // Next slot to fill (producer)
+  char pad0[64 - sizeof(std::atomic<uint64_t>)];
+  std::atomic<uint64_t> tail;   // Next slot to drain (consumer)
+  char pad1[64 - sizeof(std::atomic<uint64_t>)];
+  void *slots[RING];
+};
+
+static pthread_barrier_t bar;
+static ring *rings;
+static int npair;
+static int niter;
+static size_t maxsize;
+
+// Return the bytes of memory this process has resident.  sv6 has no
+// per-process count, so there this is the number of pages the whole
+// system faulted in minus the pages MADV_DONTNEED released, which is
+// only meaningful as a difference on an otherwise idle system.
+static int64_t
+resident_bytes(void)
+{
+#if defined(XV6_USER)
+  kstats ks;
+  int fd = open("/dev/kstats", O_RDONLY);
+  if (fd < 0)
+    die("Couldn't open /dev/kstats");
+  if (xread(fd, &ks, sizeof ks) != sizeof ks)
+    die("Short read from /dev/kstats");
+  close(fd);
+  return ((int64_t)ks.page_fault_alloc_count -
+          (int64_t)ks.madvise_dontneed_pages) * 4096;
+#else
+  long size, resident;
+  FILE *f = fopen("/proc/self/statm", "r");
+  if (!f || fscanf(f, "%ld %ld", &size, &resident) != 2)
+    die("Couldn't read /proc/self/statm");
+  fclose(f);
+  return (int64_t)resident * sysconf(_SC_PAGESIZE);
+#endif
+}
+
+static size_t
+pick_size(uint64_t *seed)
+{
+  // Mostly small objects with an occasional large one
+  *seed = *seed * 6364136223846793005ULL + 1442695040888963407ULL;
+  size_t r = *seed >> 33;
+  if (r % 16 == 0)
+    return 1 + r % maxsize;
+  return 1 + r % 256;
+}
+
+void*
+producer(void *arg)
+{
+  int tid = (uintptr_t)arg;
+  ring *rg = &rings[tid];
+  uint64_t seed = tid + 1;
+
+  if (setaffinity(2 * tid) < 0)
+    die("setaffinity err");
+  pthread_barrier_wait(&bar);
+
+  for (int i = 0; i < niter; i++) {
+    uint64_t h = rg->head.load(std::memory_order_relaxed);
+    while (h - rg->tail.load(std::memory_order_acquire) == RING)
+      ;
+    size_t sz = pick_size(&seed);
+    char *p = (char*)malloc(sz);
+    if (!p)
+      die("%d: malloc(%zu) failed", tid, sz);
+    // Touch the block like a real producer filling in a message
+    p[0] = p[sz - 1] = i;
+    rg->slots[h % RING] = p;
+    rg->head.store(h + 1, std::memory_order_release);
+  }
+  return 0;
+}
+
+void*
+consumer(void *arg)
+{
+  int tid = (uintptr_t)arg;
+  ring *rg = &rings[tid];
+
+  if (setaffinity(2 * tid + 1) < 0)
+    die("setaffinity err");
+  pthread_barrier_wait(&bar);
+
+  for (int i = 0; i < niter; i++) {
+    uint64_t t = rg->tail.load(std::memory_order_relaxed);
+    while (rg->head.load(std::memory_order_acquire) == t)
+      ;
+    free(rg->slots[t % RING]);
+    rg->tail.store(t + 1, std::memory_order_release);
+  }
+  return 0;
+}
+
+int
+main(int ac, char **av)
+{
+  if (ac < 2)
+    die("usage: %s npairs [niter [maxsize]]", av[0]);
+
+  npair = atoi(av[1]);
+  niter = 1000000;
+  if (ac > 2)
+    niter = atoi(av[2]);
+  maxsize = 64 * 1024;
+  if (ac > 3)
+    maxsize = atoi(av[3]);
+
+  rings = (ring*)malloc(sizeof(*rings) * npair);
+  for (int i = 0; i < npair; i++) {
+    rings[i].head = 0;
+    rings[i].tail = 0;
+  }
+
+  pthread_t* tid = (pthread_t*) malloc(sizeof(*tid) * 2 * npair);
+  pthread_barrier_init(&bar, 0, 2 * npair);
+
+  int64_t res0 = resident_bytes();
+  uint64_t t0 = rdtsc();
+  for (uint64_t i = 0; i < npair; i++) {
+    xthread_create(&tid[2 * i], 0, producer, (void*) i);
+    xthread_create(&tid[2 * i + 1], 0, consumer, (void*) i);
+  }
+  for (int i = 0; i < 2 * npair; i++)
+    xpthread_join(tid[i]);
+  uint64_t t1 = rdtsc();
+  int64_t res1 = resident_bytes();
+
+  printf("%d pairs, %d blocks each, max %zu bytes\n", npair, niter, maxsize);
+  printf("%" PRIu64 " cycles\n", t1 - t0);
+  printf("%" PRIu64 " cycles/block\n", (t1 - t0) / ((uint64_t)npair * niter));
+  // Everything has been freed, so this should be close to zero
+  printf("%" PRId64 " KB more resident after free than before\n",
+         (res1 - res0) / 1024);
+#if !defined(XV6_USER)
+  // Linux also tracks the peak
+  FILE *f = fopen("/proc/self/status", "r");
+  char line[128];
+  while (f && fgets(line, sizeof line, f))
+    if (strncmp(line, "VmHWM:", 6) == 0)
+      printf("peak resident %s", line + 6);
+  if (f)
+    fclose(f);
+#endif
+  return 0;
+}
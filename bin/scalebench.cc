@@ -0,0 +1,398 @@
+// Scalability benchmark runner.  This runs a suite of the standalone
+// benchmarks at a range of core counts, with warmup and repeated runs,
+// and writes one machine-readable result file.  For each run it
+// records wall-clock time, the benchmark's own operation count (and
+// hence throughput), the kstats delta, and the most contended lock
+// classes.  tools/bench-compare compares two result files.
+//
+// Benchmarks print free-form text, so each suite entry names the
+// output line ("<count> <metric>") that counts its operations.
+// Entries without one give their amount of work, either per core or
+// in total.  Every benchmark takes the core count as an argument, so
+// its curve means something.
+
+#include "types.h"
+#include "user.h"
+#include "amd64.h"
+#include "kstats.hh"
+#include "uk/lockstat.h"
+#include "libutil.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/utsname.h>
+#include <sys/wait.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+// Number of lock classes reported per run
+#define TOP_LOCKS 5
+
+// Online CPUs
+static int ncpu;
+
+struct bench_def
+{
+  const char *name;
+  // Command line.  "%c" is replaced by the core count.
+  const char *argv[8];
+  // Output line suffix giving the run's operation count, or null.
+  const char *metric;
+  // Operations when metric is null or missing from the output
+  u64 ops;
+  // Whether ops is per core rather than the total
+  bool per_core;
+};
+
+static const bench_def suite[] = {
+  { "mapbench",  { "/mapbench", "%c", "local" },  "iterations", 0, false },
+  { "countbench", { "/countbench", "%c" },        "iterations", 0, false },
+  { "fdbench",   { "/fdbench", "%c" },            "opens", 0, false },
+  { "dirbench",  { "/dirbench", "%c", "50" },     "ops", 0, false },
+  { "filebench", { "/filebench", "%c", "1000" },  nullptr, 1000, true },
+};
+
+struct lock_result
+{
+  char name[16];
+  u64 contends;
+  u64 locking;
+};
+
+struct run_result
+{
+  const char *bench;
+  int cores;
+  int rep;
+  double secs;
+  u64 ops;
+  int status;
+  kstats ks;
+  std::vector<lock_result> locks;
+};
+
+static int
+write_cmd(const char *dev, char c)
+{
+  int fd = open(dev, O_WRONLY);
+  if (fd < 0)
+    return -1;
+  int r = write(fd, &c, 1);
+  close(fd);
+  return r == 1 ? 0 : -1;
+}
+
+static void
+read_kstats(kstats *out)
+{
+  int fd = open("/dev/kstats", O_RDONLY);
+  if (fd < 0)
+    die("scalebench: open /dev/kstats failed");
+  if (xread(fd, out, sizeof *out) != sizeof *out)
+    die("scalebench: short read from /dev/kstats");
+  close(fd);
+}
+
+static std::vector<lock_result>
+read_lockstat(void)
+{
+  std::vector<lock_result> out;
+  struct lockstat ls;
+
+  int fd = open("/dev/lockstat", O_RDONLY);
+  if (fd < 0)
+    return out;
+  while (xread(fd, &ls, sizeof(ls)) == sizeof(ls)) {
+    if (!ls.contends)
+      continue;
+    lock_result lr;
+    memcpy(lr.name, ls.name, sizeof(lr.name));
+    lr.name[sizeof(lr.name) - 1] = 0;
+    lr.contends = ls.contends;
+    lr.locking = ls.locking;
+    out.push_back(lr);
+  }
+  close(fd);
+
+  std::sort(out.begin(), out.end(),
+            [](const lock_result &a, const lock_result &b) {
+              return a.locking > b.locking;
+            });
+  if (out.size() > TOP_LOCKS)
+    out.erase(out.begin() + TOP_LOCKS, out.end());
+  return out;
+}
+
+// Find a "<count> <metric>" line in output.
+static bool
+parse_metric(const std::string &output, const char *metric, u64 *out)
+{
+  size_t mlen = strlen(metric);
+  const char *line = output.c_str();
+  while (*line) {
+    const char *eol = strchr(line, '\n');
+    if (!eol)
+      eol = line + strlen(line);
+    char *end;
+    long v = strtol(line, &end, 10);
+    if (end != line && *end == ' ' && end + 1 + mlen == eol &&
+        strncmp(end + 1, metric, mlen) == 0) {
+      *out = v;
+      return true;
+    }
+    line = *eol ? eol + 1 : eol;
+  }
+  return false;
+}
+
+// Run one benchmark at cores cores, capturing its output.
+static run_result
+run_one(const bench_def &b, int cores, int rep, bool verbose)
+{
+  run_result res;
+  res.bench = b.name;
+  res.cores = cores;
+  res.rep = rep;
+
+  char corestr[16];
+  snprintf(corestr, sizeof(corestr), "%d", cores);
+  std::vector<const char*> args;
+  for (int i = 0; b.argv[i]; i++)
+    args.push_back(strcmp(b.argv[i], "%c") == 0 ? corestr : b.argv[i]);
+  args.push_back(nullptr);
+
+  int out[2];
+  if (pipe(out) < 0)
+    die("scalebench: pipe failed");
+
+  kstats before, after;
+  read_kstats(&before);
+  write_cmd("/dev/lockstat", '3');
+  write_cmd("/dev/lockstat", '1');
+
+  u64 t0 = rdtsc();
+  int pid = fork();
+  if (pid < 0)
+    die("scalebench: fork failed");
+  if (pid == 0) {
+    close(out[0]);
+    dup2(out[1], 1);
+    close(out[1]);
+    execv(args[0], const_cast<char * const *>(args.data()));
+    die("scalebench: exec %s failed", args[0]);
+  }
+  close(out[1]);
+
+  std::string output;
+  char buf[512];
+  int n;
+  while ((n = read(out[0], buf, sizeof(buf))) > 0)
+    output.append(buf, n);
+  close(out[0]);
+  int status = 0;
+  waitpid(pid, &status, 0);
+  u64 t1 = rdtsc();
+
+  write_cmd("/dev/lockstat", '2');
+  read_kstats(&after);
+
+  res.secs = (double)(t1 - t0) / cpuhz();
+  res.status = status;
+  res.ks = after - before;
+  res.locks = read_lockstat();
+  if (!b.metric || !parse_metric(output, b.metric, &res.ops))
+    res.ops = b.per_core ? b.ops * cores : b.ops;
+
+  if (verbose)
+    fprintf(stderr, "%s", output.c_str());
+  fprintf(stderr, "scalebench: %s cores=%d rep=%d %.3f secs %lu ops\n",
+          b.name, cores, rep, res.secs, res.ops);
+  return res;
+}
+
+static void
+write_json(int fd, const std::vector<run_result> &results)
+{
+  struct utsname uts;
+  uname(&uts);
+
+  dprintf(fd, "{\n  \"kernel\": \"%s\",\n  \"version\": \"%s\",\n"
+          "  \"ncpu\": %d,\n  \"results\": [",
+          uts.sysname, uts.version, ncpu);
+  const char *sep = "";
+  for (auto &r : results) {
+    dprintf(fd, "%s\n    {\"bench\": \"%s\", \"cores\": %d, \"rep\": %d, "
+            "\"status\": %d, \"secs\": %f, \"ops\": %lu, "
+            "\"throughput\": %f,\n     \"kstats\": {",
+            sep, r.bench, r.cores, r.rep, r.status, r.secs, r.ops,
+            r.secs > 0 ? r.ops / r.secs : 0.0);
+    const char *ksep = "";
+#define X(type, name)                                                   \
+    if (r.ks.name) {                                                    \
+      dprintf(fd, "%s\"" #name "\": %lu", ksep, (u64)r.ks.name);       \
+      ksep = ", ";                                                      \
+    }
+    KSTATS_ALL(X);
+#undef X
+    dprintf(fd, "},\n     \"locks\": [");
+    const char *lsep = "";
+    for (auto &l : r.locks) {
+      dprintf(fd, "%s{\"name\": \"%s\", \"contends\": %lu, \"locking\": %lu}",
+              lsep, l.name, l.contends, l.locking);
+      lsep = ", ";
+    }
+    dprintf(fd, "]}");
+    sep = ",";
+  }
+  dprintf(fd, "\n  ]\n}\n");
+}
+
+static void
+write_csv(int fd, const std::vector<run_result> &results)
+{
+  dprintf(fd, "bench,cores,rep,status,secs,ops,throughput,top_lock,"
+          "top_lock_cycles");
+#define X(type, name) dprintf(fd, "," #name);
+  KSTATS_ALL(X);
+#undef X
+  dprintf(fd, "\n");
+
+  for (auto &r : results) {
+    dprintf(fd, "%s,%d,%d,%d,%f,%lu,%f,%s,%lu", r.bench, r.cores, r.rep,
+            r.status, r.secs, r.ops, r.secs > 0 ? r.ops / r.secs : 0.0,
+            r.locks.empty() ? "" : r.locks[0].name,
+            r.locks.empty() ? 0 : r.locks[0].locking);
+#define X(type, name) dprintf(fd, ",%lu", (u64)r.ks.name);
+    KSTATS_ALL(X);
+#undef X
+    dprintf(fd, "\n");
+  }
+}
+
+static std::vector<int>
+parse_cores(char *arg)
+{
+  std::vector<int> out;
+  for (char *tok = arg, *next; tok; tok = next) {
+    next = strchr(tok, ',');
+    if (next)
+      *next++ = 0;
+    int n = atoi(tok);
+    if (n <= 0 || n > ncpu)
+      die("scalebench: bad core count %s", tok);
+    out.push_back(n);
+  }
+  return out;
+}
+
+static void
+usage(const char *argv0)
+{
+  fprintf(stderr, "Usage: %s [options] [bench...]\n", argv0);
+  fprintf(stderr,
+          "  -o file   Write results to FILE (default: stdout)\n"
+          "  -f fmt    Result format: json (default) or csv\n"
+          "  -c list   Comma-separated core counts (default: 1,2,4,...,ncpu)\n"
+          "  -w n      Warmup runs per core count (default: 1)\n"
+          "  -r n      Measured runs per core count (default: 3)\n"
+          "  -v        Echo benchmark output to stderr\n"
+          "Benchmarks:");
+  for (auto &b : suite)
+    fprintf(stderr, " %s", b.name);
+  fprintf(stderr, "\n");
+  exit(2);
+}
+
+int
+main(int ac, char *av[])
+{
+  const char *outpath = nullptr;
+  bool csv = false, verbose = false;
+  int warmup = 1, reps = 3;
+  std::vector<int> cores;
+
+  ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+  if (ncpu <= 0)
+    die("scalebench: sysconf(_SC_NPROCESSORS_ONLN) failed");
+
+  int opt;
+  while ((opt = getopt(ac, av, "o:f:c:w:r:v")) != -1) {
+    switch (opt) {
+    case 'o':
+      outpath = optarg;
+      break;
+    case 'f':
+      if (strcmp(optarg, "csv") == 0)
+        csv = true;
+      else if (strcmp(optarg, "json") != 0)
+        usage(av[0]);
+      break;
+    case 'c':
+      cores = parse_cores(optarg);
+      break;
+    case 'w':
+      warmup = atoi(optarg);
+      break;
+    case 'r':
+      reps = atoi(optarg);
+      if (reps <= 0)
+        usage(av[0]);
+      break;
+    case 'v':
+      verbose = true;
+      break;
+    default:
+      usage(av[0]);
+    }
+  }
+
+  if (cores.empty()) {
+    for (int n = 1; n < ncpu; n *= 2)
+      cores.push_back(n);
+    cores.push_back(ncpu);
+  }
+
+  std::vector<const bench_def*> benches;
+  for (int i = optind; i < ac; i++) {
+    const bench_def *found = nullptr;
+    for (auto &b : suite)
+      if (strcmp(b.name, av[i]) == 0)
+        found = &b;
+    if (!found)
+      die("scalebench: unknown benchmark %s", av[i]);
+    benches.push_back(found);
+  }
+  if (benches.empty())
+    for (auto &b : suite)
+      benches.push_back(&b);
+
+  std::vector<run_result> results;
+  for (auto b : benches) {
+    for (int n : cores) {
+      for (int i = 0; i < warmup; i++)
+        run_one(*b, n, -1, verbose);
+      for (int i = 0; i < reps; i++)
+        results.push_back(run_one(*b, n, i, verbose));
+    }
+  }
+
+  int fd = 1;
+  if (outpath) {
+    unlink(outpath);
+    fd = open(outpath, O_WRONLY|O_CREAT, 0666);
+    if (fd < 0)
+      die("scalebench: open %s failed", outpath);
+  }
+  if (csv)
+    write_csv(fd, results);
+  else
+    write_json(fd, results);
+  if (fd != 1)
+    close(fd);
+  return 0;
+}
@@ -0,0 +1,218 @@
+// Report per-system-call counts and latency percentiles.
+//
+//   syscallstat [-p] command...  Run command and report the system
+//                                calls made while it ran.  With -p,
+//                                count only the command's own process.
+//   syscallstat -s file          Start gathering statistics and save a
+//                                snapshot of them to file.
+//   syscallstat -d before after  Report the difference between two
+//                                saved snapshots.
+//
+// Percentiles are interpolated from the kernel's power-of-two
+// histograms, so they are accurate to within a factor of two.
+
+#include "types.h"
+#include "user.h"
+#include "libutil.h"
+#include "uk/syscallstat.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include <algorithm>
+#include <vector>
+
+typedef std::vector<struct syscallstat> snapshot;
+
+static void
+command(char c, int arg = -1)
+{
+  char cmd[32];
+  if (arg < 0)
+    snprintf(cmd, sizeof(cmd), "%c", c);
+  else
+    snprintf(cmd, sizeof(cmd), "%c%d", c, arg);
+
+  int fd = open("/dev/syscallstat", O_WRONLY);
+  if (fd < 0)
+    die("syscallstat: open /dev/syscallstat failed");
+  if (write(fd, cmd, strlen(cmd)) != strlen(cmd))
+    die("syscallstat: write failed");
+  close(fd);
+}
+
+static snapshot
+read_stats(const char *path)
+{
+  static const size_t sz = sizeof(struct syscallstat);
+  struct syscallstat st;
+  snapshot out;
+
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    die("syscallstat: open %s failed", path);
+  while (1) {
+    size_t r = xread(fd, &st, sz);
+    if (r == 0)
+      break;
+    if (r != sz)
+      die("syscallstat: short read from %s", path);
+    out.push_back(st);
+  }
+  close(fd);
+  return out;
+}
+
+static void
+save_stats(const char *path)
+{
+  snapshot s = read_stats("/dev/syscallstat");
+  unlink(path);
+  int fd = open(path, O_WRONLY|O_CREAT, 0666);
+  if (fd < 0)
+    die("syscallstat: open %s failed", path);
+  xwrite(fd, s.data(), s.size() * sizeof(s[0]));
+  close(fd);
+}
+
+// Subtract before from after, matching records by syscall number.
+static snapshot
+diff(const snapshot &before, const snapshot &after)
+{
+  snapshot out(after);
+  for (auto &a : out) {
+    for (auto &b : before) {
+      if (b.num != a.num)
+        continue;
+      a.count -= b.count;
+      a.cycles -= b.cycles;
+      for (int i = 0; i < SYSCALLSTAT_BUCKETS; i++)
+        a.hist[i] -= b.hist[i];
+      break;
+    }
+  }
+  return out;
+}
+
+// Return the q'th quantile (0 < q <= 1) of st's latency histogram.
+static u64
+quantile(const struct syscallstat &st, double q)
+{
+  double target = q * st.count;
+  u64 seen = 0;
+  for (int b = 0; b < SYSCALLSTAT_BUCKETS; b++) {
+    if (!st.hist[b])
+      continue;
+    if (seen + st.hist[b] >= target) {
+      // Assume calls are spread evenly across the bucket
+      u64 lo = b ? 1ull << b : 0, hi = 1ull << (b + 1);
+      double frac = (target - seen) / st.hist[b];
+      return lo + (u64)((hi - lo) * frac);
+    }
+    seen += st.hist[b];
+  }
+  return 1ull << SYSCALLSTAT_BUCKETS;
+}
+
+static void
+report(snapshot s)
+{
+  size_t out = 0;
+  for (size_t i = 0; i < s.size(); ++i)
+    if (s[i].count)
+      s[out++] = s[i];
+  s.erase(s.begin() + out, s.end());
+  std::sort(s.begin(), s.end(),
+            [](const struct syscallstat &a, const struct syscallstat &b) {
+              return a.cycles > b.cycles;
+            });
+
+  printf("## name count cycles avg p50 p99 p999\n");
+  for (auto &st : s)
+    printf("%s %lu %lu %lu %lu %lu %lu\n", st.name, st.count, st.cycles,
+           st.cycles / st.count, quantile(st, 0.5), quantile(st, 0.99),
+           quantile(st, 0.999));
+}
+
+static void
+usage(const char *argv0)
+{
+  die("usage: %s [-p] command...\n"
+      "       %s -s file\n"
+      "       %s -d before after", argv0, argv0, argv0);
+}
+
+int
+main(int ac, char * const av[])
+{
+  bool own = false;
+
+  if (ac <= 1)
+    usage(av[0]);
+
+  if (strcmp(av[1], "-s") == 0) {
+    if (ac != 3)
+      usage(av[0]);
+    command(SYSCALLSTAT_START);
+    save_stats(av[2]);
+    return 0;
+  }
+
+  if (strcmp(av[1], "-d") == 0) {
+    if (ac != 4)
+      usage(av[0]);
+    report(diff(read_stats(av[2]), read_stats(av[3])));
+    return 0;
+  }
+
+  int argi = 1;
+  if (strcmp(av[1], "-p") == 0) {
+    own = true;
+    argi++;
+  }
+  if (argi >= ac)
+    usage(av[0]);
+
+  // The child waits on this pipe until the parent has restricted
+  // statistics to its PID.
+  int go[2];
+  if (pipe(go) < 0)
+    die("syscallstat: pipe failed");
+
+  command(SYSCALLSTAT_START);
+  snapshot before = read_stats("/dev/syscallstat");
+
+  int pid = fork();
+  if (pid < 0)
+    die("syscallstat: fork failed");
+
+  if (pid == 0) {
+    char c;
+    close(go[1]);
+    if (read(go[0], &c, 1) != 1)
+      die("syscallstat: read failed");
+    close(go[0]);
+    std::vector<const char *> args(av + argi, av + ac);
+    args.push_back(nullptr);
+    execv(args[0], const_cast<char * const *>(args.data()));
+    die("syscallstat: exec failed");
+  }
+
+  close(go[0]);
+  if (own)
+    command(SYSCALLSTAT_PID, pid);
+  xwrite(go[1], "", 1);
+  close(go[1]);
+
+  wait(NULL);
+  if (own)
+    command(SYSCALLSTAT_PID, 0);
+  snapshot after = read_stats("/dev/syscallstat");
+  command(SYSCALLSTAT_STOP);
+
+  report(diff(before, after));
+  return 0;
+}
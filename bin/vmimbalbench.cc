@@ -33,6 +33,8 @@
 
 static int npages = 0;
 static int consumercpu = 0;
+// Extra mmap flags for consumers (MAP_POPULATE with -p).
+static int mapflags = 0;
 
 // Consumers alloc pages; producers free pages allocated by consumers.
 // These will be shared by threads but written only when parsing args
@@ -54,7 +56,7 @@ consumer()
   for (uint64_t alloc = STARTADDR;
        alloc < (STARTADDR + npages * PAGESIZE);
        alloc += PAGECHUNK) {
-    while (mmap((void *)alloc, PAGECHUNK, PROT_READ | PROT_WRITE, MAP_ANONYMOUS, -1, 0) == MAP_FAILED);
+    while (mmap((void *)alloc, PAGECHUNK, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | mapflags, -1, 0) == MAP_FAILED);
     // Update alloctop so producers can free pages
     // XXX Do I need any kind of memory fence to make producers see these updates sequentially?...
     alloctop = alloc + PAGECHUNK;
@@ -128,7 +130,7 @@ parse_list(const char * const list)
 
 void
 die_usage_with_err(char * argv[], const char * const err) {
-  die("usage: %s [npages] [consumer,[producers...]]...\n%s", argv[0],err);
+  die("usage: %s [-p] [npages] [consumer,[producers...]]...\n%s", argv[0],err);
 }
 
 // Examples:
@@ -140,9 +142,18 @@ die_usage_with_err(char * argv[], const char * const err) {
 // $ vmimbalbench 1000000 0,7 7,0
 // CPU 0 allocates 4GB of pages which are freed at CPU 7. Simultaneously, CPU
 // 7 allocates 4GB of pages which are freed at CPU 0.
+// $ vmimbalbench -p 1000000 0,1
+// Like the first example, but consumers pre-fault their pages with
+// MAP_POPULATE.
 int
 main(int argc, char * argv[])
 {
+  if (argc > 1 && strcmp(argv[1], "-p") == 0) {
+    mapflags = MAP_POPULATE;
+    argv[1] = argv[0];
+    argv++;
+    argc--;
+  }
   if ((argc < 3) || (argc > MAXCPU + 2)) {
     die_usage_with_err(argv, "(bad number of args!)");
   }
@@ -21,6 +21,7 @@ struct ahci_reg_global {
 };
 
 #define AHCI_GHC_AE		(1 << 31)
+#define AHCI_GHC_MRSM		(1 << 2)	/* MSI reverted to single message */
 #define AHCI_GHC_IE		(1 << 1)
 #define AHCI_GHC_HR		(1 << 0)
 
@@ -3,6 +3,10 @@
 #include "amd64.h"
 #ifdef XV6_KERNEL
 #include "kernel.hh"
+#include "lockstat.h"
+#define BIT_SPINLOCK_LOCKSTAT LOCKSTAT
+#else
+#define BIT_SPINLOCK_LOCKSTAT 0
 #endif
 
 #ifdef DEBUG
@@ -26,11 +30,17 @@
  * Since this object only wraps a value stored elsewhere,
  * ::bit_spinlock can be copied or moved, but will continue to refer
  * to the same underlying spinlock bit.
+ *
+ * Bit spinlocks have no room to name themselves, so lockstat only
+ * gathers statistics for those constructed with a ::lockstat_class.
  */
 class bit_spinlock
 {
   volatile void* lock_;
   unsigned bit_;
+#ifdef XV6_KERNEL
+  lockstat_class *class_;
+#endif
 
 public:
   /**
@@ -61,7 +71,21 @@ public:
    * (32 for 32-bit or 64 for 64-bit).
    */
   constexpr bit_spinlock(volatile void* lock, unsigned bit)
-    : lock_(lock), bit_(bit) { }
+    : lock_(lock), bit_(bit)
+#ifdef XV6_KERNEL
+    , class_(nullptr)
+#endif
+  { }
+
+#ifdef XV6_KERNEL
+  /**
+   * Construct a bit spinlock whose lock statistics are gathered under
+   * @c cls.
+   */
+  constexpr bit_spinlock(volatile void* lock, unsigned bit,
+                         lockstat_class *cls)
+    : lock_(lock), bit_(bit), class_(cls) { }
+#endif
 
   /**
    * Initialize the value of this lock.  Beyond being able to
@@ -89,8 +113,20 @@ public:
     if (cli == cli_internal)
       pushcli();
 #endif
+#if BIT_SPINLOCK_LOCKSTAT
+    u64 start = lockstat_start();
+    bool contended = false;
+    while (locked_test_and_set_bit(bit_, lock_) != 0) {
+      contended = true;
+      nop_pause();
+    }
+    if (start)
+      lockstat_cpu_locked(class_->stat, lockstat_wait(class_->stat, start,
+                                                      contended, nullptr));
+#else
     while (locked_test_and_set_bit(bit_, lock_) != 0)
       nop_pause();
+#endif
   }
 
   bool try_acquire(cli_manager cli = cli_internal) const noexcept
@@ -98,6 +134,9 @@ public:
 #ifdef XV6_KERNEL
     if (cli == cli_internal)
       pushcli();
+#endif
+#if BIT_SPINLOCK_LOCKSTAT
+    u64 start = lockstat_start();
 #endif
     if (locked_test_and_set_bit(bit_, lock_) != 0) {
 #ifdef XV6_KERNEL
@@ -106,6 +145,11 @@ public:
 #endif
       return false;
     }
+#if BIT_SPINLOCK_LOCKSTAT
+    if (start)
+      lockstat_cpu_locked(class_->stat, lockstat_wait(class_->stat, start,
+                                                      false, nullptr));
+#endif
     return true;
   }
 
@@ -113,6 +157,10 @@ public:
   {
 #if BIT_SPINLOCK_DEBUG
     assert(is_locked());
+#endif
+#if BIT_SPINLOCK_LOCKSTAT
+    if (lockstat_enable && class_ && class_->stat)
+      lockstat_cpu_releasing(class_->stat);
 #endif
     clear_bit(bit_, lock_);
 #ifdef XV6_KERNEL
@@ -120,6 +168,18 @@ public:
       popcli();
 #endif
   }
+
+private:
+#if BIT_SPINLOCK_LOCKSTAT
+  // Returns the time an acquire started, or 0 if lockstat isn't
+  // gathering statistics for this lock.
+  u64 lockstat_start() const noexcept
+  {
+    if (!lockstat_enable || !class_ || !class_->get())
+      return 0;
+    return rdtsc();
+  }
+#endif
 };
 
 /**
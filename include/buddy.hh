@@ -10,6 +10,10 @@
 #define BUDDY_DEBUG 1
 #endif
 
+#ifndef BUDDY_MAX_ORDER
+#define BUDDY_MAX_ORDER 12
+#endif
+
 // Binary buddy allocator.
 class buddy_allocator
 {
@@ -18,11 +22,38 @@ public:
     // The size of an order 0 block.  This must be a power of two.
     MIN_SIZE = 4096,
     // The maximum order.  The higher this is, the larger blocks this
-    // allocator can allocate.  The worst-case time for allocate and
-    // free is proportional to MAX_ORDER.
-    MAX_ORDER = 12,
+    // allocator can allocate.  Finding a free block takes constant
+    // time regardless of MAX_ORDER; splitting and merging take time
+    // proportional to the difference between the orders involved.
+    MAX_ORDER = BUDDY_MAX_ORDER,
     // The maximum size this allocator can allocate.
     MAX_SIZE = MIN_SIZE << MAX_ORDER,
+    // Free memory is grouped by mobility in aligned pageblocks of
+    // this order, so that allocations that can never move don't end
+    // up scattered across all of memory.
+    PAGEBLOCK_ORDER = MAX_ORDER < 9 ? MAX_ORDER : 9,
+    PAGEBLOCK_SIZE = MIN_SIZE << PAGEBLOCK_ORDER,
+    // Tracked regions are always rounded out to at least this order,
+    // and so every allocator can allocate blocks at least this large.
+    // Regions get a higher maximum order only if rounding them out to
+    // it doesn't much inflate their tracking bitmaps.
+    TRACK_ORDER = MAX_ORDER < 12 ? MAX_ORDER : 12,
+  };
+
+  // The mobility of an allocation and of a pageblock.  Each pageblock
+  // has a type, and free blocks are kept on separate lists by type.
+  // Allocations prefer pageblocks of their own type and fall back to
+  // taking over a pageblock of the other type.
+  enum mobility : unsigned char {
+    // Kernel memory that stays where it's allocated.
+    UNMOVABLE,
+    // Memory whose contents may be migrated elsewhere, such as user
+    // pages.
+    MOVABLE,
+    // A pageblock being emptied by the compactor.  Blocks freed into
+    // it are never allocated until it's returned to another type.
+    ISOLATE,
+    NR_MOBILITY,
   };
 
   struct stats
@@ -35,6 +66,8 @@ public:
     std::size_t free;
     // The number of free blocks at each order.
     std::size_t nfree[MAX_ORDER + 1];
+    // The free bytes in blocks of each mobility.
+    std::size_t free_type[NR_MOBILITY];
   };
 
 private:
@@ -47,15 +80,35 @@ private:
       throw std::domain_error("buddy allocator: size < MIN_SIZE");
     if (size > MAX_SIZE)
       throw std::domain_error("buddy allocator: size > MAX_SIZE");
-    std::size_t log2 = __builtin_ctz(size);
-    if (size != 1 << log2)
+    std::size_t log2 = __builtin_ctzl(size);
+    if (size != (std::size_t)1 << log2)
       throw std::domain_error("buddy allocator: size is not a power of two");
     return log2 - __builtin_ctz(MIN_SIZE);
   }
 
-  void *alloc_order(std::size_t order);
+  void *alloc_order(std::size_t order, mobility type);
   void free_order(void *ptr, std::size_t order);
 
+  // Add, remove, or take the first block of an order's free list,
+  // keeping nonempty up to date.  push_block puts the block on the
+  // list for its pageblock's type; each free block records the list
+  // it's on, so the others find it regardless of later type changes.
+  void push_block(void *ptr, std::size_t order);
+  void erase_block(void *ptr, std::size_t order);
+  void *pop_block(std::size_t order, mobility type);
+
+  // Return the type of the pageblock containing ptr.
+  mobility type_of(void *ptr) const
+  {
+    if (!pageblocks)
+      return UNMOVABLE;
+    return (mobility)pageblocks[((uintptr_t)ptr - pageblocks_base) /
+                                PAGEBLOCK_SIZE];
+  }
+
+  // Set the type of every pageblock in [ptr, ptr+len).
+  void set_type(void *ptr, std::size_t len, mobility type);
+
   // Flip the bitmap bit for the buddy pair containing ptr and return
   // its new value.
   bool flip_bit(void *ptr, std::size_t order);
@@ -66,14 +119,21 @@ private:
 public:
   // Construct a buddy allocator with no memory.  Useful in
   // conjunction with move assignment.
-  buddy_allocator() : base(0), limit(0) { }
+  buddy_allocator() : base(0), limit(0), max_order(0), nonempty{},
+                      pageblocks(nullptr), pageblocks_base(0) { }
 
   // Construct a buddy allocator containing the memory from [base,
   // base+len).  If track_len is not 0, then the buddy allocator will
   // additionally be able to track any memory in the range
-  // [track_base, track_base+track_len).
+  // [track_base, track_base+track_len).  If pageblocks is not null,
+  // it is a map of pageblock types, one byte per pageblock starting
+  // at address pageblocks_base, that covers at least the tracked
+  // range.  Overlapping allocators should share one map.  Without a
+  // map, all memory is UNMOVABLE.
   buddy_allocator(void *base, std::size_t len,
-                  void *track_base = nullptr, std::size_t track_len = 0);
+                  void *track_base = nullptr, std::size_t track_len = 0,
+                  unsigned char *pageblocks = nullptr,
+                  uintptr_t pageblocks_base = 0);
 
   // Move constructor.
   buddy_allocator(buddy_allocator &&o) = default;
@@ -84,28 +144,33 @@ public:
   // Return true if this buddy allocator has no available memory.
   bool empty() const
   {
-    for (auto &order : orders)
-      if (!order.blocks.empty())
-        return false;
-    return true;
+    return (nonempty[UNMOVABLE] | nonempty[MOVABLE]) == 0;
+  }
+
+  // Return true if a block of at least the given size is available.
+  // size must satisfy the same requirements as for alloc.
+  bool can_alloc(std::size_t size) const
+  {
+    return ((nonempty[UNMOVABLE] | nonempty[MOVABLE]) >>
+            size_to_order(size)) != 0;
   }
 
   // Allocate a region of the given size, which must be between
   // MIN_SIZE and MAX_SIZE and must be a power of two.  Returns
   // nullptr if out of memory.  Throws std::domain_error if size does
   // not satisfy the requirements.
-  void *alloc_nothrow(std::size_t size)
+  void *alloc_nothrow(std::size_t size, mobility type = UNMOVABLE)
   {
-    void *ptr = alloc_order(size_to_order(size));
+    void *ptr = alloc_order(size_to_order(size), type);
     if (ptr)
       free_bytes -= size;
     return ptr;
   }
 
   // Like alloc_nothrow(), but throws std::bad_alloc if out of memory.
-  void *alloc(std::size_t size)
+  void *alloc(std::size_t size, mobility type = UNMOVABLE)
   {
-    void *ptr = alloc_nothrow(size);
+    void *ptr = alloc_nothrow(size, type);
     if (!ptr)
       throw std::bad_alloc();
     return ptr;
@@ -147,14 +212,50 @@ public:
   // Return statistics for this allocator.  This may be expensive.
   stats get_stats() const;
 
+  // Return the type of the pageblock containing ptr.  ptr must be in
+  // the map passed to the constructor.
+  mobility pageblock_type(void *ptr) const
+  {
+    return type_of(ptr);
+  }
+
+  // Add the number of free MIN_SIZE blocks in each MOVABLE pageblock
+  // of [lo, lo + n * PAGEBLOCK_SIZE) to counts.  Pageblocks that are
+  // entirely free are skipped, since there's nothing to compact.
+  void count_movable_free(void *lo, std::size_t n,
+                          unsigned short *counts) const;
+
+  // Mark the pageblock at pb ISOLATE and move the free blocks in it
+  // to the ISOLATE lists.  pb must be aligned to PAGEBLOCK_SIZE.
+  void isolate(void *pb);
+
+  // Set the type of the isolated pageblock at pb to type and return
+  // every block on the ISOLATE lists to the lists for its type.
+  // Returns the number of free MIN_SIZE blocks that were isolated.
+  std::size_t unisolate(void *pb, mobility type);
+
 private:
   // The address represented by the beginning of the tracking bitmaps
   // and the address just beyond the end of the tracking bitmaps.
   uintptr_t base, limit;
 
+  // The largest order of this allocator's blocks, between
+  // TRACK_ORDER and MAX_ORDER.  base and limit are multiples of this
+  // order's block size, so every block has a buddy.
+  std::size_t max_order;
+
   // The number of bytes of free memory in this buddy allocator.
   std::size_t free_bytes;
 
+  // Bit i of nonempty[type] is set if orders[i].blocks[type] is
+  // non-empty, so the smallest order that can satisfy an allocation
+  // is one ctz away.
+  unsigned long nonempty[NR_MOBILITY];
+
+  // The shared pageblock type map, or null.
+  unsigned char *pageblocks;
+  uintptr_t pageblocks_base;
+
   // The number of bytes allocated to the tracking bitmaps.
   std::size_t bitmap_bytes;
 
@@ -165,11 +266,13 @@ private:
   struct block
   {
     ilink<block> link;
+    // The list this block is on
+    mobility type;
   };
 
   struct order_head
   {
-    ilist<block, &block::link> blocks;
+    ilist<block, &block::link> blocks[NR_MOBILITY];
 
     // Bitmap indicating the status of each pair of buddies in this
     // order.  Set to 1 if one of the buddies in the pair is free, or
@@ -23,6 +23,11 @@ public:
   u64 block() { return block_; }
   bool dirty() { return dirty_; }
 
+  // Drop the cache's reference to this buffer if it is clean and
+  // hasn't been looked up since the last call.  Returns true if it
+  // did; the buffer goes away once its other users drop it.
+  bool age();
+
   seq_reader<bufdata> read() {
     return seq_reader<bufdata>(&data_, &seq_);
   }
@@ -60,12 +65,23 @@ private:
   sleeplock write_lock_;
   sleeplock writeback_lock_;
   std::atomic<bool> dirty_;
+  std::atomic<bool> cached_;     // The cache holds a reference
+  std::atomic<bool> referenced_; // Looked up since the last age()
 
   bufdata data_;
 
   buf(u32 dev, u64 block)
-    : dev_(dev), block_(block), dirty_(false) {}
+    : dev_(dev), block_(block), write_lock_("buf::write"),
+      writeback_lock_("buf::writeback"), dirty_(false),
+      cached_(false), referenced_(true) {}
   void onzero() override;
+  static void onzero_batch(buf **bufs, size_t n);
+  friend void refcache::typed_batch_reaper<buf>(refcache::referenced **,
+                                                std::size_t);
+  refcache::batch_reaper get_batch_reaper() const override
+  {
+    return refcache::typed_batch_reaper<buf>;
+  }
   NEW_DELETE_OPS(buf);
 
   void mark_dirty() {
@@ -0,0 +1,23 @@
+#pragma once
+
+#include "gc.hh"
+#include "vm.hh"
+
+// A parsed ELF executable, cached on its mfile so exec can skip
+// reading and parsing the file and build the new address space by
+// stamping the image's layout template.  See load_image.
+struct exec_image : public rcu_freed
+{
+  u64 gen;                      // mfile write generation
+  u64 entry;                    // ELF entry point
+  u64 phdr;                     // Address of the program headers, or 0
+  u64 phnum;                    // Number of program headers
+  vmap_template layout;         // Loaded segments
+
+  exec_image() : rcu_freed("exec_image", this, sizeof(*this)),
+                 gen(0), entry(0), phdr(0), phnum(0) { }
+
+  void do_gc() override { delete this; }
+
+  NEW_DELETE_OPS(exec_image)
+};
@@ -35,6 +35,8 @@ struct file {
   // Socket operations
   virtual int bind(const struct sockaddr *addr, size_t addrlen) { return -1; }
   virtual int listen(int backlog) { return -1; }
+  virtual int connect(const struct sockaddr *addr, size_t addrlen)
+  { return -1; }
   // Unlike the syscall, the return is only an error status.  The
   // caller will allocate an FD for *out on success.  addrlen is only
   // an out-argument.
@@ -66,7 +68,8 @@ protected:
 struct file_inode : public refcache::referenced, public file {
 public:
   file_inode(sref<mnode> i, bool r, bool w, bool a)
-    : ip(i), readable(r), writable(w), append(a), off(0) {}
+    : ip(i), readable(r), writable(w), append(a), off(0),
+      off_lock("file::off") {}
   NEW_DELETE_OPS(file_inode);
 
   void inc() override { refcache::referenced::inc(); }
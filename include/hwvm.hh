@@ -7,6 +7,140 @@
 
 struct pgmap;
 
+// A small set of disjoint virtual address ranges that need to be
+// invalidated.  Ranges that overlap or abut are merged.  If more than
+// MAX_RANGES disjoint ranges are added, the two closest ranges are
+// merged, so a sparse set of invalidations degrades gradually toward
+// a single hull rather than immediately becoming one.
+class shootdown_ranges
+{
+public:
+  enum { MAX_RANGES = 8 };
+
+  struct range
+  {
+    uintptr_t start, end;
+  };
+
+  constexpr shootdown_ranges() : n_(0), r_() { }
+
+  void add(uintptr_t start, uintptr_t end)
+  {
+    if (start >= end)
+      return;
+
+    // Find the first range that ends at or after start
+    size_t i = 0;
+    while (i < n_ && r_[i].end < start)
+      ++i;
+
+    if (i < n_ && r_[i].start <= end) {
+      // Extend r_[i] and absorb any ranges it now reaches
+      if (start < r_[i].start)
+        r_[i].start = start;
+      if (r_[i].end < end)
+        r_[i].end = end;
+      size_t j = i + 1;
+      for (; j < n_ && r_[j].start <= r_[i].end; ++j)
+        if (r_[i].end < r_[j].end)
+          r_[i].end = r_[j].end;
+      erase(i + 1, j);
+      return;
+    }
+
+    // Insert a new range at i
+    for (size_t j = n_; j > i; --j)
+      r_[j] = r_[j - 1];
+    r_[i].start = start;
+    r_[i].end = end;
+    if (++n_ <= MAX_RANGES)
+      return;
+
+    // Too many ranges; merge the two with the smallest gap
+    size_t best = 0;
+    for (size_t j = 1; j + 1 < n_; ++j)
+      if (r_[j + 1].start - r_[j].end < r_[best + 1].start - r_[best].end)
+        best = j;
+    r_[best].end = r_[best + 1].end;
+    erase(best + 1, best + 2);
+  }
+
+  bool empty() const { return n_ == 0; }
+
+  const range *begin() const { return r_; }
+  const range *end() const { return r_ + n_; }
+
+  // The lowest and highest addresses covered by this set.
+  uintptr_t low() const { return n_ ? r_[0].start : 0; }
+  uintptr_t high() const { return n_ ? r_[n_ - 1].end : 0; }
+
+  // The total number of bytes covered by this set.
+  uintptr_t size() const
+  {
+    uintptr_t total = 0;
+    for (size_t i = 0; i < n_; ++i)
+      total += r_[i].end - r_[i].start;
+    return total;
+  }
+
+private:
+  void erase(size_t from, size_t to)
+  {
+    for (size_t j = to; j < n_; ++j)
+      r_[from + j - to] = r_[j];
+    n_ -= to - from;
+  }
+
+  size_t n_;
+  // One extra slot so add can insert before merging.
+  range r_[MAX_RANGES + 1];
+};
+
+// An object that must outlive an asynchronous TLB shootdown, such as
+// the pages a munmap removed, which other cores may keep accessing
+// through stale mappings until they process the shootdown.  See
+// shootdown::perform_async.
+class tlb_deferred
+{
+public:
+  virtual ~tlb_deferred() { }
+};
+
+// The process-context identifiers (PCIDs) of one address space.  With
+// PCIDs, the TLB tags each non-global entry with the PCID in CR3 when
+// it was filled, so switching address spaces does not have to flush
+// the TLB.  Each core hands out PCIDs from a counter the first time
+// it switches to an address space.  When the counter runs out, the
+// core starts a new generation: it flushes its whole TLB and every
+// PCID it handed out before becomes invalid.  PCID 0 is used for
+// kpml4.  If the CPU lacks PCID or INVPCID, everything here is a
+// no-op and CR3 loads flush as before.
+class pcid_ctx
+{
+  // Per core, the generation and PCID this address space was last
+  // assigned (generation << 12 | PCID), or 0.  Each entry is only
+  // accessed by its own core, and rarely written.
+  mutable u64 tags_[NCPU];
+
+public:
+  pcid_ctx() : tags_{} { }
+  pcid_ctx(const pcid_ctx&) = delete;
+  pcid_ctx &operator=(const pcid_ctx&) = delete;
+
+  // Return the CR3 bits (PCID and no-flush) to switch this core to
+  // this address space, assigning a PCID if necessary.  If flush is
+  // true, the load will discard this PCID's TLB entries.  The caller
+  // must have interrupts disabled.
+  u64 cr3_bits(bool flush = false) const;
+
+  // Return this address space's PCID on this core, or 0 if it has no
+  // valid one (in which case this core's TLB has no entries for it).
+  u64 pcid() const;
+
+  // Is PCID support enabled?
+  static bool enabled();
+};
+
 // A TLB shootdown gatherer that doesn't track anything, but as a
 // result can be batched with other TLB shootdowns.
 class batched_shootdown
@@ -36,14 +170,24 @@ public:
   // Fully flush all cores' TLBs.
   void perform() const;
 
+  // Shared page tables are always shot down synchronously.
+  void perform_async(tlb_deferred *obj) const
+  {
+    perform();
+    delete obj;
+  }
+
   // Handle receipt of a TLB flush IPI.
   static void on_ipi();
+
+  static void drain_async() { }
+  static void reap_async() { }
 };
 
 class core_tracking_shootdown
 {
 public:
-  constexpr core_tracking_shootdown() : t_(nullptr), start_(~0), end_(0) {}
+  constexpr core_tracking_shootdown() : t_(nullptr), ranges_() {}
 
   // Track the set of cores that are using the page_map_cache.
   class cache_tracker {
@@ -65,20 +209,26 @@ public:
   }
 
   void add_range(uintptr_t start, uintptr_t end) {
-    if (start < start_)
-      start_ = start;
-    if (end_ < end)
-      end_ = end;
+    ranges_.add(start, end);
   }
 
   void perform() const;
 
+  void perform_async(tlb_deferred *obj) const
+  {
+    perform();
+    delete obj;
+  }
+
   static void on_ipi() { panic("core_tracking_shootdown::on_ipi\n"); }
 
+  static void drain_async() { }
+  static void reap_async() { }
+
 private:
   void clear_tlb() const;
   class cache_tracker *t_;
-  uintptr_t start_, end_;
+  shootdown_ranges ranges_;
 };
 
 // An MMU implementation based on shared page tables, where each vmap
@@ -101,8 +251,17 @@ namespace mmu_shared_page_table {
   class page_map_cache : shootdown::cache_tracker
   {
     struct pgmap * const pml4;
+    pcid_ctx pcid_;
+    // Incremented by every invalidation.  A core whose TLB may hold
+    // entries for pcid_ from before the latest invalidation must
+    // flush them when it switches to this cache; shootdowns only
+    // reach cores where this cache is active.
+    std::atomic<u64> flush_gen_;
+    // Per core, the flush_gen_ this core's TLB was last synced to.
+    mutable u64 flushed_[NCPU];
 
     void __insert(uintptr_t va, pme_t pte);
+    void __insert_range(uintptr_t va, size_t n, const pme_t *ptes);
     void __invalidate(uintptr_t start, uintptr_t len, shootdown *sd);
 
   public:
@@ -125,6 +284,16 @@ namespace mmu_shared_page_table {
       __insert(va, pte);
     }
 
+    // Load mappings for the n consecutive pages starting at va, where
+    // ptes[i] and trackers[i] are for va+i*PGSIZE.  This is
+    // equivalent to n calls to insert, but walks the page structure
+    // only once per page table page.
+    void insert_range(uintptr_t va, size_t n, page_tracker *const *trackers,
+                      const pme_t *ptes)
+    {
+      __insert_range(va, n, ptes);
+    }
+
     // Invalidate all mappings from virtual address @c va to
     // <tt>start+len</tt>.  This should be called whenever a page
     // mapping's permissions become more strict or the mapped page
@@ -148,6 +317,9 @@ namespace mmu_shared_page_table {
     // Switch out of this page_map_cache on this CPU.
     void switch_from() const { track_switch_from(); }
 
+    // Shootdowns of shared page tables never outlive perform.
+    void sync_async() const { }
+
     // Count the number of pages used by this page_map_cache.
     u64 internal_pages() const;
   };
@@ -179,35 +351,56 @@ namespace mmu_per_core_page_table {
   class shootdown
   {
     class page_map_cache *cache;
-    uintptr_t start, end;
+    shootdown_ranges ranges;
     bitset<NCPU> targets;
 
     friend class page_map_cache;
 
   public:
-    constexpr shootdown() : cache(nullptr), start(~0), end(0), targets() { }
+    constexpr shootdown() : cache(nullptr), ranges(), targets() { }
 
+    // Invalidate the gathered ranges on every target core and wait
+    // for them to finish.
     void perform() const;
 
-    static void on_ipi()
-    {
-      // XXX(Austin) This shootdown uses IPI calls instead of
-      // TLBFLUSH.  Can we make batched_shootdown use the IPI call
-      // mechanism, too?
-      panic("shootdown::on_ipi called");
-    }
+    // Queue the invalidations on the target cores and return without
+    // waiting.  Targets running this cache get a TLBFLUSH IPI unless
+    // one is already on its way; the others catch up at their next
+    // context switch or timer tick.  obj (which may be null) is
+    // deleted once every target has caught up.  Until then, other
+    // cores may still use the invalidated mappings, so this is only
+    // suitable for removing mappings whose pages are held by obj.
+    void perform_async(tlb_deferred *obj) const;
+
+    // Handle receipt of a TLB flush IPI.
+    static void on_ipi() { drain_async(); }
+
+    // Perform the invalidations other cores have queued for this
+    // core.  Interrupts must be disabled.
+    static void drain_async();
+
+    // Delete the objects deferred by this core's asynchronous
+    // shootdowns that have completed.
+    static void reap_async();
   };
 
   class page_map_cache
   {
     percpu<struct pgmap*> pml4;
+    // Shootdowns reach every core with this cache in its page table,
+    // so pcid_ never has stale entries; clear invalidates them with
+    // INVPCID on cores where this cache is not current.
+    pcid_ctx pcid_;
+    // The number of asynchronous shootdown requests for this cache
+    // still queued on other cores.
+    std::atomic<u64> async_pending_;
     friend class shootdown;
 
     // Clear and TLB flush a region of this core's page table.
     void clear(uintptr_t start, uintptr_t end);
 
   public:
-    page_map_cache()
+    page_map_cache() : async_pending_(0)
     {
       for (size_t i = 0; i < NCPU; ++i)
         pml4[i] = nullptr;
@@ -219,6 +412,8 @@ namespace mmu_per_core_page_table {
     ~page_map_cache();
 
     void insert(uintptr_t va, page_tracker *t, pme_t pte);
+    void insert_range(uintptr_t va, size_t n, page_tracker *const *trackers,
+                      const pme_t *ptes);
 
     template<class ForwardIterator>
     void invalidate(uintptr_t start, uintptr_t len,
@@ -246,24 +441,33 @@ namespace mmu_per_core_page_table {
         present.reset(myid());
       }
 
-      // Update shootdown bounds
-      // XXX(Austin) For fork, this may cause us to zero huge regions
-      // of the page table because of sparse invalidates.  Maybe keep
-      // a fixed-size list of regions in the shootdown?
+      // Add to the shootdown's ranges.  Keeping disjoint ranges
+      // rather than a single hull means sparse invalidates (e.g., for
+      // fork) don't clear huge regions of the remote page tables.
       if (present.any()) {
         sd->targets |= present;
         sd->cache = this;
-        if (start < sd->start)
-          sd->start = start;
-        if (sd->end < start + len)
-          sd->end = start + len;
+        sd->ranges.add(start, start + len);
       }
     }
 
     void switch_to() const;
     void switch_from() const {}
 
+    // Wait until all asynchronous shootdowns of this cache have
+    // completed.  This must be called before mapping addresses an
+    // asynchronous shootdown unmapped, since other cores may still
+    // have the old mappings.
+    void sync_async()
+    {
+      if (async_pending_.load(std::memory_order_acquire))
+        __sync_async();
+    }
+
     u64 internal_pages() const;
+
+  private:
+    void __sync_async();
   };
 }
 
@@ -15,6 +15,17 @@ public:
   // should be used to form the appropriate IOAPIC entry or MSI
   // message.
   virtual int allocate_int(struct irq irq, struct cpu *dest) = 0;
+
+  // Reserve n consecutive interrupt remapping entries without mapping
+  // them.  Returns the index of the first entry.  Multi-message MSI
+  // needs a consecutive block because the device adds the message
+  // number to the entry index.
+  virtual int reserve_ints(size_t n) = 0;
+
+  // Point entry index at the given irq and destination CPU.  The
+  // entry may already be present (and in use by a device), in which
+  // case this retargets the interrupt without touching the device.
+  virtual void set_int(int index, struct irq irq, struct cpu *dest) = 0;
 };
 
 extern abstract_iommu *iommu;
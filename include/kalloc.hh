@@ -146,8 +146,8 @@ public:
     if (std::has_trivial_default_constructor<T>::value) {
       // A trivial default constructor will zero-initialize
       // everything, so we can short-circuit this by allocating a zero
-      // page.
-      return (T*)zalloc(typeid(T).name());
+      // page.  These are kernel structures, so they can't move.
+      return (T*)zalloc(typeid(T).name(), false);
     }
 
     // Fall back to usual allocation and default construction
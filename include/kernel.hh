@@ -131,11 +131,15 @@ void            idewrite(u32 dev, const char* data, u64 count, u64 offset);
 
 // idle.cc
 struct proc *   idleproc(void);
-void            idlezombie(struct proc*);
+void            idlezombie(struct proc*, int cpu);
+void            idlereap(void);
 
 // kalloc.c
 char*           kalloc(const char *name, size_t size = PGSIZE);
+char*           kalloc_movable(const char *name);
+size_t          kalloc_node_free(int node);
 void            kfree(void*, size_t size = PGSIZE);
+void            kfree_batch(void **pages, size_t n);
 void*           ksalloc(int slabtype);
 void            ksfree(int slabtype, void*);
 void*           early_kalloc(size_t size, size_t align);
@@ -189,7 +193,7 @@ enum clone_flags
 ENUM_BITSET_OPS(clone_flags);
 void            finishproc(struct proc*, bool removepid = true);
 void            exit(int);
-struct proc*    doclone(clone_flags);
+struct proc*    doclone(clone_flags, int cpu = -1);
 int             growproc(int);
 void            pinit(void);
 void            procdumpall(void);
@@ -213,6 +217,8 @@ void            post_swtch(void);
 void            scheddump(void);
 int             steal(void);
 void            addrun(struct proc*);
+int             sched_place(int node, bool anynode);
+bool            sched_pending(void);
 int             dwork_push(struct dwork*, int);
 
 // syscall.c
@@ -259,8 +265,10 @@ size_t          safe_read_hw(void *dst, uintptr_t src, size_t n);
 size_t          safe_read_vm(void *dst, uintptr_t src, size_t n);
 
 // zalloc.cc
-char*           zalloc(const char* name);
+char*           zalloc(const char* name, bool movable = true);
+size_t          zalloc_batch(char **pages, size_t n, const char* name);
 void            zfree(void* p);
+void            zidle(void);
 
 // other exported/imported functions
 void cmain(u64 mbmagic, u64 mbaddr);
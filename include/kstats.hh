@@ -24,6 +24,16 @@
   X(uint64_t, tlb_shootdown_targets)                                   \
   /* Total number of cycles spent in TLB shootdown operations. */      \
   X(uint64_t, tlb_shootdown_cycles)                                    \
+  /* # of shootdowns that returned without waiting for targets. */    \
+  X(uint64_t, tlb_shootdown_async_count)                               \
+  /* # of asynchronous shootdown targets that were not sent an IPI    \
+   * because one was already on its way or they weren't using the     \
+   * address space. */                                                 \
+  X(uint64_t, tlb_shootdown_ipis_saved)                                \
+  /* # of address space switches that kept the TLB using PCIDs. */   \
+  X(uint64_t, tlb_switch_noflush_count)                                \
+  /* # of times a core ran out of PCIDs and flushed its TLB. */        \
+  X(uint64_t, tlb_pcid_rollover_count)                                 \
 
 #define KSTATS_VM(X)                            \
   X(uint64_t, page_fault_count)                 \
@@ -32,12 +42,26 @@
   X(uint64_t, page_fault_alloc_cycles)                \
   X(uint64_t, page_fault_fill_count)                  \
   X(uint64_t, page_fault_fill_cycles)                 \
+  /* Read faults satisfied by mapping the shared zero page. */      \
+  X(uint64_t, page_fault_zero_count)                  \
+  X(uint64_t, page_fault_zero_cycles)                 \
                                                 \
   X(uint64_t, mmap_count)                       \
   X(uint64_t, mmap_cycles)                      \
                                                 \
   X(uint64_t, munmap_count)                     \
   X(uint64_t, munmap_cycles)                    \
+                                                \
+  X(uint64_t, exec_count)                       \
+  X(uint64_t, exec_cycles)                      \
+  /* Execs that used a cached image. */         \
+  X(uint64_t, exec_image_hit_count)             \
+                                                \
+  /* Pages released by MADV_DONTNEED. */        \
+  X(uint64_t, madvise_dontneed_pages)           \
+  /* Pages released by MADV_FREE that were      \
+   * reclaimed before being written again. */   \
+  X(uint64_t, lazyfree_reclaim_pages)           \
 
 #define KSTATS_KALLOC(X)                        \
   X(uint64_t, kalloc_page_alloc_count)          \
@@ -46,6 +70,30 @@
   X(uint64_t, kalloc_hot_list_flush_count)      \
   X(uint64_t, kalloc_hot_list_steal_count)      \
   X(uint64_t, kalloc_hot_list_remote_free_count)        \
+  /* Per-CPU caches of orders 1 through         \
+   * KALLOC_CACHE_ORDERS. */                    \
+  X(uint64_t, kalloc_order_cache_alloc_count)   \
+  X(uint64_t, kalloc_order_cache_refill_count)  \
+  X(uint64_t, kalloc_order_cache_flush_count)   \
+  /* zalloc pages taken from the pre-zeroed     \
+   * pools, and zeroed on the spot. */          \
+  X(uint64_t, zalloc_prezeroed_count)           \
+  X(uint64_t, zalloc_sync_count)                \
+  /* Pages zeroed by idle CPUs, and times idle  \
+   * zeroing stopped for runnable work. */      \
+  X(uint64_t, zalloc_idle_zeroed_count)         \
+  X(uint64_t, zalloc_idle_preempt_count)        \
+  /* Compaction passes, pages they migrated,    \
+   * and pageblocks they left entirely free. */ \
+  X(uint64_t, compact_run_count)                \
+  X(uint64_t, compact_migrate_pages)            \
+  X(uint64_t, compact_pageblock_freed_count)    \
+  /* kswapd passes and pages they reclaimed,    \
+   * and direct reclaims and their pages. */    \
+  X(uint64_t, reclaim_kswapd_run_count)         \
+  X(uint64_t, reclaim_kswapd_pages)             \
+  X(uint64_t, reclaim_direct_count)             \
+  X(uint64_t, reclaim_direct_pages)             \
 
 #define KSTATS_REFCACHE(X)                      \
   X(uint64_t, refcache_review_count)            \
@@ -57,6 +105,11 @@
   X(uint64_t, refcache_item_flushed_count)      \
   X(uint64_t, refcache_item_reviewed_count)     \
   X(uint64_t, refcache_item_freed_count)        \
+  /* Objects reaped on their home core after another core's review \
+   * found them dead. */                        \
+  X(uint64_t, refcache_item_remote_reap_count)  \
+  /* Calls to a type's batch_reaper. */         \
+  X(uint64_t, refcache_reap_batch_count)        \
   X(uint64_t, refcache_item_requeued_count)     \
   X(uint64_t, refcache_item_disowned_count)     \
   X(uint64_t, refcache_dirtied_count)           \
@@ -83,6 +136,11 @@
   X(uint64_t, sched_tick_count)                 \
   X(uint64_t, sched_blocked_tick_count)         \
   X(uint64_t, sched_delayed_tick_count)         \
+  /* New processes placed by fork and spawn, and how many of those   \
+   * went to another core or another NUMA node than the parent. */   \
+  X(uint64_t, sched_place_count)                \
+  X(uint64_t, sched_place_remote_count)         \
+  X(uint64_t, sched_place_remote_node_count)    \
 
 #define KSTATS_ALL(X)                           \
   KSTATS_TLB(X)                                 \
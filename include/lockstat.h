@@ -1,3 +1,5 @@
+#pragma once
+
 #include "ilist.hh"
 
 #define LOCKSTAT_MAGIC 0xb4cd79c1b2e46f40ull
@@ -7,20 +9,84 @@
 #include "gc.hh"
 #include "uk/lockstat.h"
 
-struct klockstat : public rcu_freed {
+// The number of contending call sites each CPU tracks per lock class.
+#define LOCKSTAT_CPU_SITES 4
+
+struct cpulockstat {
+  u64 acquires;
+  u64 contends;
+  u64 locking;
+  u64 locked;
+  u64 wait_hist[LOCKSTAT_BUCKETS];
+  u64 hold_hist[LOCKSTAT_BUCKETS];
+  // The sites with the most wait on this CPU.  A new site replaces
+  // the one with the least wait, so these are approximate.
+  struct lockstat_site sites[LOCKSTAT_CPU_SITES];
+
+  // Hold timing for spinlocks and bit spinlocks, which can't migrate
+  // while held.  Nested holds of the same class are timed as one.
+  u64 locked_ts;
+  u32 nheld;
+  __padout__;
+} __mpalign__;
+
+// The statistics for one lock class.  Locks with the same name share
+// a class.  Classes are never freed.
+struct klockstat {
   u64 magic;
-  
-  // LIST_ENTRY(klockstat) link;
   ilink<klockstat> link;
-  struct lockstat s;
+  char name[16];
+  struct cpulockstat cpu[NCPU];
 
   klockstat(const char *name);
-  void do_gc() override { delete this; }
 
   static void* operator new(unsigned long nbytes);
   static void operator delete(void *p);
 };
+
+// A class of locks that have no room to name themselves, such as bit
+// spinlocks.  Declare one of these statically for each kind of lock.
+struct lockstat_class
+{
+  const char *name;
+  struct klockstat *stat;
+
+  constexpr lockstat_class(const char *name) : name(name), stat(nullptr) { }
+
+  struct klockstat *get();
+};
+
+#if LOCKSTAT
+// Nonzero while lock statistics are being gathered.  When this is
+// zero, locks pay only for checking it.
+extern int lockstat_enable;
+
+// Return the class named name, creating it if necessary.  Returns
+// null if it could not be allocated.
+struct klockstat *lockstat_lookup(const char *name);
+// Record an acquisition that started waiting at start (an rdtsc
+// timestamp).  If contended, the wait is charged to the caller of the
+// function whose frame pointer is frame or, if frame is null, to
+// lockstat_wait's caller.  Returns the current timestamp.
+u64 lockstat_wait(struct klockstat *ls, u64 start, bool contended,
+                  void *frame);
+// Record a hold of cycles.
+void lockstat_hold(struct klockstat *ls, u64 cycles);
+// Begin and end timing a hold on this CPU.
+void lockstat_cpu_locked(struct klockstat *ls, u64 ts);
+void lockstat_cpu_releasing(struct klockstat *ls);
+
+inline struct klockstat *
+lockstat_class::get()
+{
+  // Racing lookups return the same class
+  if (!stat)
+    stat = lockstat_lookup(name);
+  return stat;
+}
+
+#endif
+
 #else
 struct klockstat;
 #endif
-
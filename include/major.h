@@ -9,3 +9,6 @@
 #define MAJ_KSTATS   9
 #define MAJ_KMEMSTATS 10
 #define MAJ_MFSSTATS 11
+#define MAJ_SYSCALLSTAT 12
+#define MAJ_TRACE    13
+#define MAJ_TOPOLOGY 14
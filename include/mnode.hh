@@ -16,6 +16,7 @@ class mdev;
 class msock;
 class mlinkref;
 class mfs;
+struct exec_image;
 
 class mnode : public refcache::weak_referenced
 {
@@ -77,6 +78,13 @@ protected:
 
 private:
   void onzero() override;
+  static void onzero_batch(mnode **ms, size_t n);
+  friend void refcache::typed_batch_reaper<mnode>(refcache::referenced **,
+                                                  std::size_t);
+  refcache::batch_reaper get_batch_reaper() const override
+  {
+    return refcache::typed_batch_reaper<mnode>;
+  }
 
   std::atomic<bool> cache_pin_;
   std::atomic<bool> dirty_;
@@ -318,7 +326,10 @@ mnode::as_dir() const
 
 class mfile : public mnode {
 private:
-  mfile(mfs* fs, u64 inum) : mnode(fs, inum), size_(0) {}
+  mfile(mfs* fs, u64 inum)
+    : mnode(fs, inum), size_(0), image_(nullptr), image_used_(false),
+      image_off_(false), write_gen_(0) {}
+  ~mfile();
   NEW_DELETE_OPS(mfile);
   friend class mnode;
   friend class mfs;
@@ -394,8 +405,10 @@ public:
       return get_page_info_raw() != nullptr;
     }
 
+    static lockstat_class lock_class;
+
     bit_spinlock get_lock() {
-      return bit_spinlock(&value_, FLAG_LOCK_BIT);
+      return bit_spinlock(&value_, FLAG_LOCK_BIT, &lock_class);
     }
 
     bool is_partial_page() {
@@ -419,6 +432,16 @@ private:
   seqcount<u32> size_seq_;
   u64 size_;
 
+  // The cached exec image of this file, if any; see load_image.  An
+  // image is only valid for the write_gen_ it was built from.  Writes
+  // only count generations once the file has been exec'd.  Once the
+  // file has been mapped shared and writable, writes can't be
+  // counted and image_off_ is set.
+  std::atomic<exec_image*> image_;
+  std::atomic<bool> image_used_;
+  std::atomic<bool> image_off_;
+  std::atomic<u64> write_gen_;
+
 public:
   class resizer : public lock_guard<spinlock>,
                   public seq_writer {
@@ -446,6 +469,30 @@ public:
   }
 
   page_state get_page(u64 pageidx);
+
+  // Note that this file's contents or size changed.  This must be
+  // called after the change.
+  void note_write()
+  {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (image_used_.load(std::memory_order_relaxed))
+      write_gen_.fetch_add(1);
+  }
+
+  // Stop caching exec images of this file.
+  void disable_image()
+  {
+    image_off_.store(true);
+  }
+
+  // Return the cached exec image of this file, or nullptr if there
+  // is none or it is stale.  In either case, set *gen to the
+  // generation to build a new image from.  The file must not be read
+  // before this is called.  The caller must be in an RCU epoch.
+  exec_image *get_image(u64 *gen);
+
+  // Cache img, built from generation gen.  Takes ownership of img.
+  void set_image(exec_image *img, u64 gen);
 };
 
 inline mfile*
@@ -506,7 +553,7 @@ private:
   friend class mnode;
   friend class mfs;
 
-  localsock* localsock_;
+  std::atomic<localsock*> localsock_;
 
 public:
   localsock* get_sock() const { return localsock_; }
@@ -515,6 +562,11 @@ public:
     assert(!localsock_);
     localsock_ = ls;
   }
+
+  // Detach ls from this socket, if it is still attached.
+  void clear(localsock* ls) {
+    localsock_.compare_exchange_strong(ls, nullptr);
+  }
 };
 
 inline msock*
@@ -52,7 +52,9 @@ extern page_info_map_entry *page_info_map_end;
 //
 // This inherits from alloc_debug_info to exploit empty base class
 // optimization.
-class page_info : public PAGE_REFCOUNT referenced, public alloc_debug_info
+class page_info : public refcache::batch_reaped<page_info,
+                                                PAGE_REFCOUNT referenced>,
+                  public alloc_debug_info
 {
 protected:
   void onzero()
@@ -60,6 +62,17 @@ protected:
     kfree(va());
   }
 
+  // Free a batch of dead pages, taking the allocator locks once.
+  static void onzero_batch(page_info **pages, size_t n)
+  {
+    void *va[refcache::REAP_BATCH];
+    for (size_t i = 0; i < n; i++)
+      va[i] = pages[i]->va();
+    kfree_batch(va, n);
+  }
+  friend void refcache::typed_batch_reaper<page_info>(refcache::referenced **,
+                                                      std::size_t);
+
 public:
   page_info() { }
 
@@ -23,6 +23,7 @@ struct pci_func {
   // Interrupt pin.  0=none, 1=INTA, .. 4=INTB
   u8 int_pin;
   u8 msi_capreg;
+  u8 msix_capreg;
 };
 
 struct pci_bus {
@@ -39,6 +40,72 @@ void pci_register_class_driver(u32 class_id, u32 subclass_id,
 void pci_func_enable(struct pci_func *f);
 irq pci_map_msi_irq(struct pci_func *f);
 
+// A set of MSI-X or MSI vectors mapped for a device.  Each vector is
+// delivered to one CPU, which can be changed while the device is
+// running, so a driver can take a queue's completions on the CPU
+// that issued its requests.
+class pci_msi
+{
+public:
+  enum { max_vectors = 32 };
+
+  size_t count() const
+  {
+    return nvec_;
+  }
+
+  irq get_irq(size_t i) const
+  {
+    return vecs_[i].irq;
+  }
+
+  struct cpu *get_cpu(size_t i) const
+  {
+    return vecs_[i].cpu;
+  }
+
+  // Deliver vector i to dest from now on.  With the IOMMU this only
+  // rewrites the interrupt remapping entry; otherwise it rewrites the
+  // device's message address.  Callers must serialize changes to the
+  // same vector.
+  void set_affinity(size_t i, struct cpu *dest);
+
+  NEW_DELETE_OPS(pci_msi);
+
+private:
+  friend pci_msi *pci_map_msi_irqs(struct pci_func *, size_t,
+                                   struct cpu * const *);
+
+  struct vec
+  {
+    struct irq irq;
+    struct cpu *cpu;
+    int index;                  // Interrupt remapping entry
+  };
+
+  // Where to find the device once its pci_func is gone
+  u32 busno_, dev_, func_;
+  u32 msi_capreg_;              // 0 if using MSI-X
+  volatile u32 *table_;         // MSI-X table
+  size_t nvec_;
+  vec vecs_[max_vectors];
+
+  explicit pci_msi(struct pci_func *f);
+  void compose(size_t i, u32 *addr, u32 *data) const;
+  void write_msix(size_t i);
+};
+
+// Map up to n MSI-X or MSI vectors for f, preferring MSI-X, and
+// deliver vector i to dest[i] (CPU 0 if dest is null).  Devices may
+// grant fewer vectors than asked for: MSI-X is limited by the device's
+// table size and plain MSI needs the IOMMU for more than one vector.
+// Plain MSI may also grant more, since it rounds n up to a power of
+// two; the extra vectors go to CPU 0.
+// Returns null if f supports neither or no IRQs are free.  f must
+// already be enabled.
+pci_msi *pci_map_msi_irqs(struct pci_func *f, size_t n,
+                          struct cpu * const *dest = nullptr);
+
 u32 pci_conf_read(u32 seg, u32 bus, u32 dev, u32 func, u32 offset, int width);
 void pci_conf_write(u32 seg, u32 bus, u32 dev, u32 func, u32 offset,
                     u32 val, int width);
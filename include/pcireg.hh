@@ -445,6 +445,22 @@ typedef u8 pci_revision_t;
 
 #define PCI_MSI_MCR_MMC(cr)     (((cr) >> 17) & 0x7)
 #define PCI_MSI_MCR_64BIT       0x00800000
+#define PCI_MSI_MCR_MME_SHIFT   20
+#define PCI_MSI_MCR_MME_MASK    (0x7 << PCI_MSI_MCR_MME_SHIFT)
+#define PCI_MSI_MCR_ENABLE      0x00010000
+
+/*
+ * MSI-X; access via capability pointer.
+ */
+#define PCI_MSIX_MCR_TBLSZ(cr)  ((((cr) >> 16) & 0x7ff) + 1)
+#define PCI_MSIX_MCR_FMASK      0x40000000
+#define PCI_MSIX_MCR_ENABLE     0x80000000
+#define PCI_MSIX_TBL_REG        0x04
+#define PCI_MSIX_TBL_BIR(r)     ((r) & 0x7)
+#define PCI_MSIX_TBL_OFFSET(r)  ((r) & ~0x7)
+/* Table entries are 4 dwords: address low, address high, data, control */
+#define PCI_MSIX_ENTRY_DWORDS   4
+#define PCI_MSIX_VCTL_MASK      0x1
 
 /*
  * Power Management Capability; access via capability pointer.
@@ -0,0 +1,74 @@
+#pragma once
+
+// Per-CPU record rings for kernel logs that a device reader drains,
+// such as the trace and sampler stack logs.  Each CPU is the only
+// producer of its ring, and the (serialized) reader is the only
+// consumer of every CPU's ring.
+
+#include "cpu.hh"
+#include <atomic>
+
+template<class T, std::size_t N>
+struct percpu_ring
+{
+  // N records, allocated by the consumer before the producer uses
+  // the ring.  The producer ignores the ring while this is null.
+  T *buf;
+  std::atomic<u64> head;
+  __mpalign__ std::atomic<u64> tail;
+  // Records dropped by the producer, in whatever unit it likes.
+  // Reset by drain.
+  std::atomic<u64> lost;
+
+  // Append x.  Returns false if the ring is full.  Must be called on
+  // the ring's CPU with interrupts disabled.
+  bool push(const T &x)
+  {
+    u64 h = head.load(std::memory_order_relaxed);
+    if (h - tail.load(std::memory_order_acquire) == N)
+      return false;
+    buf[h % N] = x;
+    head.store(h + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Copy as many whole records out of every CPU's ring as fit in the
+  // n bytes at dst, and return the number of bytes copied.  ring(cpu)
+  // must return cpu's ring.  A CPU that dropped records gets the
+  // record mklost(cpu, lost) ahead of its others.  *next is the CPU to
+  // start from; rotating it across calls keeps small reads from
+  // starving high CPUs.  Callers must serialize drains of the same
+  // rings.
+  template<class RingFn, class LostFn>
+  static int drain(int *next, char *dst, u32 n, RingFn ring, LostFn mklost)
+  {
+    int ret = 0;
+    for (int k = 0; k < ncpu && n >= sizeof(T); ++k) {
+      int cpu = (*next + k) % ncpu;
+      percpu_ring *r = ring(cpu);
+      if (!r->buf)
+        continue;
+
+      u64 lost = r->lost.exchange(0, std::memory_order_relaxed);
+      if (lost) {
+        T rec = mklost(cpu, lost);
+        memmove(dst, &rec, sizeof rec);
+        dst += sizeof rec;
+        n -= sizeof rec;
+        ret += sizeof rec;
+      }
+
+      u64 t = r->tail.load(std::memory_order_relaxed);
+      u64 h = r->head.load(std::memory_order_acquire);
+      for (; t != h && n >= sizeof(T); ++t) {
+        memmove(dst, &r->buf[t % N], sizeof(T));
+        dst += sizeof(T);
+        n -= sizeof(T);
+        ret += sizeof(T);
+      }
+      r->tail.store(t, std::memory_order_release);
+    }
+    *next = (*next + 1) % ncpu;
+    return ret;
+  }
+};
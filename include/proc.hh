@@ -78,8 +78,11 @@ struct proc {
   unsigned cpuid;
   void *fpu_state;             // FXSAVE state, lazily allocated
   struct spinlock lock;
-  ilink<proc> child_next;
-  ilist<proc,&proc::child_next> childq;
+  ilink<proc> child_next;      // Link in parent's childq or zombieq
+  ilist<proc,&proc::child_next> childq;  // Live children, under lock
+  ilist<proc,&proc::child_next> zombieq; // Exited children, under lock
+  std::atomic<proc*> newchildq; // Forked children not yet on childq
+  proc *newchild_next;          // Link in parent's newchildq
   ilink<proc> sched_link;
   struct condvar *cv;          // for waiting till children exit
   struct gc_handle *gc;
@@ -97,6 +100,7 @@ struct proc {
   u64 unmap_tlbreq_;
   int data_cpuid;              // Where vmap and kstack is likely to be cached
   int run_cpuid_;
+  int kalloc_cpu_;             // Allocate pages near this CPU, or -1
   int in_exec_;
   int uaccess_;
   bool yield_;                 // yield cpu up when returning to user space
@@ -124,8 +128,9 @@ struct proc {
           curcycles != 0 && curcycles > VICTIMAGE);
   };
 
-
-  static u64   hash(const u32& p);
+  // Move children registered by fork onto childq.  The caller must
+  // hold lock.
+  void         adopt_new_children();
 
   bool deliver_signal(int signo);
 
@@ -140,6 +145,23 @@ private:
   procstate_t state_;       // Process state  
 };
 
+// Direct p's kernel page allocations to cpu's memory (and hence its
+// NUMA node) for the lifetime of this object.  p must be the current
+// process.  This is for building state that another core will use,
+// such as a new process placed elsewhere.
+class scoped_kalloc_cpu {
+  proc *p_;
+  int prev_;
+
+public:
+  scoped_kalloc_cpu(proc *p, int cpu) : p_(p), prev_(p->kalloc_cpu_) {
+    p->kalloc_cpu_ = cpu;
+  }
+  ~scoped_kalloc_cpu() { p_->kalloc_cpu_ = prev_; }
+  scoped_kalloc_cpu(const scoped_kalloc_cpu&) = delete;
+  scoped_kalloc_cpu& operator=(const scoped_kalloc_cpu&) = delete;
+};
+
 class kill_exception : public std::runtime_error {
 public:
     kill_exception() : std::runtime_error("killed") { };
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <sys/types.h>
+
+// A cache that can give memory back under memory pressure.  Each
+// node's kswapd runs the registered shrinkers when the node's free
+// memory drops below its low watermark, and threads whose allocation
+// failed run them directly (see reclaim_direct).
+//
+// Shrinkers are registered by their constructors, so a shrinker is
+// normally a global object.  Registration happens before main runs
+// and shrinkers are never unregistered.
+class shrinker
+{
+public:
+  explicit shrinker(const char *name);
+
+  // Release up to about target pages.  Returns the number of pages
+  // released.  Memory released through refcache or gc_delayed
+  // reaches the allocator only after a few epochs, so this is an
+  // estimate of future free memory.  Called without locks held and
+  // may sleep.
+  virtual size_t shrink(size_t target) = 0;
+
+  const char * const name;
+
+protected:
+  ~shrinker() { }
+};
+
+// Run the shrinkers until they release about target pages.  Returns
+// the number of pages released.
+size_t reclaim(size_t target);
+
+// Reclaim on behalf of a thread whose allocation failed, and wake
+// the reclaim and garbage collection threads so the memory it frees
+// becomes available.  Must be called without locks held; callers
+// should yield and retry the allocation afterward.
+void reclaim_direct(void);
+
+// Ask this CPU's node's kswapd to check its watermarks now rather
+// than at its next interval.  Safe to call with locks held.
+void reclaim_wake(void);
+
+// Return node's low watermark in pages: the free memory below which
+// its kswapd starts reclaiming.  Caches that fill themselves from
+// free memory should leave at least this much.  Returns 0 before
+// reclaim is initialized or if it is disabled.
+size_t reclaim_low_watermark(int node);
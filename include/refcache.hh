@@ -140,6 +140,14 @@
 //       inc(weakref.pointer)
 //     return weakref.pointer
 //
+// Freeing an object is deferred to a per-core reaper thread.  Rather
+// than freeing a dead object on the core whose review found it, the
+// reviewer hands it to the reaper of the object's *home* core (the
+// core that constructed it), so memory goes back to the allocator it
+// most likely came from, even for single-producer workloads.  The
+// reaper frees objects of types that provide a batch_reaper in
+// batches.
+//
 // For epoch management, our current implementation uses a simple
 // barrier scheme that tracks a global epoch counter, per-core epochs,
 // and a count of how many per-core epochs have reached the current
@@ -168,10 +176,24 @@
 
 namespace refcache {
   enum {
-    CACHE_SLOTS = 4096
+    CACHE_SLOTS = 4096,
+    // The maximum number of objects the reaper passes to a single
+    // batch_reaper call.
+    REAP_BATCH = 64,
+    // The number of distinct batch_reapers the reaper accumulates
+    // batches for at once.
+    REAP_CLASSES = 4,
   };
 
   template<class T> class weakref;
+  class referenced;
+
+  // A batch_reaper frees n dead objects at once, in place of calling
+  // onzero() on each.  The reaper groups dead objects by the
+  // batch_reaper returned by referenced::get_batch_reaper() and hands
+  // each group to that function, so a type can amortize the cost of
+  // freeing many objects (e.g., by taking an allocator lock once).
+  typedef void (*batch_reaper)(referenced **objs, std::size_t n);
 
   // Base class for an object that's reference counted using the
   // refcaching scheme.
@@ -215,6 +237,11 @@ namespace refcache {
     // reference.
     bool weak_ : 1;
 
+    // The core that constructed this object.  Once this object is
+    // known to be dead, it is reaped on this core, so its memory is
+    // returned to the allocator that (most likely) supplied it.
+    uint16_t home_;
+
   public:
     referenced(uint64_t refcount = 1)
       : lock_("refcache::referenced"),
@@ -222,7 +249,8 @@ namespace refcache {
         next_(),
         review_epoch_(0),
         dirty_(false),
-        weak_(false) { }
+        weak_(false),
+        home_(myid()) { }
     virtual ~referenced() { }
 
     referenced(const referenced &o) = delete;
@@ -247,6 +275,46 @@ namespace refcache {
     // each object or the overhead of virtual method calls.
 
     virtual void onzero() = 0;
+
+    // Return this object's batch_reaper, or nullptr to have the
+    // reaper call onzero() on this object by itself.
+    virtual batch_reaper get_batch_reaper() const
+    {
+      return nullptr;
+    }
+  };
+
+  // A batch_reaper that downcasts each object to T and passes the
+  // batch to T::onzero_batch(T **objs, size_t n), which must free
+  // every object just as T::onzero() would.
+  template<class T>
+  void
+  typed_batch_reaper(referenced **objs, std::size_t n)
+  {
+    T *typed[REAP_BATCH];
+    for (std::size_t i = 0; i < n; i++)
+      typed[i] = static_cast<T*>(objs[i]);
+    T::onzero_batch(typed, n);
+  }
+
+  // Derive T from batch_reaped<T, Base> instead of Base to have
+  // refcache free T's in batches with typed_batch_reaper<T>.  Base
+  // may be any reference counting base, so types whose reference
+  // counting scheme is configurable (e.g., page_info) can use it
+  // unconditionally; it only adds get_batch_reaper() if Base is
+  // refcache::referenced.
+  template<class T, class Base,
+           bool = std::is_base_of<referenced, Base>::value>
+  class batch_reaped : public Base { };
+
+  template<class T, class Base>
+  class batch_reaped<T, Base, true> : public Base
+  {
+  public:
+    batch_reaper get_batch_reaper() const override
+    {
+      return &typed_batch_reaper<T>;
+    }
   };
 
   // A subclass of referenced for objects that support a weak
@@ -414,11 +482,19 @@ namespace refcache {
 
     // The list of objects whose onzero() method should be called.  Call
     // onzero() from a separate thread, instead of the timer interrupt,
-    // to avoid deadlock with the thread preempted by the timer.
+    // to avoid deadlock with the thread preempted by the timer.  Any
+    // core's review may add objects to this list, but only objects
+    // whose home is this core.
     referenced::list reap_;
     spinlock reap_lock_;
     condvar reap_cv_;
 
+    // Dead objects found by this core's review, by home core.  These
+    // are handed off to each home core's reap_ list in one batch at
+    // the end of the review.  Like review_, this must be accessed
+    // only by the local reviewer.
+    referenced::list reap_out_[NCPU];
+
     // The last global epoch number observed by this core.
     uint64_t local_epoch;
 
@@ -478,6 +554,14 @@ namespace refcache {
     // call may be active at a time per core.
     void review();
 
+    // Move the objects this core's review found dead to their home
+    // cores' reap lists and wake the reapers.
+    void send_reapable();
+
+    // Free the objects in reapable, grouping objects with the same
+    // batch_reaper.  Returns the number of objects freed.
+    static uint64_t reap(referenced::list *reapable);
+
   public:
     cache() = default;
     cache(const cache &o) = delete;
@@ -8,6 +8,12 @@ struct perf_selector
   // Enable precise sampling, if possible.  This is incompatible with
   // recording stack traces.
   bool precise : 1;
+  // Aggregate samples by their full kernel and user call stack
+  // instead of logging them.  While set, reads of the sampler device
+  // drain pmustack records incrementally rather than returning a log
+  // snapshot, and sampling never stops for lack of log space.  This
+  // is incompatible with precise.
+  bool stacks : 1;
   // If non-zero, profile load latency by sampling loads that take
   // load_latency or more CPU cycles.  This is only supported on Intel
   // Nehalem or later.  If this is set, the value must be at least 4,
@@ -39,6 +45,27 @@ struct pmuevent {
   u64 load_address;
 };
 
+#define NSTACK 30
+
+// A call stack and the number of samples that hit it.  In stack
+// mode, the sampler device returns a stream of these.
+struct pmustack {
+  u32 count;
+  u16 cpu;
+  u8 idle:1;
+  u8 ints_disabled:1;
+  u8 kernel:1;
+  // If set, this record has no stack; count is the number of samples
+  // cpu dropped because its ring was full.
+  u8 lost:1;
+  // pc[0, kdepth) are kernel frames and pc[kdepth, depth) are the
+  // frames of the user thread the kernel is running on behalf of,
+  // each innermost first.
+  u8 kdepth;
+  u8 depth;
+  u64 pc[NSTACK];
+};
+
 struct logheader {
   u64 ncpus;
   struct {
@@ -5,25 +5,55 @@
 
 class sleeplock {
  public:
-  sleeplock() : held_(false) {}
+  sleeplock() : sleeplock("sleeplock") {}
+
+  explicit sleeplock(const char *name)
+    : held_(false)
+#if LOCKSTAT
+    , name_(name), stat_(nullptr), held_ts_(0)
+#endif
+  {}
 
   void acquire() {
+#if LOCKSTAT
+    u64 start = lockstat_start();
+#endif
     scoped_acquire x(&spinlock_);
+    bool contended = held_;
     while (held_)
       cv_.sleep(&spinlock_);
     held_ = true;
+#if LOCKSTAT
+    if (start)
+      held_ts_ = lockstat_wait(stat_, start, contended, nullptr);
+#endif
   }
 
   bool try_acquire() {
+#if LOCKSTAT
+    u64 start = lockstat_start();
+#endif
     scoped_acquire x(&spinlock_);
     if (held_)
       return false;
     held_ = true;
+#if LOCKSTAT
+    if (start)
+      held_ts_ = lockstat_wait(stat_, start, false, nullptr);
+#endif
     return true;
   }
 
   void release() {
     scoped_acquire x(&spinlock_);
+#if LOCKSTAT
+    // A sleeplock may be released on another CPU, so it times its
+    // own holds.
+    if (held_ts_) {
+      lockstat_hold(stat_, rdtsc() - held_ts_);
+      held_ts_ = 0;
+    }
+#endif
     held_ = false;
     cv_.wake_all();
   }
@@ -33,7 +63,23 @@ class sleeplock {
   }
 
  private:
+#if LOCKSTAT
+  // Returns the time an acquire started, or 0 if lockstat is off.
+  u64 lockstat_start() {
+    if (!lockstat_enable)
+      return 0;
+    if (!stat_)
+      stat_ = lockstat_lookup(name_);
+    return stat_ ? rdtsc() : 0;
+  }
+#endif
+
   spinlock spinlock_;
   condvar cv_;
   bool held_;
+#if LOCKSTAT
+  const char *name_;
+  struct klockstat *stat_;
+  u64 held_ts_;                 // When the current hold began, if timed
+#endif
 };
@@ -5,10 +5,6 @@
 #include <atomic>
 #include "cpputil.hh"           // For NEW_DELETE_OPS
 
-#if LOCKSTAT
-extern struct klockstat klockstat_lazy;
-#endif
-
 // ::lock_guard represents lock ownership of a lockable object.  These
 // objects are not copyable, but they are movable, so lock ownership
 // may be transferred.
@@ -95,16 +91,23 @@ struct spinlock {
   u32 locked;
 #endif
 
+#if LOCKSTAT
+  bool want_stat;    // Gather lockstat for this lock?
+#endif
+
+#if SPINLOCK_DEBUG || LOCKSTAT
+  const char *name;  // Name of lock.
+#endif
+
 #if SPINLOCK_DEBUG
   // For debugging:
-  const char *name;  // Name of lock.
   struct cpu *cpu;   // The cpu holding the lock.
   uptr pcs[10];      // The call stack (an array of program counters)
                      // that locked the lock.
 #endif
 
 #if LOCKSTAT
-  struct klockstat *stat;
+  struct klockstat *stat;  // This lock's class, once looked up.
 #endif
 
   // Construct an uninitialized spinlock.  This should be
@@ -113,8 +116,14 @@ struct spinlock {
   // incurring a static constructor.
   constexpr spinlock()
     : locked(0)
+#if LOCKSTAT
+    , want_stat(false)
+#endif
+#if SPINLOCK_DEBUG || LOCKSTAT
+    , name(nullptr)
+#endif
 #if SPINLOCK_DEBUG
-    , name(nullptr), cpu(nullptr), pcs{}
+    , cpu(nullptr), pcs{}
 #endif
 #if LOCKSTAT
     , stat(nullptr)
@@ -125,11 +134,17 @@ struct spinlock {
   // global spinlocks without incurring a static constructor.
   constexpr spinlock(const char *name, bool lockstat = false)
     : locked(0)
+#if LOCKSTAT
+    , want_stat(lockstat)
+#endif
+#if SPINLOCK_DEBUG || LOCKSTAT
+    , name(name)
+#endif
 #if SPINLOCK_DEBUG
-    , name(name), cpu(nullptr), pcs{}
+    , cpu(nullptr), pcs{}
 #endif
 #if LOCKSTAT
-    , stat(lockstat ? &klockstat_lazy : nullptr)
+    , stat(nullptr)
 #endif
   { }
 
@@ -142,11 +157,6 @@ struct spinlock {
   spinlock(spinlock &&o);
   spinlock &operator=(spinlock &&o);
 
-#if LOCKSTAT
-  // Conflicts with constexpr
-  // ~spinlock();
-#endif
-
   NEW_DELETE_OPS(spinlock);
 
   void acquire();
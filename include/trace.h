@@ -0,0 +1,74 @@
+// Kernel event trace records, as read from /dev/trace.  This is
+// shared by the kernel, the trace tool, and tools/ktrace-json.
+#pragma once
+
+#include <stdint.h>
+
+// Trace categories.  Tracepoints in a category record only while its
+// bit is set in the mask written to /dev/trace.
+#define TRACE_SCHED     0x01
+#define TRACE_VM        0x02
+#define TRACE_GC        0x04
+#define TRACE_REFCACHE  0x08
+#define TRACE_IPI       0x10
+#define TRACE_FUTEX     0x20
+#define TRACE_DISK      0x40
+#define TRACE_ALL       0x7f
+
+// Every trace event as X(name, category, phase, arg0, arg1).  The
+// phase is a Chrome trace-event phase: 'B' and 'E' begin and end a
+// duration in the current process (which may migrate in between) and
+// 'i' marks an instant.  arg0 and arg1 name the arguments, or are
+// null if unused.
+#define TRACE_EVENTS(X)                                                 \
+  /* Written when tracing starts.  arg0 is the TSC frequency. */       \
+  X(clock,           0,              'i', "hz", nullptr)               \
+  /* Records dropped on the recording CPU because its ring was full. */ \
+  X(lost,            0,              'i', "count", nullptr)            \
+  X(sched_switch,    TRACE_SCHED,    'i', "prev", "next")              \
+  X(sched_wakeup,    TRACE_SCHED,    'i', "pid", "cpu")                \
+  X(page_fault,      TRACE_VM,       'B', "addr", "err")               \
+  X(page_fault_done, TRACE_VM,       'E', "ret", nullptr)              \
+  X(tlb_shootdown,   TRACE_VM,       'B', "targets", nullptr)          \
+  X(tlb_shootdown_done, TRACE_VM,    'E', nullptr, nullptr)            \
+  X(gc_epoch,        TRACE_GC,       'i', "epoch", nullptr)            \
+  X(gc_free,         TRACE_GC,       'B', "epoch", nullptr)            \
+  X(gc_free_done,    TRACE_GC,       'E', "freed", nullptr)            \
+  X(refcache_epoch,  TRACE_REFCACHE, 'i', "epoch", nullptr)            \
+  X(refcache_flush,  TRACE_REFCACHE, 'B', "epoch", nullptr)            \
+  X(refcache_flush_done, TRACE_REFCACHE, 'E', "flushed", nullptr)      \
+  X(refcache_review, TRACE_REFCACHE, 'B', "epoch", nullptr)            \
+  X(refcache_review_done, TRACE_REFCACHE, 'E', "reviewed", nullptr)    \
+  X(ipi_send,        TRACE_IPI,      'i', "cpu", nullptr)              \
+  X(ipi_call,        TRACE_IPI,      'B', nullptr, nullptr)            \
+  X(ipi_call_done,   TRACE_IPI,      'E', nullptr, nullptr)            \
+  X(futex_wait,      TRACE_FUTEX,    'B', "key", "val")                \
+  X(futex_wait_done, TRACE_FUTEX,    'E', nullptr, nullptr)            \
+  X(futex_wake,      TRACE_FUTEX,    'i', "key", "nwake")              \
+  X(disk_read,       TRACE_DISK,     'B', "offset", "count")           \
+  X(disk_read_done,  TRACE_DISK,     'E', nullptr, nullptr)            \
+  X(disk_write,      TRACE_DISK,     'B', "offset", "count")           \
+  X(disk_write_done, TRACE_DISK,     'E', nullptr, nullptr)            \
+
+enum trace_event {
+#define X(name, cat, ph, a0, a1) TRACE_EV_##name,
+  TRACE_EVENTS(X)
+#undef X
+  TRACE_NEVENTS
+};
+
+// A trace record.  Records from one CPU are in timestamp order;
+// records from different CPUs are interleaved arbitrarily.
+struct trace_rec
+{
+  uint64_t tsc;
+  uint16_t event;               // enum trace_event
+  uint16_t cpu;
+  uint32_t pid;                 // Current process, or 0
+  uint64_t arg[2];
+};
+
+// Commands written to /dev/trace.  TRACE_CMD_START is followed by a
+// hexadecimal category mask; without one, it enables TRACE_ALL.
+#define TRACE_CMD_START '1'
+#define TRACE_CMD_STOP  '2'
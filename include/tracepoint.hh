@@ -0,0 +1,39 @@
+#pragma once
+
+// Static kernel tracepoints.  TRACEPOINT(name, arg0, arg1) appends a
+// trace_rec for event name to this CPU's trace ring if its category
+// is enabled.  While tracing is off, a tracepoint costs one test of a
+// read-mostly word, and with KTRACE off it compiles to nothing.
+//
+// The ring is lock-free: the only producer is this CPU, with
+// interrupts disabled, and the only consumer is the /dev/trace
+// reader.  If the reader falls behind, new records are dropped and
+// counted, rather than overwriting older ones.
+
+#include "trace.h"
+
+#if KTRACE
+// Mask of enabled TRACE_* categories.  Written only by /dev/trace.
+extern u32 trace_mask;
+
+void trace_emit(enum trace_event ev, u64 arg0, u64 arg1);
+
+constexpr u32 trace_categories[] = {
+#define X(name, cat, ph, a0, a1) cat,
+  TRACE_EVENTS(X)
+#undef X
+};
+
+#define TRACEPOINT(name, arg0, arg1)                                    \
+  do {                                                                  \
+    if (__builtin_expect(trace_mask &                                   \
+                         trace_categories[TRACE_EV_##name], 0))         \
+      trace_emit(TRACE_EV_##name, (u64)(arg0), (u64)(arg1));            \
+  } while (0)
+#else
+#define TRACEPOINT(name, arg0, arg1)                                    \
+  do {                                                                  \
+    if (0)                                                              \
+      (void)((u64)(arg0) + (u64)(arg1));                                \
+  } while (0)
+#endif
@@ -15,4 +15,7 @@ char* gets(char*, int max);
 int forkt(void *sp, void *pc, void *arg, int forkflags);
 void forkt_setup(u64 pid);
 
+// umalloc.cc
+void malloc_thread_exit(void);
+
 END_DECLS
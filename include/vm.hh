@@ -9,8 +9,11 @@
 #include "kalloc.hh"
 #include "page_info.hh"
 #include "mfs.hh"
+#include "ilist.hh"
 
 struct padded_length;
+class page_reserve;
+class page_holder;
 
 using std::atomic;
 
@@ -48,6 +51,18 @@ struct vmdesc : public mmu::page_tracker
 
     // Set if the page should be shared across fork().
     FLAG_SHARED = 1<<5,
+
+    // Set if this page frame's page was released with MADV_FREE.
+    // The page may be reclaimed at any time, after which the page
+    // frame reads as zero.  It's mapped read-only, so the first
+    // write faults and clears this flag, keeping the page.  Only set
+    // for private anonymous memory with a non-COW page.
+    FLAG_LAZYFREE = 1<<6,
+
+    // Set if pagelookup has handed out this page frame's page's
+    // kernel address (e.g., as a futex key), so the compactor must
+    // not move the page.
+    FLAG_PINNED = 1<<7,
   };
 
   // Flags
@@ -85,11 +100,14 @@ struct vmdesc : public mmu::page_tracker
   // A memory descriptor for writable anonymous memory.
   static struct vmdesc anon_desc;
 
+  // Lock statistics class for the per-page descriptor locks.
+  static lockstat_class lock_class;
+
   // Radix_array element methods
 
   bit_spinlock get_lock()
   {
-    return bit_spinlock(&flags, FLAG_LOCK_BIT);
+    return bit_spinlock(&flags, FLAG_LOCK_BIT, &lock_class);
   }
 
   bool is_set() const
@@ -123,6 +141,28 @@ private:
 
 void to_stream(class print_stream *s, const vmdesc &vmd);
 
+// A prebuilt layout of part of an address space, as runs of identical
+// vmdescs.  vmap::stamp maps a template into a new vmap with one
+// radix fill per run.  File mappings don't hold their inode (the
+// template may be cached on that inode), so stamp supplies it.
+// Pages in a template are shared copy-on-write with every vmap it's
+// stamped into.
+struct vmap_template
+{
+  enum { MAX_REGIONS = 16 };
+
+  struct region
+  {
+    uptr start, end;
+    vmdesc desc;
+  };
+
+  size_t n;
+  region regions[MAX_REGIONS];
+
+  vmap_template() : n(0) { }
+};
+
 // An address space. This manages the mapping from virtual addresses
 // to virtual memory descriptors.
 struct vmap : public referenced {
@@ -141,6 +181,29 @@ struct vmap : public referenced {
   // Populate vmdesc's.
   int willneed(uptr start, uptr len);
 
+  // Release the pages backing start to start+len (MADV_DONTNEED).
+  // Anonymous memory will read as zero and file mappings will read
+  // the file's contents.
+  int dontneed(uptr start, uptr len);
+
+  // Mark the pages backing start to start+len as free to reclaim
+  // under memory pressure (MADV_FREE).  Until a page frame is
+  // written, it may read as either its old contents or zero.  Only
+  // valid on private anonymous memory.
+  int lazyfree(uptr start, uptr len);
+
+  // Reclaim up to @c target pages released with lazyfree from any
+  // address space.  Returns the number of pages reclaimed.
+  static size_t reclaim_lazyfree(size_t target);
+
+  // Move the private anonymous pages of every address space that are
+  // in any of the n size-byte kernel virtual ranges starting at
+  // blocks to new pages, for the compactor.  Address spaces are
+  // walked once per call, so the compactor should pass every
+  // pageblock it has isolated.  Returns the number of pages moved.
+  static size_t migrate(void *const *blocks, size_t n, size_t size);
+  struct migrate_set;
+
   // Invalidate page caches.
   int invalidate_cache(uptr start, uptr len);
 
@@ -177,6 +240,15 @@ struct vmap : public referenced {
   // Set write permission bit in vmdesc
   int set_write_permission(uptr start, uptr len, bool is_readonly, bool is_cow);
 
+  // Record this vmap's mappings in *out, marking its pages
+  // copy-on-write.  File mappings must all be of ip.  Returns false
+  // if the layout has too many runs for a template.
+  bool make_template(vmap_template *out, const sref<mnode> &ip);
+
+  // Map t into this vmap, where its file mappings map ip.  The
+  // template's ranges must be unmapped.
+  void stamp(const vmap_template &t, const sref<mnode> &ip);
+
   uptr brk_;                    // Top of heap
 
 private:
@@ -190,6 +262,20 @@ private:
   mmu::page_map_cache cache;
   friend void switchvm(struct proc *);
 
+  // Link in the list of address spaces with lazily freed pages.
+  // Protected by that list's lock.
+  ilink<vmap> lazyfree_link_;
+  bool lazyfree_listed_;
+  // lazyfree calls that have marked pages but not yet shot them down.
+  std::atomic<int> lazyfree_inflight_;
+  friend class lazyfree_list;
+
+  // Link in the per-CPU list of all address spaces, and that list's
+  // CPU.  Protected by that list's lock.
+  ilink<vmap> all_link_;
+  int all_cpu_;
+  friend class vmap_list;
+
   // Virtual page frames
   typedef radix_array<vmdesc, USERTOP / PGSIZE, PGSIZE,
                       kalloc_allocator<vmdesc>, scoped_no_sched> vpf_array;
@@ -199,13 +285,37 @@ private:
 
   enum class access_type
   {
-    READ, WRITE
+    READ, WRITE,
+    // A read fault from user space.  This is like READ, except that
+    // an unbacked, private anonymous page frame will be backed by the
+    // shared zero page (copy-on-write) instead of a new page.
+    READ_FAULT,
   };
 
   // Ensure there is a backing page at @c it.  The caller is
   // responsible for ensuring that there is a mapping at @c it and for
   // locking vpfs_ at @c it.  This throws bad_alloc if a page must be
-  // allocated and cannot be.
+  // allocated and cannot be.  For a READ or WRITE access to a page
+  // frame backed by the zero page, this replaces the zero page with a
+  // private page, so, like for a COW fault, the caller must
+  // invalidate any existing mapping of the page frame first.  If
+  // @c reserve is non-null, new pages are taken from it.
   page_info *ensure_page(const vpf_array::iterator &it, access_type type,
-                         bool *allocated = nullptr);
+                         bool *allocated = nullptr,
+                         page_reserve *reserve = nullptr);
+
+  // Move the page backing the page frame at @c it to @c pages,
+  // leaving the page frame unbacked.  The caller must lock vpfs_ at
+  // @c it and must have already invalidated it.
+  void drop_page(const vpf_array::iterator &it, page_holder *pages);
+
+  // Set @c set and clear @c clear in the flags of the page frame at
+  // @c it, which must be locked.
+  void update_flags(const vpf_array::iterator &it, u64 set, u64 clear);
+
+  // Reclaim lazily freed pages in this address space.
+  size_t reclaim_lazyfree_pages(size_t target, bool *more);
+
+  // Move this address space's pages in set.  See migrate.
+  size_t migrate_pages(const migrate_set &set);
 };
@@ -84,6 +84,18 @@ private:
       }
     }
 
+    template<class F>
+    void
+    for_each(F &fn) const
+    {
+      scoped_gc_epoch reader;
+      for (auto &i: chain_) {
+        sref<V> v = i.weakref_.get();
+        if (v)
+          fn(v.get());
+      }
+    }
+
     void
     update_stats(struct stats *stats) const
     {
@@ -144,6 +156,24 @@ public:
     i->parent_->remove(i);
   }
 
+  std::size_t
+  buckets() const
+  {
+    return mask_ + 1;
+  }
+
+  // Call fn on each live value in the n buckets starting at *cursor,
+  // wrapping around, and advance *cursor past them.  This lets a
+  // caller sweep the cache a piece at a time, as a clock.
+  template<class F>
+  void
+  sweep(std::atomic<std::size_t> *cursor, std::size_t n, F fn) const
+  {
+    std::size_t start = cursor->fetch_add(n, std::memory_order_relaxed);
+    for (std::size_t i = 0; i < n; ++i)
+      buckets_[(start + i) & mask_].for_each(fn);
+  }
+
   struct stats
   get_stats() const
   {
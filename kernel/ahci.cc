@@ -100,12 +100,20 @@ public:
 
   void handle_irq() override;
 
+  // Deliver port pid's completions to this CPU.  Called by the port
+  // before it issues a command.
+  void steer_port_irq(int pid);
+
   NEW_DELETE_OPS(ahci_hba);
 
 private:
   const u32 membase;
   volatile ahci_reg *const reg;
   ahci_port* port[32];
+  // Non-null if each port has its own MSI vector
+  pci_msi *port_msi;
+
+  void handle_port(int i);
 };
 
 void
@@ -133,42 +141,76 @@ ahci_hba::attach(struct pci_func *pcif)
 
 ahci_hba::ahci_hba(struct pci_func *pcif)
   : membase(pcif->reg_base[5]),
-    reg((ahci_reg*) p2v(membase))
+    reg((ahci_reg*) p2v(membase)), port{}, port_msi(nullptr)
 {
   reg->g.ghc |= AHCI_GHC_AE;
 
+  int nports = 0;
   for (int i = 0; i < 32; i++) {
     if (reg->g.pi & (1 << i)) {
       port[i] = new ahci_port(this, i, &reg->port[i].p);
+      nports = i + 1;
     }
   }
 
-  irq ahci_irq = extpic->map_pci_irq(pcif);
-  ahci_irq.enable();
-  ahci_irq.register_handler(this);
+  // Ask for a vector per port.  If the HBA gets every message it
+  // requested, port i interrupts with message i (AHCI 1.3, section
+  // 10.7.2.2); otherwise it reverts to message 0 for all ports.
+  pci_msi *msi = nports ? pci_map_msi_irqs(pcif, nports) : nullptr;
+  if (msi && msi->count() >= (size_t)nports &&
+      !(reg->g.ghc & AHCI_GHC_MRSM)) {
+    port_msi = msi;
+    for (int i = 0; i < nports; i++) {
+      if (port[i])
+        msi->get_irq(i).register_callback([this, i]() { handle_port(i); });
+    }
+    // MSI grants a power of two.  The HBA never sends the messages
+    // past its ports, but if it did, the shared handler copes.
+    for (size_t i = nports; i < msi->count(); i++)
+      msi->get_irq(i).register_handler(this);
+  } else if (msi) {
+    msi->get_irq(0).register_handler(this);
+  } else {
+    irq ahci_irq = extpic->map_pci_irq(pcif);
+    ahci_irq.enable();
+    ahci_irq.register_handler(this);
+  }
   reg->g.ghc |= AHCI_GHC_IE;
 }
 
+void
+ahci_hba::steer_port_irq(int pid)
+{
+  // Each port has one command in flight at a time, so the issuing
+  // CPU is the one waiting for the completion.
+  if (port_msi)
+    port_msi->set_affinity(pid, mycpu());
+}
+
 void
 ahci_hba::handle_irq()
 {
   for (int i = 0; i < 32; i++) {
-    if (!(reg->g.is & (1 << i)))
-      continue;
-
-    if (port[i]) {
-      port[i]->handle_port_irq();
-    } else {
-      cprintf("AHCI: stray irq for port %d, clearing\n", i);
-    }
+    if (reg->g.is & (1 << i))
+      handle_port(i);
+  }
+}
 
-    /* AHCI 1.3, section 10.7.2.1 says we need to first clear the
-     * port interrupt status and then clear the host interrupt
-     * status.  It's fine to do this even after we've processed the
-     * port interrupt: if any port interrupts happened in the mean
-     * time, the host interrupt bit will just get set again. */
-    reg->g.is = (1 << i);
+void
+ahci_hba::handle_port(int i)
+{
+  if (port[i]) {
+    port[i]->handle_port_irq();
+  } else {
+    cprintf("AHCI: stray irq for port %d, clearing\n", i);
   }
+
+  /* AHCI 1.3, section 10.7.2.1 says we need to first clear the
+   * port interrupt status and then clear the host interrupt
+   * status.  It's fine to do this even after we've processed the
+   * port interrupt: if any port interrupts happened in the mean
+   * time, the host interrupt bit will just get set again. */
+  reg->g.is = (1 << i);
 }
 
 
@@ -458,5 +500,6 @@ ahci_port::issue(kiovec* iov, int iov_cnt, u64 off, int cmd)
   }
 
   fill_fis(&fis);
+  hba->steer_port_irq(pid);
   preg->ci |= 1;
 }
@@ -2,9 +2,16 @@
 #include "kernel.hh"
 #include "buf.hh"
 #include "weakcache.hh"
+#include "tracepoint.hh"
+#include "reclaim.hh"
 
 static weakcache<buf::key_t, buf> bufcache(512 << 10);
 
+enum {
+  // Buckets the shrinker sweeps between checks of its target
+  BUFCACHE_SWEEP = 64,
+};
+
 sref<buf>
 buf::get(u32 dev, u64 block)
 {
@@ -15,14 +22,23 @@ buf::get(u32 dev, u64 block)
       // Wait for buffer to load, by getting a read seqlock,
       // which waits for the write seqlock bit to be cleared.
       b->seq_.read_begin();
+      if (!b->referenced_.load(std::memory_order_relaxed))
+        b->referenced_.store(true);
+      // The shrinker may have dropped the cache's reference
+      if (!b->cached_.load(std::memory_order_relaxed) &&
+          cmpxch(&b->cached_, false, true))
+        b->inc();
       return b;
     }
 
     sref<buf> nb = sref<buf>::transfer(new buf(dev, block));
     auto locked = nb->write();
     if (bufcache.insert(k, nb.get())) {
+      nb->cached_ = true;
       nb->inc();  // keep it in the cache
+      TRACEPOINT(disk_read, block*BSIZE, BSIZE);
       ideread(dev, locked->data, BSIZE, block*BSIZE);
+      TRACEPOINT(disk_read_done, 0, 0);
       return nb;
     }
   }
@@ -37,7 +53,25 @@ buf::writeback()
 
   // write copy[] to disk; don't need to wait for write to finish,
   // as long as write order to disk has been established.
+  TRACEPOINT(disk_write, block_*BSIZE, BSIZE);
   idewrite(dev_, copy->data, BSIZE, block_*BSIZE);
+  TRACEPOINT(disk_write_done, 0, 0);
+}
+
+bool
+buf::age()
+{
+  // Dirty buffers stay until written back
+  if (dirty_)
+    return false;
+  if (referenced_.load(std::memory_order_relaxed)) {
+    referenced_.store(false, std::memory_order_relaxed);
+    return false;
+  }
+  if (!cmpxch(&cached_, true, false))
+    return false;
+  dec();
+  return true;
 }
 
 void
@@ -46,3 +80,37 @@ buf::onzero()
   bufcache.cleanup(weakref_);
   delete this;
 }
+
+void
+buf::onzero_batch(buf **bufs, size_t n)
+{
+  for (size_t i = 0; i < n; i++)
+    bufcache.cleanup(bufs[i]->weakref_);
+  for (size_t i = 0; i < n; i++)
+    delete bufs[i];
+}
+
+namespace {
+  // Evict clean buffers that haven't been used for a full sweep of
+  // the cache.  They'll be read back from disk if needed again.
+  class bufcache_shrinker : public shrinker
+  {
+    std::atomic<size_t> cursor_;
+
+  public:
+    bufcache_shrinker() : shrinker("bufcache"), cursor_(0) { }
+
+    size_t shrink(size_t target) override
+    {
+      // Each buffer holds one block
+      size_t n = 0;
+      for (size_t swept = 0; n < target && swept < bufcache.buckets();
+           swept += BUFCACHE_SWEEP)
+        bufcache.sweep(&cursor_, BUFCACHE_SWEEP, [&n](buf *b) {
+            if (b->age())
+              ++n;
+          });
+      return n * BSIZE / PGSIZE;
+    }
+  } bufcache_shrinker_;
+}
@@ -3,6 +3,7 @@
 #include "kstream.hh"
 #endif
 
+#include <algorithm>
 #include <cassert>
 #include <cstring>
 #include <iterator>
@@ -10,7 +11,11 @@
 using namespace std;
 
 buddy_allocator::buddy_allocator(void *base, size_t len,
-                                 void *track_base, size_t track_len)
+                                 void *track_base, size_t track_len,
+                                 unsigned char *pageblocks,
+                                 uintptr_t pageblocks_base)
+  : max_order(MAX_ORDER), nonempty{}, pageblocks(pageblocks),
+    pageblocks_base(pageblocks_base)
 {
   if (track_base == nullptr && track_len == 0) {
     track_base = base;
@@ -22,10 +27,22 @@ buddy_allocator::buddy_allocator(void *base, size_t len,
   uintptr_t track_end = (uintptr_t)track_base + track_len;
   assert(track_base <= base && free_end <= track_end);
 
-  // Round tracked region out to a multiple of MAX_SIZE so that every
-  // trackable block has a buddy.
-  track_base = (void*)((uintptr_t)track_base & ~(MAX_SIZE - 1));
-  track_end = (track_end + MAX_SIZE - 1) & ~(MAX_SIZE - 1);
+  // Round tracked region out to a multiple of the largest block size
+  // so that every trackable block has a buddy.  Large blocks would
+  // make small regions' bitmaps mostly track memory that isn't there
+  // (or not fit at all), so lower this region's maximum order until
+  // rounding out at most doubles it.
+  uintptr_t block_size;
+  for (;; --max_order) {
+    block_size = (uintptr_t)MIN_SIZE << max_order;
+    uintptr_t lo = (uintptr_t)track_base & ~(block_size - 1);
+    uintptr_t hi = (track_end + block_size - 1) & ~(block_size - 1);
+    if (max_order == TRACK_ORDER ||
+        hi - lo <= 2 * (track_end - (uintptr_t)track_base))
+      break;
+  }
+  track_base = (void*)((uintptr_t)track_base & ~(block_size - 1));
+  track_end = (track_end + block_size - 1) & ~(block_size - 1);
   track_len = track_end - (uintptr_t)track_base;
 
   // Use a linear allocator to allocate buddy tracking bitmaps from
@@ -33,7 +50,7 @@ buddy_allocator::buddy_allocator(void *base, size_t len,
   // XXX(Austin) Should we check if we have more unaligned space at
   // the end?  Currently, we skip 16 megs between each buddy region.
   size_t nBlocks = track_len / MIN_SIZE;
-  for (size_t i = 0; i < MAX_ORDER; ++i) {
+  for (size_t i = 0; i < max_order; ++i) {
     size_t bitmapSize = (nBlocks + 7) / 8;
     orders[i].bitmap = (unsigned char*)base;
     if ((uintptr_t)base + bitmapSize >= free_end)
@@ -51,16 +68,18 @@ buddy_allocator::buddy_allocator(void *base, size_t len,
     nBlocks /= 2;
   }
 
-  // The MAX_ORDER bitmap is unused because it doesn't have buddy
-  // pairs.
-  orders[MAX_ORDER].bitmap = nullptr;
+  // The max_order bitmap is unused because it doesn't have buddy
+  // pairs, and no blocks are larger.
+  for (size_t i = max_order; i <= MAX_ORDER; ++i) {
+    orders[i].bitmap = nullptr;
 #if BUDDY_DEBUG
-  orders[MAX_ORDER].debug = nullptr;
+    orders[i].debug = nullptr;
 #endif
+  }
 
   // Record the region we can track.  These must be multiples of
   // MIN_SIZE, but they will be since we've already rounded to
-  // MAX_SIZE above.
+  // block_size above.
   this->base = (uintptr_t)track_base;
   limit = track_end;
 
@@ -68,10 +87,10 @@ buddy_allocator::buddy_allocator(void *base, size_t len,
   uintptr_t block_base = ((uintptr_t)base + MIN_SIZE - 1) & ~(MIN_SIZE - 1);
   uintptr_t block_end = free_end & ~(MIN_SIZE - 1);
   for (uintptr_t block = block_base; block < block_end; ) {
-    if ((block & (MAX_SIZE - 1)) == 0 && block + MAX_SIZE <= block_end) {
-      // Fast path for MAX_SIZE blocks
-      free_order((void*)block, MAX_ORDER);
-      block += MAX_SIZE;
+    if ((block & (block_size - 1)) == 0 && block + block_size <= block_end) {
+      // Fast path for max_order blocks
+      free_order((void*)block, max_order);
+      block += block_size;
     } else {
       free_order((void*)block, 0);
       block += MIN_SIZE;
@@ -92,80 +111,204 @@ buddy_allocator::buddy_allocator(void *base, size_t len,
 }
 
 void*
-buddy_allocator::alloc_order(size_t order)
+buddy_allocator::alloc_order(size_t order, mobility type)
 {
-  // Is a block of this order available?
-  if (!orders[order].blocks.empty()) {
-    // Get a block
-    struct block *block = &orders[order].blocks.front();
-    orders[order].blocks.pop_front();
-
-    // Mark it as allocated
-    if (order < MAX_ORDER) {
-      bool state = flip_bit(block, order);
-      // Now both buddies must be allocated (otherwise they would have
-      // been promoted).
-      assert(state == 0);
-      mark_allocated(block, order, true);
-    }
+  if (!pageblocks)
+    type = UNMOVABLE;
 
-    assert((uintptr_t)block >= base && (uintptr_t)block < limit);
-    return (void*)block;
-  } else if (order == MAX_ORDER) {
-    return nullptr;
+  // Find the smallest order at least as large as order that has a
+  // free block of this type.
+  mobility from_type = type;
+  unsigned long avail = nonempty[type] >> order;
+  size_t from;
+  if (avail) {
+    from = order + __builtin_ctzl(avail);
   } else {
-    // We need to split a block.  We'll allocate one of order + 1, use
-    // the first half of it and add the second half to order's free
-    // list.
-    void *parent = alloc_order(order + 1);
-    if (!parent)
+    // Fall back to the other type.  Prefer a block that covers whole
+    // pageblocks, which we take over so later allocations of this
+    // type find them.  Otherwise take the largest block there is, so
+    // we break up as few of the other type's pageblocks as possible.
+    from_type = type == UNMOVABLE ? MOVABLE : UNMOVABLE;
+    unsigned long other = nonempty[from_type];
+    size_t min = std::max(order, (size_t)PAGEBLOCK_ORDER);
+    if (min <= max_order && (other >> min))
+      from = min + __builtin_ctzl(other >> min);
+    else if (other >> order)
+      from = (sizeof other * 8 - 1) - __builtin_clzl(other);
+    else
       return nullptr;
-    struct block *second_half =
-      (struct block*)((char*)parent + (MIN_SIZE << order));
-    orders[order].blocks.push_front(second_half);
+  }
+
+  // Get a block and mark it as allocated
+  void *block = pop_block(from, from_type);
+  if (from_type != type && from >= PAGEBLOCK_ORDER)
+    // Claim the pageblocks we're allocating from.  The halves split
+    // off below past them keep their type.
+    set_type(block, (size_t)MIN_SIZE << std::max(order,
+                                                 (size_t)PAGEBLOCK_ORDER),
+             type);
+  if (from < max_order) {
+    bool state = flip_bit(block, from);
+    // Now both buddies must be allocated (otherwise they would have
+    // been promoted).
+    assert(state == 0);
+    mark_allocated(block, from, true);
+  }
+
+  // Split it down to order.  At each step we keep the first half and
+  // add the second half to the lower order's free list.
+  while (from > order) {
+    --from;
+    push_block((char*)block + ((uintptr_t)MIN_SIZE << from), from);
 
     // Mark this pair as half-allocated
-    bool state = flip_bit(parent, order);
+    bool state = flip_bit(block, from);
     assert(state == 1);
-    mark_allocated(parent, order, true);
-
-    assert((uintptr_t)parent >= base && (uintptr_t)parent < limit);
-    return parent;
+    mark_allocated(block, from, true);
   }
+
+  assert((uintptr_t)block >= base && (uintptr_t)block < limit);
+  return block;
 }
 
 void
 buddy_allocator::free_order(void *ptr, size_t order)
 {
-  assert(base <= (uintptr_t)ptr && (uintptr_t)ptr < limit);
+  for (;;) {
+    assert(base <= (uintptr_t)ptr && (uintptr_t)ptr < limit);
 #if BUDDY_DEBUG && !KALLOC_BUDDY_PER_CPU
-  /*
-   * Per-CPU buddy allocators cannot answer is_allocated() correctly.
-   */
-  if (order < MAX_ORDER)
-    if (!is_allocated(ptr, order))
-      spanic.println("double free or too-small free of ", ptr,
-                     " of size ", MIN_SIZE << order, " (order ", order, ")");
-  if (order > 0)
-    if (is_allocated(ptr, order - 1))
-      spanic.println("too-large free of ", ptr,
-                     " of size ", MIN_SIZE << order, " (order ", order, ")");
+    /*
+     * Per-CPU buddy allocators cannot answer is_allocated() correctly.
+     */
+    if (order < max_order)
+      if (!is_allocated(ptr, order))
+        spanic.println("double free or too-small free of ", ptr,
+                       " of size ", MIN_SIZE << order, " (order ", order, ")");
+    if (order > 0)
+      if (is_allocated(ptr, order - 1))
+        spanic.println("too-large free of ", ptr,
+                       " of size ", MIN_SIZE << order, " (order ", order, ")");
 #endif
-  mark_allocated(ptr, order, false);
-
-  if (order < MAX_ORDER && flip_bit(ptr, order) == 0) {
-    // This block's buddy is also free.  Remove the buddy from its
-    // list, combine them, and free to the higher order.
-    uintptr_t buddy = (uintptr_t)ptr ^ ((uintptr_t)MIN_SIZE << order);
-    orders[order].blocks.erase(
-      orders[order].blocks.iterator_to((struct block*)buddy));
-    uintptr_t parent = (uintptr_t)ptr & ~((uintptr_t)MIN_SIZE << order);
-    free_order((void*)parent, order + 1);
-  } else {
-    // This block's buddy is allocated.  Release this block to the
-    // current order.
-    orders[order].blocks.push_front((struct block*)ptr);
+    mark_allocated(ptr, order, false);
+
+    if (order < max_order && flip_bit(ptr, order) == 0) {
+      // This block's buddy is also free.  Remove the buddy from its
+      // list, combine them, and free to the higher order.
+      uintptr_t buddy = (uintptr_t)ptr ^ ((uintptr_t)MIN_SIZE << order);
+      erase_block((void*)buddy, order);
+      ptr = (void*)((uintptr_t)ptr & ~((uintptr_t)MIN_SIZE << order));
+      ++order;
+    } else {
+      // This block's buddy is allocated.  Release this block to the
+      // current order.
+      push_block(ptr, order);
+      return;
+    }
+  }
+}
+
+void
+buddy_allocator::push_block(void *ptr, size_t order)
+{
+  auto *b = (struct block*)ptr;
+  b->type = type_of(ptr);
+  orders[order].blocks[b->type].push_front(b);
+  nonempty[b->type] |= 1ul << order;
+}
+
+void
+buddy_allocator::erase_block(void *ptr, size_t order)
+{
+  auto *b = (struct block*)ptr;
+  auto &blocks = orders[order].blocks[b->type];
+  blocks.erase(blocks.iterator_to(b));
+  if (blocks.empty())
+    nonempty[b->type] &= ~(1ul << order);
+}
+
+void*
+buddy_allocator::pop_block(size_t order, mobility type)
+{
+  auto &blocks = orders[order].blocks[type];
+  struct block *block = &blocks.front();
+  blocks.pop_front();
+  if (blocks.empty())
+    nonempty[type] &= ~(1ul << order);
+  return block;
+}
+
+void
+buddy_allocator::set_type(void *ptr, size_t len, mobility type)
+{
+  if (!pageblocks)
+    return;
+  size_t first = ((uintptr_t)ptr - pageblocks_base) / PAGEBLOCK_SIZE;
+  memset(pageblocks + first, type,
+         (len + PAGEBLOCK_SIZE - 1) / PAGEBLOCK_SIZE);
+}
+
+void
+buddy_allocator::count_movable_free(void *lo, size_t n,
+                                    unsigned short *counts) const
+{
+  for (size_t order = 0; order < PAGEBLOCK_ORDER; ++order) {
+    for (auto &b : orders[order].blocks[MOVABLE]) {
+      size_t i = ((uintptr_t)&b - (uintptr_t)lo) / PAGEBLOCK_SIZE;
+      if ((uintptr_t)&b >= (uintptr_t)lo && i < n)
+        counts[i] += 1 << order;
+    }
+  }
+}
+
+void
+buddy_allocator::isolate(void *pb)
+{
+  assert((uintptr_t)pb % PAGEBLOCK_SIZE == 0);
+  if (!pageblocks)
+    return;
+  set_type(pb, PAGEBLOCK_SIZE, ISOLATE);
+  uintptr_t lo = (uintptr_t)pb, hi = lo + PAGEBLOCK_SIZE;
+  for (size_t order = 0; order < PAGEBLOCK_ORDER; ++order) {
+    for (int type = UNMOVABLE; type < ISOLATE; ++type) {
+      auto &blocks = orders[order].blocks[type];
+      for (auto it = blocks.begin(); it != blocks.end(); ) {
+        uintptr_t b = (uintptr_t)&*it;
+        if (b < lo || b >= hi) {
+          ++it;
+          continue;
+        }
+        it = blocks.erase(it);
+        push_block((void*)b, order);
+      }
+      if (blocks.empty())
+        nonempty[type] &= ~(1ul << order);
+    }
+  }
+}
+
+size_t
+buddy_allocator::unisolate(void *pb, mobility type)
+{
+  if (!pageblocks)
+    return 0;
+  if (type_of(pb) == ISOLATE)
+    set_type(pb, PAGEBLOCK_SIZE, type);
+  size_t n = 0;
+  for (size_t order = 0; order <= MAX_ORDER; ++order) {
+    auto &blocks = orders[order].blocks[ISOLATE];
+    while (!blocks.empty()) {
+      void *b = pop_block(order, ISOLATE);
+      // A block that merged past the pageblock may cover others that
+      // are still isolated.
+      uintptr_t end = (uintptr_t)b + ((uintptr_t)MIN_SIZE << order);
+      for (uintptr_t p = (uintptr_t)b; p < end; p += PAGEBLOCK_SIZE)
+        if (type_of((void*)p) == ISOLATE)
+          set_type((void*)p, PAGEBLOCK_SIZE, type);
+      push_block(b, order);
+      n += (size_t)1 << order;
+    }
   }
+  return n;
 }
 
 bool
@@ -195,7 +338,7 @@ buddy_allocator::is_allocated(void *ptr, size_t order)
 void
 buddy_allocator::mark_allocated(void *ptr, std::size_t order, bool allocated)
 {
-  if (order == MAX_ORDER)
+  if (order == max_order)
     return;
   uintptr_t parent = (uintptr_t)ptr & ~((uintptr_t)MIN_SIZE << order);
   if ((uintptr_t)ptr != parent)
@@ -219,11 +362,16 @@ buddy_allocator::get_stats() const
 {
   stats out{};
   for (size_t order = 0; order <= MAX_ORDER; ++order) {
-    for (auto &b : orders[order].blocks) {
-      (void)b;                  // Hush g++
-      ++out.nfree[order];
+    for (int type = 0; type < NR_MOBILITY; ++type) {
+      size_t n = 0;
+      for (auto &b : orders[order].blocks[type]) {
+        (void)b;                // Hush g++
+        ++n;
+      }
+      out.nfree[order] += n;
+      out.free_type[type] += n * ((size_t)MIN_SIZE << order);
     }
-    out.free += out.nfree[order] * (MIN_SIZE << order);
+    out.free += out.nfree[order] * ((size_t)MIN_SIZE << order);
   }
   assert(out.free == get_free_bytes());
   out.metadata_bytes = bitmap_bytes;
@@ -4,6 +4,11 @@
 #include "file.hh"
 #include "major.h"
 #include "kstats.hh"
+#include "cpu.hh"
+#include "numa.hh"
+#include "uk/topology.h"
+
+#include <algorithm>
 
 extern const char *kconfig;
 
@@ -35,9 +40,31 @@ kstatsread(mdev*, char *dst, u32 off, u32 n)
   return n;
 }
 
+static int
+topologyread(mdev*, char *dst, u32 off, u32 n)
+{
+  u32 end = ncpu * sizeof(cputopo);
+  if (off >= end)
+    return 0;
+  if (n > end - off)
+    n = end - off;
+  for (u32 pos = off; pos < off + n; ) {
+    u32 i = pos / sizeof(cputopo), skip = pos % sizeof(cputopo);
+    cputopo t{};
+    t.cpu = i;
+    t.node = cpus[i].node ? cpus[i].node->id : 0;
+    t.hwid = cpus[i].hwid.num;
+    u32 len = std::min((u32)sizeof(t) - skip, off + n - pos);
+    memmove(dst + (pos - off), (char*)&t + skip, len);
+    pos += len;
+  }
+  return n;
+}
+
 void
 initdev(void)
 {
   devsw[MAJ_KCONFIG].pread = kconfigread;
   devsw[MAJ_KSTATS].pread = kstatsread;
+  devsw[MAJ_TOPOLOGY].pread = topologyread;
 }
@@ -47,6 +47,7 @@ class e1000 : public netdev, irq_handler
   int eeprom_read(u16 *buf, int off, int count);
 
   void cleantx();
+  void cleantx_locked();
   void allocrx();
 
   void cleanrx();
@@ -213,6 +214,11 @@ e1000::transmit(void *buf, u32 len)
   u32 tail;
 
   scoped_acquire l(&lk_);
+  // Reap finished descriptors here rather than waiting for TXDW, so
+  // most transmit buffers are freed by the CPU that sent them.  The
+  // interrupt still catches whatever is left after a burst.
+  cleantx_locked();
+
   // WMREG_TDT should only equal WMREG_TDH when we have
   // nothing to transmit.  Therefore, we can accomodate
   // TX_RING_SIZE-1 buffers.
@@ -239,11 +245,17 @@ e1000::transmit(void *buf, u32 len)
 
 void
 e1000::cleantx()
+{
+  scoped_acquire l(&lk_);
+  cleantx_locked();
+}
+
+void
+e1000::cleantx_locked()
 {
   struct wiseman_txdesc *desc;
   void *va;
 
-  scoped_acquire l(&lk_);
   while (txinuse_) {
     desc = &txd_[txclean_];
     if (!(desc->wtx_fields.wtxu_status & WTX_ST_DD))
@@ -15,6 +15,8 @@
 #include "mfs.hh"
 #include "work.hh"
 #include "filetable.hh"
+#include "exec_image.hh"
+#include "kstats.hh"
 
 #define BRK (USERTOP >> 1)
 
@@ -71,18 +73,15 @@ dosegment(sref<mnode> ip, vmap* vmp, u64 off, u64 *load_addr)
     // ends.
     if (vmp->insert(vmdesc::anon_desc, mapped_end, backed_end - mapped_end) < 0)
       return -1;
+    // This is less than a page, so read it straight into place.
     size_t seg_pos = mapped_end >= ph.vaddr ? mapped_end - ph.vaddr : 0;
-    char buf[512];
-    while (seg_pos < ph.filesz) {
+    if (seg_pos < ph.filesz) {
       size_t to_read = ph.filesz - seg_pos;
-      if (to_read > sizeof(buf))
-        to_read = sizeof(buf);
-      int res = readi(ip, buf, ph.offset + seg_pos, to_read);
-      if (res <= 0)
+      char *dst = (char*)vmp->pagelookup(ph.vaddr + seg_pos);
+      if (!dst)
         return -1;
-      if (vmp->copyout(ph.vaddr + seg_pos, buf, res) < 0)
+      if (readi(ip, dst, ph.offset + seg_pos, to_read) != (s64)to_read)
         return -1;
-      seg_pos += res;
     }
   }
 
@@ -197,15 +196,9 @@ exec(const char *path, const char * const *argv)
   return 0;
 }
 
-// Load an ELF image or script into the given process.  p->cwd_m must
-// be set (path is resolved relative to this) and p->tf must be a
-// valid pointer.  This sets p->vmap, *p->tf, p->run_cpuid_,
-// p->data_cpuid, and p->name.  If this fails, p will not be modified.
-// This does not switch to the new vmap.  If p already has a vmap and
-// this call succeeds, *oldvmap_out will be set to the old vmap.
-int
-load_image(proc *p, const char *path, const char * const *argv,
-           sref<vmap> *oldvmap_out)
+static int
+do_load_image(proc *p, const char *path, const char * const *argv,
+              sref<vmap> *oldvmap_out)
 {
   sref<mnode> ip = namei(p->cwd_m, path);
   if (!ip)
@@ -213,56 +206,95 @@ load_image(proc *p, const char *path, const char * const *argv,
 
   scoped_gc_epoch rcu;
 
-  // Check header
-  char buf[1024];
   if (ip->type() != mnode::types::file)
     return -1;
-  size_t sz = readi(ip, buf, 0, sizeof(buf));
-  if (sz < 0)
-    return -1;
 
-  // Script?
-  if (strncmp(buf, "#!", 2) == 0) {
-    int i;
-    for (i = 2; i < sz; ++i) {
-      if (buf[i] == '\n') {
-        buf[i] = 0;
-        break;
-      }
-    }
-    if (i == sz)
+  // This must come before we read the file; see mfile::get_image.
+  u64 gen = 0;
+  exec_image *img = nullptr;
+  if (EXEC_IMAGE_CACHE)
+    img = ip->as_file()->get_image(&gen);
+
+  sref<vmap> vmp;
+  u64 entry, phdr = 0, phnum;
+  if (img) {
+    kstats::inc(&kstats::exec_image_hit_count);
+    vmp = vmap::alloc();
+    if (!vmp)
+      return -1;
+    vmp->stamp(img->layout, ip);
+    entry = img->entry;
+    phdr = img->phdr;
+    phnum = img->phnum;
+  } else {
+    // Check header
+    char buf[1024];
+    size_t sz = readi(ip, buf, 0, sizeof(buf));
+    if (sz < 0)
       return -1;
-    const char *argv[] = {&buf[2], path, NULL};
-    return load_image(p, argv[0], argv, oldvmap_out);
-  }
 
-  // ELF?
-  struct elfhdr *elf = reinterpret_cast<elfhdr*>(&buf);
-  static_assert(sizeof(elf) <= sizeof(buf), "buf too small for ELF header");
-  if (sz < sizeof(elf))
-    return -1;
-  if(elf->magic != ELF_MAGIC)
-    return -1;
+    // Script?
+    if (strncmp(buf, "#!", 2) == 0) {
+      int i;
+      for (i = 2; i < sz; ++i) {
+        if (buf[i] == '\n') {
+          buf[i] = 0;
+          break;
+        }
+      }
+      if (i == sz)
+        return -1;
+      const char *argv[] = {&buf[2], path, NULL};
+      return do_load_image(p, argv[0], argv, oldvmap_out);
+    }
 
-  sref<vmap> vmp = vmap::alloc();
-  if (!vmp)
-    return -1;
+    // ELF?
+    struct elfhdr *elf = reinterpret_cast<elfhdr*>(&buf);
+    static_assert(sizeof(elf) <= sizeof(buf), "buf too small for ELF header");
+    if (sz < sizeof(elf))
+      return -1;
+    if(elf->magic != ELF_MAGIC)
+      return -1;
 
-  u64 load_addr = -1;
-  for (size_t i=0, off=elf->phoff; i<elf->phnum; i++, off+=sizeof(proghdr)){
-    Elf64_Word type;
-    if(readi(ip, (char*)&type, 
-             off+__offsetof(struct proghdr, type), 
-             sizeof(type)) != sizeof(type))
+    vmp = vmap::alloc();
+    if (!vmp)
       return -1;
 
-    switch (type) {
-    case ELF_PROG_LOAD:
-      if (dosegment(ip, vmp.get(), off, &load_addr) < 0)
+    u64 load_addr = -1;
+    for (size_t i=0, off=elf->phoff; i<elf->phnum; i++, off+=sizeof(proghdr)){
+      Elf64_Word type;
+      if(readi(ip, (char*)&type, 
+               off+__offsetof(struct proghdr, type), 
+               sizeof(type)) != sizeof(type))
         return -1;
-      break;
-    default:
-      continue;
+
+      switch (type) {
+      case ELF_PROG_LOAD:
+        if (dosegment(ip, vmp.get(), off, &load_addr) < 0)
+          return -1;
+        break;
+      default:
+        continue;
+      }
+    }
+
+    // for usetup
+    entry = elf->entry;
+    phnum = elf->phnum;
+    if (load_addr != -1)
+      phdr = load_addr + elf->phoff;
+
+    // Cache the segment layout for the next exec of this file
+    if (EXEC_IMAGE_CACHE) {
+      exec_image *ni = new (std::nothrow) exec_image();
+      if (ni && vmp->make_template(&ni->layout, ip)) {
+        ni->entry = entry;
+        ni->phdr = phdr;
+        ni->phnum = phnum;
+        ip->as_file()->set_image(ni, gen);
+      } else {
+        delete ni;
+      }
     }
   }
 
@@ -274,11 +306,6 @@ load_image(proc *p, const char *path, const char * const *argv,
   if (sp < 0)
     return -1;
 
-  // for usetup
-  uintptr_t phdr = 0;
-  if (load_addr != -1)
-    phdr = load_addr + elf->phoff;
-
   // Commit to the user image.
   if (p->vmap)
     assert(oldvmap_out);
@@ -286,12 +313,12 @@ load_image(proc *p, const char *path, const char * const *argv,
     *oldvmap_out = std::move(p->vmap);
 
   p->vmap = vmp;
-  p->tf->rip = elf->entry;
+  p->tf->rip = entry;
   p->tf->rsp = sp;
   // Additional arguments.  We can't pass these in ABI argument
   // registers because the sysentry return path doesn't restore those.
   p->tf->r12 = phdr;         // AT_PHDR
-  p->tf->r13 = elf->phnum;   // AT_PHNUM
+  p->tf->r13 = phnum;        // AT_PHNUM
   p->run_cpuid_ = myid();
   p->data_cpuid = myid();
   memset(p->sig, 0, sizeof(p->sig));
@@ -304,3 +331,18 @@ load_image(proc *p, const char *path, const char * const *argv,
 
   return 0;
 }
+
+// Load an ELF image or script into the given process.  p->cwd_m must
+// be set (path is resolved relative to this) and p->tf must be a
+// valid pointer.  This sets p->vmap, *p->tf, p->run_cpuid_,
+// p->data_cpuid, and p->name.  If this fails, p will not be modified.
+// This does not switch to the new vmap.  If p already has a vmap and
+// this call succeeds, *oldvmap_out will be set to the old vmap.
+int
+load_image(proc *p, const char *path, const char * const *argv,
+           sref<vmap> *oldvmap_out)
+{
+  kstats::inc(&kstats::exec_count);
+  kstats::timer timer(&kstats::exec_cycles);
+  return do_load_image(p, path, argv, oldvmap_out);
+}
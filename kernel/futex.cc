@@ -9,6 +9,7 @@
 #include "cpu.hh"
 #include "spercpu.hh"
 #include "kmtrace.hh"
+#include "tracepoint.hh"
 
 //
 // futexkey
@@ -26,6 +27,12 @@ futexkey_hash(futexkey_t const& key)
   return (u64)key;
 }
 
+u64
+futexpid_hash(u32 const& pid)
+{
+  return pid;
+}
+
 u64
 futexkey_val(futexkey_t const& key)
 {
@@ -53,11 +60,11 @@ struct nscache {
   struct spinlock lock_;
   volatile u64 head_;
   volatile u64 tail_;
-  xns<u32, proc*, proc::hash>* ns_[16];
+  xns<u32, proc*, futexpid_hash>* ns_[16];
 
   nscache();
-  xns<u32, proc*, proc::hash>* alloc();
-  bool cache(xns<u32, proc*, proc::hash>* ns);
+  xns<u32, proc*, futexpid_hash>* alloc();
+  bool cache(xns<u32, proc*, futexpid_hash>* ns);
 
   NEW_DELETE_OPS(nscache);
 };
@@ -71,10 +78,10 @@ nscache::nscache(void)
 {
 }
 
-xns<u32, proc*, proc::hash>*
+xns<u32, proc*, futexpid_hash>*
 nscache::alloc(void)
 {
-  xns<u32, proc*, proc::hash>* ns = nullptr;
+  xns<u32, proc*, futexpid_hash>* ns = nullptr;
   
   acquire(&lock_);
   if (head_ - tail_ > 0) {
@@ -87,7 +94,7 @@ nscache::alloc(void)
 }
 
 bool
-nscache::cache(xns<u32, proc*, proc::hash>* ns)
+nscache::cache(xns<u32, proc*, futexpid_hash>* ns)
 {
   bool cached = false;
 
@@ -114,10 +121,10 @@ struct futexaddr : public referenced, public rcu_freed
 
   futexkey_t key_;
   bool inserted_;
-  xns<u32, proc*, proc::hash>* const nspid_;
+  xns<u32, proc*, futexpid_hash>* const nspid_;
 
 private:
-  futexaddr(futexkey_t key, xns<u32, proc*, proc::hash>* nspid);
+  futexaddr(futexkey_t key, xns<u32, proc*, futexpid_hash>* nspid);
   NEW_DELETE_OPS(futexaddr);
 };
 
@@ -126,12 +133,12 @@ xns<futexkey_t, futexaddr*, futexkey_hash> *nsfutex __mpalign__;
 futexaddr*
 futexaddr::alloc(futexkey_t key)
 {
-  xns<u32, proc*, proc::hash>* nspid;
+  xns<u32, proc*, futexpid_hash>* nspid;
   futexaddr* fa;
 
   nspid = nscache_->alloc();
   if (nspid == nullptr)
-    nspid = new xns<u32, proc*, proc::hash>(false);
+    nspid = new xns<u32, proc*, futexpid_hash>(false);
 
   if (nspid == nullptr)
     return nullptr;
@@ -144,7 +151,7 @@ futexaddr::alloc(futexkey_t key)
   return fa;
 }
 
-futexaddr::futexaddr(futexkey_t key, xns<u32, proc*, proc::hash>* nspid)
+futexaddr::futexaddr(futexkey_t key, xns<u32, proc*, futexpid_hash>* nspid)
   : rcu_freed("futexaddr", this, sizeof(*this)),
     key_(key), inserted_(false), nspid_(nspid)
 {
@@ -199,10 +206,12 @@ futexwait(futexkey_t key, u64 val, u64 timer)
   assert(fa->key_ == key);
   mtwriteavar("futex:%p.%p", key, fa);
 
+  TRACEPOINT(futex_wait, key, val);
   acquire(&myproc()->futex_lock);  
   auto cleanup = scoped_cleanup([&fa](){
     release(&myproc()->futex_lock);
     fa->dec();
+    TRACEPOINT(futex_wait_done, 0, 0);
   });
 
   // This first check is an optimization
@@ -245,6 +254,7 @@ futexwake(futexkey_t key, u64 nwake)
     fa->dec();
   });
   mtwriteavar("futex:%p.%p", key, fa);
+  TRACEPOINT(futex_wake, key, nwake);
 
   fa->nspid_->enumerate([&nwoke, &nwake](u32 pid, proc* p) {
     acquire(&p->futex_lock);
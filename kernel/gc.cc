@@ -12,6 +12,7 @@
 #include "mtrace.h"
 #include "file.hh"
 #include "uk/gcstat.h"
+#include "tracepoint.hh"
 
 using std::atomic;
 
@@ -112,6 +113,7 @@ gc_inc_global_epoch(void)
   if (minepoch > global-2) {
     if (gc_debug) cprintf("update global_epoch to: %lu\n", minepoch+1);
     global_epoch = global + 1;
+    TRACEPOINT(gc_epoch, global + 1, 0);
   }
 done:
   release(&gc_lock.l);
@@ -133,6 +135,7 @@ gc_state::inc_cur_epoch(void)
       if (gc_debug) cprintf("%d: update my epoch to: %lu\n",
                           mycpu()->id, cur_epoch+1);
       cur_epoch += 1;
+      TRACEPOINT(gc_epoch, cur_epoch.load(), 0);
     }
     global_min = nexttofree_epoch.load();
   } else {
@@ -228,7 +231,9 @@ gc_state::do_gc(void)
     // give up lock during free; gc_free() may call gc_begin/end_epoch
     release(&lock_);
 
+    TRACEPOINT(gc_free, i, 0);
     int nfree = gc_free(head,i);
+    TRACEPOINT(gc_free_done, nfree, 0);
 
     acquire(&lock_);
     delayed[i%NEPOCH].head = nullptr;
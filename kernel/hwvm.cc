@@ -15,6 +15,7 @@
 #include "kstats.hh"
 #include "cpuid.hh"
 #include "vmalloc.hh"
+#include "tracepoint.hh"
 
 using namespace std;
 
@@ -25,6 +26,18 @@ static __padout__ __attribute__((used));
 
 DEFINE_PERCPU(const MMU_SCHEME::page_map_cache*, cur_page_map_cache);
 
+// Set by initpg if this machine supports PCID and INVPCID.
+static bool pcid_on;
+
+// Per-core PCID allocator; see pcid_ctx.
+struct pcid_alloc
+{
+  u64 gen;                      // Current generation
+  u64 next;                     // Next PCID to hand out
+  pcid_alloc() : gen(1), next(1) { }
+};
+DEFINE_PERCPU(struct pcid_alloc, pcid_allocs);
+
 static const char *levelnames[] = {
   "PT", "PD", "PDP", "PML4"
 };
@@ -112,14 +125,18 @@ public:
     return pml4;
   }
 
-  // Make this page table active on this CPU.
-  void switch_to()
+  // Make this page table active on this CPU.  pcid is the PCID and
+  // no-flush bits from pcid_ctx::cr3_bits.
+  void switch_to(u64 pcid = 0)
   {
     auto nreq = tlbflush_req.load();
-    u64 cr3 = v2p(this);
+    u64 cr3 = v2p(this) | pcid;
     lcr3(cr3);
-    mycpu()->tlbflush_done = nreq;
-    mycpu()->tlb_cr3 = cr3;
+    // A no-flush load keeps this PCID's TLB entries, so it hasn't
+    // caught up with the batched shootdowns requested before it.
+    if (!(cr3 & CR3_NOFLUSH))
+      mycpu()->tlbflush_done = nreq;
+    mycpu()->tlb_cr3 = cr3 & ~CR3_NOFLUSH;
   }
 
   u64 internal_pages() const
@@ -333,6 +350,63 @@ initpg(void)
 
   // Enable global pages.  This has to happen on every core.
   lcr4(rcr4() | CR4_PGE);
+
+  // Enable PCIDs.  CR3 must have PCID 0 when we do this, which it
+  // does since nothing has switched address spaces yet.
+  static bool pcid_checked;
+  if (!pcid_checked) {
+    pcid_checked = true;
+    pcid_on = cpuid::features().pcid && cpuid::features().invpcid;
+  }
+  if (pcid_on)
+    lcr4(rcr4() | CR4_PCIDE);
+}
+
+bool
+pcid_ctx::enabled()
+{
+  return pcid_on;
+}
+
+u64
+pcid_ctx::cr3_bits(bool flush) const
+{
+  if (!pcid_on)
+    return 0;
+
+  pcid_alloc *a = &*pcid_allocs;
+  u64 &tag = tags_[myid()];
+  bool fresh = false;
+  if ((tag >> 12) != a->gen) {
+    if (a->next > CR3_PCID_MASK) {
+      // Out of PCIDs.  Start a new generation, which invalidates
+      // every PCID this core has handed out, so flush them all.
+      a->gen++;
+      a->next = 1;
+      invpcid(INVPCID_NONGLOBAL, 0, 0);
+      kstats::inc(&kstats::tlb_pcid_rollover_count);
+    }
+    // This PCID has not been used since the last generation began,
+    // so the TLB has nothing tagged with it.
+    tag = (a->gen << 12) | a->next++;
+    flush = false;
+    fresh = true;
+  }
+  // Only count switches that keep TLB entries from an earlier visit
+  if (!flush && !fresh)
+    kstats::inc(&kstats::tlb_switch_noflush_count);
+  return (tag & CR3_PCID_MASK) | (flush ? 0 : CR3_NOFLUSH);
+}
+
+u64
+pcid_ctx::pcid() const
+{
+  if (!pcid_on)
+    return 0;
+  u64 tag = tags_[myid()];
+  if ((tag >> 12) != pcid_allocs->gen)
+    return 0;
+  return tag & CR3_PCID_MASK;
 }
 
 // Clean up mappings that were only required during early boot.
@@ -388,12 +462,17 @@ switchvm(struct proc *p)
   // XXX(Austin) This puts the TLB tracking logic in pgmap, which is
   // probably the wrong place.
   if (p->vmap) {
-    p->vmap->cache.switch_to();
+    // Publish the new cache before draining asynchronous shootdowns
+    // below; see shootdown::perform_async.
     *cur_page_map_cache = &p->vmap->cache;
+    atomic_thread_fence(memory_order_seq_cst);
+    p->vmap->cache.switch_to();
   } else {
-    kpml4.switch_to();
+    // kpml4 has no user mappings, so PCID 0 never needs flushing
     *cur_page_map_cache = nullptr;
+    kpml4.switch_to(pcid_on ? CR3_NOFLUSH : 0);
   }
+  mmu::shootdown::drain_async();
 
   writefs(UDSEG);
   writemsr(MSR_FS_BASE, p->user_fs_);
@@ -475,7 +554,8 @@ batched_shootdown::perform() const
     return;
 
   u64 myreq = ++tlbflush_req;
-  u64 cr3 = rcr3();
+  // Every core may use a different PCID for the same page table
+  u64 cr3 = rcr3() & ~CR3_PCID_MASK;
 
   // the caller may not hold any spinlock, because other CPUs might
   // be spinning waiting for that spinlock, with interrupts disabled,
@@ -485,15 +565,16 @@ batched_shootdown::perform() const
   kstats::inc(&kstats::tlb_shootdown_count);
   kstats::timer timer(&kstats::tlb_shootdown_cycles);
 
+  auto same = [cr3](u64 other) { return (other & ~CR3_PCID_MASK) == cr3; };
   for (int i = 0; i < ncpu; i++) {
-    if (cpus[i].tlb_cr3 == cr3 && cpus[i].tlbflush_done < myreq) {
+    if (same(cpus[i].tlb_cr3) && cpus[i].tlbflush_done < myreq) {
       lapic->send_tlbflush(&cpus[i]);
       kstats::inc(&kstats::tlb_shootdown_targets);
     }
   }
 
   for (int i = 0; i < ncpu; i++)
-    while (cpus[i].tlb_cr3 == cr3 && cpus[i].tlbflush_done < myreq)
+    while (same(cpus[i].tlb_cr3) && cpus[i].tlbflush_done < myreq)
       /* spin */ ;
 }
 
@@ -502,6 +583,7 @@ batched_shootdown::on_ipi()
 {
   pushcli();
   u64 nreq = tlbflush_req.load();
+  // Without the no-flush bit, this flushes the current PCID
   lcr3(rcr3());
   mycpu()->tlbflush_done = nreq;
   popcli();
@@ -527,18 +609,19 @@ core_tracking_shootdown::cache_tracker::track_switch_from() const
 void
 core_tracking_shootdown::clear_tlb() const
 {
-  if (end_ > start_ && end_ - start_ > 4 * PGSIZE) {
+  if (ranges_.size() > 4 * PGSIZE) {
     lcr3(rcr3());
   } else {
-    for (uintptr_t va = start_; va < end_; va += PGSIZE)
-      invlpg((void*) va);
+    for (auto &r : ranges_)
+      for (uintptr_t va = r.start; va < r.end; va += PGSIZE)
+        invlpg((void*) va);
   }
 }
 
 void
 core_tracking_shootdown::perform() const
 {
-  if (!t_ || start_ >= end_)
+  if (!t_ || ranges_.empty())
     return;
 
   // Ensure that cache invalidations happen before reading the tracker;
@@ -560,11 +643,14 @@ core_tracking_shootdown::perform() const
   kstats::inc(&kstats::tlb_shootdown_count);
   kstats::inc(&kstats::tlb_shootdown_targets, targets.count());
   kstats::timer timer(&kstats::tlb_shootdown_cycles);
+  TRACEPOINT(tlb_shootdown, targets.count(), 0);
   run_on_cpus(targets, [this]() { clear_tlb(); });
+  TRACEPOINT(tlb_shootdown_done, 0, 0);
 }
 
 namespace mmu_shared_page_table {
-  page_map_cache::page_map_cache() : pml4(kpml4.kclone())
+  page_map_cache::page_map_cache()
+    : pml4(kpml4.kclone()), flush_gen_(0), flushed_{}
   {
     if (!pml4) {
       swarn.println("setupkvm out of memory\n");
@@ -583,25 +669,55 @@ namespace mmu_shared_page_table {
     pml4->find(va).create(PTE_U)->store(pte, memory_order_relaxed);
   }
 
+  void
+  page_map_cache::__insert_range(uintptr_t va, size_t n, const pme_t *ptes)
+  {
+    auto it = pml4->find(va);
+    for (size_t i = 0; i < n; ++i) {
+      if (i)
+        it += PGSIZE;
+      it.create(PTE_U)->store(ptes[i], memory_order_relaxed);
+    }
+  }
+
   void
   page_map_cache::__invalidate(
     uintptr_t start, uintptr_t len, shootdown *sd)
   {
     sd->set_cache_tracker(this);
+    bool cleared = false;
     for (auto it = pml4->find(start); it.index() < start + len;
          it += it.span()) {
       if (it.is_set()) {
         it->store(0, memory_order_relaxed);
         sd->add_range(it.index(), it.index() + it.span());
+        cleared = true;
       }
     }
+    // Cores where this cache is inactive may still have TLB entries
+    // for it under its PCID.  This must happen before the shootdown
+    // reads the set of active cores; see switch_to.
+    if (cleared && pcid_on)
+      flush_gen_++;
   }
 
   void
   page_map_cache::switch_to() const
   {
     track_switch_to();
-    pml4->switch_to();
+    // Batched shootdowns find their targets by tlb_cr3 instead of the
+    // tracker, so publish that too.
+    mycpu()->tlb_cr3 = v2p(pml4);
+    atomic_thread_fence(memory_order_seq_cst);
+    // Either a concurrent invalidation sees us in the tracker (or
+    // tlb_cr3) and shoots us down, or we see its flush_gen_ increment
+    // here.  (Cores that were shot down will still flush once more
+    // the next time they switch here.)
+    u64 gen = flush_gen_.load();
+    u64 &seen = flushed_[myid()];
+    bool flush = seen != gen;
+    seen = gen;
+    pml4->switch_to(pcid_.cr3_bits(flush));
   }
 
   u64
@@ -612,8 +728,87 @@ namespace mmu_shared_page_table {
 }
 
 namespace mmu_per_core_page_table {
+  // Asynchronous shootdowns.  Each core has a queue of invalidations
+  // other cores have asked it to perform, holding at most one request
+  // per page_map_cache: concurrent shootdowns of the same cache merge
+  // their ranges into one request and share one IPI.  A core drains
+  // its queue on a TLBFLUSH IPI, on every context switch, and on
+  // every timer tick.  Drains that take requests are numbered, so an
+  // initiator that queued behind drain g knows the target has caught
+  // up once drain g+1 is done.
+  enum {
+    ASYNC_QUEUE_LEN = 8,
+    // Past this many outstanding asynchronous shootdowns, a core
+    // shoots down synchronously rather than defer more objects.
+    ASYNC_MAX_DEFERRED = 64,
+  };
+
+  struct async_req
+  {
+    page_map_cache *cache;
+    shootdown_ranges ranges;
+  };
+
+  struct async_queue
+  {
+    spinlock lock;
+    async_req reqs[ASYNC_QUEUE_LEN];
+    std::atomic<size_t> n;
+    // The number of drains that have taken requests from this queue.
+    u64 taken;
+    // The number of the last drain that finished.
+    std::atomic<u64> done;
+    // Set while a TLBFLUSH IPI is on its way to this core.
+    std::atomic<bool> ipi_sent;
+
+    async_queue()
+      : lock("tlb_async_queue", LOCKSTAT_VM), n(0), taken(0), done(0),
+        ipi_sent(false) { }
+  };
+  DEFINE_PERCPU(struct async_queue, async_queues, NO_INT);
+
+  // An asynchronous shootdown with a deferred object, waiting for
+  // each target core to finish the drain numbered gen.
+  struct async_ticket
+  {
+    async_ticket *next;
+    tlb_deferred *obj;
+    size_t size;
+    size_t n;
+    struct {
+      u64 cpu, gen;
+    } wait[];
+  };
+
+  struct deferred_list
+  {
+    async_ticket *head;
+    size_t count;
+    deferred_list() : head(nullptr), count(0) { }
+  };
+  DEFINE_PERCPU(struct deferred_list, deferred_lists);
+
   page_map_cache::~page_map_cache()
   {
+    // Cancel queued shootdowns of this cache.  An emptied queue
+    // counts as drained, so tickets waiting on it complete.
+    if (async_pending_.load()) {
+      for (size_t i = 0; i < ncpu; ++i) {
+        auto &q = async_queues[i];
+        auto l = q.lock.guard();
+        size_t n = q.n.load(memory_order_relaxed), orig = n;
+        for (size_t j = 0; j < n; ) {
+          if (q.reqs[j].cache == this)
+            q.reqs[j] = q.reqs[--n];
+          else
+            ++j;
+        }
+        q.n.store(n, memory_order_relaxed);
+        if (n == 0 && orig != 0)
+          q.done.store(++q.taken, memory_order_release);
+      }
+    }
+
     for (size_t i = 0; i < ncpu; ++i) {
       delete pml4[i];
     }
@@ -629,13 +824,30 @@ namespace mmu_per_core_page_table {
     t->tracker_cores.set(myid());
   }
 
+  void
+  page_map_cache::insert_range(uintptr_t va, size_t n,
+                               page_tracker *const *trackers,
+                               const pme_t *ptes)
+  {
+    scoped_cli cli;
+    auto mypml4 = *pml4;
+    assert(mypml4);
+    auto it = mypml4->find(va);
+    for (size_t i = 0; i < n; ++i) {
+      if (i)
+        it += PGSIZE;
+      it.create(PTE_U)->store(ptes[i], memory_order_relaxed);
+      trackers[i]->tracker_cores.set(myid());
+    }
+  }
+
   void
   page_map_cache::switch_to() const
   {
     auto &mypml4 = *pml4;
     if (!mypml4)
       mypml4 = kpml4.kclone();
-    mypml4->switch_to();
+    mypml4->switch_to(pcid_.cr3_bits());
   }
 
   u64
@@ -667,11 +879,16 @@ namespace mmu_per_core_page_table {
     // inserted something into it previously.  (Note that this may
     // not hold if we start tracking shootdowns conservatively.)
     assert(mypml4);
+    // If this cache isn't current, the TLB can still hold entries for
+    // it under its PCID.
+    u64 pcid = current ? 0 : pcid_.pcid();
     for (auto it = mypml4->find(start); it.index() < end; it += it.span()) {
       if (it.is_set()) {
         it->store(0, memory_order_relaxed);
         if (current)
           invlpg((void*)it.index());
+        else if (pcid)
+          invpcid(INVPCID_ADDR, pcid, it.index());
       }
     }
   }
@@ -685,12 +902,188 @@ namespace mmu_per_core_page_table {
     // tracker), but it would probably require more communication.
     if (targets.none())
       return;
-    assert(start < end && end <= USERTOP);
+    assert(!ranges.empty() && ranges.high() <= USERTOP);
     kstats::inc(&kstats::tlb_shootdown_count);
     kstats::inc(&kstats::tlb_shootdown_targets, targets.count());
     kstats::timer timer(&kstats::tlb_shootdown_cycles);
+    TRACEPOINT(tlb_shootdown, targets.count(), 0);
     run_on_cpus(targets, [this]() {
-        cache->clear(start, end);
+        for (auto &r : ranges)
+          cache->clear(r.start, r.end);
       });
+    TRACEPOINT(tlb_shootdown_done, 0, 0);
+  }
+
+  void
+  shootdown::perform_async(tlb_deferred *obj) const
+  {
+    reap_async();
+    if (targets.none()) {
+      delete obj;
+      return;
+    }
+    assert(!ranges.empty() && ranges.high() <= USERTOP);
+
+    size_t size = sizeof(async_ticket) +
+      targets.count() * sizeof(async_ticket::wait[0]);
+    async_ticket *t = nullptr;
+    if (deferred_lists->count < ASYNC_MAX_DEFERRED)
+      t = (async_ticket*)kmalloc(size, "async_ticket");
+    if (!t) {
+      perform();
+      delete obj;
+      return;
+    }
+    t->obj = obj;
+    t->size = size;
+    t->n = 0;
+
+    kstats::inc(&kstats::tlb_shootdown_count);
+    kstats::inc(&kstats::tlb_shootdown_async_count);
+    kstats::inc(&kstats::tlb_shootdown_targets, targets.count());
+    kstats::timer timer(&kstats::tlb_shootdown_cycles);
+    TRACEPOINT(tlb_shootdown, targets.count(), 0);
+
+    // Queue the ranges on each target, merging with any request
+    // already queued there for this cache.  Targets with full queues
+    // are shot down synchronously.
+    bitset<NCPU> sync;
+    for (auto cpu : targets) {
+      auto &q = async_queues[cpu];
+      auto l = q.lock.guard();
+      size_t n = q.n.load(memory_order_relaxed), i = 0;
+      while (i < n && q.reqs[i].cache != cache)
+        ++i;
+      if (i == n) {
+        if (n == ASYNC_QUEUE_LEN) {
+          sync.set(cpu);
+          continue;
+        }
+        q.reqs[i].cache = cache;
+        q.reqs[i].ranges = shootdown_ranges();
+        cache->async_pending_.fetch_add(1, memory_order_relaxed);
+        q.n.store(n + 1, memory_order_relaxed);
+      }
+      for (auto &r : ranges)
+        q.reqs[i].ranges.add(r.start, r.end);
+      t->wait[t->n].cpu = cpu;
+      t->wait[t->n].gen = q.taken + 1;
+      ++t->n;
+    }
+
+    // Pairs with the fences in switchvm and drain_async: either the
+    // target sees our request when it next drains, or we see that it
+    // is running this cache (or has cleared ipi_sent) and send an
+    // IPI.  Targets running other caches can wait for their next
+    // switch or tick, since they aren't using these mappings.
+    atomic_thread_fence(memory_order_seq_cst);
+    u64 saved = 0;
+    for (size_t i = 0; i < t->n; ++i) {
+      unsigned cpu = t->wait[i].cpu;
+      auto cur = reinterpret_cast<const page_map_cache*>(cur_page_map_cache[cpu]);
+      if (cur == cache && !async_queues[cpu].ipi_sent.exchange(true))
+        lapic->send_tlbflush(&cpus[cpu]);
+      else
+        ++saved;
+    }
+    kstats::inc(&kstats::tlb_shootdown_ipis_saved, saved);
+
+    if (sync.any()) {
+      run_on_cpus(sync, [this]() {
+          for (auto &r : ranges)
+            cache->clear(r.start, r.end);
+        });
+    }
+    TRACEPOINT(tlb_shootdown_done, 0, 0);
+
+    if (t->n == 0) {
+      delete obj;
+      kmfree(t, size);
+      return;
+    }
+    scoped_no_sched ns;
+    t->next = deferred_lists->head;
+    deferred_lists->head = t;
+    ++deferred_lists->count;
+  }
+
+  void
+  shootdown::drain_async()
+  {
+    auto &q = *async_queues;
+    // Clear ipi_sent before checking the queue, so anything queued
+    // after this drain takes the queue will send a new IPI.
+    q.ipi_sent.store(false);
+    if (!q.n.load())
+      return;
+
+    auto l = q.lock.guard();
+    size_t n = q.n.load(memory_order_relaxed);
+    if (!n)
+      return;
+    u64 gen = ++q.taken;
+    for (size_t i = 0; i < n; ++i) {
+      auto &req = q.reqs[i];
+      for (auto &r : req.ranges)
+        req.cache->clear(r.start, r.end);
+      req.cache->async_pending_.fetch_sub(1, memory_order_release);
+    }
+    q.n.store(0, memory_order_relaxed);
+    q.done.store(gen, memory_order_release);
+  }
+
+  static bool
+  ticket_done(const async_ticket *t)
+  {
+    for (size_t i = 0; i < t->n; ++i) {
+      auto &q = async_queues[t->wait[i].cpu];
+      if (q.done.load(memory_order_acquire) < t->wait[i].gen)
+        return false;
+    }
+    return true;
+  }
+
+  void
+  shootdown::reap_async()
+  {
+    async_ticket *done = nullptr;
+    {
+      scoped_no_sched ns;
+      for (async_ticket **p = &deferred_lists->head; *p; ) {
+        async_ticket *t = *p;
+        if (ticket_done(t)) {
+          *p = t->next;
+          --deferred_lists->count;
+          t->next = done;
+          done = t;
+        } else {
+          p = &t->next;
+        }
+      }
+    }
+
+    while (done) {
+      async_ticket *next = done->next;
+      delete done->obj;
+      kmfree(done, done->size);
+      done = next;
+    }
+  }
+
+  void
+  page_map_cache::__sync_async()
+  {
+    {
+      scoped_cli cli;
+      shootdown::drain_async();
+      // Kick cores that are waiting for their next switch or tick
+      for (size_t i = 0; i < ncpu; ++i) {
+        auto &q = async_queues[i];
+        if (i != myid() && q.n.load() && !q.ipi_sent.exchange(true))
+          lapic->send_tlbflush(&cpus[i]);
+      }
+    }
+    while (async_pending_.load(memory_order_acquire))
+      nop_pause();
   }
 }
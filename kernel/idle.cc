@@ -12,6 +12,7 @@
 #include "benchcodex.hh"
 #include "cpuid.hh"
 #include "ilist.hh"
+#include "hwvm.hh"
 
 struct idle {
   struct proc *cur;
@@ -31,23 +32,33 @@ idleproc(void)
   return idlem->cur;
 }
 
+// Queue zombie p to be freed by cpu.  p must have switched out.
 void
-idlezombie(struct proc *p)
+idlezombie(struct proc *p, int cpu)
 {
-  struct idle *i = &idlem[mycpu()->id];
+  struct idle *i = &idlem[cpu];
   scoped_acquire l(&i->lock);
   i->zombies.push_back(p);
 }
 
-static inline void
-finishzombies(void)
+// Free the zombies queued for this CPU.  Called after every context
+// switch and from the idle loop.
+void
+idlereap(void)
 {
   struct idle *i = &idlem[mycpu()->id];
-  scoped_acquire l(&i->lock);
+  if (i->zombies.empty())
+    return;
+
+  ilist<proc, &proc::child_next> zombies;
+  {
+    scoped_acquire l(&i->lock);
+    zombies = std::move(i->zombies);
+  }
 
-  while(!i->zombies.empty()) {
-    auto &p = i->zombies.front();
-    i->zombies.pop_front();
+  while (!zombies.empty()) {
+    auto &p = zombies.front();
+    zombies.pop_front();
     finishproc(&p);
   }
 }
@@ -76,11 +87,15 @@ idleloop(void)
     acquire(&myproc()->lock);
     myproc()->set_state(RUNNABLE);
     sched();
-    finishzombies();
+    idlereap();
+    mmu::shootdown::reap_async();
     if (steal() == 0) {
-        // XXX(Austin) This will prevent us from immediately picking
-        // up work that's trying to push itself to this core (pinned
-        // thread).  Use an IPI to poke idle cores.
+        zidle();
+        if (sched_pending())
+          continue;
+        // addrun sends us a T_WAKEUP if it queues work here.
+        // XXX(Austin) Work that arrives between sched() and the hlt
+        // still waits for the next timer tick.
         asm volatile("hlt");
     }
   }
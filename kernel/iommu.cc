@@ -11,6 +11,7 @@
 #include "cpu.hh"
 #include "irq.hh"
 #include "kstream.hh"
+#include "spinlock.hh"
 #include "vector.hh"
 
 #include <iterator>
@@ -148,10 +149,12 @@ struct iommu_instance
   uint64_t cap, ecap;
   uint32_t cmd_fixed;
   iommu_ieci *iq;
+  // Serializes invalidations, which may come from any CPU
+  struct spinlock iq_lock;
 
   iommu_instance(paddr base)
     : regs((struct regs*)p2v(base)), cap(regs->cap), ecap(regs->ecap),
-      cmd_fixed(0)
+      cmd_fixed(0), iq_lock("iommu_iq")
   {
     iq = (iommu_ieci*)kmalloc(IQ_ENTRIES * sizeof *iq, "iommu_ieci");
     if (!iq)
@@ -172,6 +175,8 @@ public:
   constexpr intel_iommu() : instances(), irt(nullptr), next(0) { }
   void register_base(paddr base);
   int allocate_int(struct irq irq, struct cpu *dest);
+  int reserve_ints(size_t n);
+  void set_int(int index, struct irq irq, struct cpu *dest);
   bool configure();
 };
 
@@ -261,37 +266,64 @@ iommu_instance::configure(iommu_irte *irt)
 int
 intel_iommu::allocate_int(struct irq irq, struct cpu *dest)
 {
-  if (next == IRT_ENTRIES)
+  int index = reserve_ints(1);
+  set_int(index, irq, dest);
+  return index;
+}
+
+int
+intel_iommu::reserve_ints(size_t n)
+{
+  if (n > IRT_ENTRIES - next)
     panic("interrupt remapping table full");
 
-  int index = next++;
+  int index = next;
+  next += n;
+  return index;
+}
+
+void
+intel_iommu::set_int(int index, struct irq irq, struct cpu *dest)
+{
+  assert(index >= 0 && (size_t)index < next);
   verbose.println("iommu: Mapping ", irq, " for CPU ", dest->id,
                   " to index ", index);
-  irt[index].vector = irq.vector;
-  irt[index].destination = dest->hwid.num;
-  irt[index].flags = iommu_irte::FLAG_PRESENT | iommu_irte::FLAG_DEST_PHYSICAL |
+  bool was_present = irt[index].flags & iommu_irte::FLAG_PRESENT;
+
+  iommu_irte e;
+  e.vector = irq.vector;
+  // [IOMMU 9.5] In xAPIC mode the APIC ID goes in bits 15:8
+  e.destination = lapic->is_x2apic() ? dest->hwid.num : dest->hwid.num << 8;
+  e.flags = iommu_irte::FLAG_PRESENT | iommu_irte::FLAG_DEST_PHYSICAL |
     iommu_irte::FLAG_DLM_FIXED |
     (irq.level_triggered ? iommu_irte::FLAG_TRIGGER_LEVEL
      : iommu_irte::FLAG_TRIGGER_EDGE);
+  // The flags, vector, and destination share the low quadword of the
+  // entry, so a single store keeps the IOMMU from seeing a torn entry
+  // if the device is already using it.
+  static_assert(offsetof(iommu_irte, sid) == 8, "iommu_irte layout");
+  u64 lo;
+  memcpy(&lo, &e, sizeof lo);
+  *(volatile u64*)&irt[index] = lo;
 
   for (auto &i : instances)
-    i.invalidate(index, true);
-
-  return index;
+    i.invalidate(index, !was_present);
 }
 
 void
 iommu_instance::invalidate(int index, bool was_nonpresent)
 {
+  scoped_acquire l(&iq_lock);
   iommu_ieci ieci;
   bool need_invalidate = false;
   if (index == -1) {
     // Global invalidate
     ieci = iommu_ieci(false);
     need_invalidate = true;
-  } else if (was_nonpresent && (cap & regs::CAP_CACHING_MODE)) {
-    // The IOMMU caches non-present entries, so we need to
-    // invalidate.  This implies a write buffer flush.
+  } else if (!was_nonpresent || (cap & regs::CAP_CACHING_MODE)) {
+    // The IOMMU may have cached the old entry (or, in caching mode,
+    // its non-present state), so we need to invalidate.  This
+    // implies a write buffer flush.
     ieci = iommu_ieci(true, index);
     need_invalidate = true;
   } else if (cap & regs::CAP_WRITE_BUF_FLUSH) {
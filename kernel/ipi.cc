@@ -3,6 +3,7 @@
 #include "apic.hh"
 #include "traps.h"
 #include "bits.hh"
+#include "tracepoint.hh"
 
 #include <iterator>
 
@@ -35,8 +36,10 @@ ipi_call::start(unsigned cpu)
     *q.tail = this;
     q.tail = &this->next[cpu];
   }
-  if (need_ipi)
+  if (need_ipi) {
+    TRACEPOINT(ipi_send, cpu, 0);
     lapic->send_ipi(&cpus[cpu], T_IPICALL);
+  }
 }
 
 void
@@ -78,7 +81,9 @@ on_ipicall()
 
     // Walk the call list
     while (call) {
+      TRACEPOINT(ipi_call, 0, 0);
       call->run();
+      TRACEPOINT(ipi_call_done, 0, 0);
 
       ipi_call *next = call->next[id];
 
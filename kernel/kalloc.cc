@@ -18,10 +18,15 @@
 #include "kstats.hh"
 #include "vector.hh"
 #include "numa.hh"
+#include "reclaim.hh"
 #include "lb.hh"
 #include "file.hh"
 #include "major.h"
 #include "heapprof.hh"
+#include "proc.hh"
+#include "condvar.hh"
+#include "vm.hh"
+#include "ipi.hh"
 
 #include <algorithm>
 #include <iterator>
@@ -56,6 +61,11 @@ struct locked_buddy
 
 static static_vector<locked_buddy, MAX_BUDDIES> buddies;
 
+// The buddies [low, high) made from each NUMA node's memory
+static struct {
+  size_t low, high;
+} node_buddy_range[MAX_NUMA_NODES];
+
 struct mempool : public balance_pool<mempool> {
   int buddy_;      // the buddy allocator this pool; it can contain any phys mem
   uintptr_t base_; // base this pool's local memory
@@ -279,9 +289,19 @@ struct cpu_mem
   steal_order steal;
   int mempool;   // XXX cache align?
 
-  // Hot page cache of recently freed pages
-  void *hot_pages[KALLOC_HOT_PAGES];
-  size_t nhot;
+  // Hot page caches of recently freed pages, one for each of the
+  // UNMOVABLE and MOVABLE pageblock types
+  struct {
+    void *pages[KALLOC_HOT_PAGES];
+    size_t n;
+  } hot[2];
+
+  // Caches of recently freed blocks of orders 1 through
+  // KALLOC_CACHE_ORDERS, indexed by order - 1
+  struct {
+    void *blocks[KALLOC_CACHE_BLOCKS];
+    size_t n;
+  } order_cache[KALLOC_CACHE_ORDERS];
 };
 
 // Prefer mycpu()->mem for local access to this.  This is NOINIT since
@@ -294,6 +314,22 @@ void *percpu_offsets[NCPU];
 
 static int kinited __mpalign__;
 
+static void compact_wake(void);
+
+// The type of each pageblock of physical memory, shared by all of
+// the buddy allocators.  See buddy_allocator::mobility.
+static unsigned char *pageblock_map;
+
+typedef buddy_allocator::mobility mobility;
+
+static mobility
+pageblock_type(void *v)
+{
+  if (!pageblock_map)
+    return buddy_allocator::UNMOVABLE;
+  return (mobility)pageblock_map[v2p(v) / buddy_allocator::PAGEBLOCK_SIZE];
+}
+
 struct memory {
   balancer<memory, mempool> b_;
 
@@ -320,10 +356,16 @@ struct memory {
       return (char*)early_kalloc(size, size);
     void *res = nullptr;
     auto mem = mycpu()->mem;
-    if (size == PGSIZE) {
+    auto p = myproc();
+    if (p && p->kalloc_cpu_ >= 0 && p->kalloc_cpu_ != myid()) {
+      // Allocate from another CPU's pool; its hot pages are its own.
+      mem = &cpu_mem[p->kalloc_cpu_];
+      res = mempools[mem->mempool].kalloc(size);
+    } else if (size == PGSIZE) {
       // allocate from page cache, if possible
-      if (mem->nhot > 0) {
-        res = mem->hot_pages[--mem->nhot];
+      auto &hot = mem->hot[buddy_allocator::UNMOVABLE];
+      if (hot.n > 0) {
+        res = hot.pages[--hot.n];
       }
     }
     if (!res) {
@@ -337,9 +379,9 @@ struct memory {
       if (ALLOC_MEMSET) {
         char* chk = (char*)res;
         for (int i = 0; i < size - 2*sizeof(void*); i++) {
-          // Ignore buddy allocator list links at the beginning of each
-          // page
-          if ((uintptr_t)&chk[i] % PGSIZE < sizeof(void*)*2)
+          // Ignore buddy allocator list links and type at the
+          // beginning of each page
+          if ((uintptr_t)&chk[i] % PGSIZE < sizeof(void*)*3)
             continue;
           if (chk[i] != 1)
             spanic.println(shexdump(chk, size),
@@ -354,6 +396,9 @@ struct memory {
       return (char*)res;
     } else {
       cprintf("kalloc: out of memory\n");
+      if (size > PGSIZE)
+        compact_wake();
+      reclaim_wake();
       return nullptr;
     }
   }
@@ -395,25 +440,25 @@ struct memory {
     if (size == PGSIZE) {
       // Free to the hot list
       scoped_cli cli;
-      auto mem = mycpu()->mem;
-      if (mem->nhot == KALLOC_HOT_PAGES) {
+      auto &hot = mycpu()->mem->hot[buddy_allocator::UNMOVABLE];
+      if (hot.n == KALLOC_HOT_PAGES) {
         // There's no more room in the hot pages list, so free half of
         // it.  We sort the list so we can merge it with the buddy
         // allocator list.
         kstats::inc(&kstats::kalloc_hot_list_flush_count);
-        std::sort(mem->hot_pages, mem->hot_pages + (KALLOC_HOT_PAGES / 2));
+        std::sort(hot.pages, hot.pages + (KALLOC_HOT_PAGES / 2));
         // XXX make kfree_batch_pool to batch moving hot pages
         for (size_t i = 0; i < KALLOC_HOT_PAGES / 2; ++i) {
-          void *ptr = mem->hot_pages[i];
+          void *ptr = hot.pages[i];
           kfree_pool(ptr, size);
         }
         // Shift hot page list down
         // XXX(Austin) Could use two lists and switch off
-        mem->nhot = KALLOC_HOT_PAGES - (KALLOC_HOT_PAGES / 2);
-        memmove(mem->hot_pages, mem->hot_pages + (KALLOC_HOT_PAGES / 2),
-                mem->nhot * sizeof *mem->hot_pages);
+        hot.n = KALLOC_HOT_PAGES - (KALLOC_HOT_PAGES / 2);
+        memmove(hot.pages, hot.pages + (KALLOC_HOT_PAGES / 2),
+                hot.n * sizeof *hot.pages);
       }
-      mem->hot_pages[mem->nhot++] = v;
+      hot.pages[hot.n++] = v;
       kstats::inc(&kstats::kalloc_page_free_count);
       return;
     }
@@ -636,6 +681,21 @@ early_kalloc(size_t size, size_t align)
   return (char*)p2v(pa);
 }
 
+// Return how fragmented the free memory described by stats is, in
+// thousandths: the share of free memory in blocks smaller than a
+// pageblock.  0 means every free page could be part of a
+// pageblock-sized allocation.
+static size_t
+fragmentation_index(const buddy_allocator::stats &stats)
+{
+  if (!stats.free)
+    return 0;
+  size_t small = 0;
+  for (size_t order = 0; order < buddy_allocator::PAGEBLOCK_ORDER; ++order)
+    small += stats.nfree[order] * ((size_t)buddy_allocator::MIN_SIZE << order);
+  return small * 1000 / stats.free;
+}
+
 void
 kmemprint(print_stream *s)
 {
@@ -659,7 +719,10 @@ kmemprint(print_stream *s)
 
       //MIN_SIZE is the same as the page size (4 KB).
       s->print("free (pages) ", stats.free / buddy_allocator::MIN_SIZE,
-      " limit (pages) ", free_limit / buddy_allocator::MIN_SIZE, "]");
+      " limit (pages) ", free_limit / buddy_allocator::MIN_SIZE,
+      " movable (pages) ",
+      stats.free_type[buddy_allocator::MOVABLE] / buddy_allocator::MIN_SIZE,
+      " frag ", fragmentation_index(stats), "]");
       total_free += stats.free;
       total_limit += free_limit;
     }
@@ -673,6 +736,20 @@ kmemprint(print_stream *s)
   s->println();
 }
 
+// Return the free bytes in node's buddies.  These are sampled one
+// buddy at a time, so the total is only approximate.
+size_t
+kalloc_node_free(int node)
+{
+  size_t free = 0;
+  for (size_t i = node_buddy_range[node].low;
+       i < node_buddy_range[node].high; ++i) {
+    auto l = buddies[i].lock.guard();
+    free += buddies[i].alloc.get_free_bytes();
+  }
+  return free;
+}
+
 static int
 kmemstatsread(mdev*, char *dst, u32 off, u32 n)
 {
@@ -687,31 +764,87 @@ kalloc(const char *name, size_t size)
 {
   return allmem.kalloc(name, size);
 }
-#else
+
 char*
-kalloc(const char *name, size_t size)
+kalloc_movable(const char *name)
+{
+  return allmem.kalloc(name, PGSIZE);
+}
+#else
+// Return the order of size if blocks of that size have a per-CPU
+// cache, or 0 if not.
+static inline size_t
+cache_order(size_t size)
+{
+  if (size <= PGSIZE || size > ((size_t)PGSIZE << KALLOC_CACHE_ORDERS) ||
+      (size & (size - 1)))
+    return 0;
+  return __builtin_ctzl(size) - PGSHIFT;
+}
+
+// Allocate up to n blocks of size into out from the buddies in steal
+// order, taking each buddy's lock at most once.  Buddies that can't
+// satisfy size are skipped without locking them.  Returns the number
+// of blocks allocated.
+static size_t
+kalloc_buddies(const steal_order &steal, size_t size, void **out, size_t n)
+{
+  size_t got = 0;
+  for (auto idx : steal) {
+    auto &lb = buddies[idx];
+    if (!lb.alloc.can_alloc(size))
+      continue;
+    auto l = lb.lock.guard();
+    while (got < n) {
+      void *block = lb.alloc.alloc_nothrow(size, buddy_allocator::UNMOVABLE);
+      if (!block)
+        break;
+      out[got++] = block;
+    }
+    if (got == n)
+      break;
+  }
+  return got;
+}
+
+// Allocate size bytes from pageblocks of the given type.  Only single
+// pages may be MOVABLE.  alloc_rip is the caller to charge in the
+// heap profile.
+static char*
+kalloc_type(const char *name, size_t size, mobility type, void *alloc_rip)
 {
   if (!kinited)
     return (char*)early_kalloc(size, size);
 
   void *res = nullptr;
   const char *source = nullptr;
+  const steal_order *steal = nullptr;
+
+  // If the current process asked for memory near another CPU (see
+  // scoped_kalloc_cpu), steal in that CPU's order.  Its hot list
+  // belongs to it, so go straight to the buddies.
+  auto p = myproc();
+  if (p && p->kalloc_cpu_ >= 0 && p->kalloc_cpu_ != myid()) {
+    steal = &cpu_mem[p->kalloc_cpu_].steal;
+    goto general;
+  }
 
   if (size == PGSIZE) {
     // Go to the hot list
     scoped_cli cli;
     auto mem = mycpu()->mem;
-    if (mem->nhot == 0) {
+    auto &hot = mem->hot[type];
+    if (hot.n == 0) {
       // No hot pages; fill half of the cache
       kstats::inc(&kstats::kalloc_hot_list_refill_count);
       auto buddyit = mem->steal.begin(), buddyend = mem->steal.end();
       auto lb = &buddies[*buddyit];
       auto l = lb->lock.guard();
-      while (mem->nhot < KALLOC_HOT_PAGES / 2 && buddyit != buddyend) {
-        void *page = lb->alloc.alloc_nothrow(PGSIZE);
+      while (hot.n < KALLOC_HOT_PAGES / 2 && buddyit != buddyend) {
+        void *page = lb->alloc.alloc_nothrow(PGSIZE, type);
         if (!page) {
           // Move to the next allocator
-          if (++buddyit == buddyend && mem->nhot == 0) {
+          if (++buddyit == buddyend && hot.n == 0) {
             // We couldn't allocate any pages; we're probably out of
             // memory, but drop through to the more aggressive
             // general-purpose allocator.
@@ -722,33 +855,55 @@ kalloc(const char *name, size_t size)
           l = lb->lock.guard();
           if (!mem->steal.is_local(*buddyit)) {
             kstats::inc(&kstats::kalloc_hot_list_steal_count);
+            // Our node is running low
+            reclaim_wake();
 #if PRINT_STEAL
             cprintf("CPU %d stealing hot list from buddy %lu\n",
                     myid(), *buddyit);
 #endif
           }
         } else {
-          mem->hot_pages[mem->nhot++] = page;
+          hot.pages[hot.n++] = page;
         }
       }
       source = "refilled hot list";
     }
-    res = mem->hot_pages[--mem->nhot];
+    res = hot.pages[--hot.n];
     kstats::inc(&kstats::kalloc_page_alloc_count);
     if (!source)
       source = "hot list";
+  } else if (cache_order(size)) {
+    // Go to this order's cache
+    scoped_cli cli;
+    auto mem = mycpu()->mem;
+    auto &cache = mem->order_cache[cache_order(size) - 1];
+    if (cache.n == 0) {
+      // Fill half of the cache in one pass over the buddies
+      kstats::inc(&kstats::kalloc_order_cache_refill_count);
+      cache.n = kalloc_buddies(mem->steal, size, cache.blocks,
+                               KALLOC_CACHE_BLOCKS / 2);
+      if (cache.n == 0)
+        goto general;
+      source = "refilled order cache";
+    }
+    res = cache.blocks[--cache.n];
+    kstats::inc(&kstats::kalloc_order_cache_alloc_count);
+    if (!source)
+      source = "order cache";
   } else {
     // General allocation path for non-PGSIZE allocations or if we
     // can't fill our hot page cache.
   general:
+    if (!steal)
+      steal = &mycpu()->mem->steal;
     // XXX(Austin) Would it be better to linear scan our local buddies
     // and then randomly traverse the others to avoid hot-spots?
-    for (auto idx : mycpu()->mem->steal) {
+    for (auto idx : *steal) {
       auto &lb = buddies[idx];
       auto l = lb.lock.guard();
-      res = lb.alloc.alloc_nothrow(size);
+      res = lb.alloc.alloc_nothrow(size, type);
 #if PRINT_STEAL
-      if (res && mycpu()->mem->steal.is_local(idx))
+      if (res && steal->is_local(idx))
         cprintf("CPU %d stole from buddy %lu\n", myid(), idx);
 #endif
       if (res)
@@ -760,9 +915,9 @@ kalloc(const char *name, size_t size)
     if (ALLOC_MEMSET) {
       char* chk = (char*)res;
       for (int i = 0; i < size - 2*sizeof(void*); i++) {
-        // Ignore buddy allocator list links at the beginning of each
-        // page
-        if ((uintptr_t)&chk[i] % PGSIZE < sizeof(void*)*2)
+        // Ignore buddy allocator list links and type at the
+        // beginning of each page
+        if ((uintptr_t)&chk[i] % PGSIZE < sizeof(void*)*3)
           continue;
         if (chk[i] != 1)
           spanic.println(shexdump(chk, size),
@@ -777,7 +932,6 @@ kalloc(const char *name, size_t size)
     // Update debug_info
     alloc_debug_info *adi = alloc_debug_info::of(res, size);
     if (KERNEL_HEAP_PROFILE) {
-      auto alloc_rip = __builtin_return_address(0);
       if (heap_profile_update(HEAP_PROFILE_KALLOC, alloc_rip, size))
         adi->set_kalloc_rip(alloc_rip);
       else
@@ -790,9 +944,29 @@ kalloc(const char *name, size_t size)
     cprintf("kalloc: out of memory\n");
     if (KERNEL_HEAP_PROFILE)
       heap_profile_print(&console);
+    // A larger block may be there to be had by compacting
+    if (size > PGSIZE)
+      compact_wake();
+    reclaim_wake();
     return nullptr;
   }
 }
+
+char*
+kalloc(const char *name, size_t size)
+{
+  return kalloc_type(name, size, buddy_allocator::UNMOVABLE,
+                     __builtin_return_address(0));
+}
+
+// Allocate a page whose contents may later be migrated by the
+// compactor, such as a user page.
+char*
+kalloc_movable(const char *name)
+{
+  return kalloc_type(name, PGSIZE, buddy_allocator::MOVABLE,
+                     __builtin_return_address(0));
+}
 #endif
 
 void *
@@ -988,6 +1162,14 @@ initkalloc(void)
   if (VERBOSE)
     cprintf("%lu mbytes\n", mem.bytes() / (1<<20));
 
+  // Start with every pageblock MOVABLE, since most memory ends up
+  // holding user pages.  Kernel allocations take over pageblocks as
+  // they need them.
+  size_t npageblocks = (mem.max() + buddy_allocator::PAGEBLOCK_SIZE - 1) /
+    buddy_allocator::PAGEBLOCK_SIZE;
+  pageblock_map = (unsigned char*)early_kalloc(npageblocks, 1);
+  memset(pageblock_map, buddy_allocator::MOVABLE, npageblocks);
+
   // Construct one or more buddy allocators for each NUMA node
 
 #if KALLOC_LOAD_BALANCE
@@ -1027,11 +1209,13 @@ initkalloc(void)
         // [reg.base, reg.base+size) as free.  This allows us to move
         // phys memory from one buddy to another during
         // balance_move_to().
-        auto buddy = buddy_allocator(p2v(remaining.base), subsize, base, sz);
+        auto buddy = buddy_allocator(p2v(remaining.base), subsize, base, sz,
+                                     pageblock_map, (uintptr_t)p2v(0));
 #else
         // The buddy allocator can manage any page within this node
         auto buddy = buddy_allocator(p2v(remaining.base), subsize,
-                                     p2v(reg.base), reg.end - reg.base);
+                                     p2v(reg.base), reg.end - reg.base,
+                                     pageblock_map, (uintptr_t)p2v(0));
 #endif
         if (!buddy.empty()) {
           // Get some stats
@@ -1049,6 +1233,7 @@ initkalloc(void)
       }
     }
     size_t node_buddies = buddies.size() - node_low;
+    node_buddy_range[node.id] = {node_low, buddies.size()};
 
     console.println("kalloc: ", ssize(node_stats.free), " available in node ",
                     node.id,
@@ -1073,7 +1258,10 @@ initkalloc(void)
       // Then steal from the whole node (this will be a no-op if
       // there's only one subnode).
       cpu->mem->steal.add(node_low, node_low + node_buddies);
-      cpu->mem->nhot = 0;
+      for (auto &hot : cpu->mem->hot)
+        hot.n = 0;
+      for (auto &cache : cpu->mem->order_cache)
+        cache.n = 0;
       cpu->mem->mempool = node_low;
       ++cpu_index;
     }
@@ -1110,9 +1298,62 @@ kfree(void *v, size_t size)
 {
   allmem.kfree(v, size);
 }
-#else
+
 void
-kfree(void *v, size_t size)
+kfree_batch(void **pages, size_t n)
+{
+  for (size_t i = 0; i < n; ++i)
+    allmem.kfree(pages[i], PGSIZE);
+}
+#else
+// Return n blocks of size, sorted by address, to the buddy
+// allocators.  We merge the sorted blocks with the buddy allocator
+// lists, minimizing and batching our locks.  Interrupts must be
+// disabled.
+static void
+kfree_buddies(struct cpu_mem *mem, void **pages, size_t n,
+              size_t size = PGSIZE)
+{
+  locked_buddy *lb = nullptr;
+  lock_guard<spinlock> lock;
+  for (size_t i = 0; i < n; ++i) {
+    void *ptr = pages[i];
+    // Do we have the right buddy?
+    if (!lb || !(lb->alloc.contains(ptr) &&
+                 lb->alloc.get_free_bytes() < lb->free_limit)) {
+      // Find the first buddy in steal order that contains ptr and
+      // hasn't reached its free limit.  We do it this way in case
+      // there are overlapping buddies.
+      lock.release();
+      lb = nullptr;
+      for (auto buddyidx : mem->steal) {
+        auto lbtry = &buddies[buddyidx];
+        // We can access free_bytes and free_limit without locking
+        // here since it's okay if we actually go a little over
+        // free_limit.
+        if (lbtry->alloc.contains(ptr) &&
+            lbtry->alloc.get_free_bytes() < lbtry->free_limit) {
+          lb = lbtry;
+          break;
+        }
+      }
+      assert(lb);
+      if (!mem->steal.is_local(lb - &buddies[0])) {
+        kstats::inc(&kstats::kalloc_hot_list_remote_free_count);
+#if PRINT_STEAL
+        cprintf("CPU %d returning hot list to buddy %lu\n", myid(),
+                lb - &buddies[0]);
+#endif
+      }
+      lock = lb->lock.guard();
+    }
+    lb->alloc.free(ptr, size);
+  }
+}
+
+// Free the debug state of a page that is about to be freed.
+static void
+kfree_debug(void *v, size_t size)
 {
   // Fill with junk to catch dangling refs.
   if (ALLOC_MEMSET && kinited)
@@ -1128,64 +1369,66 @@ kfree(void *v, size_t size)
     if (alloc_rip)
       heap_profile_update(HEAP_PROFILE_KALLOC, alloc_rip, -size);
   }
+}
+
+// Put page v on the hot list for its pageblock's type, flushing half
+// of that list to the buddies if it's full.  Interrupts must be
+// disabled.
+static void
+kfree_hot(struct cpu_mem *mem, void *v, mobility type)
+{
+  auto &hot = mem->hot[type];
+  if (hot.n == KALLOC_HOT_PAGES) {
+    // There's no more room in the hot pages list, so free half of
+    // it.
+    kstats::inc(&kstats::kalloc_hot_list_flush_count);
+    std::sort(hot.pages, hot.pages + (KALLOC_HOT_PAGES / 2));
+    kfree_buddies(mem, hot.pages, KALLOC_HOT_PAGES / 2);
+    // Shift hot page list down
+    // XXX(Austin) Could use two lists and switch off
+    hot.n = KALLOC_HOT_PAGES - (KALLOC_HOT_PAGES / 2);
+    memmove(hot.pages, hot.pages + (KALLOC_HOT_PAGES / 2),
+            hot.n * sizeof *hot.pages);
+  }
+  hot.pages[hot.n++] = v;
+}
+
+void
+kfree(void *v, size_t size)
+{
+  kfree_debug(v, size);
 
+  // Blocks in a pageblock being compacted go straight back to the
+  // buddies so the pageblock can coalesce.
+  mobility type = pageblock_type(v);
   auto mem = mycpu()->mem;
-  if (size == PGSIZE) {
+  if (size == PGSIZE && type != buddy_allocator::ISOLATE) {
     // Free to the hot list
     scoped_cli cli;
-    if (mem->nhot == KALLOC_HOT_PAGES) {
-      // There's no more room in the hot pages list, so free half of
-      // it.  We sort the list so we can merge it with the buddy
-      // allocator list, minimizing and batching our locks.
-      kstats::inc(&kstats::kalloc_hot_list_flush_count);
-      std::sort(mem->hot_pages, mem->hot_pages + (KALLOC_HOT_PAGES / 2));
-      locked_buddy *lb = nullptr;
-      lock_guard<spinlock> lock;
-      for (size_t i = 0; i < KALLOC_HOT_PAGES / 2; ++i) {
-        void *ptr = mem->hot_pages[i];
-        // Do we have the right buddy?
-        if (!lb || !(lb->alloc.contains(ptr) &&
-                     lb->alloc.get_free_bytes() < lb->free_limit)) {
-          // Find the first buddy in steal order that contains ptr and
-          // hasn't reached its free limit.  We do it this way in case
-          // there are overlapping buddies.
-          lock.release();
-          lb = nullptr;
-          for (auto buddyidx : mem->steal) {
-            auto lbtry = &buddies[buddyidx];
-            // We can access free_bytes and free_limit without locking
-            // here since it's okay if we actually go a little over
-            // free_limit.
-            if (lbtry->alloc.contains(ptr) &&
-                lbtry->alloc.get_free_bytes() < lbtry->free_limit) {
-              lb = lbtry;
-              break;
-            }
-          }
-          assert(lb);
-          if (!mem->steal.is_local(lb - &buddies[0])) {
-            kstats::inc(&kstats::kalloc_hot_list_remote_free_count);
-#if PRINT_STEAL
-            cprintf("CPU %d returning hot list to buddy %lu\n", myid(),
-                    lb - &buddies[0]);
-#endif
-          }
-          lock = lb->lock.guard();
-        }
-        lb->alloc.free(ptr, PGSIZE);
-      }
-      lock.release();
-      // Shift hot page list down
-      // XXX(Austin) Could use two lists and switch off
-      mem->nhot = KALLOC_HOT_PAGES - (KALLOC_HOT_PAGES / 2);
-      memmove(mem->hot_pages, mem->hot_pages + (KALLOC_HOT_PAGES / 2),
-              mem->nhot * sizeof *mem->hot_pages);
-    }
-    mem->hot_pages[mem->nhot++] = v;
+    kfree_hot(mycpu()->mem, v, type);
     kstats::inc(&kstats::kalloc_page_free_count);
     return;
   }
 
+  size_t order = cache_order(size);
+  if (order && type != buddy_allocator::ISOLATE) {
+    // Free to this order's cache
+    scoped_cli cli;
+    mem = mycpu()->mem;
+    auto &cache = mem->order_cache[order - 1];
+    if (cache.n == KALLOC_CACHE_BLOCKS) {
+      // Full; return half of it to the buddies in one batch
+      kstats::inc(&kstats::kalloc_order_cache_flush_count);
+      std::sort(cache.blocks, cache.blocks + KALLOC_CACHE_BLOCKS / 2);
+      kfree_buddies(mem, cache.blocks, KALLOC_CACHE_BLOCKS / 2, size);
+      cache.n = KALLOC_CACHE_BLOCKS - KALLOC_CACHE_BLOCKS / 2;
+      memmove(cache.blocks, cache.blocks + KALLOC_CACHE_BLOCKS / 2,
+              cache.n * sizeof *cache.blocks);
+    }
+    cache.blocks[cache.n++] = v;
+    return;
+  }
+
   // Find the first allocator in steal order to return v to.  This
   // will check our local allocators first and handle overlapping
   // buddies.
@@ -1198,6 +1441,83 @@ kfree(void *v, size_t size)
   }
   panic("kfree: pointer %p is not in an allocated region", v);
 }
+
+void
+kfree_batch(void **pages, size_t n)
+{
+  for (size_t i = 0; i < n; ++i) {
+    if (!std::any_of(buddies.begin(), buddies.end(),
+                     [&](const locked_buddy &lb) {
+                       return lb.alloc.contains(pages[i]);
+                     }))
+      panic("kfree: pointer %p is not in an allocated region", pages[i]);
+    kfree_debug(pages[i], PGSIZE);
+  }
+
+  // Top off the hot lists and return whatever doesn't fit (or belongs
+  // to an isolated pageblock) directly to the buddy allocators,
+  // rather than repeatedly flushing half of a hot list.
+  scoped_cli cli;
+  auto mem = mycpu()->mem;
+  size_t nrest = 0;
+  for (size_t i = 0; i < n; ++i) {
+    mobility type = pageblock_type(pages[i]);
+    if (type != buddy_allocator::ISOLATE &&
+        mem->hot[type].n < KALLOC_HOT_PAGES)
+      mem->hot[type].pages[mem->hot[type].n++] = pages[i];
+    else
+      pages[nrest++] = pages[i];
+  }
+  if (nrest) {
+    kstats::inc(&kstats::kalloc_hot_list_flush_count);
+    std::sort(pages, pages + nrest);
+    kfree_buddies(mem, pages, nrest);
+  }
+  kstats::inc(&kstats::kalloc_page_free_count, (uint64_t)n);
+}
+
+// Return every block in this CPU's order caches to the buddies.
+// Interrupts must be disabled.  Returns the number of pages freed.
+static size_t
+kfree_order_caches(struct cpu_mem *mem)
+{
+  size_t pages = 0;
+  for (size_t order = 1; order <= KALLOC_CACHE_ORDERS; ++order) {
+    auto &cache = mem->order_cache[order - 1];
+    if (cache.n == 0)
+      continue;
+    kstats::inc(&kstats::kalloc_order_cache_flush_count);
+    std::sort(cache.blocks, cache.blocks + cache.n);
+    kfree_buddies(mem, cache.blocks, cache.n, (size_t)PGSIZE << order);
+    pages += cache.n << order;
+    cache.n = 0;
+  }
+  return pages;
+}
+
+namespace {
+  // The order caches hold up to KALLOC_CACHE_BLOCKS blocks of each
+  // order per CPU, none of which kalloc_node_free counts.  Under
+  // pressure, empty them on every CPU of the reclaiming node.  They
+  // can only be touched by their own CPU, so this takes an IPI.
+  class order_cache_shrinker : public shrinker
+  {
+  public:
+    order_cache_shrinker() : shrinker("kalloc order caches") { }
+
+    size_t shrink(size_t target) override
+    {
+      bitset<NCPU> targets;
+      for (auto c : mycpu()->node->cpus)
+        targets.set(c->id);
+      std::atomic<size_t> pages(0);
+      run_on_cpus(targets, [&pages]() {
+          pages += kfree_order_caches(mycpu()->mem);
+        });
+      return pages;
+    }
+  } order_cache_shrinker_;
+}
 #endif
 
 void
@@ -1205,3 +1525,192 @@ ksfree(int slab, void *v)
 {
   kfree(v, 1 << slabmem[slab].order);
 }
+
+/*
+ * Compaction
+ */
+
+enum {
+  // Compact a node when this many thousandths of its free memory are
+  // in blocks smaller than a pageblock.
+  COMPACT_FRAG_THRESHOLD = 500,
+  // Only compact pageblocks with at least this many free pages, so
+  // freeing a pageblock copies at most three quarters of it.
+  COMPACT_MIN_FREE = (1 << buddy_allocator::PAGEBLOCK_ORDER) / 4,
+  // The most pageblocks to isolate and compact per pass.
+  COMPACT_BATCH = 8,
+};
+
+// How often each node's compactor checks its fragmentation.
+static const u64 compact_interval_ns = 1000000000;
+// How long to leave a pageblock isolated after migrating its pages.
+// The old pages are freed once their last reference drops, which
+// takes a few refcache epochs.
+static const u64 compact_settle_ns = 100000000;
+
+struct compactor
+{
+  struct spinlock lock;
+  struct condvar cv;
+  bool wanted;                  // Protected by lock
+};
+
+static compactor compactors[MAX_NUMA_NODES];
+static bool compact_inited;
+
+// Ask this node's compactor to run now rather than at its next
+// interval.
+static void
+compact_wake(void)
+{
+  if (!KALLOC_COMPACT || !compact_inited)
+    return;
+  auto &c = compactors[mycpu()->node->id];
+  scoped_acquire l(&c.lock);
+  c.wanted = true;
+  c.cv.wake_all();
+}
+
+// Return the fragmentation index of all of node's memory.
+static size_t
+node_fragmentation(int node)
+{
+  buddy_allocator::stats total{};
+  for (size_t i = node_buddy_range[node].low;
+       i < node_buddy_range[node].high; ++i) {
+    buddy_allocator::stats stats;
+    {
+      auto l = buddies[i].lock.guard();
+      stats = buddies[i].alloc.get_stats();
+    }
+    total.free += stats.free;
+    for (size_t order = 0; order <= buddy_allocator::MAX_ORDER; ++order)
+      total.nfree[order] += stats.nfree[order];
+  }
+  // Don't bother if there isn't room for a couple of pageblocks
+  // anyway.
+  if (total.free < 2 * buddy_allocator::PAGEBLOCK_SIZE)
+    return 0;
+  return fragmentation_index(total);
+}
+
+// Find the MOVABLE pageblock in node's memory with the most free
+// pages that isn't entirely free, and isolate it in every buddy that
+// can hold it.  Returns nullptr if no pageblock is worth compacting.
+static void*
+compact_isolate(int node)
+{
+  auto &range = node_buddy_range[node];
+  if (range.low == range.high)
+    return nullptr;
+  uintptr_t lo = ~0ul, hi = 0;
+  for (size_t i = range.low; i < range.high; ++i) {
+    lo = std::min(lo, (uintptr_t)buddies[i].alloc.get_base());
+    hi = std::max(hi, (uintptr_t)buddies[i].alloc.get_limit());
+  }
+  size_t n = (hi - lo) / buddy_allocator::PAGEBLOCK_SIZE;
+  size_t bytes = std::max((size_t)PGSIZE,
+                          (size_t)1 << ceil_log2(n * sizeof(unsigned short)));
+  auto counts = (unsigned short*)kalloc("compact counts", bytes);
+  if (!counts)
+    return nullptr;
+  memset(counts, 0, bytes);
+  for (size_t i = range.low; i < range.high; ++i) {
+    auto l = buddies[i].lock.guard();
+    buddies[i].alloc.count_movable_free((void*)lo, n, counts);
+  }
+
+  size_t best = n;
+  for (size_t i = 0; i < n; ++i)
+    if (counts[i] >= COMPACT_MIN_FREE &&
+        counts[i] < (1 << buddy_allocator::PAGEBLOCK_ORDER) &&
+        (best == n || counts[i] > counts[best]))
+      best = i;
+  kfree(counts, bytes);
+  if (best == n)
+    return nullptr;
+
+  void *pb = (void*)(lo + best * buddy_allocator::PAGEBLOCK_SIZE);
+  for (auto &lb : buddies) {
+    if (!lb.alloc.contains(pb))
+      continue;
+    auto l = lb.lock.guard();
+    lb.alloc.isolate(pb);
+  }
+  return pb;
+}
+
+// Return the isolated pageblock pb to MOVABLE.  Returns true if it
+// ended up entirely free.
+static bool
+compact_release(void *pb)
+{
+  size_t free = 0;
+  for (auto &lb : buddies) {
+    if (!lb.alloc.contains(pb))
+      continue;
+    auto l = lb.lock.guard();
+    free += lb.alloc.unisolate(pb, buddy_allocator::MOVABLE);
+  }
+  return free >= (1 << buddy_allocator::PAGEBLOCK_ORDER);
+}
+
+// Compact node's memory: isolate a batch of fragmented pageblocks,
+// migrate the user pages out of all of them in one walk of the
+// address spaces, and give their frees time to coalesce them.
+static void
+compact_node(int node)
+{
+  auto &c = compactors[node];
+  if (node_fragmentation(node) < COMPACT_FRAG_THRESHOLD)
+    return;
+  void *pbs[COMPACT_BATCH];
+  size_t n = 0;
+  while (n < COMPACT_BATCH && (pbs[n] = compact_isolate(node)))
+    ++n;
+  if (!n)
+    return;
+  kstats::inc(&kstats::compact_run_count);
+  vmap::migrate(pbs, n, buddy_allocator::PAGEBLOCK_SIZE);
+  {
+    u64 until = nsectime() + compact_settle_ns;
+    scoped_acquire l(&c.lock);
+    while (nsectime() < until)
+      c.cv.sleep_to(&c.lock, until);
+  }
+  for (size_t i = 0; i < n; ++i)
+    if (compact_release(pbs[i]))
+      kstats::inc(&kstats::compact_pageblock_freed_count);
+}
+
+static void
+compactd(void *arg)
+{
+  int node = (uintptr_t)arg;
+  auto &c = compactors[node];
+  for (;;) {
+    {
+      scoped_acquire l(&c.lock);
+      if (!c.wanted)
+        c.cv.sleep_to(&c.lock, nsectime() + compact_interval_ns);
+      c.wanted = false;
+    }
+    compact_node(node);
+  }
+}
+
+void
+initcompact(void)
+{
+  if (!KALLOC_COMPACT)
+    return;
+  for (auto &node : numa_nodes) {
+    auto &c = compactors[node.id];
+    c.lock = spinlock("compactor", LOCKSTAT_KALLOC);
+    c.cv = condvar("compactor");
+    c.wanted = false;
+    int cpu = node.cpus.empty() ? 0 : node.cpus[0]->id;
+    threadpin(compactd, (void*)(uintptr_t)node.id, "compactd", cpu);
+  }
+  compact_inited = true;
+}
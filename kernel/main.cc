@@ -33,6 +33,8 @@ void initpercpu(void);
 void initpageinfo(void);
 void initkalloc(void);
 void initz(void);
+void initcompact(void);
+void initreclaim(void);
 void initrcu(void);
 void initproc(void);
 void initinode(void);
@@ -45,6 +47,8 @@ void initpci(void);
 void initnet(void);
 void initsched(void);
 void initlockstat(void);
+void initsyscallstat(void);
+void inittrace(void);
 void initidle(void);
 void initcpprt(void);
 void initfutex(void);
@@ -223,10 +227,14 @@ cmain(u64 mbmagic, u64 mbaddr)
   initidle();
   initgc();        // gc epochs and threads
   initrefcache();  // Requires initsched
+  initcompact();   // Requires initsched, initkalloc
+  initreclaim();   // Requires initsched, initkalloc
   initconsole();
   initfutex();
   initsamp();
   initlockstat();
+  initsyscallstat();
+  inittrace();
   initacpi();              // Requires initacpitables, initkalloc?
   inite1000();             // Before initpci
   initahci();
@@ -199,7 +199,7 @@ writei(sref<mnode> m, const char* buf, u64 start, u64 nbytes,
         if (msize % PGSIZE) {
           resize->resize_nogrow(msize - (msize % PGSIZE) + PGSIZE);
         } else {
-          char* p = zalloc("file page");
+          char* p = zalloc("file page", false);
           if (!p)
             break;
 
@@ -210,7 +210,7 @@ writei(sref<mnode> m, const char* buf, u64 start, u64 nbytes,
         msize = resize->read_size();
       }
 
-      char* p = zalloc("file page");
+      char* p = zalloc("file page", false);
       if (!p)
         break;
 
@@ -222,6 +222,7 @@ writei(sref<mnode> m, const char* buf, u64 start, u64 nbytes,
     off += (pgend - pgoff);
   }
 
+  m->as_file()->note_write();
   return off ?: -1;
 }
 
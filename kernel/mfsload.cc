@@ -34,7 +34,7 @@ static void
 load_file(sref<inode> i, sref<mnode> m)
 {
   for (size_t pos = 0; pos < i->size; pos += PGSIZE) {
-    char* p = zalloc("load_file");
+    char* p = zalloc("load_file", false);
     assert(p);
 
     auto pi = sref<page_info>::transfer(new (page_info::of(p)) page_info());
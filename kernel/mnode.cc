@@ -4,6 +4,7 @@
 #include "weakcache.hh"
 #include "atomic_util.hh"
 #include "percpu.hh"
+#include "exec_image.hh"
 
 namespace {
   // 32MB icache (XXX make this proportional to physical RAM)
@@ -91,6 +92,18 @@ mnode::onzero()
   delete this;
 }
 
+void
+mnode::onzero_batch(mnode **ms, size_t n)
+{
+  // Drop all of the cache entries before freeing any of the mnodes,
+  // so we walk the mnode cache and the allocator separately.
+  for (size_t i = 0; i < n; i++)
+    mnode_cache.cleanup(ms[i]->weakref_);
+  kstats::inc(&kstats::mnode_free, (uint64_t)n);
+  for (size_t i = 0; i < n; i++)
+    delete ms[i];
+}
+
 void
 mnode::linkcount::onzero()
 {
@@ -102,6 +115,46 @@ mnode::linkcount::onzero()
   m->cache_pin(false);
 }
 
+lockstat_class mfile::page_state::lock_class("mfile::page");
+
+mfile::~mfile()
+{
+  // Nobody can be using the image, since they'd hold a reference to
+  // this mfile.
+  delete image_.load();
+}
+
+exec_image *
+mfile::get_image(u64 *gen)
+{
+  // Start counting writes before the caller reads the file.  This
+  // pairs with the fence in note_write: either the writer sees
+  // image_used_ and bumps write_gen_, or we read its write.
+  if (!image_used_.load(std::memory_order_relaxed))
+    image_used_.store(true);
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  *gen = write_gen_.load();
+
+  exec_image *img = image_.load(std::memory_order_acquire);
+  if (!img || image_off_.load(std::memory_order_relaxed) ||
+      img->gen != *gen)
+    return nullptr;
+  return img;
+}
+
+void
+mfile::set_image(exec_image *img, u64 gen)
+{
+  if (image_off_.load(std::memory_order_relaxed)) {
+    delete img;
+    return;
+  }
+  img->gen = gen;
+  exec_image *old = image_.exchange(img);
+  if (old)
+    gc_delayed(old);
+}
+
 void
 mfile::resizer::resize_nogrow(u64 newsize)
 {
@@ -122,6 +175,7 @@ mfile::resizer::resize_nogrow(u64 newsize)
     /* Shrunk, and last page is partial */
     mf_->pages_.find(newsize / PGSIZE)->set_partial_page(true);
   }
+  mf_->note_write();
 }
 
 void
@@ -144,6 +198,7 @@ mfile::resizer::resize_append(u64 size, sref<page_info> pi)
     ps.set_partial_page(true);
   mf_->pages_.fill(it, ps);
   mf_->size_ = size;
+  mf_->note_write();
 }
 
 mfile::page_state
@@ -8,6 +8,7 @@
 #include "cpu.hh"
 #include "vector.hh"
 #include "iommu.hh"
+#include "log2.hh"
 
 static console_stream verbose(true);
 
@@ -178,6 +179,9 @@ pci_scan_caplist(struct pci_func* f)
     case PCI_CAP_MSI:
       f->msi_capreg = cap_ptr;
       break;
+    case PCI_CAP_MSIX:
+      f->msix_capreg = cap_ptr;
+      break;
     default:
       break;
     }
@@ -185,82 +189,205 @@ pci_scan_caplist(struct pci_func* f)
   }
 }
 
-irq
-pci_map_msi_irq(struct pci_func *f)
+pci_msi::pci_msi(struct pci_func *f)
+  : busno_(f->bus->busno), dev_(f->dev), func_(f->func),
+    msi_capreg_(0), table_(nullptr), nvec_(0), vecs_{}
 {
-  // PCI System Architecture, Fourth Edition
+}
 
-  if (!f->msi_capreg)
-    return irq();
+void
+pci_msi::compose(size_t i, u32 *addr, u32 *data) const
+{
+  // The Message Address and Data formats are mandated by the x86
+  // architecture.  See 9.11 in the Vol. 3 of the Intel architecture
+  // manual.
+  const vec &v = vecs_[i];
+  if (!iommu) {
+    // Non-remapped ("compatibility format") interrupts
+    *addr = (0x0fee << 20) |       // magic constant for northbridge
+            (v.cpu->hwid.num << 12) | // destination ID
+            (1 << 3) |             // redirection hint
+            (0 << 2);              // destination mode
+    *data = (0 << 15) |            // trigger mode (edge)
+            //(0 << 14) |          // level for trigger mode (don't care)
+            (0 << 8) |             // delivery mode (fixed)
+            v.irq.vector;          // vector
+  } else {
+    // IOMMU remapped interrupts.  MSI-X vectors each carry their own
+    // handle.  MSI messages share the first vector's handle and the
+    // device adds the message number to the data, which the IOMMU
+    // adds to the handle as a subhandle.
+    u32 handle = table_ ? v.index : vecs_[0].index;
+    *addr = (0x0fee << 20) |       // magic constant for northbridge
+            ((handle & 0x7fff) << 5) |
+            ((handle >> 15) << 2) |
+            (1 << 4) |             // VT-d interrupt
+            (1 << 3);              // Subhandle valid
+    *data = 0;
+  }
+}
 
-  // Allocate an IRQ
-  irq res = irq::default_msi();
-  if (!res.reserve(nullptr, 0))
-    return irq();
+void
+pci_msi::write_msix(size_t i)
+{
+  u32 addr, data;
+  compose(i, &addr, &data);
+  volatile u32 *ent = &table_[i * PCI_MSIX_ENTRY_DWORDS];
+  // Mask the entry while it's inconsistent
+  ent[3] |= PCI_MSIX_VCTL_MASK;
+  ent[0] = addr;
+  ent[1] = 0;
+  ent[2] = data;
+  ent[3] &= ~PCI_MSIX_VCTL_MASK;
+}
+
+void
+pci_msi::set_affinity(size_t i, struct cpu *dest)
+{
+  assert(i < nvec_);
+  if (vecs_[i].cpu == dest)
+    return;
+  vecs_[i].cpu = dest;
+  if (iommu) {
+    // The device's message names the remapping entry, so only the
+    // entry changes.
+    iommu->set_int(vecs_[i].index, vecs_[i].irq, dest);
+  } else if (table_) {
+    write_msix(i);
+  } else {
+    // Without the IOMMU, MSI has only one vector.  The destination is
+    // entirely in the low address dword, so the device never sees a
+    // torn address.
+    u32 addr, data;
+    compose(i, &addr, &data);
+    pci_conf_write(0, busno_, dev_, func_, msi_capreg_ + 4*1, addr, 32);
+  }
+}
+
+pci_msi *
+pci_map_msi_irqs(struct pci_func *f, size_t n, struct cpu * const *dest)
+{
+  // PCI System Architecture, Fourth Edition
 
-  verbose.println("pci: Routing ", *f, " to MSI ", res);
+  assert(n > 0);
+  if (!f->msix_capreg && !f->msi_capreg)
+    return nullptr;
+
+  size_t ndest = n;
+  n = std::min(n, (size_t)pci_msi::max_vectors);
+  if (f->msix_capreg) {
+    n = std::min(n, (size_t)PCI_MSIX_MCR_TBLSZ(
+                   pci_conf_read(f, f->msix_capreg)));
+  } else if (!iommu) {
+    // Multiple MSI messages use consecutive, aligned vectors, which
+    // irq::reserve can't promise.
+    n = 1;
+  } else {
+    // The device can use up to 2^MMC messages, in powers of two, so
+    // round up rather than lose the vectors past the last power of
+    // two below n.  The device never sends the extra messages.
+    u32 cap_entry = pci_conf_read(f, f->msi_capreg);
+    n = std::min((size_t)1 << ceil_log2(n),
+                 (size_t)1 << PCI_MSI_MCR_MMC(cap_entry));
+  }
 
-  u32 cap_entry = pci_conf_read(f, f->msi_capreg);  
+  // Allocate IRQs
+  pci_msi *m = new pci_msi(f);
+  for (size_t i = 0; i < n; ++i) {
+    irq res = irq::default_msi();
+    if (!res.reserve(nullptr, 0))
+      break;
+    m->vecs_[i].irq = res;
+    m->vecs_[i].cpu = dest && i < ndest ? dest[i] : &cpus[0];
+    m->nvec_++;
+  }
+  if (!f->msix_capreg) {
+    // Leftover IRQs stay reserved, but we only run short of IRQs
+    // if we have many devices.
+    while (m->nvec_ & (m->nvec_ - 1))
+      m->nvec_ &= m->nvec_ - 1;
+  }
+  if (m->nvec_ == 0) {
+    delete m;
+    return nullptr;
+  }
+
+  // If we're using an IOMMU, allocate interrupt redirection entries.
+  // These must be consecutive for MSI, since the device adds the
+  // message number to the first entry's handle.
+  if (iommu) {
+    int base = iommu->reserve_ints(m->nvec_);
+    for (size_t i = 0; i < m->nvec_; ++i) {
+      m->vecs_[i].index = base + i;
+      iommu->set_int(base + i, m->vecs_[i].irq, m->vecs_[i].cpu);
+    }
+  }
 
-  if (!(cap_entry & PCI_MSI_MCR_64BIT))
-    panic("pci_map_msi_irq only handles 64-bit address capable devices");
-  if (PCI_MSI_MCR_MMC(cap_entry) != 0)
-    panic("pci_map_msi_irq only handles 1 requested message");
+  for (size_t i = 0; i < m->nvec_; ++i)
+    verbose.println("pci: Routing ", *f, " to ",
+                    f->msix_capreg ? "MSI-X " : "MSI ", m->vecs_[i].irq,
+                    " on CPU ", m->vecs_[i].cpu->id);
+
+  if (f->msix_capreg) {
+    // [PCI 3.0 6.8.3.3] Program the table with the whole function
+    // masked, then unmask it.
+    u32 cap_entry = pci_conf_read(f, f->msix_capreg);
+    u32 tbl = pci_conf_read(f, f->msix_capreg + PCI_MSIX_TBL_REG);
+    m->table_ = (volatile u32*)p2v(f->reg_base[PCI_MSIX_TBL_BIR(tbl)] +
+                                   PCI_MSIX_TBL_OFFSET(tbl));
+    pci_conf_write(f, f->msix_capreg,
+                   cap_entry | PCI_MSIX_MCR_ENABLE | PCI_MSIX_MCR_FMASK);
+    for (size_t i = 0; i < m->nvec_; ++i)
+      m->write_msix(i);
+    pci_conf_write(f, f->msix_capreg,
+                   (cap_entry | PCI_MSIX_MCR_ENABLE) & ~PCI_MSIX_MCR_FMASK);
+    return m;
+  }
 
-  // If we're using an IOMMU, allocate an interrupt redirection entry
-  uint64_t iommu_index = 0;
-  if (iommu)
-    iommu_index = iommu->allocate_int(res, &cpus[0]);
+  m->msi_capreg_ = f->msi_capreg;
+  u32 cap_entry = pci_conf_read(f, f->msi_capreg);
+  u32 addr, data;
+  m->compose(0, &addr, &data);
 
   // [PCI SA pg 253]
   // Step 4. Assign a dword-aligned memory address to the device's
   // Message Address Register.
-  // (The Message Address Register format is mandated by the x86
-  // architecture.  See 9.11.1 in the Vol. 3 of the Intel architecture
-  // manual.)
-  if (!iommu) {
-    // Non-remapped ("compatibility format") interrupts
-    uint64_t dest = cpus[0].hwid.num;
-    pci_conf_write(f, f->msi_capreg + 4*1,
-                   (0x0fee << 20) |   // magic constant for northbridge
-                   (dest << 12) |     // destination ID
-                   (1 << 3) |         // redirection hint
-                   (0 << 2));         // destination mode
-    pci_conf_write(f, f->msi_capreg + 4*2, 0);
-  } else {
-    // IOMMU remapped interrupts
-    pci_conf_write(f, f->msi_capreg + 4*1,
-                   (0x0fee << 20) |   // magic constant for northbridge
-                   ((iommu_index & 0x7fff) << 5) |
-                   ((iommu_index >> 15) << 2) |
-                   (1 << 4) |          // VT-d interrupt
-                   (1 << 3));          // Subhandle valid
+  pci_conf_write(f, f->msi_capreg + 4*1, addr);
+  u32 data_reg = f->msi_capreg + 4*2;
+  if (cap_entry & PCI_MSI_MCR_64BIT) {
     pci_conf_write(f, f->msi_capreg + 4*2, 0);
+    data_reg = f->msi_capreg + 4*3;
   }
 
-  // Step 5 and 6. Allocate messages for the device.  Since we
-  // support only one message and that is the default value in
-  // the message control register, we do nothing.
+  // Step 5 and 6. Allocate messages for the device.  The device
+  // requested 2^MMC messages; we grant 2^MME.
+  u32 mme = 0;
+  while ((1u << mme) < m->nvec_)
+    mme++;
+  cap_entry = (cap_entry & ~PCI_MSI_MCR_MME_MASK) |
+    (mme << PCI_MSI_MCR_MME_SHIFT);
 
   // Step 7. Write base message data pattern into the device's
   // Message Data Register.
-  // (The Message Data Register format is mandated by the x86
-  // architecture.  See 9.11.2 in the Vol. 3 of the Intel architecture
-  // manual.
-  if (!iommu) {
-    pci_conf_write(f, f->msi_capreg + 4*3,
-                   (0 << 15) |        // trigger mode (edge)
-                   //(0 << 14) |      // level for trigger mode (don't care)
-                   (0 << 8) |         // delivery mode (fixed)
-                   res.vector);       // vector
-  } else {
-    pci_conf_write(f, f->msi_capreg + 4*3, 0);
-  }
+  pci_conf_write(f, data_reg, data);
 
   // Step 8. Set the MSI enable bit in the device's Message
   // control register.
-  pci_conf_write(f, f->msi_capreg, cap_entry | (1 << 16));
+  pci_conf_write(f, f->msi_capreg, cap_entry | PCI_MSI_MCR_ENABLE);
 
+  return m;
+}
+
+irq
+pci_map_msi_irq(struct pci_func *f)
+{
+  pci_msi *m = pci_map_msi_irqs(f, 1);
+  if (!m)
+    return irq();
+  // The caller can't change the vector's affinity, so it doesn't need
+  // m.
+  irq res = m->get_irq(0);
+  delete m;
   return res;
 }
 
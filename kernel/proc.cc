@@ -10,21 +10,208 @@
 #include "kmtrace.hh"
 #include "kalloc.hh"
 #include "vm.hh"
-#include "ns.hh"
 #include "work.hh"
 #include "filetable.hh"
+#include "percpu.hh"
+#include "radix_array.hh"
+#include "bit_spinlock.hh"
 #include <uk/fcntl.h>
 #include <uk/unistd.h>
 #include <uk/wait.h>
 
-u64
-proc::hash(const u32 &p)
+struct proc *bootproc __mpalign__;
+
+// Process IDs.  Each CPU hands out pids from its own block of
+// PID_BLOCK ids, so concurrent forks don't share a counter.  Freed
+// pids are collected per CPU in batches and handed out again, oldest
+// batch first and in the order they were freed, before any new block
+// is taken, so the pids in use stay close to the number of live
+// processes without an exited pid coming straight back.  The map from pids to procs is a radix
+// array over the pid space: lookups are lock-free, updates lock only
+// their own slot, and since radix_array never frees its nodes,
+// recycling pids is what keeps it from growing forever.
+//
+// pids are positive ints, so the block counter wraps at PID_LIMIT.
+// After it wraps, a new block can contain pids that are still live;
+// the allocator skips those.
+enum { PID_BLOCK = 64, PID_LIMIT = 1u << 31 };
+
+// Up to PID_BLOCK freed pids waiting to be reused.  pids[head..n)
+// haven't been reused yet.
+struct pid_batch
 {
-  return p;
-}
+  pid_batch *next;
+  unsigned head, n;
+  u32 pids[PID_BLOCK];
+};
 
-xns<u32, proc*, proc::hash> *xnspid __mpalign__;
-struct proc *bootproc __mpalign__;
+struct pid_alloc
+{
+  u32 next, end;                // Next new pid to hand out, end of block
+  pid_batch *reuse;             // Batch being handed out again, or null
+  pid_batch *freed;             // Pids freed on this CPU, or null
+};
+DEFINE_PERCPU(struct pid_alloc, pid_allocs);
+
+static std::atomic<u32> pid_next __mpalign__;
+
+// Full batches of freed pids, shared by all CPUs, oldest first.
+static spinlock pid_batches_lock("pid_batches", LOCKSTAT_PROC);
+static pid_batch *pid_batches, *pid_batches_tail;
+
+// A pid map slot.  The low bit is the radix_array lock bit and the
+// rest is the proc pointer.
+class pid_slot
+{
+  enum { FLAG_LOCK_BIT = 0 };
+  u64 value_;
+
+public:
+  pid_slot() : value_(0) { }
+  explicit pid_slot(proc *p) : value_((u64)p) { }
+
+  proc *get() const
+  {
+    return (proc*)(value_ & ~(u64)1);
+  }
+
+  static lockstat_class lock_class;
+
+  // Radix_array element methods
+
+  bit_spinlock get_lock()
+  {
+    return bit_spinlock(&value_, FLAG_LOCK_BIT, &lock_class);
+  }
+
+  bool is_set() const
+  {
+    return get() != nullptr;
+  }
+};
+
+lockstat_class pid_slot::lock_class("pid_slot");
+
+class pid_map
+{
+  typedef radix_array<pid_slot, (1ul << 32), PGSIZE,
+                      kalloc_allocator<pid_slot>, scoped_no_sched> slot_array;
+  slot_array slots_;
+
+public:
+  // Return a pid that isn't in the map.  Another CPU can still insert
+  // the same pid before the caller does if the counter has wrapped
+  // into it, so the caller must retry if insert fails.
+  u32 alloc()
+  {
+    scoped_no_sched ns;
+    pid_alloc *a = &*pid_allocs;
+    for (;;) {
+      u32 pid;
+      if (a->reuse && a->reuse->head < a->reuse->n) {
+        pid = a->reuse->pids[a->reuse->head++];
+      } else if (pid_batches || (a->freed && a->freed->n)) {
+        // Racy check.  Replace our used-up batch with the oldest full
+        // one or, failing that, the pids freed on this CPU.
+        pid_batch *b = nullptr;
+        if (pid_batches) {
+          scoped_acquire l(&pid_batches_lock);
+          if ((b = pid_batches) && !(pid_batches = b->next))
+            pid_batches_tail = nullptr;
+        }
+        if (!b) {
+          if (!a->freed || !a->freed->n)
+            continue;
+          b = a->freed;
+          a->freed = nullptr;
+        }
+        if (a->reuse)
+          kmfree(a->reuse, sizeof(pid_batch));
+        a->reuse = b;
+        continue;
+      } else {
+        if (a->next == a->end) {
+          u32 base = pid_next.fetch_add(PID_BLOCK, std::memory_order_relaxed)
+            % PID_LIMIT;
+          // pid 0 is never handed out
+          a->next = base ? base : 1;
+          a->end = base + PID_BLOCK;
+        }
+        pid = a->next++;
+      }
+      if (!lookup(pid))
+        return pid;
+    }
+  }
+
+  // Make pid available to alloc again.  The caller must have removed
+  // it from the map.
+  void recycle(u32 pid)
+  {
+    scoped_no_sched ns;
+    pid_alloc *a = &*pid_allocs;
+    if (a->freed && a->freed->n == PID_BLOCK) {
+      scoped_acquire l(&pid_batches_lock);
+      a->freed->next = nullptr;
+      if (pid_batches_tail)
+        pid_batches_tail->next = a->freed;
+      else
+        pid_batches = a->freed;
+      pid_batches_tail = a->freed;
+      a->freed = nullptr;
+    }
+    if (!a->freed) {
+      a->freed = (pid_batch*)kmalloc(sizeof(pid_batch), "pid_batch");
+      // Out of memory: pid won't be reused until the counter wraps
+      if (!a->freed)
+        return;
+      a->freed->head = a->freed->n = 0;
+    }
+    a->freed->pids[a->freed->n++] = pid;
+  }
+
+  bool insert(u32 pid, proc *p)
+  {
+    auto it = slots_.find(pid);
+    auto l = slots_.acquire(it);
+    if (it.is_set())
+      return false;
+    slots_.fill(it, pid_slot(p));
+    return true;
+  }
+
+  // Remove pid from the map if it maps to p, and recycle pid.
+  bool remove(u32 pid, proc *p)
+  {
+    {
+      auto it = slots_.find(pid);
+      auto l = slots_.acquire(it);
+      if (it->get() != p)
+        return false;
+      slots_.unset(it, slots_.find((u64)pid + 1));
+    }
+    recycle(pid);
+    return true;
+  }
+
+  proc *lookup(u32 pid)
+  {
+    auto it = slots_.find(pid);
+    return it.is_set() ? it->get() : nullptr;
+  }
+
+  // Call cb on each live process.  This takes no locks.
+  template<class CB>
+  void enumerate(CB cb)
+  {
+    for (auto it = slots_.begin(), end = slots_.end(); it < end;
+         it += it.span())
+      if (it.is_set())
+        cb(it->get());
+  }
+};
+
+static pid_map pids __mpalign__;
 
 #if MTRACE
 struct kstack_tag kstack_tag[NCPU];
@@ -35,9 +222,11 @@ enum { sched_debug = 0 };
 proc::proc(int npid) :
   kstack(0), pid(npid), parent(0), tf(0), context(0), killed(0),
   tsc(0), curcycles(0), cpuid(0), fpu_state(nullptr),
+  newchildq(nullptr), newchild_next(nullptr),
   cpu_pin(0), oncv(0), cv_wakeup(0),
   futex_lock("proc::futex_lock", LOCKSTAT_PROC),
-  user_fs_(0), unmap_tlbreq_(0), data_cpuid(-1), in_exec_(0), 
+  user_fs_(0), unmap_tlbreq_(0), data_cpuid(-1), kalloc_cpu_(-1),
+  in_exec_(0), 
   uaccess_(0), yield_(false),
   upath(nullptr), uargv(nullptr),
   exception_inuse(0), magic(PROC_MAGIC), unmapped_hint(0), state_(EMBRYO)
@@ -158,18 +347,25 @@ exit(int status)
 
   myproc()->status = (status & __WAIT_STATUS_VAL_MASK) | __WAIT_STATUS_EXITED;
 
-  // Pass abandoned children to init.
+  // Pass abandoned children, live and exited, to init.
   wakeupinit = 0;
-  while (!myproc()->childq.empty()) {
-    auto &p = myproc()->childq.front();
-    myproc()->childq.pop_front();
-    scoped_acquire pl(&p.lock);
+  {
+    scoped_acquire l(&myproc()->lock);
+    myproc()->adopt_new_children();
     scoped_acquire bl(&bootproc->lock);
-    p.parent = bootproc;
-    if(p.get_state() == ZOMBIE)  {
+    while (!myproc()->childq.empty()) {
+      auto &p = myproc()->childq.front();
+      myproc()->childq.pop_front();
+      p.parent = bootproc;
+      bootproc->childq.push_back(&p);
+    }
+    while (!myproc()->zombieq.empty()) {
+      auto &p = myproc()->zombieq.front();
+      myproc()->zombieq.pop_front();
+      p.parent = bootproc;
+      bootproc->zombieq.push_back(&p);
       wakeupinit = 1;
     }
-    bootproc->childq.push_back(&p);
   }
 
   // Release vmap
@@ -180,18 +376,33 @@ exit(int status)
     switchvm(myproc());
   }
 
-  // Lock the parent first, since otherwise we might deadlock.
-  if (myproc()->parent != nullptr)
-    acquire(&myproc()->parent->lock);
+  // Lock the parent first, since otherwise we might deadlock.  Our
+  // parent can only change while it's locked, when it exits and
+  // passes us to init.
+  struct proc *parent;
+  for (;;) {
+    parent = myproc()->parent;
+    if (parent == nullptr)
+      break;
+    acquire(&parent->lock);
+    if (parent == myproc()->parent)
+      break;
+    release(&parent->lock);
+  }
 
+  // Our lock stays held until we've switched out (see post_swtch),
+  // which is how wait knows we're done with our kernel stack.
   acquire(&(myproc()->lock));
 
   // Kernel threads might not have a parent
-  if (myproc()->parent != nullptr) {
-    release(&myproc()->parent->lock);
-    myproc()->parent->cv->wake_all();
+  if (parent != nullptr) {
+    parent->adopt_new_children();
+    parent->childq.erase(parent->childq.iterator_to(myproc()));
+    parent->zombieq.push_back(myproc());
+    release(&parent->lock);
+    parent->cv->wake_all();
   } else {
-    idlezombie(myproc());
+    idlezombie(myproc(), myid());
   }
 
   if (wakeupinit)
@@ -218,13 +429,22 @@ freeproc(struct proc *p)
   delete p;
 }
 
+void
+proc::adopt_new_children()
+{
+  proc *p = newchildq.exchange(nullptr);
+  // The list is newest first
+  for (; p; p = p->newchild_next)
+    childq.push_front(p);
+}
+
 proc*
 proc::alloc(void)
 {
   char *sp;
   proc* p;
 
-  p = new proc(xnspid->allockey());
+  p = new proc(pids.alloc());
   if (p == nullptr)
     throw_bad_alloc();
 
@@ -233,8 +453,9 @@ proc::alloc(void)
   p->mtrace_stacks.curr = -1;
 #endif
 
-  if (!xnspid->insert(p->pid, p))
-    panic("allocproc: ns_insert");
+  // Lost a race for a wrapped-around pid
+  while (!pids.insert(p->pid, p))
+    p->pid = pids.alloc();
 
   // Allocate kernel stack.
   try {
@@ -248,8 +469,8 @@ proc::alloc(void)
       throw_bad_alloc();
 #endif
   } catch (...) {
-    if (!xnspid->remove(p->pid, &p))
-      panic("allocproc: ns_remove");
+    if (!pids.remove(p->pid, p))
+      panic("allocproc: pid remove");
     freeproc(p);
     throw;
   }
@@ -281,9 +502,7 @@ proc::alloc(void)
 void
 initproc(void)
 {
-  xnspid = new xns<u32, proc*, proc::hash>(false);
-  if (xnspid == 0)
-    panic("pinit");
+  pid_next = 1;
 }
 
 // Kill the process with the given pid.
@@ -319,7 +538,7 @@ proc::kill(int pid)
   // XXX The one use of lookup and it is wrong: it should return a locked
   // proc structure, or be in an RCU epoch.  Now another process can delete
   // p between lookup and kill.
-  p = xnspid->lookup(pid);
+  p = pids.lookup(pid);
   if (p == 0) {
     panic("kill");
     return -1;
@@ -344,7 +563,7 @@ procdumpall(void)
   const char *state;
   uptr pc[10];
 
-  for (proc *p : xnspid) {
+  pids.enumerate([&](proc *p) {
     if(p->get_state() >= 0 && p->get_state() < NELEM(states) && 
        states[p->get_state()])
       state = states[p->get_state()];
@@ -362,26 +581,34 @@ procdumpall(void)
       for(int i=0; i<10 && pc[i] != 0; i++)
         cprintf(" %lx\n", pc[i]);
     }
-  }
+  });
 }
 
 // Create a new process copying p as the parent.  Sets up stack to
 // return as if from system call.  By default, the new process shares
-// nothing with its parent and it is made RUNNABLE.
+// nothing with its parent and it is made RUNNABLE.  The new process
+// will run on cpu, or if cpu is -1, on a lightly loaded core in the
+// parent's NUMA node, since it starts out using the parent's memory.
 struct proc*
-doclone(clone_flags flags)
+doclone(clone_flags flags, int cpu)
 {
   struct proc *np;
 
   //cprintf("%d: fork\n", myproc()->pid);
 
-  // Allocate process.
-  if((np = proc::alloc()) == 0)
-    return nullptr;
+  if (cpu < 0)
+    cpu = myproc()->cpu_pin ? myid() : sched_place(-1, false);
+
+  // Allocate process, with its kernel stack near where it will run.
+  {
+    scoped_kalloc_cpu kc(myproc(), cpu);
+    if((np = proc::alloc()) == 0)
+      return nullptr;
+  }
 
   auto proc_cleanup = scoped_cleanup([&np]() {
-    if (!xnspid->remove(np->pid, &np))
-      panic("fork: ns_remove");
+    if (!pids.remove(np->pid, np))
+      panic("fork: pid remove");
     freeproc(np);
   });
 
@@ -412,11 +639,13 @@ doclone(clone_flags flags)
   np->cwd = myproc()->cwd;
   np->cwd_m = myproc()->cwd_m;
   safestrcpy(np->name, myproc()->name, sizeof(myproc()->name));
-  acquire(&myproc()->lock);
-  myproc()->childq.push_back(np);
-  release(&myproc()->lock);
+  // Register with the parent without taking its lock, which its
+  // exiting children and wait contend on.
+  np->newchild_next = myproc()->newchildq.load(std::memory_order_relaxed);
+  while (!myproc()->newchildq.compare_exchange_weak(np->newchild_next, np))
+    ;
 
-  np->cpuid = mycpu()->id;
+  np->cpuid = cpu;
   if (!(flags & CLONE_NO_RUN)) {
     acquire(&np->lock);
     addrun(np);
@@ -430,8 +659,8 @@ doclone(clone_flags flags)
 void
 finishproc(struct proc *p, bool removepid)
 {
-  if (removepid && !xnspid->remove(p->pid, &p))
-    panic("finishproc: ns_remove");
+  if (removepid && !pids.remove(p->pid, p))
+    panic("finishproc: pid remove");
 #if !KSTACK_DEBUG
   if (p->kstack)
     kfree(p->kstack, KSTACKSIZE);
@@ -444,69 +673,68 @@ finishproc(struct proc *p, bool removepid)
   freeproc(p);
 }
 
-struct finishproc_work : public dwork
-{
-  finishproc_work(proc *p)
-    : dwork(), p_(p) {}
-
-  virtual void run() override {
-    finishproc(p_, 0);
-    delete this;
-  };
-
-  proc* p_;
-
-  NEW_DELETE_OPS(finishproc_work)
-};
-
-
 // Wait for a child process to exit and return its pid.
 // Return -1 if this process has no children.
 int
 wait(int wpid,  userptr<int> status)
 {
-  int havekids, pid;
+  struct proc *me = myproc();
 
   for(;;){
-    // Scan children for ZOMBIEs
-    havekids = 0;
-    acquire(&myproc()->lock);
-    for (auto it = myproc()->childq.begin(); it != myproc()->childq.end(); it++) {
-      proc &p = *it;
-      acquire(&p.lock);
-      if (wpid == -1 || wpid == p.pid) {
-	havekids = 1;
-	if(p.get_state() == ZOMBIE){
-	  release(&p.lock);	// noone else better be trying to lock p
-	  pid = p.pid;
-          myproc()->childq.erase(it);
-	  release(&myproc()->lock);
-
-          if (status) {
-            status.store(&p.status);
-          }
-
-          proc *np = &p;
-          if (!xnspid->remove(pid, &np))
-            panic("wait: ns_remove");
-
-          finishproc_work *w = new finishproc_work(&p);
-          assert(dwork_push(w, p.run_cpuid_) >= 0);
-	  return pid;
-	}
+    struct proc *p = nullptr;
+    acquire(&me->lock);
+    me->adopt_new_children();
+    if (wpid == -1) {
+      if (!me->zombieq.empty())
+        p = &me->zombieq.front();
+    } else {
+      for (auto &z : me->zombieq) {
+        if (z.pid == wpid) {
+          p = &z;
+          break;
+        }
       }
-      release(&p.lock);
+    }
+
+    if (p) {
+      me->zombieq.erase(me->zombieq.iterator_to(p));
+      release(&me->lock);
+
+      // p may not have switched out yet.  It holds its lock until
+      // it has (see exit).
+      acquire(&p->lock);
+      release(&p->lock);
+
+      int pid = p->pid;
+      int pstatus = p->status;
+      // Free p on the core it exited on, which freed its kernel
+      // stack and probably allocated it.
+      idlezombie(p, p->cpuid);
+      if (status)
+        status.store(&pstatus);
+      return pid;
     }
 
     // No point waiting if we don't have any children.
-    if(!havekids || myproc()->killed){
-      release(&myproc()->lock);
+    bool havekids = false;
+    if (wpid == -1) {
+      havekids = !me->childq.empty();
+    } else {
+      for (auto &c : me->childq) {
+        if (c.pid == wpid) {
+          havekids = true;
+          break;
+        }
+      }
+    }
+    if(!havekids || me->killed){
+      release(&me->lock);
       return -1;
     }
 
-    // Wait for children to exit.  (See wakeup1 call in proc_exit.)
-    myproc()->cv->sleep(&myproc()->lock);
-    release(&myproc()->lock);
+    // Wait for children to exit.  (See wake_all call in exit.)
+    me->cv->sleep(&me->lock);
+    release(&me->lock);
   }
 }
 
@@ -529,8 +757,8 @@ threadalloc(void (*fn)(void *), void *arg)
     return 0;
 
   auto proc_cleanup = scoped_cleanup([&p]() {
-    if (!xnspid->remove(p->pid, &p))
-      panic("fork: ns_remove");
+    if (!pids.remove(p->pid, p))
+      panic("fork: pid remove");
     freeproc(p);
   });
 
@@ -0,0 +1,146 @@
+// Reclaim under memory pressure.
+//
+// Caches register shrinkers that release memory they can rebuild.
+// Each NUMA node has a kswapd thread that runs the shrinkers once the
+// node's free memory drops below its low watermark, reclaiming up to
+// its high watermark.  Threads whose allocation failed reclaim
+// directly from their allocation retry loops (see reclaim_direct).
+//
+// kalloc itself never reclaims: its callers may hold arbitrary locks
+// and memory released through refcache won't be free until a few
+// epochs later anyway.  Instead, it wakes kswapd when it starts
+// stealing from remote buddies or runs out of memory.
+
+#include "types.h"
+#include "kernel.hh"
+#include "spinlock.hh"
+#include "condvar.hh"
+#include "cpu.hh"
+#include "numa.hh"
+#include "kstats.hh"
+#include "reclaim.hh"
+#include "gc.hh"
+
+enum {
+  MAX_SHRINKERS = 16,
+  // Pages a thread reclaims directly after a failed allocation.
+  DIRECT_RECLAIM = 256,
+  // Watermarks as a fraction of each node's memory, and their floor
+  // in pages.
+  WMARK_LOW_SHIFT = 6,          // 1/64
+  WMARK_HIGH_SHIFT = 5,         // 1/32
+  WMARK_MIN = 256,
+};
+
+// How often each node's kswapd checks its watermarks.
+static const u64 kswapd_interval_ns = 100000000;
+
+// Plain arrays so shrinker constructors can register regardless of
+// global constructor order.
+static shrinker *shrinkers[MAX_SHRINKERS];
+static size_t nshrinkers;
+
+struct kswapd_state
+{
+  struct spinlock lock;
+  struct condvar cv;
+  bool wanted;                  // Protected by lock
+  size_t low, high;             // Watermarks, in pages
+};
+
+static kswapd_state kswapds[MAX_NUMA_NODES];
+static bool reclaim_inited;
+
+shrinker::shrinker(const char *name) : name(name)
+{
+  if (nshrinkers == MAX_SHRINKERS)
+    panic("shrinker: too many shrinkers");
+  shrinkers[nshrinkers++] = this;
+}
+
+size_t
+reclaim(size_t target)
+{
+  size_t n = 0;
+  for (size_t i = 0; i < nshrinkers && n < target; ++i)
+    n += shrinkers[i]->shrink(target - n);
+  return n;
+}
+
+void
+reclaim_direct(void)
+{
+  kstats::inc(&kstats::reclaim_direct_count);
+  size_t n = reclaim(DIRECT_RECLAIM);
+  kstats::inc(&kstats::reclaim_direct_pages, n);
+  reclaim_wake();
+  gc_wakeup();
+}
+
+void
+reclaim_wake(void)
+{
+  if (!KALLOC_RECLAIM || !reclaim_inited)
+    return;
+  auto &k = kswapds[mycpu()->node->id];
+  // Racy check so frequent callers don't bounce the lock
+  if (k.wanted)
+    return;
+  scoped_acquire l(&k.lock);
+  k.wanted = true;
+  k.cv.wake_all();
+}
+
+size_t
+reclaim_low_watermark(int node)
+{
+  if (!KALLOC_RECLAIM || !reclaim_inited)
+    return 0;
+  return kswapds[node].low;
+}
+
+static void
+kswapd(void *arg)
+{
+  int node = (uintptr_t)arg;
+  auto &k = kswapds[node];
+  for (;;) {
+    {
+      scoped_acquire l(&k.lock);
+      if (!k.wanted)
+        k.cv.sleep_to(&k.lock, nsectime() + kswapd_interval_ns);
+      k.wanted = false;
+    }
+    size_t free = kalloc_node_free(node) / PGSIZE;
+    if (free >= k.low)
+      continue;
+    // Released memory trickles back over the next few epochs, so
+    // reclaim the whole deficit at once and recheck next interval
+    // rather than looping on the free count.
+    kstats::inc(&kstats::reclaim_kswapd_run_count);
+    size_t n = reclaim(k.high - free);
+    kstats::inc(&kstats::reclaim_kswapd_pages, n);
+    if (n)
+      gc_wakeup();
+  }
+}
+
+void
+initreclaim(void)
+{
+  if (!KALLOC_RECLAIM)
+    return;
+  for (auto &node : numa_nodes) {
+    auto &k = kswapds[node.id];
+    k.lock = spinlock("kswapd", LOCKSTAT_KALLOC);
+    k.cv = condvar("kswapd");
+    k.wanted = false;
+    // Nearly all memory is free this early in boot
+    size_t total = kalloc_node_free(node.id) / PGSIZE;
+    k.low = std::max(total >> WMARK_LOW_SHIFT, (size_t)WMARK_MIN);
+    k.high = std::max(total >> WMARK_HIGH_SHIFT, (size_t)WMARK_MIN * 2);
+    int cpu = node.cpus.empty() ? 0 : node.cpus[0]->id;
+    threadpin(kswapd, (void*)(uintptr_t)node.id, "kswapd", cpu);
+  }
+  reclaim_inited = true;
+}
@@ -1,7 +1,9 @@
 #include "refcache.hh"
 #include "proc.hh"
 #include "kstream.hh"
+#include "tracepoint.hh"
 
+#include <algorithm>
 #include <atomic>
 #include <iterator>
 
@@ -128,6 +130,7 @@ refcache::cache::review()
 
   if (!last_reviewable)
     return;
+  TRACEPOINT(refcache_review, epoch, 0);
 
   // Cut the review list
   referenced::list reviewable;
@@ -141,7 +144,7 @@ refcache::cache::review()
   // re-added to the review list, or dropped from the review list.
   auto review = reviewable.begin();
   auto review_end = reviewable.end();
-  uint64_t nreviewed = 0, nrequeued = 0, ndisowned = 0;
+  uint64_t nreviewed = 0, nrequeued = 0, ndisowned = 0, nremote = 0;
   while (review != review_end) {
     auto obj = review++;
     ++nreviewed;
@@ -185,9 +188,9 @@ refcache::cache::review()
         obj->review_epoch_ = 0;
         l.release();
 
-        scoped_acquire rl(&reap_lock_);
-        reap_.push_back(&*obj);
-        reap_cv_.wake_all();
+        if (obj->home_ != myid())
+          ++nremote;
+        reap_out_[obj->home_].push_back(&*obj);
       }
     } else {
       // The count is now non-zero and hence clearly unstable.  Drop
@@ -208,6 +211,8 @@ refcache::cache::review()
       ++ndisowned;
     }
   }
+  send_reapable();
+
   // if (nreviewed)
   //   console.println("refcache: CPU ", myid(), " reviewed ", nreviewed,
   //                   " freed ", nfreed, " requeued ", nrequeued,
@@ -216,6 +221,23 @@ refcache::cache::review()
   kstats::inc(&kstats::refcache_item_reviewed_count, nreviewed);
   kstats::inc(&kstats::refcache_item_requeued_count, nrequeued);
   kstats::inc(&kstats::refcache_item_disowned_count, ndisowned);
+  kstats::inc(&kstats::refcache_item_remote_reap_count, nremote);
+  TRACEPOINT(refcache_review_done, nreviewed, 0);
+}
+
+void
+refcache::cache::send_reapable()
+{
+  for (int i = 0; i < ncpu; i++) {
+    if (reap_out_[i].empty())
+      continue;
+    // Hand the whole batch to the home core's reaper at once, so a
+    // review that finds many dead objects takes each reap lock once.
+    cache *home = &mycache[i];
+    scoped_acquire rl(&home->reap_lock_);
+    home->reap_.splice_back(std::move(reap_out_[i]));
+    home->reap_cv_.wake_all();
+  }
 }
 
 void
@@ -238,6 +260,7 @@ refcache::cache::flush()
   // Update local_epoch so we can tell evict that local_epoch is
   // exact.
   local_epoch = cur_global;
+  TRACEPOINT(refcache_flush, cur_global, 0);
 
   // Flush our cache
   // XXX Even though we're pinned, we still need interrupts disabled
@@ -265,9 +288,11 @@ refcache::cache::flush()
     // next epoch.
     global_epoch_left = ncpu;
     ++global_epoch;
+    TRACEPOINT(refcache_epoch, cur_global + 1, 0);
   }
 
   kstats::inc(&kstats::refcache_item_flushed_count, nflushed);
+  TRACEPOINT(refcache_flush_done, nflushed, 0);
 }
 
 void
@@ -294,17 +319,72 @@ refcache::cache::reaper()
     kstats::inc(&kstats::refcache_reap_count);
     kstats::timer timer(&kstats::refcache_reap_cycles);
 
-    auto reap = reapable.begin();
-    auto reap_end = reapable.end();
-    uint64_t nfreed = 0;
-    while (reap != reap_end) {
-      auto obj = reap++;
+    uint64_t nfreed = reap(&reapable);
+
+    kstats::inc(&kstats::refcache_item_freed_count, nfreed);
+  }
+}
+
+uint64_t
+refcache::cache::reap(referenced::list *reapable)
+{
+  // Pending batches, one per distinct batch_reaper.  This is small
+  // because in practice only a few types implement batch reaping.
+  struct batch
+  {
+    batch_reaper fn;
+    size_t n;
+    referenced *objs[REAP_BATCH];
+  } batches[REAP_CLASSES];
+  size_t nbatches = 0;
+  uint64_t nfreed = 0;
+
+  auto flush_batch = [&](batch *b) {
+    b->fn(b->objs, b->n);
+    nfreed += b->n;
+    kstats::inc(&kstats::refcache_reap_batch_count);
+    b->n = 0;
+  };
+
+  auto it = reapable->begin();
+  auto end = reapable->end();
+  while (it != end) {
+    // Advance before freeing obj, since freeing destroys its link.
+    referenced *obj = &*it++;
+    batch_reaper fn = obj->get_batch_reaper();
+    if (!fn) {
       obj->onzero();
       ++nfreed;
+      continue;
     }
 
-    kstats::inc(&kstats::refcache_item_freed_count, nfreed);
+    batch *b = nullptr;
+    for (size_t i = 0; i < nbatches; i++) {
+      if (batches[i].fn == fn) {
+        b = &batches[i];
+        break;
+      }
+    }
+    if (!b) {
+      if (nbatches == REAP_CLASSES) {
+        // Out of batch slots; retire the oldest class.
+        flush_batch(&batches[0]);
+        std::move(batches + 1, batches + nbatches, batches);
+        --nbatches;
+      }
+      b = &batches[nbatches++];
+      b->fn = fn;
+      b->n = 0;
+    }
+    b->objs[b->n++] = obj;
+    if (b->n == REAP_BATCH)
+      flush_batch(b);
   }
+
+  for (size_t i = 0; i < nbatches; i++)
+    if (batches[i].n)
+      flush_batch(&batches[i]);
+  return nfreed;
 }
 
 uint64_t
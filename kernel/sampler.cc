@@ -15,8 +15,12 @@
 #include "percpu.hh"
 #include "kstream.hh"
 #include "cpuid.hh"
+#include "ipi.hh"
+#include "sleeplock.hh"
+#include "percpu_ring.hh"
 
 #include <algorithm>
+#include <atomic>
 
 #define LOGHEADER_SZ (sizeof(struct logheader) + \
                       sizeof(((struct logheader*)0)->cpu[0])*NCPU)
@@ -34,6 +38,11 @@
 
 #define LOG2_HASH_BUCKETS 12
 
+// The number of hash buckets and ring slots in each CPU's stack log.
+// These bound stack mode to 192K per CPU, however long it runs.
+#define LOG2_STACK_HASH_BUCKETS 8
+#define STACK_RING 512
+
 #define MAX_PMCS 2
 
 static void enable_nehalem_workaround(void);
@@ -87,6 +96,26 @@ public:
 
 DEFINE_PERCPU(struct pmulog, pmulog);
 
+// The ring holds stacks evicted from hash, waiting for a reader.  Its
+// lost count is of samples dropped because the ring was full or the
+// hash was being flushed.
+struct stacklog : public percpu_ring<pmustack, STACK_RING> {
+  // Direct-mapped table of stacks aggregated since they were last
+  // evicted.  Only touched on this CPU.
+  struct pmustack *hash;
+
+private:
+  bool dirty;
+  // Set while flush runs outside the sampler NMI.
+  volatile bool flushing;
+
+public:
+  void log(const struct pmustack &st);
+  void flush();
+} __mpalign__;
+
+DEFINE_PERCPU(struct stacklog, stacklog);
+
 //
 // AMD PMU
 //
@@ -570,6 +599,152 @@ pmulog::flush()
   dirty = false;
 }
 
+//
+// Stack log
+//
+
+static uintptr_t
+stackhash(const struct pmustack *st)
+{
+  uintptr_t h = st->idle | (st->ints_disabled << 1) | (st->kernel << 2);
+  for (int i = 0; i < st->depth; ++i)
+    h = (h ^ st->pc[i]) * 0x100000001b3ull;
+  return h ^ (h >> 32);
+}
+
+// Test if two stacks are the same except for their count.
+static bool
+stackequal(const struct pmustack *a, const struct pmustack *b)
+{
+  return a->idle == b->idle && a->ints_disabled == b->ints_disabled &&
+    a->kernel == b->kernel && a->kdepth == b->kdepth &&
+    a->depth == b->depth &&
+    memcmp(a->pc, b->pc, a->depth * sizeof(a->pc[0])) == 0;
+}
+
+// Aggregate st into the hash table, evicting whatever stack it
+// collides with to the ring.  Called from the sampler NMI.
+void
+stacklog::log(const struct pmustack &st)
+{
+  if (flushing) {
+    lost.fetch_add(st.count, std::memory_order_relaxed);
+    return;
+  }
+
+  auto bucket = &hash[stackhash(&st) % (1 << LOG2_STACK_HASH_BUCKETS)];
+  if (bucket->count) {
+    if (stackequal(&st, bucket)) {
+      bucket->count += st.count;
+      return;
+    }
+    // If the reader has fallen behind, drop this sample rather than
+    // the aggregated one and keep going.
+    if (!push(*bucket)) {
+      lost.fetch_add(st.count, std::memory_order_relaxed);
+      return;
+    }
+  }
+  *bucket = st;
+  dirty = true;
+}
+
+// Move the hash table's stacks to the ring, as far as there's room.
+// Must be called on this CPU with interrupts disabled.  Samples that
+// arrive meanwhile are counted as lost.
+void
+stacklog::flush()
+{
+  if (!dirty)
+    return;
+  flushing = true;
+  std::atomic_signal_fence(std::memory_order_seq_cst);
+  bool full = false;
+  for (int i = 0; i < 1 << LOG2_STACK_HASH_BUCKETS && !full; ++i) {
+    if (hash[i].count) {
+      if (push(hash[i]))
+        hash[i].count = 0;
+      else
+        full = true;
+    }
+  }
+  dirty = full;
+  std::atomic_signal_fence(std::memory_order_seq_cst);
+  flushing = false;
+}
+
+// Serializes stack log allocation and stack readers, which together
+// are the consumer of every CPU's ring.
+static sleeplock stack_lock("sampler:stack");
+// True if the most recently written selector enabled stack mode.
+// This stays set after sampling is disabled so the reader can drain
+// the last of the stacks.
+static bool stack_mode;
+
+// Allocate every CPU's stack log, if they aren't already.  The memory
+// is only spent once someone uses stack mode.
+static bool
+stacklog_init(void)
+{
+  const size_t hashsz = (1 << LOG2_STACK_HASH_BUCKETS) * sizeof(pmustack);
+  const size_t ringsz = STACK_RING * sizeof(pmustack);
+  auto l = stack_lock.guard();
+  for (int i = 0; i < ncpu; ++i) {
+    auto sl = &stacklog[i];
+    if (sl->buf)
+      continue;
+    auto hash = (pmustack*)kmalloc(hashsz, "perfstackhash");
+    auto ring = (pmustack*)kmalloc(ringsz, "perfstackring");
+    if (!hash || !ring) {
+      if (hash)
+        kmfree(hash, hashsz);
+      if (ring)
+        kmfree(ring, ringsz);
+      return false;
+    }
+    memset(hash, 0, hashsz);
+    sl->hash = hash;
+    sl->buf = ring;
+  }
+  return true;
+}
+
+// Copy as many whole records out of the rings as fit in dst.
+// Caller must hold stack_lock.
+static int
+stackdrain(char *dst, u32 n)
+{
+  static int next;
+  return stacklog::drain(
+    &next, dst, n,
+    [](int cpu) -> struct stacklog* { return &stacklog[cpu]; },
+    [](int cpu, u64 lost) {
+      struct pmustack st{};
+      st.count = std::min(lost, (u64)(u32)-1);
+      st.cpu = cpu;
+      st.lost = 1;
+      return st;
+    });
+}
+
+// Read pmustack records.  Once the rings are empty, this pulls the
+// stacks still aggregating in each CPU's hash table, so a read that
+// returns 0 means the reader has caught up.
+static int
+stackread(char *dst, u32 n)
+{
+  auto l = stack_lock.guard();
+  int r = stackdrain(dst, n);
+  if (r == 0 && selectors[0].enable) {
+    bitset<NCPU> cpus;
+    for (int i = 0; i < ncpu; ++i)
+      cpus.set(i);
+    run_on_cpus(cpus, []() { stacklog->flush(); });
+    r = stackdrain(dst, n);
+  }
+  return r;
+}
+
 //
 // Configuration and interrupt handling
 //
@@ -578,9 +753,13 @@ void
 sampconf(void)
 {
   pushcli();
-  if (selectors[0].period)
+  if (selectors[0].period && !selectors[0].stacks)
     pmulog[myid()].count = 0;
   pmu->configure(0, selectors[0]);
+  // With the counter off, nothing else adds to this CPU's stack hash,
+  // so hand what's left to the reader.
+  if (!selectors[0].enable && stacklog->hash)
+    stacklog->flush();
   popcli();
 }
 
@@ -646,6 +825,43 @@ samplog(int pmc, struct trapframe *tf)
   }
 }
 
+static void
+sampstack(int pmc, struct trapframe *tf)
+{
+  struct pmustack st{};
+  struct proc *p = myproc();
+  st.count = 1;
+  st.cpu = myid();
+  st.idle = (p == idleproc());
+  st.ints_disabled = !(tf->rflags & FL_IF);
+  st.kernel = tf->rip >= KCODE;
+  st.pc[0] = tf->rip;
+  getcallerpcs((void*)tf->rbp, st.pc + 1, NSTACK - 1);
+
+  int n = 1;
+  if (st.kernel) {
+    // The kernel's frame chain may run on into the user stack.  Cut
+    // it at the first user return address and take the user frames
+    // from the thread's trap frame, which also covers samples taken
+    // in interrupt handlers.
+    while (n < NSTACK && st.pc[n] >= KCODE)
+      ++n;
+    st.kdepth = n;
+    struct trapframe *utf = p ? p->tf : nullptr;
+    if (!st.idle && utf && (utf->cs & 3) == 3 && n < NSTACK) {
+      st.pc[n] = utf->rip;
+      getcallerpcs((void*)utf->rbp, st.pc + n + 1, NSTACK - n - 1);
+    } else {
+      memset(st.pc + n, 0, (NSTACK - n) * sizeof(st.pc[0]));
+    }
+  }
+  while (n < NSTACK && st.pc[n])
+    ++n;
+  st.depth = n;
+
+  stacklog->log(st);
+}
+
 static int
 readlog(char *dst, u32 off, u32 n)
 {
@@ -682,7 +898,13 @@ static void
 sampstat(mdev*, struct stat *st)
 {
   u64 sz = 0;
-  
+
+  if (stack_mode) {
+    // A stream, not a snapshot
+    st->st_size = 0;
+    return;
+  }
+
   sz += LOGHEADER_SZ;
   for (int i = 0; i < ncpu; ++i) {
     struct pmulog *p = &pmulog[i];
@@ -699,7 +921,10 @@ sampread(mdev*, char *dst, u32 off, u32 n)
   struct logheader *hdr;
   int ret;
   int i;
-  
+
+  if (stack_mode)
+    return stackread(dst, n);
+
   ret = 0;
   if (off < LOGHEADER_SZ) {
     u64 len = LOGHEADER_SZ;
@@ -745,8 +970,17 @@ sampwrite(mdev*, const char *buf, u32 n)
     console.println("sampler: Cannot re-enable enabled counter");
     return -1;
   }
+  if (ps->stacks) {
+    if (ps->precise) {
+      console.println("sampler: Stack mode cannot be precise");
+      return -1;
+    }
+    if (!stacklog_init())
+      return -1;
+  }
   *static_cast<perf_selector*>(&selectors[0]) = *ps;
-  selectors[0].on_overflow = samplog;
+  selectors[0].on_overflow = ps->stacks ? sampstack : samplog;
+  stack_mode = ps->stacks;
   sampstart();
   return n;
 }
@@ -16,9 +16,18 @@
 #include "ilist.hh"
 #include "kstream.hh"
 #include "file.hh"
+#include "tracepoint.hh"
+#include "numa.hh"
+#include "kstats.hh"
+#include "apic.hh"
 
 enum { sched_debug = 0 };
 
+// Where sched_place starts scanning.  Races just reorder the scan.
+namespace {
+  DEFINE_PERCPU(u32, place_rotor, NO_CRITICAL);
+};
+
 struct schedule : public balance_pool<schedule> {
 public:
   schedule(int id);
@@ -37,6 +46,13 @@ public:
   void balance_move_to(schedule *other);
   u64 balance_count() const;
 
+  // Approximate load for placing new processes: the number of queued
+  // runnable processes, plus one if the core is running something
+  // other than its idle process.  Read without the lock.
+  u32 load() const { return nqueued_ + !idle_; }
+  bool idle() const { return idle_; }
+  void set_idle(bool idle) { if (idle_ != idle) idle_ = idle; }
+
   sched_stat stats_;
   u64 ncansteal_;
 private:
@@ -46,11 +62,14 @@ private:
   ilist<proc, &proc::sched_link> proc_;
   isqueue<dwork, &dwork::link_> work_;
   volatile bool cansteal_ __mpalign__;
+  volatile u32 nqueued_;
+  volatile bool idle_;
   __padout__;
 };
 
 schedule::schedule(int id)
-  : balance_pool(1), id_(id), lock_("schedule::lock_", LOCKSTAT_SCHED)
+  : balance_pool(1), id_(id), lock_("schedule::lock_", LOCKSTAT_SCHED),
+    nqueued_(0), idle_(true)
 {
   ncansteal_ = 0;
   stats_.enqs = 0;
@@ -84,6 +103,7 @@ schedule::balance_move_to(schedule* target)
   for (auto it = proc_.begin(); it != proc_.end(); ++it) {
     if ((*it).cansteal(true)) {
       proc_.erase(it);
+      --nqueued_;
       if (--ncansteal_ == 0)
         cansteal_ = false;
       sanity();
@@ -126,6 +146,7 @@ schedule::enq(proc* p)
 {
   scoped_acquire x(&lock_);
   proc_.push_back(p);
+  ++nqueued_;
   if (p->cansteal(true))
     if (ncansteal_++ == 0) {
       cansteal_ = true;
@@ -145,6 +166,7 @@ schedule::deq(void)
     return nullptr;
   proc &p = proc_.front();
   proc_.pop_front();
+  --nqueued_;
   if (p.cansteal(true))
     if (--ncansteal_ == 0)
       cansteal_ = false;
@@ -217,8 +239,12 @@ public:
   }
 
   void addrun(struct proc* p) {
+    TRACEPOINT(sched_wakeup, p->pid, p->cpuid);
     p->set_state(RUNNABLE);
     schedule_[p->cpuid]->enq(p);
+    // An idle CPU sleeps in hlt until its next interrupt
+    if (p->cpuid != myid() && schedule_[p->cpuid]->idle())
+      lapic->send_wakeup(&cpus[p->cpuid]);
   }
 
   void pushwork(struct dwork *w, int cpu) {
@@ -233,6 +259,45 @@ public:
     return schedule_[mycpu()->id]->deq();
   }
 
+  bool pending() const {
+    return schedule_[myid()]->load() != 0;
+  }
+
+  // Pick the least loaded CPU in node for a new process, scanning
+  // from a per-CPU rotor so concurrent forks spread out.  Ties go to
+  // the current CPU, whose caches are warm, if it is in the requested
+  // node.
+  int place_in(const numa_node &node, int best, u32 *bestload) {
+    size_t n = node.cpus.size();
+    size_t start = (*place_rotor)++;
+    for (size_t i = 0; i < n && *bestload; ++i) {
+      int c = node.cpus[(start + i) % n]->id;
+      u32 l = schedule_[c]->load();
+      if (l < *bestload) {
+        best = c;
+        *bestload = l;
+      }
+    }
+    return best;
+  }
+
+  int place(int node, bool anynode) {
+    if (node < 0)
+      node = mycpu()->node->id;
+    // Seed the search from a CPU in the requested node, or the child
+    // could stay here on the wrong node.
+    int best = myid();
+    if (mycpu()->node->id != node)
+      best = numa_nodes[node].cpus[0]->id;
+    u32 bestload = schedule_[best]->load();
+    best = place_in(numa_nodes[node], best, &bestload);
+    if (anynode)
+      for (auto &n : numa_nodes)
+        if (n.id != node && bestload)
+          best = place_in(n, best, &bestload);
+    return best;
+  }
+
   void
   sched(void)
   {
@@ -274,6 +339,7 @@ public:
           myproc()->cpuid != mycpu()->id) {
         next = idleproc();
       } else {
+        schedule_[mycpu()->id]->set_idle(myproc() == idleproc());
         myproc()->set_state(RUNNING);
         mycpu()->intena = intena;
         release(&myproc()->lock);
@@ -284,9 +350,11 @@ public:
     if (next->get_state() != RUNNABLE)
       panic("non-RUNNABLE next %s %u", next->name, next->get_state());
 
+    schedule_[mycpu()->id]->set_idle(next == idleproc());
     prev = myproc();
     mycpu()->proc = next;
     mycpu()->prev = prev;
+    TRACEPOINT(sched_switch, prev->pid, next->pid);
 
     if (prev->get_state() == ZOMBIE)
       mtstop(prev);
@@ -333,10 +401,19 @@ sched_dir thesched_dir __mpalign__;
 void
 post_swtch(void)
 {
-  if (mycpu()->prev->get_state() == RUNNABLE && 
-      mycpu()->prev != idleproc())
-    addrun(mycpu()->prev);
-  release(&mycpu()->prev->lock);
+  struct proc *prev = mycpu()->prev;
+  if (prev->get_state() == RUNNABLE && prev != idleproc())
+    addrun(prev);
+#if !KSTACK_DEBUG
+  if (prev->get_state() == ZOMBIE && prev->kstack) {
+    // Nothing will run on prev's stack again, so free it now, on the
+    // core it ran on, rather than whenever its parent waits.
+    kfree(prev->kstack, KSTACKSIZE);
+    prev->kstack = nullptr;
+  }
+#endif
+  release(&prev->lock);
+  idlereap();
   thesched_dir.trywork();
 }
 
@@ -352,6 +429,34 @@ addrun(struct proc* p)
   thesched_dir.addrun(p);
 }
 
+// Choose the CPU a new process should start on.  node is the NUMA
+// node whose memory the process will use, or -1 for the current
+// CPU's node.  If anynode, the process's memory isn't tied to a node
+// yet (it is about to exec), so a less loaded CPU on another node is
+// better than a busy local one.
+int
+sched_place(int node, bool anynode)
+{
+  if (!SCHED_PLACE_NEW)
+    return myid();
+  int cpu = thesched_dir.place(node, anynode);
+  kstats::inc(&kstats::sched_place_count);
+  if (cpu != myid())
+    kstats::inc(&kstats::sched_place_remote_count);
+  if (cpus[cpu].node != mycpu()->node)
+    kstats::inc(&kstats::sched_place_remote_node_count);
+  return cpu;
+}
+
+// Whether the current CPU has something to run other than what it's
+// running now, for idle-time work that should stop when real work
+// arrives.  Racy.
+bool
+sched_pending(void)
+{
+  return thesched_dir.pending();
+}
+
 int
 dwork_push(struct dwork *w, int cpu)
 {
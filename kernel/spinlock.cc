@@ -11,21 +11,12 @@
 #include "fs.h"
 #include "file.hh"
 #include "major.h"
+#include "percpu.hh"
 
-#if LOCKSTAT
-// The klockstat structure pointed to by spinlocks that want lockstat,
-// but have never been acquired.
-struct klockstat klockstat_lazy("<lazy>");
-
-static int lockstat_enable;
-
-void lockstat_init(struct spinlock *lk, bool lazy);
+#include <algorithm>
 
-static inline struct cpulockstat *
-mylockstat(struct spinlock *lk)
-{
-  return &lk->stat->s.cpu[mycpu()->id];
-}
+#if LOCKSTAT
+int lockstat_enable;
 
 void*
 klockstat::operator new(unsigned long nbytes)
@@ -44,7 +35,9 @@ klockstat::operator delete(void *p)
 }
 #endif
 
-static inline void
+// Returns the time lk started waiting, or 0 if lockstat isn't
+// gathering statistics for lk.
+static inline u64
 locking(struct spinlock *lk)
 {
 #if SPINLOCK_DEBUG
@@ -54,19 +47,24 @@ locking(struct spinlock *lk)
   }
 #endif
 
+  u64 start = 0;
 #if LOCKSTAT
-  if (lockstat_enable && lk->stat != nullptr) {
-    if (lk->stat == &klockstat_lazy)
-      lockstat_init(lk, true);
-    mylockstat(lk)->locking_ts = rdtsc();
+  if (lockstat_enable && lk->want_stat) {
+    if (!lk->stat)
+      lk->stat = lockstat_lookup(lk->name);
+    if (lk->stat)
+      start = rdtsc();
   }
 #endif
 
   mtlock(lk);
+  return start;
 }
 
+// frame is the frame pointer of the spinlock method, so its caller
+// is charged for any wait.
 static inline void
-locked(struct spinlock *lk, u64 retries)
+locked(struct spinlock *lk, u64 retries, u64 start, void *frame)
 {
   mtacquired(lk);
 
@@ -77,13 +75,9 @@ locked(struct spinlock *lk, u64 retries)
 #endif
 
 #if LOCKSTAT
-  if (lockstat_enable && lk->stat != nullptr) {
-    struct cpulockstat *s = mylockstat(lk);
-    if (retries > 0)
-      s->contends++;
-    s->acquires++;
-    s->locked_ts = rdtsc();
-  }
+  if (start)
+    lockstat_cpu_locked(lk->stat,
+                        lockstat_wait(lk->stat, start, retries > 0, frame));
 #endif
 }
 
@@ -105,12 +99,8 @@ releasing(struct spinlock *lk)
 #endif
 
 #if LOCKSTAT
-  if (lockstat_enable && lk->stat != nullptr) {
-    struct cpulockstat *s = mylockstat(lk);
-    u64 ts = rdtsc();
-    s->locking += ts - s->locking_ts;
-    s->locked += ts - s->locked_ts;
-  }
+  if (lockstat_enable && lk->stat)
+    lockstat_cpu_releasing(lk->stat);
 #endif
 }
 
@@ -126,125 +116,234 @@ spinlock::holding()
 #if LOCKSTAT
 
 ilist<klockstat,&klockstat::link> lockstat_list;
-//LIST_HEAD(lockstat_list, klockstat);
-//static struct lockstat_list lockstat_list = { (struct klockstat*) nullptr };
 static struct spinlock lockstat_lock("lockstat");
 
-klockstat::klockstat(const char *name) :
-  rcu_freed("klockstat", this, sizeof(*this))
+// Set while this CPU is allocating a class, so the allocator's own
+// locks don't recurse into lockstat_lookup.  They find their classes
+// on a later acquire.
+DEFINE_PERCPU(bool, lockstat_allocating);
+
+klockstat::klockstat(const char *name)
 {
   magic = LOCKSTAT_MAGIC;
-  memset(&s, 0, sizeof(s));
-  safestrcpy(s.name, name, sizeof(s.name));
-};
+  memset(cpu, 0, sizeof(cpu));
+  safestrcpy(this->name, name, sizeof(this->name));
+}
 
-void
-lockstat_init(struct spinlock *lk, bool lazy)
+// Caller must hold lockstat_lock.
+static struct klockstat *
+lockstat_find(const char *name)
+{
+  for (auto &ls : lockstat_list)
+    if (strncmp(ls.name, name, sizeof(ls.name) - 1) == 0)
+      return &ls;
+  return nullptr;
+}
+
+struct klockstat *
+lockstat_lookup(const char *name)
 {
-  klockstat *ls = new klockstat(lk->name);
+  if (!name)
+    name = "<unnamed>";
+
+  {
+    auto l = lockstat_lock.guard();
+    if (auto ls = lockstat_find(name))
+      return ls;
+  }
+
+  scoped_cli cli;
+  if (*lockstat_allocating)
+    return nullptr;
+  *lockstat_allocating = true;
+  klockstat *ls;
+  try {
+    ls = new klockstat(name);
+  } catch (std::bad_alloc &e) {
+    ls = nullptr;
+  }
+  *lockstat_allocating = false;
   if (!ls)
-    return;
+    return nullptr;
+
+  auto l = lockstat_lock.guard();
+  if (auto old = lockstat_find(name)) {
+    l.release();
+    delete ls;
+    return old;
+  }
+  lockstat_list.push_front(ls);
+  return ls;
+}
+
+static inline int
+lockstat_bucket(u64 cycles)
+{
+  if (cycles < 2)
+    return 0;
+  return std::min(63 - __builtin_clzll(cycles), LOCKSTAT_BUCKETS - 1);
+}
 
-  if (lazy) {
-    if (!__sync_bool_compare_and_swap(&lk->stat, &klockstat_lazy, ls)) {
-      delete ls;
+// Charge wait to the call site pcs.  If this CPU isn't tracking pcs
+// yet, it replaces the site with the least wait.
+static void
+lockstat_record_site(struct cpulockstat *s, const uptr *pcs, u64 wait)
+{
+  struct lockstat_site *victim = &s->sites[0];
+  for (auto &site : s->sites) {
+    if (memcmp(site.pcs, pcs, sizeof(site.pcs)) == 0) {
+      site.contends++;
+      site.wait += wait;
       return;
     }
-  } else {
-    lk->stat = ls;
+    if (site.wait < victim->wait)
+      victim = &site;
+  }
+  memmove(victim->pcs, pcs, sizeof(victim->pcs));
+  victim->contends = 1;
+  victim->wait = wait;
+}
+
+u64
+lockstat_wait(struct klockstat *ls, u64 start, bool contended, void *frame)
+{
+  u64 ts = rdtsc();
+  u64 wait = ts - start;
+  uptr pcs[LOCKSTAT_DEPTH];
+  if (contended)
+    getcallerpcs(frame ?: __builtin_frame_address(0), pcs, NELEM(pcs));
+
+  scoped_cli cli;
+  struct cpulockstat *s = &ls->cpu[myid()];
+  s->acquires++;
+  s->locking += wait;
+  s->wait_hist[lockstat_bucket(wait)]++;
+  if (contended) {
+    s->contends++;
+    lockstat_record_site(s, pcs, wait);
   }
+  return ts;
+}
+
+void
+lockstat_hold(struct klockstat *ls, u64 cycles)
+{
+  scoped_cli cli;
+  struct cpulockstat *s = &ls->cpu[myid()];
+  s->locked += cycles;
+  s->hold_hist[lockstat_bucket(cycles)]++;
+}
+
+void
+lockstat_cpu_locked(struct klockstat *ls, u64 ts)
+{
+  struct cpulockstat *s = &ls->cpu[myid()];
+  if (s->nheld++ == 0)
+    s->locked_ts = ts;
+}
 
-  acquire(&lockstat_lock);
-  lockstat_list.push_front(lk->stat);
-  //LIST_INSERT_HEAD(&lockstat_list, lk->stat, link);
-  release(&lockstat_lock);
+void
+lockstat_cpu_releasing(struct klockstat *ls)
+{
+  struct cpulockstat *s = &ls->cpu[myid()];
+  // Holds that began while lockstat was stopped aren't counted
+  if (s->nheld && --s->nheld == 0)
+    lockstat_hold(ls, rdtsc() - s->locked_ts);
 }
 
 static void
-lockstat_stop(struct spinlock *lk)
+lockstat_start(void)
 {
-  if (lk->stat != nullptr) {
-    lk->stat->magic = 0;
-    lk->stat = nullptr;
+  // Forget holds that were in progress when lockstat last stopped;
+  // their releases were never seen.
+  {
+    auto l = lockstat_lock.guard();
+    for (auto &ls : lockstat_list)
+      for (auto &c : ls.cpu)
+        c.nheld = 0;
   }
+  lockstat_enable = 1;
 }
 
-void
+static void
 lockstat_clear(void)
 {
-  // struct klockstat *stat, *tmp;
-
-  acquire(&lockstat_lock);
-  
-  //LIST_FOREACH_SAFE(stat, &lockstat_list, link, tmp) {
-  for (auto it = lockstat_list.begin(); it != lockstat_list.end(); it++) {
-    klockstat *stat = &(*it);
-    if (stat->magic == 0) {
-      lockstat_list.erase(it);
-      // LIST_REMOVE(stat, link);
-      // So verifyfree doesn't follow le_next
-      // stat->link.le_next = 0;
-      gc_delayed(stat);
-    } else {
-      memset(&stat->s.cpu, 0, sizeof(stat->s.cpu));
+  auto l = lockstat_lock.guard();
+  for (auto &ls : lockstat_list)
+    for (auto &c : ls.cpu)
+      memset(&c, 0, __offsetof(struct cpulockstat, locked_ts));
+}
+
+// Add site to the top sites, if it waited longer than one of them.
+static void
+lockstat_merge_site(struct lockstat_site *top, const struct lockstat_site &site)
+{
+  struct lockstat_site *victim = &top[0];
+  for (int i = 0; i < LOCKSTAT_SITES; ++i) {
+    if (top[i].contends && memcmp(top[i].pcs, site.pcs, sizeof(site.pcs)) == 0) {
+      top[i].contends += site.contends;
+      top[i].wait += site.wait;
+      return;
+    }
+    if (!top[i].contends || (victim->contends && top[i].wait < victim->wait))
+      victim = &top[i];
+  }
+  if (!victim->contends || site.wait > victim->wait)
+    *victim = site;
+}
+
+// Sum the per-CPU statistics of ls into out.
+static void
+lockstat_sum(const struct klockstat *ls, struct lockstat *out)
+{
+  memset(out, 0, sizeof(*out));
+  memmove(out->name, ls->name, sizeof(out->name));
+  for (int i = 0; i < ncpu; ++i) {
+    const struct cpulockstat *c = &ls->cpu[i];
+    out->acquires += c->acquires;
+    out->contends += c->contends;
+    out->locking += c->locking;
+    out->locked += c->locked;
+    for (int b = 0; b < LOCKSTAT_BUCKETS; ++b) {
+      out->wait_hist[b] += c->wait_hist[b];
+      out->hold_hist[b] += c->hold_hist[b];
     }
+    for (auto &site : c->sites)
+      if (site.contends)
+        lockstat_merge_site(out->sites, site);
   }
-  release(&lockstat_lock);
+  std::sort(out->sites, out->sites + LOCKSTAT_SITES,
+            [](const lockstat_site &a, const lockstat_site &b) {
+              return a.wait > b.wait;
+            });
 }
 
 static int
 lockstat_read(mdev*, char *dst, u32 off, u32 n)
 {
   static const u64 sz = sizeof(struct lockstat);
-  static struct {
-    struct klockstat *stat;
-    u32 off;
-  } cache;
-
-  u32 cur;
-  iiterator<klockstat,&klockstat::link> it;
-  struct klockstat *stat;
+  struct lockstat out;
 
   if (off % sz || n < sz)
     return -1;
 
-  acquire(&lockstat_lock);
-  if (cache.off == off && cache.stat != nullptr) {
-    cur = cache.off;
-    stat = cache.stat;
-    it = lockstat_list.iterator_to(stat);
-  } else {
-    cur = 0;
-    it = lockstat_list.begin();
-    // stat = LIST_FIRST(&lockstat_list);
-    // stat = lockstat_list.front();
-    
-  }
-  stat = &(*it);
-//  for (; stat != nullptr; stat = LIST_NEXT(stat, link)) {
-  for (; it != lockstat_list.end(); it++) {
-    stat = &(*it);
-    struct lockstat *ls = &stat->s;
-    if (n < sizeof(*ls))
+  u32 skip = off / sz;
+  int ret = 0;
+  auto l = lockstat_lock.guard();
+  for (auto &ls : lockstat_list) {
+    if (n < sz)
       break;
-    if (cur >= off) {
-      memmove(dst, ls, sz);
-      dst += sz;
-      n -= sz;
+    if (skip) {
+      --skip;
+      continue;
     }
-    cur += sz;
-  }
-  release(&lockstat_lock);
-
-  if (cur < off) {
-    cache.off = 0;
-    cache.stat = (struct klockstat*) nullptr;
-    return 0;
+    lockstat_sum(&ls, &out);
+    memmove(dst, &out, sz);
+    dst += sz;
+    n -= sz;
+    ret += sz;
   }
-
-  cache.off = cur;
-  cache.stat = stat;
-  return cur - off;
+  return ret;
 }
 
 static int
@@ -254,7 +353,7 @@ lockstat_write(mdev*, const char *buf, u32 n)
 
   switch(cmd) {
   case LOCKSTAT_START:
-    lockstat_enable = 1;
+    lockstat_start();
     break;
   case LOCKSTAT_STOP:
     lockstat_enable = 0;
@@ -288,8 +387,15 @@ spinlock::spinlock(spinlock &&o)
   : locked(o.locked.load())
 #endif
 
-#if SPINLOCK_DEBUG
+#if LOCKSTAT
+    , want_stat(o.want_stat)
+#endif
+
+#if SPINLOCK_DEBUG || LOCKSTAT
     , name(o.name)
+#endif
+
+#if SPINLOCK_DEBUG
     , cpu(o.cpu)
 #endif
 
@@ -301,44 +407,31 @@ spinlock::spinlock(spinlock &&o)
 #if SPINLOCK_DEBUG
   memcpy(&pcs, &o.pcs, sizeof(pcs));
 #endif
-#if LOCKSTAT
-  lockstat_stop(&o);
-#endif
 }
 
 spinlock &
 spinlock::operator=(spinlock &&o)
 {
-#if LOCKSTAT
-  lockstat_stop(this);
-#endif
-
 #if USE_CODEX_IMPL
   locked = o.locked;
 #else
   locked = o.locked.load();
 #endif
 
-#if SPINLOCK_DEBUG
+#if SPINLOCK_DEBUG || LOCKSTAT
   name = o.name;
+#endif
+#if SPINLOCK_DEBUG
   cpu = o.cpu;
   memcpy(&pcs, &o.pcs, sizeof(pcs));
 #endif
 #if LOCKSTAT
+  want_stat = o.want_stat;
   stat = o.stat;
-  o.stat = nullptr;
 #endif
   return *this;
 }
 
-#if LOCKSTAT
-// Conflicts with constexpr
-// spinlock::~spinlock()
-// {
-//   lockstat_stop(this);
-// }
-#endif
-
 #if USE_CODEX_IMPL
 // note: the codex implemention doesn't actually enforce mutual exclusion, but
 // that's by design
@@ -373,12 +466,12 @@ bool
 spinlock::try_acquire()
 {
   pushcli();
-  locking(this);
+  u64 start = locking(this);
   if (locked.exchange(1, std::memory_order_acquire) != 0) {
       popcli();
       return false;
   }
-  ::locked(this, 0);
+  ::locked(this, 0, start, __builtin_frame_address(0));
   return true;
 }
 
@@ -392,14 +485,14 @@ spinlock::acquire()
   u64 retries;
 
   pushcli();
-  locking(this);
+  u64 start = locking(this);
 
   retries = 0;
   while (locked.exchange(1, std::memory_order_acquire) != 0) {
     retries++;
     nop_pause();
   }
-  ::locked(this, retries);
+  ::locked(this, retries, start, __builtin_frame_address(0));
 }
 
 // Release the lock.
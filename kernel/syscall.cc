@@ -8,6 +8,13 @@
 #include "cpu.hh"
 #include "kmtrace.hh"
 #include "errno.h"
+#include "percpu.hh"
+#include "sleeplock.hh"
+#include "fs.h"
+#include "file.hh"
+#include "major.h"
+#include "uk/syscallstat.h"
+#include "reclaim.hh"
 
 extern "C" int __uaccess_mem(void* dst, const void* src, u64 size);
 extern "C" int __uaccess_str(char* dst, const char* src, u64 size);
@@ -101,6 +108,139 @@ extern u64 (*syscalls[])(u64, u64, u64, u64, u64, u64);
 extern const char* syscall_names[];
 extern const int nsyscalls;
 
+/*
+ * Per-syscall statistics.  Each CPU counts the calls it completes in
+ * its own table, indexed by system call number, so the syscall path
+ * writes only CPU-local memory.  /dev/syscallstat sums the tables
+ * when it is read.  The tables are allocated when statistics are
+ * first started and never freed.
+ */
+
+struct syscallstat_cpu {
+  u64 count;
+  u64 cycles;
+  u64 hist[SYSCALLSTAT_BUCKETS];
+};
+
+// Nonzero while statistics are being gathered.  Both of these are
+// written only by /dev/syscallstat, so syscalls can read them without
+// sharing a dirty cache line.
+static int syscallstat_enable;
+static int syscallstat_pid;
+static sleeplock syscallstat_lock("syscallstat");
+DEFINE_PERCPU(struct syscallstat_cpu*, syscallstat_table, NO_CRITICAL);
+
+// Return the time a system call started, or 0 if it isn't being
+// counted.
+static inline u64
+syscallstat_start(void)
+{
+  if (!syscallstat_enable)
+    return 0;
+  if (syscallstat_pid && myproc()->pid != syscallstat_pid)
+    return 0;
+  return rdtsc();
+}
+
+static void
+syscallstat_record(u64 num, u64 start)
+{
+  u64 cycles = rdtsc() - start;
+  int b = cycles ? 63 - __builtin_clzl(cycles) : 0;
+  if (b >= SYSCALLSTAT_BUCKETS)
+    b = SYSCALLSTAT_BUCKETS - 1;
+  // We may have migrated since start, but every CPU's table is
+  // allocated before syscallstat_enable is set.  Keep interrupts off
+  // so we neither migrate nor get preempted mid-update.
+  scoped_cli cli;
+  syscallstat_cpu *st = &(*syscallstat_table)[num];
+  st->count++;
+  st->cycles += cycles;
+  st->hist[b]++;
+}
+
+static int
+syscallstat_read(mdev*, char *dst, u32 off, u32 n)
+{
+  static const u64 sz = sizeof(struct syscallstat);
+  struct syscallstat out;
+
+  if (off % sz || n < sz)
+    return -1;
+
+  int ret = 0;
+  for (u64 num = off / sz; num < nsyscalls && n >= sz; ++num) {
+    memset(&out, 0, sizeof(out));
+    out.num = num;
+    if (const char *name = syscall_names[num]) {
+      if (strncmp(name, "sys_", 4) == 0)
+        name += 4;
+      strncpy(out.name, name, sizeof(out.name) - 1);
+    }
+    for (int i = 0; i < ncpu; i++) {
+      syscallstat_cpu *table = syscallstat_table[i];
+      if (!table)
+        continue;
+      out.count += table[num].count;
+      out.cycles += table[num].cycles;
+      for (int b = 0; b < SYSCALLSTAT_BUCKETS; b++)
+        out.hist[b] += table[num].hist[b];
+    }
+    memmove(dst, &out, sz);
+    dst += sz;
+    n -= sz;
+    ret += sz;
+  }
+  return ret;
+}
+
+static int
+syscallstat_write(mdev*, const char *buf, u32 n)
+{
+  auto l = syscallstat_lock.guard();
+
+  switch (buf[0]) {
+  case SYSCALLSTAT_START:
+    for (int i = 0; i < ncpu; i++) {
+      if (syscallstat_table[i])
+        continue;
+      size_t sz = nsyscalls * sizeof(syscallstat_cpu);
+      syscallstat_cpu *table = (syscallstat_cpu*)kmalloc(sz, "syscallstat");
+      if (!table)
+        return -1;
+      memset(table, 0, sz);
+      syscallstat_table[i] = table;
+    }
+    syscallstat_enable = 1;
+    break;
+  case SYSCALLSTAT_STOP:
+    syscallstat_enable = 0;
+    break;
+  case SYSCALLSTAT_CLEAR:
+    for (int i = 0; i < ncpu; i++)
+      if (syscallstat_table[i])
+        memset(syscallstat_table[i], 0, nsyscalls * sizeof(syscallstat_cpu));
+    break;
+  case SYSCALLSTAT_PID: {
+    int pid = 0;
+    for (u32 i = 1; i < n && buf[i] >= '0' && buf[i] <= '9'; i++)
+      pid = pid * 10 + buf[i] - '0';
+    syscallstat_pid = pid;
+    break;
+  }
+  default:
+    return -1;
+  }
+  return n;
+}
+
+void
+initsyscallstat(void)
+{
+  devsw[MAJ_SYSCALLSTAT].write = syscallstat_write;
+  devsw[MAJ_SYSCALLSTAT].pread = syscallstat_read;
+}
+
 u64
 syscall(u64 a0, u64 a1, u64 a2, u64 a3, u64 a4, u64 a5, u64 num)
 {
@@ -110,12 +250,15 @@ syscall(u64 a0, u64 a1, u64 a2, u64 a3, u64 a4, u64 a5, u64 num)
 #endif
       if(num < nsyscalls && syscalls[num]) {
         u64 r;
+        u64 start = syscallstat_start();
         mtstart(syscalls[num], myproc());
         mtrec();
         {
           mt_ascope ascope("syscall:%ld", num);
           r = syscalls[num](a0, a1, a2, a3, a4, a5);
         }
+        if (start)
+          syscallstat_record(num, start);
         mtstop(myproc());
         mtign();
         return r;
@@ -127,7 +270,7 @@ syscall(u64 a0, u64 a1, u64 a2, u64 a3, u64 a4, u64 a5, u64 num)
 #if EXCEPTIONS
     } catch (std::bad_alloc& e) {
       cprintf("%d: syscall retry\n", myproc()->pid);
-      gc_wakeup();
+      reclaim_direct();
       yield();
     } catch (kill_exception &e) {
       return -1;
@@ -17,6 +17,7 @@
 #include <vector>
 #include "kstream.hh"
 #include <uk/spawn.h>
+#include "numa.hh"
 #include "filetable.hh"
 
 sref<file>
@@ -675,13 +676,40 @@ sys_readdir(int dirfd, const userptr<char> prevptr, userptr<char> nameptr)
   return 1;
 }
 
-//SYSCALL {"uargs":["const char *upath", "char * const uargv[]", "const void *actions", "size_t actions_len"]}
+//SYSCALL {"uargs":["const char *upath", "char * const uargv[]", "const void *actions", "size_t actions_len", "const struct __posix_spawnattr *attr"]}
 int
 sys_sys_spawn(userptr_str upath, userptr<userptr_str> uargv,
-              const userptr<void> uactions, size_t actions_len)
+              const userptr<void> uactions, size_t actions_len,
+              const userptr<__posix_spawnattr> uattr)
 {
   sref<filetable> newftable;
 
+  // Choose where the child will run.  Unless the caller asked for a
+  // node, the child's memory is all about to be built from scratch,
+  // so any node will do.
+  int cpu = -1, node = -1;
+  if (uattr) {
+    __posix_spawnattr attr;
+    if (!uattr.load(&attr))
+      return -1;
+    if (attr.flags & POSIX_SPAWN_SETCPU_NP) {
+      if (attr.cpu < 0 || attr.cpu >= ncpu)
+        return -1;
+      cpu = attr.cpu;
+    }
+    if (attr.flags & POSIX_SPAWN_SETNODE_NP) {
+      if (attr.node < 0 || attr.node >= numa_nodes.size())
+        return -1;
+      node = attr.node;
+    }
+  }
+  if (cpu < 0) {
+    if (myproc()->cpu_pin && node < 0)
+      cpu = myid();
+    else
+      cpu = sched_place(node, node < 0);
+  }
+
   // Build a new file table by executing actions
   if (uactions && actions_len) {
     // Copy actions buffer
@@ -748,12 +776,13 @@ sys_sys_spawn(userptr_str upath, userptr<userptr_str> uargv,
   }
 
   // Create the new process
-  proc *p = doclone(CLONE_NO_VMAP | CLONE_NO_FTABLE | CLONE_NO_RUN);
+  proc *p = doclone(CLONE_NO_VMAP | CLONE_NO_FTABLE | CLONE_NO_RUN, cpu);
   if (!p)
     return -1;
 
-  // Load the new image
+  // Load the new image, allocating its memory near where it will run
   {
+    scoped_kalloc_cpu kc(myproc(), cpu);
     std::unique_ptr<char[]> path;
     if (!(path = upath.load_alloc(DIRSIZ+1)))
       return -1;
@@ -766,6 +795,7 @@ sys_sys_spawn(userptr_str upath, userptr<userptr_str> uargv,
     argv.push_back(nullptr);
     if (load_image(p, path.get(), argv.data(), nullptr) < 0)
       return -1;
+    p->run_cpuid_ = p->data_cpuid = cpu;
   }
 
   // Install ftable
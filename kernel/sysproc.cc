@@ -125,7 +125,7 @@ sys_mmap(userptr<void> addr, size_t len, int prot, int flags, int fd,
       m = anon_fs->alloc(mnode::types::file).mn();
       auto resizer = m->as_file()->write_size();
       for (size_t i = 0; i < len; i += PGSIZE) {
-        void* p = zalloc("MAP_ANON|MAP_SHARED");
+        void* p = zalloc("MAP_ANON|MAP_SHARED", false);
         if (!p)
           throw_bad_alloc();
         auto pi = sref<page_info>::transfer(new (page_info::of(p)) page_info());
@@ -140,6 +140,9 @@ sys_mmap(userptr<void> addr, size_t len, int prot, int flags, int fd,
     m = f->get_mnode();
     if (!m || m->type() != mnode::types::file)
       return MAP_FAILED;
+    // We can't track writes through the mapping
+    if ((flags & MAP_SHARED) && (prot & PROT_WRITE))
+      m->as_file()->disable_image();
   }
 
   uptr start = PGROUNDDOWN((uptr)addr);
@@ -161,6 +164,8 @@ sys_mmap(userptr<void> addr, size_t len, int prot, int flags, int fd,
   if (m && (flags & MAP_PRIVATE))
     desc.flags |= vmdesc::FLAG_COW;
   uptr r = myproc()->vmap->insert(desc, start, end - start);
+  if (r != (uptr)-1 && (flags & MAP_POPULATE))
+    myproc()->vmap->willneed(r, end - start);
   return (void*)r;
 }
 
@@ -189,6 +194,16 @@ sys_madvise(userptr<void> addr, size_t len, int advice)
       return -1;
     return 0;
 
+  case MADV_DONTNEED:
+    if (myproc()->vmap->dontneed(align_addr, align_len) < 0)
+      return -1;
+    return 0;
+
+  case MADV_FREE:
+    if (myproc()->vmap->lazyfree(align_addr, align_len) < 0)
+      return -1;
+    return 0;
+
   case MADV_INVALIDATE_CACHE:
     if (myproc()->vmap->invalidate_cache(align_addr, align_len) < 0)
       return -1;
@@ -244,6 +259,20 @@ sys_cpuhz(void)
   return cpuhz;
 }
 
+//SYSCALL
+long
+sys_sysconf(int name)
+{
+  switch (name) {
+  case _SC_PAGESIZE:
+    return PGSIZE;
+  case _SC_NPROCESSORS_CONF:
+  case _SC_NPROCESSORS_ONLN:
+    return ncpu;
+  }
+  return -1;
+}
+
 //SYSCALL
 int
 sys_setfs(u64 base)
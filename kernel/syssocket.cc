@@ -163,14 +163,25 @@ sys_sendto(int sockfd, const userptr<void> buf, size_t len, int flags,
 int
 sys_connect(int sockfd, const userptr<struct sockaddr> addr, u32 addrlen)
 {
-  return -1;
+  sref<file> f = getfile(sockfd);
+  if (!f)
+    return -1;
+
+  struct sockaddr_storage ss;
+  if (!addr)
+    return -1;
+  int r = sockaddr_from_user(&ss, addr, addrlen);
+  if (r < 0)
+    return r;
+
+  return f->connect((struct sockaddr*)&ss, addrlen);
 }
 
 //SYSCALL
 ssize_t
 sys_send(int sockfd, const userptr<void> buf, size_t len, int flags)
 {
-  return -1;
+  return sys_sendto(sockfd, buf, len, flags, nullptr, 0);
 }
 
 //SYSCALL
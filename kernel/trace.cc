@@ -0,0 +1,149 @@
+// Kernel event tracing.  See tracepoint.hh.
+
+#include "types.h"
+#include "kernel.hh"
+#include "amd64.h"
+#include "cpu.hh"
+#include "proc.hh"
+#include "fs.h"
+#include "file.hh"
+#include "major.h"
+#include "percpu.hh"
+#include "sleeplock.hh"
+#include "tracepoint.hh"
+#include "percpu_ring.hh"
+
+#include <algorithm>
+#include <atomic>
+
+#if KTRACE
+
+// Records per CPU ring (256KB at 32 bytes per record)
+#define TRACE_RING 8192
+
+// Written by this CPU with interrupts disabled; drained by the
+// (serialized) /dev/trace reader.
+struct tracelog : public percpu_ring<trace_rec, TRACE_RING> {
+} __mpalign__;
+
+DEFINE_PERCPU(struct tracelog, tracelog, NO_CRITICAL);
+
+u32 trace_mask __mpalign__;
+
+// Serializes ring allocation and readers.
+static sleeplock trace_lock("trace");
+
+void
+trace_emit(enum trace_event ev, u64 arg0, u64 arg1)
+{
+  // A tracepoint in an interrupt handler must not interleave with
+  // one in the code it interrupted.
+  scoped_cli cli;
+  struct tracelog *tl = &*tracelog;
+  if (!tl->buf)
+    return;
+
+  struct proc *p = myproc();
+  struct trace_rec r;
+  r.tsc = rdtsc();
+  r.event = ev;
+  r.cpu = myid();
+  r.pid = p ? p->pid : 0;
+  r.arg[0] = arg0;
+  r.arg[1] = arg1;
+  if (!tl->push(r))
+    tl->lost.fetch_add(1, std::memory_order_relaxed);
+}
+
+// Allocate every CPU's ring, if they aren't already.  Caller must
+// hold trace_lock.
+static bool
+trace_init(void)
+{
+  const size_t ringsz = TRACE_RING * sizeof(trace_rec);
+  for (int i = 0; i < ncpu; ++i) {
+    auto tl = &tracelog[i];
+    if (tl->buf)
+      continue;
+    auto ring = (trace_rec*)kmalloc(ringsz, "tracering");
+    if (!ring)
+      return false;
+    tl->buf = ring;
+  }
+  return true;
+}
+
+// Copy as many whole records out of the rings as fit in dst.  This
+// never blocks; a return of 0 means the reader has caught up.
+static int
+traceread(mdev*, char *dst, u32 n)
+{
+  static int next;
+  auto l = trace_lock.guard();
+  return tracelog::drain(
+    &next, dst, n,
+    [](int cpu) -> struct tracelog* { return &tracelog[cpu]; },
+    [](int cpu, u64 lost) {
+      struct trace_rec r{};
+      r.tsc = rdtsc();
+      r.event = TRACE_EV_lost;
+      r.cpu = cpu;
+      r.arg[0] = lost;
+      return r;
+    });
+}
+
+static int
+tracewrite(mdev*, const char *buf, u32 n)
+{
+  if (n == 0)
+    return -1;
+
+  auto l = trace_lock.guard();
+  switch (buf[0]) {
+  case TRACE_CMD_START: {
+    u32 mask = 0;
+    u32 i;
+    for (i = 1; i < n; i++) {
+      char c = buf[i];
+      if (c >= '0' && c <= '9')
+        mask = (mask << 4) | (c - '0');
+      else if (c >= 'a' && c <= 'f')
+        mask = (mask << 4) | (c - 'a' + 10);
+      else
+        break;
+    }
+    if (i == 1)
+      mask = TRACE_ALL;
+    if (!trace_init())
+      return -1;
+    // Give the converter the clock rate before anything else
+    extern u64 cpuhz;
+    trace_emit(TRACE_EV_clock, cpuhz, 0);
+    trace_mask = mask & TRACE_ALL;
+    break;
+  }
+  case TRACE_CMD_STOP:
+    trace_mask = 0;
+    break;
+  default:
+    return -1;
+  }
+  return n;
+}
+
+void
+inittrace(void)
+{
+  devsw[MAJ_TRACE].read = traceread;
+  devsw[MAJ_TRACE].write = tracewrite;
+}
+
+#else
+
+void
+inittrace(void)
+{
+}
+
+#endif
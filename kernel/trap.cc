@@ -194,6 +194,7 @@ trap(struct trapframe *tf)
     if (mycpu()->id == 0)
       timerintr();
     refcache::mycache->tick();
+    mmu::shootdown::drain_async();
     lapiceoi();
     if (mycpu()->no_sched_count) {
       kstats::inc(&kstats::sched_blocked_tick_count);
@@ -250,6 +251,11 @@ trap(struct trapframe *tf)
     on_ipicall();
     break;
   }
+  case T_WAKEUP:
+    // Nothing to do; this just gets the CPU out of hlt so its idle
+    // loop looks at its run queue.
+    lapiceoi();
+    break;
   case T_DEVICE: {
     // Clear "task switched" flag to enable floating-point
     // instructions.  sched will set this again when it switches
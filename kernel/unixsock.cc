@@ -7,11 +7,27 @@
 #include "atomic_util.hh"
 #include "proc.hh"
 #include "file.hh"
+#include "condvar.hh"
+#include "sleeplock.hh"
+#include "gc.hh"
 #include <uk/socket.h>
 #include <uk/un.h>
 
 #define QUEUELEN 10   // Number of message per queue of a local socket
 #define LB 0          // Run with load balancer?
+#define DGRAM_RETRY_NS 10000000  // Recheck other cores' queues this often
+
+#define STREAM_SEGS 16             // Page segments per stream direction
+#define STREAM_MERGE (PGSIZE / 2)  // Shorter writes share a page
+#define STREAM_BACKLOG 128         // Maximum listen() backlog
+
+// What a bound socket's mnode refers to (see msock).
+struct localsock {
+  const int type_;
+
+  localsock(int type) : type_(type) {}
+  virtual ~localsock() {}
+};
 
 struct msghdr {
   u32 len;
@@ -30,9 +46,16 @@ struct coresocket : public balance_pool<coresocket> {
   int len;
   struct spinlock lock;
   msghdr::list_t messages;
+  // Readers and writers sleep here when the queue is empty or full.
+  // The counts (protected by lock) let the other side skip the wakeup
+  // in the common case that no one is waiting.
+  struct condvar nonempty, nonfull;
+  int nrwait, nwwait;
 
   coresocket() : balance_pool(QUEUELEN), len(0),
-                 lock("coresocket", LOCKSTAT_LOCALSOCK) {}
+                 lock("coresocket", LOCKSTAT_LOCALSOCK),
+                 nonempty("coresocket:nonempty"), nonfull("coresocket:nonfull"),
+                 nrwait(0), nwwait(0) {}
   ~coresocket() {}
   NEW_DELETE_OPS(coresocket);
 
@@ -64,6 +87,10 @@ struct coresocket : public balance_pool<coresocket> {
 
     if (n > 0) {
       kstats::inc(&kstats::socket_load_balance);
+      if (target->nrwait)
+        target->nonempty.wake_all();
+      if (nwwait)
+        nonfull.wake_all();
     }
 
     lock.release();
@@ -71,20 +98,25 @@ struct coresocket : public balance_pool<coresocket> {
   }
 };
 
-struct localsock {
+// Datagram sockets.  SOCK_DGRAM_UNORDERED keeps a message queue per
+// core, so senders and receivers on the same core don't share
+// anything with other cores.  SOCK_DGRAM uses a single queue.
+struct dgramsock : public localsock {
   bool ordered_;
   atomic<coresocket*> pipes[NCPU];
-  balancer<localsock, coresocket> b;
+  balancer<dgramsock, coresocket> b;
   atomic<int> nreader;
 
-  localsock(bool ordered) : ordered_(ordered), b(this), nreader(0) {
+  dgramsock(bool ordered)
+    : localsock(ordered ? SOCK_DGRAM : SOCK_DGRAM_UNORDERED),
+      ordered_(ordered), b(this), nreader(0) {
     for (int i = 0; i < NCPU; i++)
       pipes[i] = 0;
     if (ordered)
       pipes[0] = new coresocket;
   }
 
-  ~localsock() {
+  ~dgramsock() {
     for (int i = 0; i < NCPU; i++) {
       coresocket* c = pipes[i].load();
       if (c)
@@ -92,7 +124,7 @@ struct localsock {
     }
   }
 
-  NEW_DELETE_OPS(localsock);
+  NEW_DELETE_OPS(dgramsock);
 
   coresocket* reader() {
     for (int i = 0; i < NCPU; i++) {
@@ -133,6 +165,38 @@ struct localsock {
 #endif
   }
 
+  // Take a message from another core's queue, so a reader isn't stuck
+  // waiting on its own queue while writers on other cores fill
+  // theirs.
+  msghdr* steal() {
+    int id = myid();
+    for (int i = 1; i < NCPU; i++) {
+      coresocket *cp = pipes[(id + i) % NCPU];
+      if (!cp || cp->len <= 0)
+        continue;
+      scoped_acquire l(&cp->lock);
+      if (cp->len > 0) {
+        msghdr &m = cp->messages.front();
+        cp->messages.pop_front();
+        cp->len--;
+        if (cp->nwwait)
+          cp->nonfull.wake_all();
+        return &m;
+      }
+    }
+    return nullptr;
+  }
+
+  // Wait on cv.  Each core's queue has its own wait queues and
+  // writers only wake their own core's, so an unordered socket must
+  // periodically look at the other queues itself.
+  void wait(condvar *cv, spinlock *lk) {
+    if (ordered_)
+      cv->sleep(lk);
+    else
+      cv->sleep_to(lk, nsectime() + DGRAM_RETRY_NS);
+  }
+
   int write(msghdr *m) {
     bool toyield = true;
     for (;;) {
@@ -169,8 +233,16 @@ struct localsock {
         // cprintf("w %d(%d): coresocket %p\n", myproc()->pid, myproc()->cpuid, cp);
         cp->messages.push_back(m);
         cp->len++;
+        if (cp->nrwait)
+          cp->nonempty.wake_all();
         return 0;
       }
+
+      // Still full.  Sleep until a reader makes room.
+      cp->nwwait++;
+      wait(&cp->nonfull, &cp->lock);
+      cp->nwwait--;
+      toyield = true;
     }
   }
 
@@ -191,10 +263,14 @@ struct localsock {
         continue;
       }
 
-      if (cp->len <= 0)
+      if (cp->len <= 0) {
         balance();
-      else
+        if (cp->len <= 0 && !ordered_)
+          if (msghdr *m = steal())
+            return m;
+      } else {
         kstats::inc(&kstats::socket_local_read);
+      }
 
       scoped_acquire l(&cp->lock);
       if (cp->len > 0) {
@@ -202,16 +278,25 @@ struct localsock {
         msghdr &m = cp->messages.front();
         cp->messages.pop_front();
         cp->len--;
+        if (cp->nwwait)
+          cp->nonfull.wake_all();
         return &m;
       }
-      toyield = true;   // iterate between yielding and balancing
+
+      // Nothing here or to steal.  Sleep until a writer on this core
+      // (or the balancer) delivers a message, or until it's time to
+      // look at the other cores' queues again.
+      cp->nrwait++;
+      wait(&cp->nonempty, &cp->lock);
+      cp->nrwait--;
+      toyield = true;
     }
   }
 };
 
 struct file_unix_dgram : public refcache::referenced, public file
 {
-  struct localsock *localsock_;
+  struct dgramsock *localsock_;
   char socketpath_[UNIX_PATH_MAX];
 
   ~file_unix_dgram()
@@ -237,7 +322,7 @@ struct file_unix_dgram : public refcache::referenced, public file
   }
 
 public:
-  file_unix_dgram(bool ordered) : localsock_(new localsock(ordered)) {}
+  file_unix_dgram(bool ordered) : localsock_(new dgramsock(ordered)) {}
   NEW_DELETE_OPS(file_unix_dgram);
 
   void inc() override { referenced::inc(); }
@@ -278,6 +363,9 @@ public:
 
     if (ip->type() != mnode::types::sock)
       return -1;
+    localsock *ls = ip->as_sock()->get_sock();
+    if (!ls || ls->type_ == SOCK_STREAM)
+      return -1;
 
     char *b = kalloc("writebuf");
     if (!b)
@@ -296,7 +384,7 @@ public:
     m->uaddr.sun_family = AF_UNIX;
     strncpy(m->uaddr.sun_path, socketpath_, UNIX_PATH_MAX);
 
-    int r = ip->as_sock()->get_sock()->write(m);
+    int r = static_cast<dgramsock*>(ls)->write(m);
     if (r < 0) {
       kfree(b);
       delete m;
@@ -315,6 +403,8 @@ public:
     ssize_t r = -1;
 
     msghdr *m = localsock_->read();
+    if (!m)
+      return -1;
     if (src_addr) {
       *(struct sockaddr_un*)src_addr = m->uaddr;
       *addrlen = sizeof(m->uaddr);
@@ -340,6 +430,404 @@ public:
   }
 };
 
+// One direction of a SOCK_STREAM connection: a ring of page-sized
+// segments.  Short writes are appended to the page at the tail of the
+// ring, so a stream of small messages lives in a page or two.  Longer
+// writes are copied into a fresh page outside of the lock and the
+// page itself is handed to the reader, so the lock is only held to
+// link it in.  Readers and writers each serialize on a sleeplock,
+// which keeps one large write or read from being interleaved with
+// another; the spinlock only protects the segment indexes, so a
+// reader and a writer proceed in parallel.
+struct stream_ring {
+  struct seg {
+    char *page;
+    u32 start, end;             // Unread bytes are page[start, end)
+  };
+
+  struct spinlock lock;
+  struct condvar nonempty, nonfull;
+  int nrwait, nwwait;           // Sleepers on nonempty, nonfull
+  sleeplock rlock, wlock;
+  seg segs[STREAM_SEGS];
+  u64 head, tail;               // Unread segments are [head, tail)
+  bool rclosed, wclosed;
+
+  stream_ring()
+    : lock("stream_ring", LOCKSTAT_LOCALSOCK),
+      nonempty("stream_ring:nonempty"), nonfull("stream_ring:nonfull"),
+      nrwait(0), nwwait(0),
+      rlock("stream_ring:read"), wlock("stream_ring:write"),
+      head(0), tail(0), rclosed(false), wclosed(false) {}
+
+  ~stream_ring() {
+    for (; head != tail; ++head)
+      kfree(segs[head % STREAM_SEGS].page);
+  }
+
+  // Append len bytes to the ring, blocking while it is full.
+  // copy(dst, off, n) copies bytes [off, off+n) of the source to dst
+  // and returns false if the source is bad.  Returns the number of
+  // bytes written, or -1 if none could be.
+  template<class Copy>
+  ssize_t write(size_t len, Copy copy) {
+    auto wl = wlock.guard();
+    char *page = nullptr;
+    auto cleanup = scoped_cleanup([&]() { if (page) kfree(page); });
+    size_t done = 0;
+    while (done < len) {
+      size_t n = std::min(len - done, (size_t)PGSIZE);
+      if (!page && !(page = kalloc("stream_ring")))
+        break;
+      if (!copy(page, done, n))
+        break;
+
+      scoped_acquire l(&lock);
+      for (;;) {
+        if (rclosed || myproc()->killed)
+          goto out;
+        if (n < STREAM_MERGE && head != tail) {
+          seg &s = segs[(tail - 1) % STREAM_SEGS];
+          if (s.end + n <= PGSIZE) {
+            memmove(s.page + s.end, page, n);
+            s.end += n;
+            break;
+          }
+        }
+        if (tail - head < STREAM_SEGS) {
+          segs[tail % STREAM_SEGS] = seg{page, 0, (u32)n};
+          ++tail;
+          page = nullptr;
+          break;
+        }
+        nwwait++;
+        nonfull.sleep(&lock);
+        nwwait--;
+      }
+      if (nrwait)
+        nonempty.wake_all();
+      done += n;
+    }
+  out:
+    if (done == 0 && len != 0)
+      return -1;
+    return done;
+  }
+
+  // Take up to len bytes from the ring, blocking until there is at
+  // least one.  copy(src, off, n) copies n bytes from src to [off,
+  // off+n) of the destination.  Returns 0 at end of stream.
+  template<class Copy>
+  ssize_t read(size_t len, Copy copy) {
+    auto rl = rlock.guard();
+    auto l = lock.guard();
+    while (head == tail) {
+      if (wclosed)
+        return 0;
+      if (myproc()->killed)
+        return -1;
+      nrwait++;
+      nonempty.sleep(&lock);
+      nrwait--;
+    }
+
+    // Only we remove segments and the writer only appends to them, so
+    // the bytes we're copying stay put while we drop the lock.
+    size_t done = 0;
+    while (done < len && head != tail) {
+      seg *s = &segs[head % STREAM_SEGS];
+      const char *src = s->page + s->start;
+      size_t n = std::min(len - done, (size_t)(s->end - s->start));
+      l.release();
+      bool ok = copy(src, done, n);
+      l = lock.guard();
+      if (!ok)
+        break;
+      s->start += n;
+      done += n;
+      if (s->start == s->end) {
+        kfree(s->page);
+        ++head;
+        if (nwwait)
+          nonfull.wake_all();
+      }
+    }
+    if (done == 0 && len != 0)
+      return -1;
+    return done;
+  }
+
+  void close_read() {
+    scoped_acquire l(&lock);
+    rclosed = true;
+    nonfull.wake_all();
+  }
+
+  void close_write() {
+    scoped_acquire l(&lock);
+    wclosed = true;
+    nonempty.wake_all();
+  }
+};
+
+// A connected pair of SOCK_STREAM sockets.  rings[i] carries data to
+// side i.  The side that called connect is side 0.
+struct stream_conn {
+  stream_ring rings[2];
+  std::atomic<int> refs;        // Open sides
+  islink<stream_conn> link;     // On a listener's backlog
+
+  stream_conn() : refs(2) {}
+  NEW_DELETE_OPS(stream_conn);
+
+  void shutdown(int side) {
+    rings[side].close_read();
+    rings[!side].close_write();
+    if (--refs == 0)
+      delete this;
+  }
+};
+
+// A listening SOCK_STREAM socket.  connect queues a new connection on
+// the backlog and accept takes it off.  connect finds the listener
+// through the socket's mnode without a reference, so the listener is
+// freed through gc.
+struct stream_listener : public localsock, public rcu_freed {
+  struct spinlock lock;
+  struct condvar pending;
+  isqueue<stream_conn, &stream_conn::link> backlog;
+  int nbacklog, maxbacklog;
+  bool closed;
+
+  stream_listener(int max)
+    : localsock(SOCK_STREAM),
+      rcu_freed("stream_listener", this, sizeof(*this)),
+      lock("stream_listener", LOCKSTAT_LOCALSOCK),
+      pending("stream_listener:pending"),
+      nbacklog(0), maxbacklog(max), closed(false) {}
+
+  void do_gc() override { delete this; }
+  NEW_DELETE_OPS(stream_listener);
+
+  // Queue c for accept.  Fails if the listener is closed or its
+  // backlog is full.
+  bool connect(stream_conn *c) {
+    scoped_acquire l(&lock);
+    if (closed || nbacklog >= maxbacklog)
+      return false;
+    backlog.push_back(c);
+    nbacklog++;
+    pending.wake_all();
+    return true;
+  }
+
+  stream_conn *accept() {
+    scoped_acquire l(&lock);
+    while (backlog.empty()) {
+      if (closed || myproc()->killed)
+        return nullptr;
+      pending.sleep(&lock);
+    }
+    stream_conn *c = &backlog.front();
+    backlog.pop_front();
+    nbacklog--;
+    return c;
+  }
+
+  // Refuse new connections and drop the ones never accepted.
+  void close() {
+    isqueue<stream_conn, &stream_conn::link> dead;
+    {
+      scoped_acquire l(&lock);
+      closed = true;
+      while (!backlog.empty()) {
+        stream_conn *c = &backlog.front();
+        backlog.pop_front();
+        dead.push_back(c);
+      }
+      nbacklog = 0;
+      pending.wake_all();
+    }
+    while (!dead.empty()) {
+      stream_conn *c = &dead.front();
+      dead.pop_front();
+      c->shutdown(1);
+    }
+  }
+};
+
+struct file_unix_stream : public refcache::referenced, public file
+{
+  struct spinlock lock_;        // Serializes bind/listen/connect
+  sref<mnode> bound_;
+  stream_listener *listener_;
+  std::atomic<stream_conn*> conn_;
+  int side_;
+
+  static void
+  peer_addr(struct sockaddr_storage *addr, size_t *addrlen)
+  {
+    // Connected stream sockets are never bound, so the peer has no
+    // name.
+    auto sun = reinterpret_cast<struct sockaddr_un*>(addr);
+    sun->sun_family = AF_UNIX;
+    sun->sun_path[0] = 0;
+    *addrlen = offsetof(struct sockaddr_un, sun_path);
+  }
+
+public:
+  file_unix_stream(stream_conn *conn = nullptr, int side = 0)
+    : lock_("file_unix_stream", LOCKSTAT_LOCALSOCK),
+      listener_(nullptr), conn_(conn), side_(side) {}
+  NEW_DELETE_OPS(file_unix_stream);
+
+  void inc() override { referenced::inc(); }
+  void dec() override { referenced::dec(); }
+
+  int
+  bind(const struct sockaddr *addr, size_t addrlen) override
+  {
+    auto uaddr = file_unix_dgram::check_sockaddr(addr, addrlen);
+    if (!uaddr)
+      return -1;
+    scoped_acquire l(&lock_);
+    if (bound_ || conn_)
+      return -1;
+    // The socket isn't connectable until listen attaches a listener.
+    bound_ = create(myproc()->cwd_m, uaddr->sun_path, T_SOCKET, 0, 0, true);
+    return bound_ ? 0 : -1;
+  }
+
+  int
+  listen(int backlog) override
+  {
+    scoped_acquire l(&lock_);
+    if (!bound_ || conn_)
+      return -1;
+    if (listener_)
+      return 0;
+    if (backlog <= 0 || backlog > STREAM_BACKLOG)
+      backlog = STREAM_BACKLOG;
+    listener_ = new stream_listener(backlog);
+    bound_->as_sock()->init(listener_);
+    return 0;
+  }
+
+  int
+  connect(const struct sockaddr *addr, size_t addrlen) override
+  {
+    auto uaddr = file_unix_dgram::check_sockaddr(addr, addrlen);
+    if (!uaddr)
+      return -1;
+    sref<mnode> ip = namei(myproc()->cwd_m, uaddr->sun_path);
+    if (!ip || ip->type() != mnode::types::sock)
+      return -1;
+
+    stream_conn *c = new stream_conn();
+    scoped_gc_epoch e;
+    scoped_acquire l(&lock_);
+    localsock *ls = ip->as_sock()->get_sock();
+    if (listener_ || conn_ || !ls || ls->type_ != SOCK_STREAM ||
+        !static_cast<stream_listener*>(ls)->connect(c)) {
+      delete c;
+      return -1;
+    }
+    side_ = 0;
+    conn_ = c;
+    return 0;
+  }
+
+  int
+  accept(struct sockaddr_storage *addr, size_t *addrlen, file **out) override
+  {
+    stream_listener *ls;
+    {
+      scoped_acquire l(&lock_);
+      ls = listener_;
+    }
+    if (!ls)
+      return -1;
+    stream_conn *c = ls->accept();
+    if (!c)
+      return -1;
+    *out = new file_unix_stream(c, 1);
+    peer_addr(addr, addrlen);
+    return 0;
+  }
+
+  ssize_t
+  read(char *addr, size_t n) override
+  {
+    stream_conn *c = conn_;
+    if (!c)
+      return -1;
+    return c->rings[side_].read(n, [=](const char *src, size_t off, size_t len) {
+        memmove(addr + off, src, len);
+        return true;
+      });
+  }
+
+  ssize_t
+  write(const char *addr, size_t n) override
+  {
+    stream_conn *c = conn_;
+    if (!c)
+      return -1;
+    return c->rings[!side_].write(n, [=](char *dst, size_t off, size_t len) {
+        memmove(dst, addr + off, len);
+        return true;
+      });
+  }
+
+  ssize_t
+  sendto(userptr<void> buf, size_t len, int flags,
+         const struct sockaddr *dest_addr, size_t addrlen) override
+  {
+    kstats::timer timer_fill(&kstats::socket_local_sendto_cycles);
+    kstats::inc(&kstats::socket_local_sendto_cnt);
+
+    stream_conn *c = conn_;
+    if (!c)
+      return -1;
+    char *ubuf = (char*)buf.unsafe_get();
+    return c->rings[!side_].write(len, [=](char *dst, size_t off, size_t n) {
+        return userptr<void>(ubuf + off).load_bytes(dst, n);
+      });
+  }
+
+  ssize_t
+  recvfrom(userptr<void> buf, size_t len, int flags,
+           struct sockaddr_storage *src_addr, size_t *addrlen) override
+  {
+    kstats::timer timer_fill(&kstats::socket_local_recvfrom_cycles);
+    kstats::inc(&kstats::socket_local_recvfrom_cnt);
+
+    stream_conn *c = conn_;
+    if (!c)
+      return -1;
+    char *ubuf = (char*)buf.unsafe_get();
+    ssize_t r = c->rings[side_].read(len, [=](const char *src, size_t off, size_t n) {
+        return userptr<void>(ubuf + off).store_bytes(src, n);
+      });
+    if (r >= 0 && src_addr)
+      peer_addr(src_addr, addrlen);
+    return r;
+  }
+
+  void
+  onzero() override
+  {
+    if (listener_) {
+      bound_->as_sock()->clear(listener_);
+      listener_->close();
+      gc_delayed(listener_);
+    }
+    if (stream_conn *c = conn_)
+      c->shutdown(side_);
+    delete this;
+  }
+};
+
 int
 unixsocket(int domain, int type, int protocol, file **out)
 {
@@ -347,6 +835,8 @@ unixsocket(int domain, int type, int protocol, file **out)
     *out = new file_unix_dgram{true};
   else if (type == SOCK_DGRAM_UNORDERED)
     *out = new file_unix_dgram{false};
+  else if (type == SOCK_STREAM)
+    *out = new file_unix_stream();
   else
     return -1;
   return 0;
@@ -14,19 +14,66 @@
 #include "kmtrace.hh"
 #include "kstream.hh"
 #include "page_info.hh"
+#include "numa.hh"
+#include "percpu.hh"
 #include <algorithm>
 #include "kstats.hh"
+#include "tracepoint.hh"
+#include "reclaim.hh"
 
 enum { SDEBUG = false };
 static console_stream sdebug(SDEBUG);
 
 enum { vm_debug = 0 };
 
+/*
+ * Zero pages
+ */
+
+// A shared, read-only zero page per NUMA node.  Read faults on
+// private anonymous memory map these copy-on-write instead of
+// allocating a page, so sparse or read-mostly anonymous memory costs
+// no physical memory.  Each node's zero page is allocated by the
+// first core on that node to need it, so it's in node-local memory.
+// We hold a reference to each zero page forever.
+static std::atomic<page_info*> zero_pages[MAX_NUMA_NODES];
+
+static page_info *
+get_zero_page()
+{
+  auto node = mycpu()->node->id;
+  page_info *zp = zero_pages[node].load(std::memory_order_acquire);
+  if (zp)
+    return zp;
+
+  char *p = zalloc("zero page", false);
+  if (!p)
+    throw_bad_alloc();
+  zp = new(page_info::of(p)) page_info();
+  page_info *expected = nullptr;
+  if (!zero_pages[node].compare_exchange_strong(expected, zp)) {
+    // Another core on this node beat us
+    zp->dec();
+    return expected;
+  }
+  return zp;
+}
+
+static bool
+is_zero_page(page_info *page)
+{
+  for (size_t i = 0; i < numa_nodes.size(); ++i)
+    if (zero_pages[i].load(std::memory_order_relaxed) == page)
+      return true;
+  return false;
+}
+
 /*
  * vmdesc
  */
 
 vmdesc vmdesc::anon_desc(vmdesc::FLAG_MAPPED | vmdesc::FLAG_ANON | vmdesc::FLAG_WRITE);
+lockstat_class vmdesc::lock_class("vmdesc");
 
 void to_stream(class print_stream *s, const vmdesc &vmd)
 {
@@ -37,6 +84,7 @@ void to_stream(class print_stream *s, const vmdesc &vmd)
         {"ANON", vmdesc::FLAG_ANON},
         {"WRITE", vmdesc::FLAG_WRITE},
         {"SHARED", vmdesc::FLAG_SHARED},
+        {"LAZYFREE", vmdesc::FLAG_LAZYFREE},
       }), " ");
   if (vmd.page)
     s->print((void*)vmd.page->pa(), "}");
@@ -104,8 +152,390 @@ public:
     }
     new (&cur->pages[cur->used++]) sref<class page_info>(std::move(page));
   }
+
+  // Move the held pages to a heap object that releases them when it
+  // is deleted.  Returns null if there are no pages.
+  tlb_deferred *detach();
+};
+
+// Pages held until an asynchronous shootdown completes.
+struct deferred_pages : public tlb_deferred
+{
+  page_holder pages;
+  NEW_DELETE_OPS(deferred_pages)
+};
+
+tlb_deferred *
+page_holder::detach()
+{
+  if (first.used == 0)
+    return nullptr;
+  deferred_pages *d = new deferred_pages();
+  page_holder *o = &d->pages;
+  for (size_t i = 0; i < first.used; ++i)
+    o->add(std::move(first.pages[i]));
+  // Hand over the heap batches as they are
+  if (first.next) {
+    o->first.next = first.next;
+    o->cur = cur;
+    o->curmax = curmax;
+    first.next = nullptr;
+    cur = &first;
+    curmax = NLOCAL;
+  }
+  return d;
+}
+
+/*
+ * Page reserve
+ */
+
+// A reserve of zeroed pages for populating many page frames at once.
+// This takes pages from zalloc in batches instead of one at a time
+// and returns any pages it didn't hand out when it's destroyed.
+class page_reserve
+{
+  enum { BATCH = 64 };
+
+  char *pages_[BATCH];
+  size_t next_, count_;
+  // The most pages we expect to hand out, so we don't over-allocate.
+  size_t want_;
+
+public:
+  page_reserve(size_t want) : next_(0), count_(0), want_(want) { }
+
+  ~page_reserve()
+  {
+    for (size_t i = next_; i < count_; ++i)
+      zfree(pages_[i]);
+  }
+
+  page_reserve(const page_reserve&) = delete;
+  page_reserve &operator=(const page_reserve&) = delete;
+
+  // Return a zeroed page, or nullptr if we're out of memory.
+  char *get(const char *name)
+  {
+    if (next_ == count_) {
+      count_ = zalloc_batch(pages_, std::max(std::min((size_t)BATCH, want_),
+                                             (size_t)1), name);
+      next_ = 0;
+      if (count_ == 0)
+        return nullptr;
+    }
+    if (want_)
+      --want_;
+    return pages_[next_++];
+  }
+};
+
+// A run of PTEs for consecutive pages, to be loaded in to a
+// page_map_cache at once.
+class pte_batch
+{
+  enum { BATCH = 64 };
+
+  mmu::page_map_cache *cache_;
+  uptr start_;
+  size_t n_;
+  mmu::page_tracker *trackers_[BATCH];
+  pme_t ptes_[BATCH];
+
+public:
+  pte_batch(mmu::page_map_cache *cache) : cache_(cache), start_(0), n_(0) { }
+
+  void add(uptr va, mmu::page_tracker *t, pme_t pte)
+  {
+    if (n_ && (n_ == BATCH || va != start_ + n_ * PGSIZE))
+      flush();
+    if (!n_)
+      start_ = va;
+    trackers_[n_] = t;
+    ptes_[n_] = pte;
+    ++n_;
+  }
+
+  void flush()
+  {
+    if (n_)
+      cache_->insert_range(start_, n_, trackers_, ptes_);
+    n_ = 0;
+  }
+};
+
+/*
+ * Lazily freed pages
+ */
+
+// The address spaces that may have page frames released with
+// MADV_FREE.  The list doesn't hold references; a vmap removes
+// itself when it's destroyed, and reclaim only uses a vmap it can
+// get a reference to.
+class lazyfree_list
+{
+  static spinlock lock_;
+  static ilist<vmap, &vmap::lazyfree_link_> list_;
+
+public:
+  static void add(vmap *vm)
+  {
+    scoped_acquire l(&lock_);
+    if (!vm->lazyfree_listed_) {
+      list_.push_back(vm);
+      vm->lazyfree_listed_ = true;
+    }
+  }
+
+  static void remove(vmap *vm)
+  {
+    scoped_acquire l(&lock_);
+    if (vm->lazyfree_listed_) {
+      list_.erase(list_.iterator_to(vm));
+      vm->lazyfree_listed_ = false;
+    }
+  }
+
+  // Remove and return the first live vmap in the list, or null if
+  // there are none.
+  static sref<vmap> pop()
+  {
+    scoped_acquire l(&lock_);
+    while (!list_.empty()) {
+      vmap *vm = &list_.front();
+      list_.pop_front();
+      vm->lazyfree_listed_ = false;
+      // If this fails, vm is being destroyed, but it can't be freed
+      // until its destructor gets lock_.
+      sref<vmap> ref;
+      if (ref.init(vm))
+        return ref;
+    }
+    return sref<vmap>();
+  }
+};
+
+spinlock lazyfree_list::lock_("lazyfree_list", LOCKSTAT_VM);
+ilist<vmap, &vmap::lazyfree_link_> lazyfree_list::list_;
+
+size_t
+vmap::reclaim_lazyfree(size_t target)
+{
+  size_t n = 0;
+  while (n < target) {
+    sref<vmap> vm = lazyfree_list::pop();
+    if (!vm)
+      break;
+    bool more;
+    n += vm->reclaim_lazyfree_pages(target - n, &more);
+    if (more)
+      lazyfree_list::add(vm.get());
+  }
+  return n;
+}
+
+namespace {
+  // Lazily freed pages are the cheapest memory to reclaim: their
+  // contents are garbage by definition.
+  class lazyfree_shrinker : public shrinker
+  {
+  public:
+    lazyfree_shrinker() : shrinker("lazyfree") { }
+
+    size_t shrink(size_t target) override
+    {
+      return vmap::reclaim_lazyfree(target);
+    }
+  } lazyfree_shrinker_;
+}
+
+/*
+ * Page migration
+ */
+
+// Every live address space, so the compactor can find the pages in a
+// pageblock.  Each vmap is listed on the CPU that created it, so
+// creating and destroying address spaces doesn't share a lock.  Like
+// lazyfree_list, this doesn't hold references.
+class vmap_list
+{
+public:
+  struct percpu_list
+  {
+    spinlock lock;
+    ilist<vmap, &vmap::all_link_> list;
+    size_t n;
+
+    percpu_list() : lock("vmap_list", LOCKSTAT_VM), n(0) { }
+  };
+
+  static void add(vmap *vm);
+  static void remove(vmap *vm);
+
+  // Call fn with each vmap that was live on cpu's list when the walk
+  // started.  The lock is only held to take a reference to every
+  // vmap on the list, so compactors on other nodes can walk it at the
+  // same time.  Address spaces created during the walk are skipped;
+  // their pages were allocated after the caller isolated its
+  // pageblocks.
+  template<class F>
+  static void for_each(int cpu, F fn);
+};
+
+namespace {
+  DEFINE_PERCPU(vmap_list::percpu_list, vmap_lists);
+};
+
+void
+vmap_list::add(vmap *vm)
+{
+  vm->all_cpu_ = myid();
+  auto &l = vmap_lists[vm->all_cpu_];
+  scoped_acquire x(&l.lock);
+  l.list.push_back(vm);
+  ++l.n;
+}
+
+void
+vmap_list::remove(vmap *vm)
+{
+  auto &l = vmap_lists[vm->all_cpu_];
+  scoped_acquire x(&l.lock);
+  l.list.erase(l.list.iterator_to(vm));
+  --l.n;
+}
+
+template<class F>
+void
+vmap_list::for_each(int cpu, F fn)
+{
+  auto &l = vmap_lists[cpu];
+  size_t cap;
+  {
+    scoped_acquire x(&l.lock);
+    cap = l.n;
+  }
+  if (!cap)
+    return;
+  size_t bytes = cap * sizeof(vmap*);
+  vmap **vms = (vmap**)kmalloc(bytes, "vmap_list");
+  if (!vms)
+    return;
+
+  size_t n = 0;
+  {
+    scoped_acquire x(&l.lock);
+    for (auto &vm : l.list) {
+      if (n == cap)
+        break;
+      // If this fails, vm is being destroyed, but it can't be freed
+      // until its destructor gets the lock.
+      sref<vmap> ref;
+      if (ref.init(&vm))
+        vms[n++] = ref.transfer_to_ptr();
+    }
+  }
+  for (size_t i = 0; i < n; ++i) {
+    auto ref = sref<vmap>::transfer(vms[i]);
+    fn(ref.get());
+  }
+  kmfree(vms, bytes);
+}
+
+// The pageblocks the compactor is emptying.
+struct vmap::migrate_set
+{
+  void *const *blocks;
+  size_t n, size;
+
+  bool contains(uintptr_t va) const
+  {
+    for (size_t i = 0; i < n; ++i)
+      if (va - (uintptr_t)blocks[i] < size)
+        return true;
+    return false;
+  }
 };
 
+size_t
+vmap::migrate(void *const *blocks, size_t n, size_t size)
+{
+  migrate_set set{blocks, n, size};
+  size_t moved = 0;
+  for (int cpu = 0; cpu < ncpu; ++cpu)
+    vmap_list::for_each(cpu, [&](vmap *vm) {
+        moved += vm->migrate_pages(set);
+      });
+  kstats::inc(&kstats::compact_migrate_pages, moved);
+  return moved;
+}
+
+// Return true if the compactor may move the page at it.  Only
+// private anonymous pages that belong to this page frame alone can
+// move; file pages can be written through the file at any time.
+static bool
+migratable(const vmdesc &desc, const vmap::migrate_set &set)
+{
+  if (!desc.page)
+    return false;
+  return (set.contains((uintptr_t)desc.page->va()) &&
+          (desc.flags & vmdesc::FLAG_ANON) &&
+          !(desc.flags & (vmdesc::FLAG_COW | vmdesc::FLAG_SHARED |
+                          vmdesc::FLAG_LAZYFREE | vmdesc::FLAG_PINNED)));
+}
+
+size_t
+vmap::migrate_pages(const migrate_set &set)
+{
+  mmu::shootdown shootdown;
+  page_holder pages;
+  size_t n = 0;
+
+  // Like fork, lock the whole address space.  Unmap every page we'll
+  // move first, so no CPU can write one while we copy it.
+  auto lock = vpfs_.acquire(vpfs_.begin(), vpfs_.end());
+  bool any = false;
+  for (auto it = vpfs_.begin(), end = vpfs_.end(); it < end;
+       it += it.span()) {
+    if (it.is_set() && migratable(*it, set)) {
+      cache.invalidate(it.index() * PGSIZE, PGSIZE, it, &shootdown);
+      any = true;
+    }
+  }
+  if (!any)
+    return 0;
+  shootdown.perform();
+
+  for (auto it = vpfs_.begin(), end = vpfs_.end(); it < end;
+       it += it.span()) {
+    if (!it.is_set() || !migratable(*it, set))
+      continue;
+    // Pages still on a hot list from before the pageblocks were
+    // isolated can come back to us.  Freeing them now sends them to
+    // the buddies, so this only repeats for as long as the hot list
+    // has them.
+    char *p;
+    while ((p = kalloc_movable("(vmap::migrate)")) &&
+           set.contains((uintptr_t)p))
+      kfree(p);
+    if (!p)
+      break;
+    memmove(p, it->page->va(), PGSIZE);
+    auto page = sref<page_info>::transfer(new(page_info::of(p)) page_info());
+    if (it.base_span() == 1) {
+      pages.add(std::move(it->page));
+      it->page = std::move(page);
+    } else {
+      vmdesc nd(*it);
+      pages.add(std::move(nd.page));
+      nd.page = std::move(page);
+      vpfs_.fill(it, std::move(nd));
+    }
+    ++n;
+  }
+  return n;
+}
+
 /*
  * vmap
  */
@@ -117,12 +547,16 @@ vmap::alloc(void)
 }
 
 vmap::vmap() : 
-  brk_(0), brklock_("brk_lock", LOCKSTAT_VM)
+  brk_(0), lazyfree_listed_(false), lazyfree_inflight_(0),
+  brklock_("brk_lock", LOCKSTAT_VM)
 {
+  vmap_list::add(this);
 }
 
 vmap::~vmap()
 {
+  lazyfree_list::remove(this);
+  vmap_list::remove(this);
 }
 
 sref<vmap>
@@ -150,12 +584,14 @@ vmap::copy()
         sdebug.println("vm: dup ", *it, " at ", shex(it.index() * PGSIZE));
 
       // If the original vmdesc isn't COW, mark it so and fix the page
-      // table.
+      // table.  This also cancels any MADV_FREE, since lazily freed
+      // pages must be private.
       if (it->page && !(it->flags & vmdesc::FLAG_SHARED) && !(it->flags & vmdesc::FLAG_COW)) {
         if (SDEBUG)
           sdebug.println("vm: mark COW");
         it->flags |= vmdesc::FLAG_COW;
-        // XXX(Austin) Should we try to invalidate in larger chunks?
+        it->flags &= ~vmdesc::FLAG_LAZYFREE;
+        // The shootdown merges consecutive pages into one range.
         cache.invalidate(it.index() * PGSIZE, PGSIZE, it, &shootdown);
       }
 
@@ -189,6 +625,10 @@ vmap::insert(const vmdesc &desc, uptr start, uptr len, bool dotlb)
 
   bool fixed = (start != 0);
 
+  // Other cores may still have mappings an asynchronous munmap
+  // removed from this range
+  cache.sync_async();
+
 again:
   if (!fixed) {
     start = unmapped_area(len / PGSIZE);
@@ -256,7 +696,13 @@ vmap::remove(uptr start, uptr len)
     // XXX If this is a large unset, we could actively re-fold already
     // expanded regions.
     vpfs_.unset(begin, end);
+#if TLB_ASYNC_SHOOTDOWN
+    // Other cores may use the old mappings until they process the
+    // shootdown, so it keeps the pages until then.
+    shootdown.perform_async(pages.detach());
+#else
     shootdown.perform();
+#endif
   }
 
   return 0;
@@ -271,33 +717,204 @@ vmap::willneed(uptr start, uptr len)
 
   page_holder pages;
   mmu::shootdown shootdown;
+  // New pages come from the zalloc pool in batches and their PTEs are
+  // loaded a run at a time, rather than a page at a time as in a
+  // page fault.
+  page_reserve reserve(len / PGSIZE);
 
-  for (auto it = begin; it < end; it += it.span()) {
-    if (!it.is_set())
-      continue;
+  {
+    pte_batch ptes(&cache);
+    for (auto it = begin; it < end; it += it.span()) {
+      if (!it.is_set())
+        continue;
 
-    bool writable = (it->flags & vmdesc::FLAG_WRITE);
-    if (writable && (it->flags & vmdesc::FLAG_COW)) {
-      sref<page_info> old_page = it->page;
-      pages.add(std::move(old_page));
-      cache.invalidate(it.index() * PGSIZE, PGSIZE, it, &shootdown);
+      bool writable = (it->flags & vmdesc::FLAG_WRITE);
+      if (writable && (it->flags & vmdesc::FLAG_COW)) {
+        sref<page_info> old_page = it->page;
+        pages.add(std::move(old_page));
+        cache.invalidate(it.index() * PGSIZE, PGSIZE, it, &shootdown);
+      }
+
+      page_info *page = ensure_page(it, writable ? access_type::WRITE
+                                                 : access_type::READ_FAULT,
+                                    nullptr, &reserve);
+      if (!page)
+        continue;
+
+      if (it->flags & vmdesc::FLAG_COW || !writable)
+        ptes.add(it.index() * PGSIZE, &*it, page->pa() | PTE_P | PTE_U);
+      else
+        ptes.add(it.index() * PGSIZE, &*it,
+                 page->pa() | PTE_P | PTE_U | PTE_W);
     }
+    ptes.flush();
+  }
 
-    page_info *page = ensure_page(it, writable ? access_type::WRITE
-                                               : access_type::READ);
-    if (!page)
-      continue;
+  shootdown.perform();
+  return 0;
+}
 
-    if (it->flags & vmdesc::FLAG_COW || !writable)
-      cache.insert(it.index() * PGSIZE, &*it, page->pa() | PTE_P | PTE_U);
-    else
-      cache.insert(it.index() * PGSIZE, &*it, page->pa() | PTE_P | PTE_U | PTE_W);
+int
+vmap::dontneed(uptr start, uptr len)
+{
+  mmu::shootdown shootdown;
+  page_holder pages;
+  size_t n = 0;
+
+  {
+    auto begin = vpfs_.find(start / PGSIZE);
+    auto end = vpfs_.find((start + len) / PGSIZE);
+    auto lock = vpfs_.acquire(begin, end);
+
+    for (auto it = begin; it < end; it += it.span())
+      if (!it.is_set())
+        return -1;              // ENOMEM
+
+    // One invalidation (and at most one shootdown) for the whole
+    // range.
+    cache.invalidate(start, len, begin, &shootdown);
+    for (auto it = begin; it < end; ) {
+      if (!it->page) {
+        it += it.span();
+        continue;
+      }
+      drop_page(it, &pages);
+      ++n;
+      ++it;
+    }
   }
+  // Like sbrk, don't hold the range while waiting for other cores.
+  // We hold the dropped pages until the shootdown is done.
+  shootdown.perform();
 
+  kstats::inc(&kstats::madvise_dontneed_pages, n);
+  return 0;
+}
+
+int
+vmap::lazyfree(uptr start, uptr len)
+{
+  mmu::shootdown shootdown;
+  page_holder pages;
+  bool any = false;
+
+  {
+    auto begin = vpfs_.find(start / PGSIZE);
+    auto end = vpfs_.find((start + len) / PGSIZE);
+    auto lock = vpfs_.acquire(begin, end);
+
+    for (auto it = begin; it < end; it += it.span()) {
+      if (!it.is_set())
+        return -1;              // ENOMEM
+      if (!(it->flags & vmdesc::FLAG_ANON) ||
+          (it->flags & vmdesc::FLAG_SHARED))
+        return -1;              // EINVAL
+    }
+
+    // Unmap the whole range so the first write to each page frame
+    // faults and cancels the free.
+    cache.invalidate(start, len, begin, &shootdown);
+    for (auto it = begin; it < end; ) {
+      if (!it->page) {
+        it += it.span();
+        continue;
+      }
+      if (it->flags & vmdesc::FLAG_COW) {
+        // This page is shared with another address space (or is the
+        // zero page), so it's not ours to reclaim later.  Just drop
+        // our reference.
+        drop_page(it, &pages);
+      } else if (!(it->flags & vmdesc::FLAG_LAZYFREE)) {
+        update_flags(it, vmdesc::FLAG_LAZYFREE, 0);
+        any = true;
+      }
+      ++it;
+    }
+    // Other cores may still have these pages mapped writable until
+    // the shootdown, so keep reclaim away from them until then.
+    ++lazyfree_inflight_;
+  }
   shootdown.perform();
+  --lazyfree_inflight_;
+
+  if (any)
+    lazyfree_list::add(this);
   return 0;
 }
 
+size_t
+vmap::reclaim_lazyfree_pages(size_t target, bool *more)
+{
+  mmu::shootdown shootdown;
+  page_holder pages;
+  size_t n = 0;
+  *more = false;
+
+  // Like fork, lock the whole address space.  This only happens
+  // under memory pressure.
+  {
+    auto lock = vpfs_.acquire(vpfs_.begin(), vpfs_.end());
+    if (lazyfree_inflight_) {
+      // A lazyfree is still shooting down its pages; try again later.
+      *more = true;
+      return 0;
+    }
+    for (auto it = vpfs_.begin(), end = vpfs_.end(); it < end; ) {
+      if (!it.is_set() || !(it->flags & vmdesc::FLAG_LAZYFREE)) {
+        it += it.span();
+        continue;
+      }
+      if (n == target) {
+        *more = true;
+        break;
+      }
+      cache.invalidate(it.index() * PGSIZE, PGSIZE, it, &shootdown);
+      drop_page(it, &pages);
+      ++n;
+      ++it;
+    }
+    shootdown.perform();
+  }
+
+  kstats::inc(&kstats::lazyfree_reclaim_pages, n);
+  return n;
+}
+
+void
+vmap::drop_page(const vpf_array::iterator &it, page_holder *pages)
+{
+  auto &desc = *it;
+  u64 flags = desc.flags & ~(vmdesc::FLAG_LAZYFREE | vmdesc::FLAG_PINNED);
+  if (desc.flags & vmdesc::FLAG_ANON)
+    // Unbacked anonymous memory must not be COW
+    flags &= ~vmdesc::FLAG_COW;
+  else if (!(desc.flags & vmdesc::FLAG_SHARED))
+    // Go back to COW-sharing the file's page
+    flags |= vmdesc::FLAG_COW;
+
+  if (it.base_span() == 1) {
+    pages->add(std::move(desc.page));
+    desc.flags = flags;
+  } else {
+    vmdesc n(desc);
+    pages->add(std::move(n.page));
+    n.flags = flags;
+    vpfs_.fill(it, std::move(n));
+  }
+}
+
+void
+vmap::update_flags(const vpf_array::iterator &it, u64 set, u64 clear)
+{
+  if (it.base_span() == 1) {
+    it->flags = (it->flags | set) & ~clear;
+  } else {
+    vmdesc n(*it);
+    n.flags = (n.flags | set) & ~clear;
+    vpfs_.fill(it, std::move(n));
+  }
+}
+
 int
 vmap::invalidate_cache(uptr start, uptr len)
 {
@@ -346,6 +963,11 @@ vmap::mprotect(uptr start, uptr len, uint64_t flags)
 
       // XXX This should fail if this is a mapped file that was opened
       // O_RDONLY (we don't check this in mmap either).
+
+      // Like sys_mmap, stop caching the file's exec image once it can
+      // be written through a mapping.
+      if ((it->flags & vmdesc::FLAG_SHARED) && it->inode)
+        it->inode->as_file()->disable_image();
     }
 
     it->flags = nflags;
@@ -388,7 +1010,8 @@ vmap::dup_page(uptr dest, uptr src)
 int
 vmap::pagefault(uptr va, u32 err)
 {
-  access_type type = (err & FEC_WR) ? access_type::WRITE : access_type::READ;
+  access_type type = (err & FEC_WR) ? access_type::WRITE
+                                    : access_type::READ_FAULT;
   mmu::shootdown shootdown;
 
   if (va >= USERTOP)
@@ -398,6 +1021,7 @@ vmap::pagefault(uptr va, u32 err)
   kstats::timer timer(&kstats::page_fault_cycles);
   kstats::timer timer_alloc(&kstats::page_fault_alloc_cycles);
   kstats::timer timer_fill(&kstats::page_fault_fill_cycles);
+  kstats::timer timer_zero(&kstats::page_fault_zero_cycles);
 
   // If we replace a page, hold a reference until after the shootdown.
   sref<class page_info> old_page;
@@ -432,19 +1056,26 @@ vmap::pagefault(uptr va, u32 err)
     // Ensure we have a backing page and copy COW pages
     bool allocated;
     page_info *page = ensure_page(it, type, &allocated);
-    if (allocated) {
+    if (page && is_zero_page(page)) {
+      kstats::inc(&kstats::page_fault_zero_count);
+      timer_alloc.abort();
+      timer_fill.abort();
+    } else if (allocated) {
       kstats::inc(&kstats::page_fault_alloc_count);
       timer_fill.abort();
+      timer_zero.abort();
     } else {
       kstats::inc(&kstats::page_fault_fill_count);
       timer_alloc.abort();
+      timer_zero.abort();
     }
     if (!page)
       return -1;
 
     // If this is a read COW fault, we can reuse the COW page, but
-    // don't mark it writable!
-    if (desc.flags & vmdesc::FLAG_COW)
+    // don't mark it writable!  Likewise, a lazily freed page must
+    // fault on its next write.
+    if (desc.flags & (vmdesc::FLAG_COW | vmdesc::FLAG_LAZYFREE))
       cache.insert(va, &*it, page->pa() | PTE_P | PTE_U);
     else {
       if (desc.flags & vmdesc::FLAG_WRITE)
@@ -470,11 +1101,15 @@ pagefault(vmap *vmap, uptr va, u32 err)
 #if EXCEPTIONS
     try {
 #endif
-      return vmap->pagefault(va, err);
+      TRACEPOINT(page_fault, va, err);
+      int r = vmap->pagefault(va, err);
+      TRACEPOINT(page_fault_done, r, 0);
+      return r;
 #if EXCEPTIONS
     } catch (std::bad_alloc& e) {
+      TRACEPOINT(page_fault_done, -1, 0);
       cprintf("%d: pagefault retry\n", myproc()->pid);
-      gc_wakeup();
+      reclaim_direct();
       yield();
     }
 #endif
@@ -498,9 +1133,17 @@ vmap::pagelookup(uptr va)
   if (!it.is_set())
     return nullptr;
 
+  // Callers may write to the page or use its address as an identity
+  // (e.g., futexes), so give this page frame its own page.
+  mmu::shootdown shootdown;
+  if (it->page && is_zero_page(it->page.get()))
+    cache.invalidate(PGROUNDDOWN(va), PGSIZE, it, &shootdown);
   page_info* pi = ensure_page(it, access_type::READ);
+  shootdown.perform();
   if (!pi)
     return nullptr;
+  if (!(it->flags & vmdesc::FLAG_PINNED))
+    update_flags(it, vmdesc::FLAG_PINNED, 0);
 
   char* kptr = (char*)pi->va();
   return &kptr[va & (PGSIZE-1)];
@@ -522,7 +1165,7 @@ pagelookup(vmap* vmap, uptr va)
 #if EXCEPTIONS
     } catch (std::bad_alloc& e) {
       cprintf("%d: pagelookup retry\n", myproc()->pid);
-      gc_wakeup();
+      reclaim_direct();
       yield();
     }
 #endif
@@ -536,10 +1179,13 @@ vmap::copyout(uptr va, const void *p, u64 len)
   auto it = vpfs_.find(va / PGSIZE);
   auto end = vpfs_.find(PGROUNDUP(va + len) / PGSIZE);
   auto lock = vpfs_.acquire(it, end);
+  mmu::shootdown shootdown;
   for (; it != end; ++it) {
     if (!it.is_set())
       return -1;
     uptr va0 = (uptr)PGROUNDDOWN(va);
+    if (it->page && is_zero_page(it->page.get()))
+      cache.invalidate(va0, PGSIZE, it, &shootdown);
     page_info* pi = ensure_page(it, access_type::READ);
     if (!pi)
       return -1;
@@ -552,6 +1198,7 @@ vmap::copyout(uptr va, const void *p, u64 len)
     buf += n;
     va = va0 + PGSIZE;
   }
+  shootdown.perform();
   return 0;
 }
 
@@ -579,12 +1226,90 @@ vmap::set_write_permission(uptr start, uptr len, bool is_readonly, bool is_cow)
   return 0;
 }
 
+bool
+vmap::make_template(vmap_template *out, const sref<mnode> &ip)
+{
+  mmu::shootdown shootdown;
+  auto lock = vpfs_.acquire(vpfs_.begin(), vpfs_.end());
+
+  // Entries we've already made copy-on-write must be shot down even
+  // if we give up on the template partway through.
+  bool ok = true;
+  out->n = 0;
+  for (auto it = vpfs_.begin(), end = vpfs_.end(); it != end;
+       it += it.span()) {
+    if (!it.is_set())
+      continue;
+    if (it->inode && it->inode != ip) {
+      ok = false;
+      break;
+    }
+
+    // The template shares this page, so we must copy it on write,
+    // too.  As in copy, this also cancels any MADV_FREE.
+    if (it->page && !(it->flags & vmdesc::FLAG_SHARED) &&
+        !(it->flags & vmdesc::FLAG_COW)) {
+      it->flags |= vmdesc::FLAG_COW;
+      it->flags &= ~vmdesc::FLAG_LAZYFREE;
+      cache.invalidate(it.index() * PGSIZE, it.span() * PGSIZE, it,
+                       &shootdown);
+    }
+
+    uptr start = it.index() * PGSIZE, rend = start + it.span() * PGSIZE;
+    vmdesc d(it->dup());
+    d.inode = sref<mnode>();
+    // Pinning belongs to this address space, not to the processes
+    // stamped from the template.
+    d.flags &= ~vmdesc::FLAG_PINNED;
+    if (out->n) {
+      auto &prev = out->regions[out->n - 1];
+      if (prev.end == start && prev.desc.flags == d.flags &&
+          prev.desc.page == d.page && prev.desc.start == d.start) {
+        prev.end = rend;
+        continue;
+      }
+    }
+    if (out->n == vmap_template::MAX_REGIONS) {
+      ok = false;
+      break;
+    }
+    auto &r = out->regions[out->n++];
+    r.start = start;
+    r.end = rend;
+    r.desc = d;
+  }
+
+  shootdown.perform();
+  return ok;
+}
+
+void
+vmap::stamp(const vmap_template &t, const sref<mnode> &ip)
+{
+  for (size_t i = 0; i < t.n; ++i) {
+    auto &r = t.regions[i];
+    vmdesc d(r.desc.dup());
+    if (!(d.flags & vmdesc::FLAG_ANON))
+      d.inode = ip;
+    auto begin = vpfs_.find(r.start / PGSIZE);
+    auto end = vpfs_.find(r.end / PGSIZE);
+    auto lock = vpfs_.acquire(begin, end);
+    vpfs_.fill(begin, end, d, true);
+  }
+}
+
 int
 vmap::sbrk(ssize_t n, uptr *addr)
 {
   if (SDEBUG)
     sdebug.println("vm: sbrk(", n, ") pid ", myproc()->pid);
 
+  mmu::shootdown shootdown;
+  page_holder pages;
+  // Growing the break may map pages an asynchronous munmap removed.
+  // We can't wait for that while holding brklock_.
+  if (n > 0)
+    cache.sync_async();
   scoped_acquire xlock(&brklock_);
   auto curbrk = brk_;
   *addr = curbrk;
@@ -615,6 +1340,10 @@ vmap::sbrk(ssize_t n, uptr *addr)
     auto begin = vpfs_.find(newend / PGSIZE),
       end = vpfs_.find(newstart / PGSIZE);
     auto rlock = vpfs_.acquire(begin, end);
+    for (auto it = begin; it < end; it += it.span())
+      if (it.is_set())
+        pages.add(std::move(it->page));
+    cache.invalidate(newend, newstart - newend, begin, &shootdown);
     vpfs_.unset(begin, end);
   } else if (newstart < newend) {
     // Adjust break up by mapping pages
@@ -635,6 +1364,10 @@ vmap::sbrk(ssize_t n, uptr *addr)
   }
 
   brk_ += n;
+  // Don't wait for other cores while holding brklock_.  We hold the
+  // freed pages until the shootdown is done.
+  xlock.release();
+  shootdown.perform();
   return 0;
 }
 
@@ -658,27 +1391,49 @@ vmap::unmapped_area(size_t npages)
 
 page_info *
 vmap::ensure_page(const vmap::vpf_array::iterator &it, vmap::access_type type,
-                  bool *allocated)
+                  bool *allocated, page_reserve *reserve)
 {
   if (allocated)
     *allocated = false;
 
   auto &desc = *it;
-  bool need_copy = (type == access_type::WRITE &&
-                    (desc.flags & vmdesc::FLAG_COW));
-  if (desc.page && !need_copy)
-    return desc.page.get();
+  bool zero = desc.page && is_zero_page(desc.page.get());
+  // Anything but a user read fault needs a private copy of the zero
+  // page.
+  bool need_copy = ((type == access_type::WRITE &&
+                     (desc.flags & vmdesc::FLAG_COW)) ||
+                    (zero && type != access_type::READ_FAULT));
+  if (desc.page && !need_copy) {
+    // Anything but a user read might write the page, so it cancels
+    // MADV_FREE.  A user read leaves it mapped read-only.
+    if ((desc.flags & vmdesc::FLAG_LAZYFREE) &&
+        type != access_type::READ_FAULT)
+      update_flags(it, 0, vmdesc::FLAG_LAZYFREE);
+    return it->page.get();
+  }
 
+  // True if we're mapping the zero page in to this page frame.
+  bool zero_fill = false;
   sref<page_info> page = desc.page;
   if (!page) {
     if (desc.flags & vmdesc::FLAG_ANON) {
       assert(!(desc.flags & vmdesc::FLAG_COW));
-      if (allocated)
-        *allocated = true;
-      char *p = zalloc("(vmap::pagelookup)");
-      if (!p)
-        throw_bad_alloc();
-      page = sref<page_info>::transfer(new(page_info::of(p)) page_info());
+      if (type == access_type::READ_FAULT &&
+          !(desc.flags & vmdesc::FLAG_SHARED)) {
+        // Back this with the zero page until it's written.  This
+        // can't be done for shared memory because the COW copy would
+        // un-share it.
+        page = sref<page_info>::newref(get_zero_page());
+        zero_fill = true;
+      } else {
+        if (allocated)
+          *allocated = true;
+        char *p = reserve ? reserve->get("(vmap::pagelookup)")
+                          : zalloc("(vmap::pagelookup)");
+        if (!p)
+          throw_bad_alloc();
+        page = sref<page_info>::transfer(new(page_info::of(p)) page_info());
+      }
     } else {
       u64 page_idx = (it.index() * PGSIZE - desc.start) / PGSIZE;
       page = desc.inode->as_file()->get_page(page_idx).get_page_info();
@@ -691,14 +1446,17 @@ vmap::ensure_page(const vmap::vpf_array::iterator &it, vmap::access_type type,
     // This is a COW fault; copy in to a new page
     if (allocated)
       *allocated = true;
-    char *p = zalloc("(vmap::pagelookup)");
+    char *p = reserve ? reserve->get("(vmap::pagelookup)")
+                      : zalloc("(vmap::pagelookup)");
     if (!p)
       throw_bad_alloc();
 
     if (SDEBUG)
       sdebug.println("vm: COW copy to ", (void*)p, " from ", page->va(),
                      ' ', page.get());
-    memmove(p, page->va(), PGSIZE);
+    // zalloc already gave us a copy of the zero page
+    if (!zero)
+      memmove(p, page->va(), PGSIZE);
     page = sref<page_info>::transfer(new(page_info::of(p)) page_info());
   }
 
@@ -708,11 +1466,15 @@ vmap::ensure_page(const vmap::vpf_array::iterator &it, vmap::access_type type,
     desc.page = page;
     if (need_copy)
       desc.flags &= ~vmdesc::FLAG_COW;
+    if (zero_fill)
+      desc.flags |= vmdesc::FLAG_COW;
   } else {
     vmdesc n(desc);
     n.page = page;
     if (need_copy)
       n.flags &= ~vmdesc::FLAG_COW;
+    if (zero_fill)
+      n.flags |= vmdesc::FLAG_COW;
     // XXX(austin) Fill could do a move in this case, which would
     // save extraneous reference counting
     vpfs_.fill(it, std::move(n));
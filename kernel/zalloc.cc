@@ -5,13 +5,31 @@
 #include "cpputil.hh"
 #include "ilist.hh"
 #include "mtrace.h"
-#include "work.hh"
+#include "spinlock.hh"
+#include "condvar.hh"
+#include "cpu.hh"
+#include "numa.hh"
+#include "kstats.hh"
+#include "reclaim.hh"
 
 extern "C" void zpage(void*);
 extern "C" void zpage_nc(void*);
 
 static const bool prezero = true;
 
+enum {
+  // Pages moved between a CPU's cache and its node's pool at once
+  ZBATCH = 16,
+  // zfree sends pages to the pool once a CPU cache holds this many
+  ZCACHE_MAX = 4 * ZBATCH,
+  // Bounds on a node pool's target size
+  ZPOOL_MIN = 64,
+  ZPOOL_MAX = 8192,
+};
+
+// How often an idle CPU resizes its node's pool
+static const u64 zwindow_ns = 10000000;
+
 struct free_page
 {
   ilink<free_page> link;
@@ -23,70 +41,121 @@ struct zallocator {
   // be accessed with interrupts disabled.
   free_page::list_t pages;
   unsigned nPages;
-  dwframe frame;
+  // Pages this CPU has allocated, read racily by zpool::resize.
+  u64 demand;
 };
 DEFINE_PERCPU(zallocator, z_);
 
-struct zwork : public dwork {
-  zwork(dwframe* frame)
-    : frame_(frame)
-  {
-    frame_->inc();
-  }
+// Pre-zeroed pages shared by the CPUs of a NUMA node.  Idle CPUs on
+// the node fill it with node-local pages until it reaches target,
+// which tracks how fast the node has been allocating zeroed pages.
+struct zpool {
+  struct spinlock lock;
+  free_page::list_t pages;
+  unsigned npages;              // Protected by lock, read racily
+  unsigned target;
+  u64 rate;                     // Smoothed pages per window, times 4
+  u64 last_demand;
+  u64 window_start;
 
-  virtual void run() override {
-    for (int i = 0; i < 32; i++) {
-      auto *r = (struct free_page*)kalloc("zpage");
-      if (r == nullptr)
-        break;
-      zpage_nc(r);
-      scoped_cli cli;
-      z_->pages.push_front(r);
-      ++z_->nPages;
+  zpool() : npages(0), target(ZPOOL_MIN), rate(0), last_demand(0),
+            window_start(0) {}
+
+  // Move up to n pages to out.  Returns the number moved.
+  unsigned take(free_page::list_t *out, unsigned n) {
+    scoped_acquire l(&lock);
+    unsigned got = 0;
+    for (; got < n && !pages.empty(); ++got) {
+      auto &p = pages.front();
+      pages.pop_front();
+      out->push_front(&p);
     }
-    frame_->dec();
-    delete this;
+    npages -= got;
+    return got;
   }
 
-  dwframe* frame_;
+  void put(free_page *p) {
+    scoped_acquire l(&lock);
+    pages.push_front(p);
+    ++npages;
+  }
 
-  NEW_DELETE_OPS(zwork);
+  // Size the pool to cover two windows' worth of allocation on the
+  // node, so a burst of faults finds pages waiting.  Only one idle
+  // CPU needs to do this per window.
+  void resize(const numa_node &node) {
+    u64 now = nsectime();
+    if (now - window_start < zwindow_ns || !tryacquire(&lock))
+      return;
+    if (now - window_start >= zwindow_ns) {
+      u64 demand = 0;
+      for (auto c : node.cpus)
+        demand += z_[c->id].demand;
+      rate = (rate * 3 + (demand - last_demand) * 4) / 4;
+      last_demand = demand;
+      window_start = now;
+      target = std::min(std::max(rate / 2, (u64)ZPOOL_MIN), (u64)ZPOOL_MAX);
+    }
+    release(&lock);
+  }
 };
 
+static zpool zpools[MAX_NUMA_NODES];
+
+static zpool*
+mypool(void)
+{
+  return &zpools[mycpu()->node->id];
+}
+
+// Refill the local cache from the node pool.  Must be called with
+// interrupts disabled.
 static void
-tryrefill(void)
+refill(void)
+{
+  if (z_->pages.empty())
+    z_->nPages += mypool()->take(&z_->pages, ZBATCH);
+}
+
+// Take pages from the local cache.  Returns the number taken.
+static size_t
+takelocal(char **pages, size_t n)
 {
-  int cpu = myid();
-  if (prezero && z_[cpu].nPages < 16 && z_[cpu].frame.zero()) {
-    zwork* w = new zwork(&z_[cpu].frame);
-    // XXX This is higher priority than doing actual work.  We should
-    // only do background zeroing if we would otherwise be idle.
-    if (dwork_push(w, cpu) < 0)
-      delete w;
+  scoped_cli cli;
+  size_t got = 0;
+  while (got < n) {
+    refill();
+    if (z_->pages.empty())
+      break;
+    pages[got++] = (char*)&z_->pages.front();
+    z_->pages.pop_front();
+    --z_->nPages;
   }
+  z_->demand += n;
+  return got;
 }
 
 // Allocate a zeroed page.  This page can be freed with kfree or, if
-// it is known to be zeroed when it is freed, zfree.
+// it is known to be zeroed when it is freed, zfree.  The pre-zeroed
+// pools hold movable pages, so a page that must not move (movable is
+// false) is zeroed on the spot.
 char*
-zalloc(const char* name)
+zalloc(const char* name, bool movable)
 {
   char* p = nullptr;
 
-  {
-    scoped_cli cli;
-    if (!z_->pages.empty()) {
-      p = (char*)&z_->pages.front();
-      z_->pages.pop_front();
-      --z_->nPages;
-    }
-  }
-
-  if (p == nullptr) {
+  if (!movable) {
+    kstats::inc(&kstats::zalloc_sync_count);
     p = kalloc(name);
     if (p != nullptr)
       zpage(p);
+  } else if (takelocal(&p, 1) == 0) {
+    kstats::inc(&kstats::zalloc_sync_count);
+    p = kalloc_movable(name);
+    if (p != nullptr)
+      zpage(p);
   } else {
+    kstats::inc(&kstats::zalloc_prezeroed_count);
     mtunlabel(mtrace_label_block, p);
     mtlabel(mtrace_label_block, p, PGSIZE, name, strlen(name));
     // Zero the free_page header
@@ -95,25 +164,129 @@ zalloc(const char* name)
       for (int i = 0; i < PGSIZE; i++)
         assert(p[i] == 0);
   }
-  tryrefill();
   return p;
 }
 
+// Allocate up to n zeroed pages in to pages, taking as many as
+// possible from the pre-zeroed pool at once.  Returns the number of
+// pages allocated, which is less than n only if we're out of memory.
+size_t
+zalloc_batch(char **pages, size_t n, const char* name)
+{
+  size_t got = takelocal(pages, n);
+  kstats::inc(&kstats::zalloc_prezeroed_count, got);
+
+  for (size_t i = 0; i < got; i++) {
+    mtunlabel(mtrace_label_block, pages[i]);
+    mtlabel(mtrace_label_block, pages[i], PGSIZE, name, strlen(name));
+    // Zero the free_page header
+    memset(pages[i], 0, sizeof(struct free_page));
+  }
+
+  if (got < n)
+    kstats::inc(&kstats::zalloc_sync_count, n - got);
+  for (; got < n; got++) {
+    char *p = kalloc_movable(name);
+    if (p == nullptr)
+      break;
+    zpage(p);
+    pages[got] = p;
+  }
+  return got;
+}
+
 // Free a page that is known to be zero
 void
 zfree(void* p)
 {
-  if (0) 
+  if (0)
     for (int i = 0; i < 4096; i++)
       assert(((char*)p)[i] == 0);
 
-  scoped_cli cli;
   mtunlabel(mtrace_label_block, p);
-  z_->pages.push_front((struct free_page*)p);
-  ++z_->nPages;
+  scoped_cli cli;
+  if (z_->nPages < ZCACHE_MAX) {
+    z_->pages.push_front((struct free_page*)p);
+    ++z_->nPages;
+  } else {
+    mypool()->put((struct free_page*)p);
+  }
+}
+
+// Zero pages into this CPU's node pool until it reaches its target
+// or this CPU has something better to do.  The target only tracks
+// demand, so never take the node's free memory below its low
+// watermark for it: pages in the pool aren't free as far as kswapd
+// can tell.  Called from the idle loop with interrupts enabled, so an
+// addrun here (or a wakeup IPI from a remote addrun) stops zeroing
+// after the current page.
+void
+zidle(void)
+{
+  if (!prezero)
+    return;
+  zpool *pool = mypool();
+  int node = mycpu()->node->id;
+  pool->resize(*mycpu()->node);
+  if (pool->npages >= pool->target)
+    return;
+  size_t free = kalloc_node_free(node) / PGSIZE;
+  size_t low = reclaim_low_watermark(node);
+  if (free <= low)
+    return;
+  size_t target = std::min((size_t)pool->target,
+                           pool->npages + (free - low));
+  while (pool->npages < target) {
+    if (sched_pending()) {
+      kstats::inc(&kstats::zalloc_idle_preempt_count);
+      return;
+    }
+    auto *p = (struct free_page*)kalloc_movable("zpage");
+    if (p == nullptr)
+      return;
+    // Non-temporal stores keep the zeroing from evicting anything
+    // useful from the cache.
+    zpage_nc(p);
+    pool->put(p);
+    kstats::inc(&kstats::zalloc_idle_zeroed_count);
+  }
+}
+
+namespace {
+  // Pre-zeroed pages are cheap to give back: they're just free pages
+  // someone has zeroed.  Empty the reclaiming node's pool; zidle won't
+  // refill it until the node is back above its low watermark.
+  class zpool_shrinker : public shrinker
+  {
+  public:
+    zpool_shrinker() : shrinker("zpool") { }
+
+    size_t shrink(size_t target) override
+    {
+      zpool *pool = mypool();
+      size_t n = 0;
+      while (n < target) {
+        free_page::list_t pages;
+        unsigned got = pool->take(&pages, std::min(target - n,
+                                                   (size_t)ZBATCH));
+        if (!got)
+          break;
+        void *batch[ZBATCH];
+        for (unsigned i = 0; i < got; ++i) {
+          batch[i] = &pages.front();
+          pages.pop_front();
+        }
+        kfree_batch(batch, got);
+        n += got;
+      }
+      return n;
+    }
+  } zpool_shrinker_;
 }
 
 void
 initz(void)
 {
+  for (auto &pool : zpools)
+    pool.lock = spinlock("zpool", LOCKSTAT_KALLOC);
 }
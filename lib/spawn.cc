@@ -10,6 +10,7 @@
 
 #define EBADF (-1)
 #define ENOMEM (-1)
+#define EINVAL (-1)
 
 int
 posix_spawn_file_actions_init(posix_spawn_file_actions_t *file_actions)
@@ -105,16 +106,67 @@ posix_spawn_file_actions_adddup2(
   return 0;
 }
 
+int
+posix_spawnattr_init(posix_spawnattr_t *attr)
+{
+  attr->flags = 0;
+  attr->cpu = attr->node = -1;
+  return 0;
+}
+
+int
+posix_spawnattr_destroy(posix_spawnattr_t *attr)
+{
+  return 0;
+}
+
+int
+posix_spawnattr_getflags(const posix_spawnattr_t *attr, short *flags)
+{
+  *flags = attr->flags;
+  return 0;
+}
+
+int
+posix_spawnattr_setflags(posix_spawnattr_t *attr, short flags)
+{
+  if (flags & ~(POSIX_SPAWN_RESETIDS | POSIX_SPAWN_SETPGROUP |
+                POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK |
+                POSIX_SPAWN_SETSCHEDPARAM | POSIX_SPAWN_SETSCHEDULER |
+                POSIX_SPAWN_SETCPU_NP | POSIX_SPAWN_SETNODE_NP))
+    return EINVAL;
+  attr->flags = flags;
+  return 0;
+}
+
+int
+posix_spawnattr_setcpu_np(posix_spawnattr_t *attr, int cpu)
+{
+  if (cpu < 0)
+    return EINVAL;
+  attr->cpu = cpu;
+  attr->flags |= POSIX_SPAWN_SETCPU_NP;
+  return 0;
+}
+
+int
+posix_spawnattr_setnode_np(posix_spawnattr_t *attr, int node)
+{
+  if (node < 0)
+    return EINVAL;
+  attr->node = node;
+  attr->flags |= POSIX_SPAWN_SETNODE_NP;
+  return 0;
+}
+
 int posix_spawn(
   pid_t *pid, const char *path, const posix_spawn_file_actions_t *file_actions,
   const posix_spawnattr_t *attrp, char *const argv[], char *const envp[])
 {
-  if (attrp)
-    die("posix_spawn: attrp not implemented");
   if (envp)
     die("posix_spawn: envp not implemented");
   int res = sys_spawn(path, argv, file_actions ? file_actions->base : nullptr,
-                      file_actions ? file_actions->pos : 0);
+                      file_actions ? file_actions->pos : 0, attrp);
   if (res < 0)
     return -res;
   *pid = res;
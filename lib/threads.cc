@@ -95,6 +95,7 @@ xthread_create(pthread_t* tid, int flags,
 void
 pthread_exit(void* retval)
 {
+  malloc_thread_exit();
   exit(0);
 }
 
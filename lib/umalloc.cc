@@ -4,10 +4,9 @@
 #include <string.h>
 #include <unistd.h>
 #include <sys/mman.h>
-#ifndef XV6_USER
-#include <linux/unistd.h>       // __NR_gettid
-#endif
 
+#include <algorithm>
+#include <atomic>
 #include <memory>
 #include <new>
 #include <utility>
@@ -17,12 +16,14 @@
 #include "log2.hh"
 
 // This allocator strongly weighs its own scalability over other forms
-// of efficiency.  In particular, when memory is freed via a given
-// thread, only that thread can then reuse that memory.  Also, after a
-// page is carved up in to sub-page regions, it can never be used for
-// any other size class (allocations that involve a page or more of
-// memory can be re-partitioned, however).  It also never returns
-// memory to the system.
+// of efficiency.  In particular, each thread allocates from its own
+// free lists without synchronization.  Memory freed by a thread other
+// than the one that allocated it is handed back to the allocating
+// thread through a lock-free queue, so producer/consumer patterns
+// don't grow without bound.  A page carved up in to sub-page regions
+// returns to the page allocator once all of its regions are free, and
+// free page runs that go unused for a while are returned to the
+// system with madvise.
 
 // == Overall architecture ==
 //
@@ -51,14 +52,16 @@
 //
 // To free pages, the large allocator maintains a radix array of
 // metadata, indexed by page.  For each allocated region, this marks
-// it as allocated.  For each free region, this marks which thread has
-// the region on its free list.  In both cases, it marks the head and
+// it as allocated and which thread allocated it.  For each free
+// region, this marks which thread has the region on its free list.  In both cases, it marks the head and
 // the rest of the region differently so regions can be identified.
 // When an object is freed to the large allocator, its size is
 // computed using the radix array and it is merged with adjacent free
 // pages that belong to the same thread (also using the radix array).
 // This could result in an arbitrary size region, so it is split in to
-// the largest size classes possible.
+// the largest size classes possible.  Periodically, the large
+// allocator returns all but the first page of free runs that have
+// been idle for a while to the system using madvise.
 //
 // Finally, a *small allocator* handles allocations for size classes
 // half-a-page and smaller (where multiple objects will fit on one
@@ -70,7 +73,18 @@
 // beginning of the page.  As a result, there is no per-object space
 // overhead; only per-page overhead.  Freeing an object simply checks
 // the page header to find the object's size class and adds it to the
-// appropriate free list.
+// appropriate free list.  The page header also counts the page's free
+// objects; once they're all free (and the thread has plenty of other
+// free objects of that size class), the page goes back to the large
+// allocator, where it can be reused for any size class.
+//
+// Each thread's free lists are private to it.  Small pages and large
+// allocations record the *heap* of the thread that allocated them.
+// If another thread frees them, it pushes them on to that heap's
+// remote free list, which the owning thread drains the next time its
+// own free lists come up short.  When a thread exits, its free lists
+// move in to its heap, which goes on an orphan list; the next new
+// thread adopts the heap along with its free memory and remote list.
 //
 // malloc determines whether to use the large allocator or the small
 // allocator based on the requested object size.  free determines
@@ -95,15 +109,6 @@ namespace {
   // Must be >= 4096 and a valid size class
   size_t min_map_bytes = 256 * 1024;
 
-  pid_t gettid()
-  {
-#if defined(XV6_USER)
-    return getpid();
-#else
-    return syscall(__NR_gettid);
-#endif
-  }
-
   // Assert that ptr looks like a valid pointer.
   void check_ptr(void *ptr)
   {
@@ -149,6 +154,12 @@ namespace {
       return !!head;
     }
 
+    // Return the first block on this list, or nullptr.
+    block *front() const
+    {
+      return head;
+    }
+
     // Add ptr to this block list.  size_class is used only for
     // debugging.
     void push(void *ptr, size_t size_class)
@@ -190,6 +201,16 @@ namespace {
       return b;
     }
 
+    // Move all of o's blocks to this list, which must be empty.
+    void take(block_list &o)
+    {
+      assert(!head);
+      head = o.head;
+      o.head = nullptr;
+      if (head)
+        head->pprev = &head;
+    }
+
     // Remove ptr from whatever block list it's on.
     static void remove(void *ptr)
     {
@@ -283,6 +304,10 @@ namespace {
     T* allocate(std::size_t n, const void *hint = 0)
     {
       size_t bytes = n * sizeof(T);
+      // Radix nodes are over-aligned, and we also allocate smaller
+      // objects (external nodes and heaps), so align the position.
+      uintptr_t align = alignof(T);
+      linear_pos = (char*)(((uintptr_t)linear_pos + align - 1) & ~(align - 1));
       if (!linear_pos || linear_end - linear_pos < bytes) {
         // Get more memory
         void *p = mmap(0, min_map_bytes, PROT_READ|PROT_WRITE,
@@ -316,6 +341,81 @@ namespace {
     }
   };
 
+  //
+  // Heaps
+  //
+
+  // An object freed by a thread other than its owner, linked through
+  // the object's first word.
+  struct remote_block
+  {
+    remote_block *next;
+  };
+
+  struct orphan_state;
+
+  // The part of a thread's allocator state that other threads can
+  // reach.  Heaps are never freed, since they're referenced by
+  // allocated memory, but the heap of an exited thread is adopted by
+  // the next new thread (see malloc_thread_exit).  Each heap gets its
+  // own cache line so other heaps' remote frees don't contend on it;
+  // linear_allocator aligns heaps to alignof(heap).
+  struct alignas(64) heap
+  {
+    // Identifies this heap's free runs in the page radix array.
+    int id;
+
+    // Objects freed to this heap by other threads.
+    std::atomic<remote_block*> remote;
+
+    // Where this heap's free lists go while it has no thread.
+    // Allocated the first time the heap is orphaned.
+    orphan_state *saved;
+  };
+
+  // IDs start at 2 so they never collide with ALLOCATED_HEAD or
+  // ALLOCATED_REST.
+  std::atomic<int> next_heap_id(2);
+
+  __thread heap *my_heap;
+
+  // Take a heap left behind by an exited thread and move its free
+  // lists in to this thread's.  Returns null if there are none.
+  heap *adopt_heap();
+
+  // Return this thread's heap, adopting an orphaned heap or creating
+  // a new one if necessary.
+  heap *get_heap()
+  {
+    if (!my_heap) {
+      heap *h = adopt_heap();
+      if (!h) {
+        h = linear_allocator<heap>().allocate(1);
+        h->id = next_heap_id++;
+        h->remote.store(nullptr, std::memory_order_relaxed);
+        h->saved = nullptr;
+      }
+      my_heap = h;
+    }
+    return my_heap;
+  }
+
+  // Free ptr to heap h from another thread.
+  void remote_free(heap *h, void *ptr)
+  {
+    remote_block *b = static_cast<remote_block*>(ptr);
+    remote_block *head = h->remote.load(std::memory_order_relaxed);
+    do {
+      b->next = head;
+    } while (!h->remote.compare_exchange_weak(head, b,
+                                              std::memory_order_release,
+                                              std::memory_order_relaxed));
+  }
+
+  // Free everything on h's remote free list to this thread's free
+  // lists.  h must be this thread's heap.
+  void drain_remote(heap *h);
+
   //
   // Large allocator (size classes one page large and up)
   //
@@ -329,16 +429,42 @@ namespace {
     ALLOCATED_REST = -1
   };
 
+  // Every RELEASE_INTERVAL large allocator operations, return free
+  // memory that sat unused for the whole interval to the system.
+  enum { RELEASE_INTERVAL = 256 };
+
+  // The number of large allocator operations on this thread.
+  __thread uint64_t large_ops;
+
+  // The number of bytes in this thread's free runs, and the lowest
+  // that's been since the last release.  That many bytes went unused
+  // for the whole interval.  (Tracking a low-water mark instead of
+  // per-run ages means constantly splitting and re-merging the front
+  // of a large free run doesn't make the whole run look busy.)
+  __thread size_t free_run_bytes, free_run_low;
+
+  // The header at the beginning of each run on a free_runs list.
+  struct run_hdr : public block_list::block
+  {
+    // True if this run's pages after the first have been released to
+    // the system.  (The first page holds this header.)
+    bool released;
+  };
+
   struct page_info
   {
     // * For unmapped pages, UNMAPPED.
-    // * For the first page of a free run, the thread ID that owns the
-    //   run.
-    // * For the non-first page of a free run, the negative thread ID
-    //   that owns the run.
+    // * For the first page of a free run, the ID of the heap that
+    //   owns the run.
+    // * For the non-first page of a free run, the negative ID of the
+    //   heap that owns the run.
     // * For allocated pages, the first page of the allocation is
     //   ALLOCATED_HEAD and the rest are ALLOCATED_REST.
-    pid_t owner;
+    int owner;
+
+    // For the first page of an allocation, the heap that allocated
+    // it, and hence the heap it must be freed to.  Otherwise null.
+    heap *home;
 
     // XXX The information about free pages could be written on the
     // pages themselves, rather than requiring lots of space in a
@@ -348,7 +474,8 @@ namespace {
     // more efficiently (we could even use a straight 16GB mapping).
 
     page_info() = default;
-    explicit page_info(pid_t owner) : owner(owner) { }
+    explicit page_info(int owner, heap *home = nullptr)
+      : owner(owner), home(home) { }
 
     dummy_bit_spinlock get_lock()
     {
@@ -367,8 +494,9 @@ namespace {
 
   // Page info radix array.  The +1 on the size is a lame way to avoid
   // having to constantly check our iterators against pages.end().
-  radix_array<page_info, (1ULL<<47)/PGSIZE + 1, 4096,
-                                linear_allocator<page_info> > pages;
+  typedef radix_array<page_info, (1ULL<<47)/PGSIZE + 1, 4096,
+                      linear_allocator<page_info> > page_array;
+  page_array pages;
 
   // Convert page pointer to pages index
   size_t idx(void *ptr)
@@ -391,7 +519,7 @@ namespace {
     assert(bytes >= PGSIZE);
     assert(bytes % PGSIZE == 0);
 
-    pid_t tid = gettid();
+    int id = get_heap()->id;
     void *end = (char*)run + bytes;
     auto it = pages.find(idx(run));
     // Divide the run up in to size-class-sized pieces
@@ -400,12 +528,14 @@ namespace {
       size_t fbytes = class_max_size(fsc);
       pdebug("adding free run %p class %zu\n", run, fsc);
       free_runs[fsc].push(run, fsc);
+      static_cast<run_hdr*>(run)->released = false;
+      free_run_bytes += fbytes;
       auto nextit = it + fbytes / PGSIZE;
 
       // Mark pages as free to this thread
-      pages.fill(it++, page_info(tid));
+      pages.fill(it++, page_info(id));
       if (it != nextit) {
-        pages.fill(it, nextit, page_info(-tid));
+        pages.fill(it, nextit, page_info(-id));
         it = nextit;
       }
       run = (char*)run + fbytes;
@@ -434,7 +564,7 @@ namespace {
 
     // Mark pages allocated
     auto start = pages.find(idx(run));
-    pages.fill(start, page_info(ALLOCATED_HEAD));
+    pages.fill(start, page_info(ALLOCATED_HEAD, get_heap()));
     if (used_pages > 1)
       pages.fill(start + 1, start + used_pages, page_info(ALLOCATED_REST));
 
@@ -447,10 +577,20 @@ namespace {
     assert(bytes >= LARGE_THRESHOLD);
     size_t sc = size_to_class(bytes);
 
+    heap *h = get_heap();
+    if (h->remote.load(std::memory_order_relaxed))
+      drain_remote(h);
+    ++large_ops;
+
     // Find a free run of at least this size class
-    for (size_t i = sc; i < MAX_LARGE_CLASS; ++i)
-      if (free_runs[i])
+    for (size_t i = sc; i < MAX_LARGE_CLASS; ++i) {
+      if (free_runs[i]) {
+        free_run_bytes -= class_max_size(i);
+        if (free_run_bytes < free_run_low)
+          free_run_low = free_run_bytes;
         return alloc_from_run(free_runs[i].pop(i), i, bytes);
+      }
+    }
 
     // Can't satisfy request.  Get more pages from the system.
     size_t map_bytes = class_max_size(sc);
@@ -470,21 +610,38 @@ namespace {
     return alloc_from_run(run, map_sc, bytes);
   }
 
-  // Free the memory at ptr to the large allocator.
-  void free_large(void *ptr)
+  // Return about as many bytes of free runs as went unused since the
+  // last call to the system, starting with the largest runs.  This
+  // releases all but the first page of each run, so runs of a single
+  // page are never released.
+  void release_idle_runs()
+  {
+    size_t idle = free_run_low;
+    free_run_low = free_run_bytes;
+    size_t min_sc = size_to_class(2 * PGSIZE);
+    for (size_t sc = MAX_LARGE_CLASS; idle && sc-- > min_sc; ) {
+      for (block_list::block *b = free_runs[sc].front(); b && idle;
+           b = b->next) {
+        run_hdr *hdr = static_cast<run_hdr*>(b);
+        if (hdr->released)
+          continue;
+        pdebug("releasing idle run %p class %zu\n", b, sc);
+        madvise((char*)b + PGSIZE, class_max_size(sc) - PGSIZE,
+                MADV_DONTNEED);
+        hdr->released = true;
+        idle -= std::min(idle, class_max_size(sc));
+      }
+    }
+  }
+
+  // Free the allocation at start, which must belong to heap h (this
+  // thread's heap), to the large allocator.
+  void free_large_local(heap *h, page_array::iterator start)
   {
-    pid_t tid = gettid();
+    int id = h->id;
+    ++large_ops;
 
     // Find length of run at start
-    auto start = pages.find(idx(ptr));
-    if (!start.is_set())
-      throw std::runtime_error("Free of non-mapped memory");
-    if (start->owner != ALLOCATED_HEAD) {
-      if (start->owner == ALLOCATED_REST)
-        throw std::runtime_error("Free in the middle of a block");
-      else
-        throw std::runtime_error("Double free");
-    }
     auto end = start;
     for (++end; end.is_set() && end->owner == ALLOCATED_REST; ++end)
       ;
@@ -493,10 +650,10 @@ namespace {
     auto pre = start;
     if (DO_MERGE) {
       for (--pre; pre.is_set(); --pre) {
-        if (pre->owner == tid) {
+        if (pre->owner == id) {
           // This is the beginning of a run we can merge with
           block_list::remove(idx_to_ptr(pre.index()));
-        } else if (pre->owner != -tid) {
+        } else if (pre->owner != -id) {
           // We can't merge with this
           break;
         }
@@ -508,9 +665,9 @@ namespace {
     auto post = end;
     if (DO_MERGE) {
       for (; post.is_set(); ++post) {
-        if (post->owner == tid) {
+        if (post->owner == id) {
           block_list::remove(idx_to_ptr(post.index()));
-        } else if (post->owner != -tid) {
+        } else if (post->owner != -id) {
           break;
         }
       }
@@ -521,8 +678,35 @@ namespace {
     // run, this may re-create lots of runs we just absorbed.  There
     // should be a way to avoid this.
     pdebug("free_large %p of %lu pages (expanded %p %lu pages)\n",
-           ptr, end - start, idx_to_ptr(pre.index()), post - pre);
+           idx_to_ptr(start.index()), end - start,
+           idx_to_ptr(pre.index()), post - pre);
+    // add_free_run will count the free runs we absorbed again
+    free_run_bytes -= ((post - pre) - (end - start)) * PGSIZE;
     add_free_run(idx_to_ptr(pre.index()), (post - pre) * PGSIZE);
+
+    if (large_ops % RELEASE_INTERVAL == 0)
+      release_idle_runs();
+  }
+
+  // Free the memory at ptr to the large allocator.
+  void free_large(void *ptr)
+  {
+    auto start = pages.find(idx(ptr));
+    if (!start.is_set())
+      throw std::runtime_error("Free of non-mapped memory");
+    if (start->owner != ALLOCATED_HEAD) {
+      if (start->owner == ALLOCATED_REST)
+        throw std::runtime_error("Free in the middle of a block");
+      else
+        throw std::runtime_error("Double free");
+    }
+
+    if (start->home != my_heap) {
+      // Give it back to the thread that allocated it
+      remote_free(start->home, ptr);
+      return;
+    }
+    free_large_local(my_heap, start);
   }
 
   // Get the allocated size of the large allocation at ptr.
@@ -540,23 +724,84 @@ namespace {
   // Small allocator (size classes less than a page)
   //
 
-  // XXX This never frees pages back to the large allocator, so once a
-  // page has been reserved for a size class, it will stay that size
-  // class forever.
-
   // Fragment free lists by size class (ceil(log2(bytes))).  Fragments
   // must be at least sizeof(block_list::block), so the smaller
   // classes are unused.
   __thread block_list free_fragments[13];
 
+  // The number of fragments on each free_fragments list.
+  __thread size_t free_count[13];
+
+  // When free_count reaches trim_at, we look for pages on that free
+  // list whose fragments are all free and return them to the large
+  // allocator.  trim_at is twice the length of the free list after
+  // trimming, so the cost of walking the list is amortized over the
+  // frees that grew it.
+  __thread size_t trim_at[13];
+
   // Header for pages owned by the small allocator.  Following this
   // header, a page is divided into equal-size fragments.
   struct page_hdr
   {
     uintptr_t magic;
     size_t size_class;
+    // The heap whose free lists this page's fragments belong on.
+    heap *owner;
+    // The number of fragments in this page.
+    uint32_t nfrags;
+    // Scratch space for trim_small.
+    uint32_t nfree;
+  };
+  enum {
+    PAGE_HDR_MAGIC = 0x2065c977e3516564,
+    // Space reserved for the header.  This keeps fragments 16-byte
+    // aligned.
+    PAGE_HDR_BYTES = 32,
   };
-  enum { PAGE_HDR_MAGIC = 0x2065c977e3516564 };
+
+  page_hdr *page_hdr_of(void *ptr)
+  {
+    return (page_hdr*)(((uintptr_t)ptr) & ~(PGSIZE-1));
+  }
+
+  // Refill the empty sc free list, first from fragments other threads
+  // have freed back to us and then from a new page.  Returns false if
+  // we're out of memory.
+  bool refill_small(size_t sc)
+  {
+    heap *h = get_heap();
+    if (h->remote.load(std::memory_order_relaxed)) {
+      drain_remote(h);
+      if (free_fragments[sc])
+        return true;
+    }
+
+    // There are no free fragments of this size.  Get a page from
+    // the large allocator and chop it up.
+    void *page = alloc_large(PGSIZE);
+    if (!page)
+      return false;
+    page_hdr *hdr = static_cast<page_hdr*>(page);
+    hdr->magic = PAGE_HDR_MAGIC;
+    hdr->size_class = sc;
+    hdr->owner = h;
+
+    size_t sbytes = class_max_size(sc);
+    // Make sure fragments are always 16-byte aligned.  (This could
+    // be less aligned for smaller size classes, but there are no
+    // smaller size classes.)
+    char *fragment = (char*)page + PAGE_HDR_BYTES;
+    static_assert(sizeof(page_hdr) <= PAGE_HDR_BYTES,
+                  "page_hdr too large");
+    char *last = (char*)page + PGSIZE - sbytes;
+    int i = 0;
+    for (; fragment <= last; fragment += sbytes, ++i)
+      free_fragments[sc].push(fragment, sc);
+    hdr->nfrags = i;
+    free_count[sc] += i;
+    pdebug("alloc_small growing class %zu by %d objects\n", sc, i);
+    return true;
+  }
 
   // Allocate bytes bytes from the small allocator
   void *alloc_small(size_t bytes)
@@ -569,53 +814,163 @@ namespace {
 
     // Check for a free fragment
     size_t sc = size_to_class(bytes);
-    if (!free_fragments[sc]) {
-      // There are no free fragments of this size.  Get a page from
-      // the large allocator and chop it up.
-      void *page = alloc_large(PGSIZE);
-      if (!page)
-        return nullptr;
-      page_hdr *hdr = static_cast<page_hdr*>(page);
-      hdr->magic = PAGE_HDR_MAGIC;
-      hdr->size_class = sc;
-
-      size_t sbytes = class_max_size(sc);
-      // Make sure fragments are always 16-byte aligned.  (This could
-      // be less aligned for smaller size classes, but there are no
-      // smaller size classes.)
-      char *fragment = (char*)page + 16;
-      assert(sizeof(page_hdr) <= 16);
-      char *last = (char*)page + PGSIZE - sbytes;
-      int i = 0;
-      for (; fragment <= last; fragment += sbytes, ++i)
-        free_fragments[sc].push(fragment, sc);
-      pdebug("alloc_small growing class %zu by %d objects\n", sc, i);
-    }
+    if (!free_fragments[sc] && !refill_small(sc))
+      return nullptr;
 
     void *ptr = free_fragments[sc].pop(sc);
+    --free_count[sc];
     pdebug("alloc_small %zu bytes from class %zu => %p\n", bytes, sc, ptr);
     return ptr;
   }
 
+  // Return pages on the sc free list whose fragments are all free to
+  // the large allocator, so they can be reused for any size class.
+  // This keeps at least a page's worth of free fragments, so a thread
+  // that repeatedly allocates and frees a few objects doesn't churn
+  // pages.
+  void trim_small(size_t sc)
+  {
+    typedef block_list::block block;
+    // Count the free fragments on each page
+    for (block *b = free_fragments[sc].front(); b; b = b->next)
+      page_hdr_of(b)->nfree = 0;
+    for (block *b = free_fragments[sc].front(); b; b = b->next)
+      ++page_hdr_of(b)->nfree;
+
+    // Remove the fragments of entirely free pages.  Pages we're
+    // releasing are marked by clearing their magic, and nfree counts
+    // down their fragments still on the list.
+    size_t released = 0;
+    block *next;
+    for (block *b = free_fragments[sc].front(); b; b = next) {
+      next = b->next;
+      page_hdr *hdr = page_hdr_of(b);
+      if (hdr->magic == PAGE_HDR_MAGIC) {
+        if (hdr->nfree != hdr->nfrags ||
+            free_count[sc] < 2 * hdr->nfrags)
+          continue;
+        hdr->magic = 0;
+        free_count[sc] -= hdr->nfrags;
+      }
+      block_list::remove(b);
+      if (--hdr->nfree == 0) {
+        pdebug("trim_small releasing %p from class %zu\n", hdr, sc);
+        free_large_local(hdr->owner, pages.find(idx(hdr)));
+        ++released;
+      }
+    }
+
+    pdebug("trim_small class %zu released %zu pages\n", sc, released);
+    trim_at[sc] = std::max(2 * free_count[sc],
+                           (size_t)4 * (PGSIZE / class_max_size(sc)));
+  }
+
+  // Free the fragment at ptr in page hdr, which must belong to this
+  // thread's heap.
+  void free_small_local(page_hdr *hdr, void *ptr)
+  {
+    size_t sc = hdr->size_class;
+    pdebug("free_small %p to class %zu\n", ptr, sc);
+    free_fragments[sc].push(ptr, sc);
+    if (++free_count[sc] >= trim_at[sc])
+      trim_small(sc);
+  }
+
   // Free the memory at ptr to the small allocator.
   void free_small(void *ptr)
   {
     // Round ptr to the page start to get the page metadata
-    page_hdr *hdr = (page_hdr*)(((uintptr_t)ptr) & ~(PGSIZE-1));
+    page_hdr *hdr = page_hdr_of(ptr);
     if (hdr->magic != PAGE_HDR_MAGIC)
       throw std::runtime_error("Bad free or corrupted page magic");
-    pdebug("free_small %p to class %zu\n", ptr, hdr->size_class);
-    free_fragments[hdr->size_class].push(ptr, hdr->size_class);
+    // If this thread doesn't have a heap yet, this can't be its page.
+    if (hdr->owner != my_heap) {
+      // Give it back to the thread that owns the page
+      remote_free(hdr->owner, ptr);
+      return;
+    }
+    free_small_local(hdr, ptr);
   }
 
   // Get the allocated size of the small allocation at ptr.
   size_t get_size_small(void *ptr)
   {
-    page_hdr *hdr = (page_hdr*)(((uintptr_t)ptr) & ~(PGSIZE-1));
+    page_hdr *hdr = page_hdr_of(ptr);
     if (hdr->magic != PAGE_HDR_MAGIC)
       throw std::runtime_error("Bad free or corrupted page magic");
     return class_max_size(hdr->size_class);
   }
+
+  //
+  // Remote frees
+  //
+
+  void drain_remote(heap *h)
+  {
+    remote_block *b = h->remote.exchange(nullptr, std::memory_order_acquire);
+    while (b) {
+      // Freeing b will overwrite b->next
+      remote_block *next = b->next;
+      if ((uintptr_t)b % PGSIZE == 0)
+        free_large_local(h, pages.find(idx(b)));
+      else
+        free_small_local(page_hdr_of(b), b);
+      b = next;
+    }
+  }
+
+  //
+  // Orphaned heaps
+  //
+
+  // A heap's free lists while it has no thread.
+  struct orphan_state
+  {
+    heap *next;
+    block_list free_runs[MAX_LARGE_CLASS];
+    size_t free_run_bytes;
+    uint64_t large_ops;
+    block_list free_fragments[13];
+    size_t free_count[13];
+    size_t trim_at[13];
+    // The exited thread's unused linear allocator space
+    char *linear_pos, *linear_end;
+  };
+
+  // Heaps of exited threads, linked through orphan_state::next.
+  // Threads come and go rarely enough that a spin lock is fine (and
+  // avoids the ABA problem of a lock-free stack).
+  heap *orphans;
+  std::atomic_flag orphans_lock = ATOMIC_FLAG_INIT;
+
+  heap *adopt_heap()
+  {
+    while (orphans_lock.test_and_set(std::memory_order_acquire))
+      ;
+    heap *h = orphans;
+    if (h)
+      orphans = h->saved->next;
+    orphans_lock.clear(std::memory_order_release);
+    if (!h)
+      return nullptr;
+
+    orphan_state *s = h->saved;
+    for (size_t i = 0; i < MAX_LARGE_CLASS; ++i)
+      free_runs[i].take(s->free_runs[i]);
+    free_run_bytes = free_run_low = s->free_run_bytes;
+    large_ops = s->large_ops;
+    for (size_t i = 0; i < 13; ++i) {
+      free_fragments[i].take(s->free_fragments[i]);
+      free_count[i] = s->free_count[i];
+      trim_at[i] = s->trim_at[i];
+    }
+    if (!linear_pos) {
+      linear_pos = s->linear_pos;
+      linear_end = s->linear_end;
+      s->linear_pos = s->linear_end = nullptr;
+    }
+    return h;
+  }
 }
 
 extern "C" void *
@@ -679,6 +1034,48 @@ realloc(void* ap, size_t nbytes)
   return n;
 }
 
+// Called by an exiting thread.  Returns the thread's idle memory to
+// the system and orphans its heap, so the next new thread reuses the
+// heap's free memory and drains the frees other threads send it.
+extern "C" void
+malloc_thread_exit(void)
+{
+  heap *h = my_heap;
+  if (!h)
+    return;
+
+  // Give fully free small pages back to the large allocator and
+  // release all of the free runs, since an orphan may wait a while.
+  for (size_t sc = 0; sc < 13; ++sc)
+    if (free_count[sc])
+      trim_small(sc);
+  free_run_low = free_run_bytes;
+  release_idle_runs();
+
+  if (!h->saved)
+    h->saved = linear_allocator<orphan_state>().allocate(1);
+  orphan_state *s = h->saved;
+  for (size_t i = 0; i < MAX_LARGE_CLASS; ++i)
+    s->free_runs[i].take(free_runs[i]);
+  s->free_run_bytes = free_run_bytes;
+  s->large_ops = large_ops;
+  for (size_t i = 0; i < 13; ++i) {
+    s->free_fragments[i].take(free_fragments[i]);
+    s->free_count[i] = free_count[i];
+    s->trim_at[i] = trim_at[i];
+  }
+  s->linear_pos = linear_pos;
+  s->linear_end = linear_end;
+  linear_pos = linear_end = nullptr;
+  my_heap = nullptr;
+
+  while (orphans_lock.test_and_set(std::memory_order_acquire))
+    ;
+  s->next = orphans;
+  orphans = h;
+  orphans_lock.clear(std::memory_order_release);
+}
+
 extern "C" void
 malloc_set_alloc_unit(size_t bytes)
 {
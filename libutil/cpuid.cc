@@ -31,11 +31,15 @@ cpuid::cpuid() : basic_{}, extended_{}
   l = get_leaf(leafid::features);
   features_.mwait = l.c & (1<<3);
   features_.pdcm = l.c & (1<<15);
+  features_.pcid = l.c & (1<<17);
   features_.x2apic = l.c & (1<<21);
 
   features_.apic = l.d & (1<<9);
   features_.ds = l.d & (1<<21);
 
+  l = get_leaf(leafid::ext_features);
+  features_.invpcid = l.b & (1<<10);
+
   l = get_leaf(leafid::extended_features);
   features_.page1GB = l.d & (1<<26);
 }
@@ -319,6 +319,18 @@ invlpg(void *a)
   __asm volatile("invlpg (%0)" : : "r" (a) : "memory");
 }
 
+// Invalidate TLB entries according to type (one of the INVPCID_*
+// types in bits.hh).
+static inline void
+invpcid(uint64_t type, uint64_t pcid, uintptr_t addr)
+{
+  struct {
+    uint64_t pcid;
+    uint64_t addr;
+  } desc = { pcid, addr };
+  __asm volatile("invpcid %0,%1" : : "m" (desc), "r" (type) : "memory");
+}
+
 static inline int
 popcnt64(uint64_t v)
 {
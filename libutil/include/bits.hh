@@ -41,6 +41,17 @@
 
 #define CR4_PGE         0x00000080      // Page global enable
 #define CR4_PCE         0x100           // RDPMC at CPL > 0
+#define CR4_PCIDE       0x00020000      // Process-context identifiers
+
+// CR3 bits when CR4_PCIDE is set
+#define CR3_PCID_MASK   0xfffull        // PCID of the new address space
+#define CR3_NOFLUSH     (1ull << 63)    // Keep TLB entries for the PCID
+
+// INVPCID types
+#define INVPCID_ADDR    0               // One address in one PCID
+#define INVPCID_CONTEXT 1               // All non-global entries of one PCID
+#define INVPCID_ALL     2               // Everything, including globals
+#define INVPCID_NONGLOBAL 3             // All non-global entries
 
 // FS/GS base registers
 #define MSR_FS_BASE     0xc0000100
@@ -167,12 +167,16 @@ public:
     // 1.ECX
     bool mwait : 1;
     bool pdcm : 1;              // Perfmon and debug
+    bool pcid : 1;              // Process-context identifiers
     bool x2apic : 1;
 
     // 1.EDX
     bool apic : 1;              // "APIC on chip"
     bool ds : 1;                // Debug store
 
+    // 7.EBX
+    bool invpcid : 1;
+
     // 80000001.EDX
     bool page1GB : 1;
   };
@@ -400,6 +400,22 @@ public:
     last = nullptr;
   }
 
+  // Move all elements of x to the end of this queue in O(1) time.
+  void
+  splice_back(isqueue &&x) noexcept
+  {
+    if (x.empty())
+      return;
+    if (empty()) {
+      *this = std::move(x);
+      return;
+    }
+    (last->*L).next = x.head.next;
+    last = x.last;
+    x.head.next = nullptr;
+    x.last = nullptr;
+  }
+
   isqueue
   cut_after(iterator pos) noexcept
   {
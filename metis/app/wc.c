@@ -43,6 +43,7 @@
 #include "lib/mr-common.h"
 #endif
 #include "lib/mr-sched.h"
+#include "lib/strkey.h"
 #include "bench.h"
 #ifdef JOS_USER
 #include "wc-datafile.h"
@@ -59,6 +60,7 @@ enum { with_vm = 1 };
 enum { max_key_len = 256 };
 
 static int nsplits = 0;
+static int merge_backend = merge_psrs;
 
 typedef struct {
     uint64_t fpos;
@@ -70,13 +72,6 @@ typedef struct {
 static int alphanumeric;
 FILE *fout = NULL;
 
-/* Comparison function to compare 2 words */
-static int
-mystrcmp(const void *s1, const void *s2)
-{
-    return strcmp((const char *) s1, (const char *) s2);
-}
-
 /* divide input on a word border i.e. a space. */
 static int
 wordcount_splitter(void *arg, split_t * out, int ncores)
@@ -273,7 +268,9 @@ do_mapreduce(int nprocs, int map_tasks, int reduce_tasks,
     mr_param.app_arg.mapreduce.outcmp = alphanumeric ? NULL : out_cmp;
 #endif
     mr_param.part_func = NULL;
-    mr_param.key_cmp = mystrcmp;
+    mr_param.key_cmp = strkey_cmp;
+    mr_param.key_prefix = strkey_prefix;
+    mr_param.merge_backend = merge_backend;
     mr_param.split_func = wordcount_splitter;
     mr_param.split_arg = &wc_data;
     assert(mr_run_scheduler(&mr_param) == 0);
@@ -291,6 +288,7 @@ wc_usage(char *prog)
     printf("  -q : quiet output (for batch test)\n");
     printf("  -a : alphanumeric word count\n");
     printf("  -o filename : save output to a file\n");
+    printf("  -b backend : final merge sort (psrs, radix or samplesort)\n");
     exit(EXIT_FAILURE);
 }
 
@@ -307,7 +305,7 @@ main(int argc, TCHAR * argv[])
 
     fn = argv[1];
 
-    while ((c = getopt(argc - 1, argv + 1, "p:s:l:m:r:qao:")) != -1) {
+    while ((c = getopt(argc - 1, argv + 1, "p:s:l:m:r:qao:b:")) != -1) {
 	switch (c) {
 	case 'p':
 	    nprocs = atoi(optarg);
@@ -327,6 +325,11 @@ main(int argc, TCHAR * argv[])
 	case 'a':
 	    alphanumeric = 1;
 	    break;
+	case 'b':
+	    merge_backend = mr_merge_backend(optarg);
+	    if (merge_backend < 0)
+		wc_usage(argv[0]);
+	    break;
 	case 'o':
 	    fout = fopen(optarg, "w+");
 	    if (!fout) {
@@ -43,6 +43,7 @@
 #include "lib/mr-common.h"
 #endif
 #include "lib/mr-sched.h"
+#include "lib/strkey.h"
 #include "lib/bench.h"
 
 #define DEFAULT_NDISP 10
@@ -58,6 +59,7 @@ enum { max_key_len = 1024 };
 #endif
 
 static uint64_t nsplits = 0;
+static int merge_backend = merge_psrs;
 
 typedef struct {
     uint64_t fpos;
@@ -71,16 +73,6 @@ enum {
     NOT_IN_WORD
 };
 
-/** mystrcmp()
- *  Comparison function to compare 2 words
- */
-static int
-mystrcmp(const void *s1, const void *s2)
-{
-    int res = strcmp((const char *) s1, (const char *) s2);
-    return res;
-}
-
 /**
  *  Divide input on a word border i.e. a space.
  */
@@ -216,7 +208,9 @@ do_mapreduce(int nprocs, int map_tasks, int reduce_tasks,
     mr_param.nr_cpus = nprocs;
     mr_param.app_arg.atype = atype_mapgroup;
     mr_param.app_arg.mapgroup.results = wr_vals;
-    mr_param.key_cmp = mystrcmp;
+    mr_param.key_cmp = strkey_cmp;
+    mr_param.key_prefix = strkey_prefix;
+    mr_param.merge_backend = merge_backend;
     mr_param.split_func = wr_splitter;
     mr_param.split_arg = &wr_data;
     mr_param.map_func = map;
@@ -243,6 +237,7 @@ wr_usage(char *prog)
 	("  -r #reduce tasks : # of reduce tasks (16 tasks per core by default)\n");
     printf("  -l ntops : # of top val. pairs to display\n");
     printf("  -q : quiet output (for batch test)\n");
+    printf("  -b backend : final merge sort (psrs, radix or samplesort)\n");
     exit(EXIT_FAILURE);
 }
 
@@ -257,7 +252,7 @@ main(int argc, TCHAR * argv[])
 
     fn = argv[1];
 
-    while ((c = getopt(argc - 1, argv + 1, "p:l:m:r:q")) != -1) {
+    while ((c = getopt(argc - 1, argv + 1, "p:l:m:r:qb:")) != -1) {
 	switch (c) {
 	case 'p':
 	    nprocs = atoi(optarg);
@@ -274,6 +269,11 @@ main(int argc, TCHAR * argv[])
 	case 'q':
 	    quiet = 1;
 	    break;
+	case 'b':
+	    merge_backend = mr_merge_backend(optarg);
+	    if (merge_backend < 0)
+		wr_usage(argv[0]);
+	    break;
 	default:
 	    wr_usage(argv[0]);
 	    exit(EXIT_FAILURE);
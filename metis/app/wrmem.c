@@ -38,10 +38,13 @@
 #include <sys/time.h>
 #include <sched.h>
 #include "mr-sched.h"
+#include "strkey.h"
 #include "bench.h"
 
 #define DEFAULT_NDISP 10
 
+static int merge_backend = merge_psrs;
+
 enum { max_key_len = 1024 };
 
 typedef struct {
@@ -171,7 +174,9 @@ do_mapreduce(int nprocs, int nsplits, int reduce_tasks,
     mr_param.nr_cpus = nprocs;
     mr_param.app_arg.atype = atype_mapgroup;
     mr_param.app_arg.mapgroup.results = wr_vals;
-    mr_param.key_cmp = (key_cmp_t) strcmp;
+    mr_param.key_cmp = strkey_cmp;
+    mr_param.key_prefix = strkey_prefix;
+    mr_param.merge_backend = merge_backend;
     mr_param.split_func = wr_splitter;
     mr_param.split_arg = &wr_data;
     mr_param.map_func = map;
@@ -197,6 +202,7 @@ wr_usage(char *prog)
     printf("  -l ntops : # of top key/value pairs to display\n");
     printf("  -s inputsize : size of input in MB\n");
     printf("  -q : quiet output (for batch test)\n");
+    printf("  -b backend : final merge sort (psrs, radix or samplesort)\n");
     exit(EXIT_FAILURE);
 }
 
@@ -219,7 +225,7 @@ main(int argc, char *argv[])
     uint64_t inputsize = 0x80000000;
     char buf[128];
     int c;
-    while ((c = getopt(argc, argv, "p:l:m:r:qs:a:")) != -1) {
+    while ((c = getopt(argc, argv, "p:l:m:r:qs:a:b:")) != -1) {
 	switch (c) {
 	case 'p':
 	    nprocs = atoi(optarg);
@@ -241,6 +247,11 @@ main(int argc, char *argv[])
 	case 'q':
 	    quiet = 1;
 	    break;
+	case 'b':
+	    merge_backend = mr_merge_backend(optarg);
+	    if (merge_backend < 0)
+		wr_usage(argv[0]);
+	    break;
 	case 'a':
 	    // xv6 malloc
 	    {
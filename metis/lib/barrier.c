@@ -0,0 +1,51 @@
+#include <string.h>
+#include "barrier.h"
+#include "bench.h"
+#include "cpumap.h"
+
+/* Two-level barrier.  CPUs arrive at a counter for their NUMA node;
+ * the last CPU of each node arrives at the root, and the last node
+ * releases each node by bumping its generation.  Waiters spin on their
+ * own node's cache line, so at most one line per node bounces between
+ * sockets, instead of the root polling every CPU's flag. */
+typedef union {
+    struct {
+	volatile int count;
+	volatile int gen;
+    };
+    char __pad[JOS_CLINE];
+} barrier_node_t;
+
+static barrier_node_t bar_nodes[JOS_NCPU];
+static barrier_node_t bar_root;
+
+void
+mr_barrier(int lcpu, int ncpus)
+{
+    const int node = lcpu_to_node[lcpu];
+    int nmembers = 0;
+    int nnodes = 0;
+    int seen[JOS_NCPU];
+    memset(seen, 0, sizeof(int) * cpumap_nnodes);
+    for (int i = 0; i < ncpus; i++) {
+	nmembers += (lcpu_to_node[i] == node);
+	if (!seen[lcpu_to_node[i]]++)
+	    nnodes++;
+    }
+    barrier_node_t *bn = &bar_nodes[node];
+    const int gen = bn->gen;
+    if (atomic_add32_ret((int *) &bn->count) == nmembers - 1) {
+	bn->count = 0;
+	if (atomic_add32_ret((int *) &bar_root.count) == nnodes - 1) {
+	    bar_root.count = 0;
+	    mfence();
+	    for (int i = 0; i < cpumap_nnodes; i++)
+		if (seen[i])
+		    bar_nodes[i].gen++;
+	    return;
+	}
+    }
+    while (bn->gen == gen)
+	nop_pause();
+    mfence();
+}
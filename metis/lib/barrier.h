@@ -0,0 +1,7 @@
+#ifndef BARRIER_H
+#define BARRIER_H
+
+/* wait until logical cpus [0, ncpus) have all called mr_barrier */
+void mr_barrier(int lcpu, int ncpus);
+
+#endif
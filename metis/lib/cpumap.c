@@ -1,10 +1,45 @@
 #include "lib/cpumap.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#if XV6_USER
+#include "types.h"
+#include "uk/topology.h"
+#endif
 
 int lcpu_to_pcpu[JOS_NCPU];
+int lcpu_to_node[JOS_NCPU];
+int cpumap_nnodes = 1;
+
+/* Find the NUMA node of each cpu.  Without topology information, all
+ * cpus are on node 0. */
+static void
+cpumap_init_nodes(void)
+{
+    int pcpu_to_node[JOS_NCPU];
+    memset(pcpu_to_node, 0, sizeof(pcpu_to_node));
+#if XV6_USER
+    int fd = open("/dev/topology", O_RDONLY);
+    if (fd >= 0) {
+	struct cputopo t;
+	while (read(fd, &t, sizeof(t)) == sizeof(t))
+	    if (t.cpu < JOS_NCPU)
+		pcpu_to_node[t.cpu] = t.node;
+	close(fd);
+    }
+#endif
+    cpumap_nnodes = 1;
+    for (int i = 0; i < JOS_NCPU; i++) {
+	lcpu_to_node[i] = pcpu_to_node[lcpu_to_pcpu[i]];
+	if (lcpu_to_node[i] >= cpumap_nnodes)
+	    cpumap_nnodes = lcpu_to_node[i] + 1;
+    }
+}
 
 void
 cpumap_init()
 {
     for (int i = 0; i < JOS_NCPU; i++)
 	lcpu_to_pcpu[i] = i;
+    cpumap_init_nodes();
 }
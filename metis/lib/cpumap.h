@@ -2,6 +2,9 @@
 #define CPUMAP_H
 
 extern int lcpu_to_pcpu[JOS_NCPU];
+/* NUMA node of each logical cpu, and the number of nodes */
+extern int lcpu_to_node[JOS_NCPU];
+extern int cpumap_nnodes;
 void cpumap_init();
 
 #endif
@@ -34,6 +34,7 @@ enum				// available options are index_arraybkt, index_appendbkt, index_btreebkt
 
 static int JSHARED_ATTR imgr;
 static key_cmp_t JSHARED_ATTR keycmp = NULL;
+static key_prefix_t JSHARED_ATTR keyprefix = NULL;
 
 static int ncols = 0;
 static int nrows = 0;
@@ -50,7 +51,7 @@ kvst_set_bktmgr(int idx)
     assert(keycmp);
     imgr = idx;
     mgrs[imgr]->mbm_set_util(keycmp);
-    rbkts_set_util(keycmp);
+    rbkts_set_util(keycmp, keyprefix);
     reduce_or_group_setcmp(keycmp);
 }
 
@@ -130,7 +131,7 @@ kvst_map_worker_init(int row)
 }
 
 void
-kvst_init(int rows, int cols, int nsplits)
+kvst_init(int rows, int cols, int nsplits, int reduce_skipped)
 {
     nrows = rows;
     ncols = cols;
@@ -143,7 +144,7 @@ kvst_init(int rows, int cols, int nsplits)
 	kvst_set_bktmgr(def_imgr);
 #endif
     mgrs[imgr]->mbm_mbks_init(rows, cols);
-    rbkts_init(nsplits);
+    rbkts_init(nsplits, !reduce_skipped);
 }
 
 void
@@ -159,10 +160,11 @@ kvst_map_put(int row, void *key, void *val, size_t keylen, unsigned hash)
 }
 
 void
-kvst_set_util(key_cmp_t kcmp, keycopy_t kcp)
+kvst_set_util(key_cmp_t kcmp, keycopy_t kcp, key_prefix_t kprefix)
 {
     keycmp = kcmp;
     mrkeycopy = kcp;
+    keyprefix = kprefix;
 }
 
 void
@@ -4,7 +4,7 @@
 #include "mr-types.h"
 #include "pchandler.h"
 
-void kvst_set_util(key_cmp_t fn, keycopy_t keycopy);
+void kvst_set_util(key_cmp_t fn, keycopy_t keycopy, key_prefix_t kprefix);
 
 /* Initialize the data structure for sampling, which involves
    the Map phase only. */
@@ -12,7 +12,7 @@ void kvst_sample_init(int rows, int cols);
 uint64_t kvst_sample_finished(int ntotal);
 
 /* Initialize the data structure for Map and Reduce phase */
-void kvst_init(int rows, int cols, int nsplits);
+void kvst_init(int rows, int cols, int nsplits, int reduce_skipped);
 void kvst_destroy();
 
 /* map phase */
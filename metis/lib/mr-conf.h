@@ -33,6 +33,21 @@ enum { use_psrs = 1 };
 enum { use_psrs = 1 };
 #endif
 
+/* Parallel sort used for the final merge when use_psrs is set.  Apps
+ * choose one at run time with mr_param_t.merge_backend; see also
+ * mr_merge_backend().
+ *     merge_psrs: PSRS (the default)
+ *     merge_radix: radix partition on a key prefix, then sort each
+ *         partition.  Needs mr_param_t.key_prefix and no output compare
+ *         function; otherwise Metis uses PSRS.
+ *     merge_samplesort: partition by splitters from a random sample */
+enum {
+    merge_psrs,
+    merge_radix,
+    merge_samplesort,
+    merge_nbackends
+};
+
 /* enable profiling. For detailed profiling options, see lib/mr-prof.c */
 //#define PROFILE_ENABLED
 
@@ -11,6 +11,9 @@
 #include "thread.h"
 #include "presplitter.h"
 #include "apphelper.h"
+#include "cpumap.h"
+#include "strkey.h"
+#include "rbktsmgr.h"
 
 #if XV6_USER
 #include "sysstubs.h"           /* For xv6 pt_pages */
@@ -50,15 +53,49 @@ static uint64_t total_merge_time;
 static uint64_t total_real_time;
 extern TLS int cur_lcpu;	// defined in lib/pthreadpool.c
 
-static unsigned
-default_hasher(void *key, int key_size)
+/* Reduce tasks are split into a contiguous range per NUMA node, in
+ * proportion to the node's cores.  Cores take tasks from their own
+ * node's range first, so each reduce bucket is usually filled (and
+ * first touched) by a core on one node.  Idle cores then steal from
+ * other nodes. */
+typedef union {
+    struct {
+	int next;
+	int end;
+    };
+    char __pad[JOS_CLINE];
+} node_tasks_t;
+
+static node_tasks_t node_tasks[JOS_NCPU];
+
+static void
+mr_reduce_tasks_init(int ntasks, int ncpus)
 {
-    size_t hash = 5381;
-    char *str = (char *) key;
+    int nnode_cpus[JOS_NCPU];
+    memset(nnode_cpus, 0, sizeof(nnode_cpus));
+    for (int i = 0; i < ncpus; i++)
+	nnode_cpus[lcpu_to_node[i]]++;
+    int ncum = 0;
+    for (int n = 0; n < cpumap_nnodes; n++) {
+	node_tasks[n].next = (uint64_t) ntasks * ncum / ncpus;
+	ncum += nnode_cpus[n];
+	node_tasks[n].end = (uint64_t) ntasks * ncum / ncpus;
+    }
+}
 
-    for (int i = 0; i < key_size; i++)
-	hash = ((hash << 5) + hash) + ((unsigned) str[i]);
-    return hash % ((unsigned) (-1));
+static int
+mr_reduce_next_task(int lcpu)
+{
+    int node = lcpu_to_node[lcpu];
+    for (int i = 0; i < cpumap_nnodes; i++) {
+	node_tasks_t *nt = &node_tasks[(node + i) % cpumap_nnodes];
+	if (nt->next >= nt->end)
+	    continue;
+	int task = atomic_add32_ret(&nt->next);
+	if (task < nt->end)
+	    return task;
+    }
+    return -1;
 }
 
 static void *
@@ -85,15 +122,14 @@ mr_map_worker(void *arg)
 }
 
 static void *
-mr_reduce_worker(void *arg)
+mr_reduce_worker(void * __attribute__ ((unused)) arg)
 {
     prof_worker_start(REDUCE, cur_lcpu);
-    int *task_idx = (int *) arg;
     int num_tasks = 0;
     assert(the_app.atype != atype_maponly);
     while (1) {
-	int cur_task = atomic_add32_ret(task_idx);
-	if (cur_task >= the_app.mapgr.tasks)
+	int cur_task = mr_reduce_next_task(cur_lcpu);
+	if (cur_task < 0)
 	    break;
 	kvst_reduce_do_task(cur_lcpu, cur_task);
 	num_tasks++;
@@ -149,7 +185,7 @@ mr_setup(mr_param_t * param)
     assert(mr_state.mr_fixed.map_func != NULL);
     // fix partition function
     if (mr_state.mr_fixed.part_func == NULL)
-	mr_state.mr_fixed.part_func = default_hasher;
+	mr_state.mr_fixed.part_func = strkey_hash;
     // fix # processors
     uint32_t maxcores = get_core_count();
     assert(mr_state.mr_fixed.nr_cpus <= maxcores);
@@ -161,7 +197,9 @@ mr_setup(mr_param_t * param)
     presplitter_init(&mr_state.ps, param->split_func, param->split_arg,
 		     mr_state.mr_fixed.nr_cpus);
     // setup key comparator and keycopy functions
-    kvst_set_util(mr_state.mr_fixed.key_cmp, mr_state.mr_fixed.keycopy);
+    kvst_set_util(mr_state.mr_fixed.key_cmp, mr_state.mr_fixed.keycopy,
+		  mr_state.mr_fixed.key_prefix);
+    rbkts_set_merge(mr_state.mr_fixed.merge_backend);
     mr_state.skip_reduce_phase = 0;
     if (the_app.atype == atype_maponly) {
 	mr_state.skip_reduce_phase = 1;
@@ -177,7 +215,7 @@ mr_setup(mr_param_t * param)
     // fix the number of reduce tasks by sampling, if enabled
     if (mr_state.skip_reduce_phase) {
 	mr_state.merge_nsplits = mr_state.mr_fixed.nr_cpus;
-	kvst_init(mr_state.mr_fixed.nr_cpus, 1, mr_state.merge_nsplits);
+	kvst_init(mr_state.mr_fixed.nr_cpus, 1, mr_state.merge_nsplits, 1);
     } else {
 	if (the_app.mapgr.tasks == 0) {
 	    the_app.mapgr.tasks = def_sample_reduce_tasks;
@@ -188,7 +226,7 @@ mr_setup(mr_param_t * param)
 	}
 	mr_state.merge_nsplits = the_app.mapgr.tasks;
 	kvst_init(mr_state.mr_fixed.nr_cpus, the_app.mapgr.tasks,
-		  mr_state.merge_nsplits);
+		  mr_state.merge_nsplits, 0);
     }
     return 0;
 }
@@ -235,6 +273,7 @@ mr_run_scheduler(mr_param_t * param)
 	// reduce phase
         printf("done with map\n");
 	start_time = read_tsc();
+	mr_reduce_tasks_init(the_app.mapgr.tasks, mr_state.mr_fixed.nr_cpus);
 	mr_run_task(REDUCE);
 	reduce_time = read_tsc() - start_time;
     }
@@ -263,6 +302,21 @@ mr_run_scheduler(mr_param_t * param)
     return 0;
 }
 
+static const char *merge_names[] = {
+    [merge_psrs] = "psrs",
+    [merge_radix] = "radix",
+    [merge_samplesort] = "samplesort",
+};
+
+int
+mr_merge_backend(const char *name)
+{
+    for (int i = 0; i < merge_nbackends; i++)
+	if (!strcmp(name, merge_names[i]))
+	    return i;
+    return -1;
+}
+
 void
 mr_print_stats(void)
 {
@@ -271,6 +325,16 @@ mr_print_stats(void)
 	total_sample_time + total_map_time + total_reduce_time +
 	total_merge_time;
 #define SEP "\t"
+    /* Print the backend that ran; rbkts_merge may not honor the
+     * requested one */
+    int used = rbkts_merge_used();
+    if (used != mr_state.mr_fixed.merge_backend && used >= 0)
+	printf("Merge backend: %s (%s requested)\n", merge_names[used],
+	       merge_names[mr_state.mr_fixed.merge_backend]);
+    else
+	printf("Merge backend: %s\n",
+	       use_psrs ? merge_names[mr_state.mr_fixed.merge_backend] :
+	       "mergesort");
     printf("Runtime in millisecond [%d cores]\n\t",
 	   mr_state.mr_fixed.nr_cpus);
     printf("Sample:\t%" PRIu64 SEP,
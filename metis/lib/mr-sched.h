@@ -2,6 +2,7 @@
 #define MR_SCHED_H
 
 #include "mr-types.h"
+#include "mr-conf.h"
 #include "profile.h"
 
 /* Metis parameters  */
@@ -14,6 +15,8 @@ typedef struct {
     /* optional arguments */
     partition_t part_func;	/* partition func. */
     keycopy_t keycopy;		/* invoked by Metis library for each new key exactly once */
+    key_prefix_t key_prefix;	/* order-preserving key prefix for merge_radix. See lib/mr-conf.h */
+    int merge_backend;		/* final merge sort (merge_psrs by default). See lib/mr-conf.h */
     int nr_cpus;		/* # of cpus to use (use all cores by default) */
 } mr_param_t;
 
@@ -21,6 +24,9 @@ typedef struct {
 extern void mr_print_stats(void);
 extern int mr_run_scheduler(mr_param_t * param);
 extern void mr_finalize(void);
+/* returns the merge backend called name ("psrs", "radix" or
+ * "samplesort"), or -1 if there is none. */
+extern int mr_merge_backend(const char *name);
 
 /* called in user defined map function. If keycopy function is used, Metis
  * calls the keycopy function for each new key, and user can free the key
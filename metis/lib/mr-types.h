@@ -78,6 +78,9 @@ typedef unsigned (*partition_t) (void *, int);
 typedef void *(*keycopy_t) (void *key, size_t);
 typedef void *(*vmodifier_t) (void *oldv, void *newv, int isnew);
 typedef int (*key_cmp_t) (const void *, const void *);
+/* returns a 64-bit prefix of a key such that key_cmp(a, b) < 0 implies
+ * prefix(a) <= prefix(b) */
+typedef uint64_t(*key_prefix_t) (const void *);
 typedef int (*kv_out_cmp_t) (const keyval_t *, const keyval_t *);
 typedef int (*kvs_out_cmp_t) (const keyvals_len_t *, const keyvals_len_t *);
 typedef int (*pair_cmp_t) (const void *, const void *);
@@ -0,0 +1,342 @@
+#include <string.h>
+#include <assert.h>
+#include "parsort.h"
+#include "bench.h"
+#include "barrier.h"
+
+enum { main_lcpu = 0 };
+enum { free_lcpu = 1 };
+
+/* radix partition digit; the histogram (8KB) fits in L1 */
+enum { radix_bits = 11, radix_nbkts = 1 << radix_bits };
+/* bytes buffered per partition before writing them out.  Writing whole
+ * cache lines avoids reading the destination line for each pair, and
+ * keeps the number of streams being written small enough for the
+ * write-combining buffers. */
+enum { wc_line = 64 };
+/* bounds on the samples each cpu contributes to samplesort */
+enum { min_oversample = 8, max_oversample = 128 };
+
+typedef union {
+    struct {
+	uint64_t min;
+	uint64_t max;
+    };
+    char __pad[JOS_CLINE];
+} prefix_range_t;
+
+/* state shared between the cpus of one sort */
+static volatile int total_len;
+static int *coll_start;		// global index of each collection's first pair
+static void *volatile output;
+static uint32_t *counts;	// per-cpu partition sizes
+static int nparts;
+static volatile int shift;
+static prefix_range_t ranges[JOS_NCPU];
+static void *volatile samples;
+static int oversample;
+
+/* Set up the state shared by both sorts.  Called by the main cpu. */
+static void
+sort_init(void *acolls, int ncolls, int ncpus, const pc_handler_t * pch,
+	  int np)
+{
+    const int parrsz = pch->pch_get_parr_size();
+    coll_start = malloc((ncolls + 1) * sizeof(int));
+    total_len = 0;
+    for (int i = 0; i < ncolls; i++) {
+	coll_start[i] = total_len;
+	total_len += pch->pch_get_len(ARRELEM(acolls, parrsz, i));
+    }
+    coll_start[ncolls] = total_len;
+    nparts = np;
+    counts = malloc(ncpus * nparts * sizeof(uint32_t));
+    output = malloc(total_len * pch->pch_get_pair_size());
+}
+
+static void
+free_arr_colls(void *acolls, int ncolls, const pc_handler_t * pch)
+{
+    const int parrsz = pch->pch_get_parr_size();
+    for (int i = 0; i < ncolls; i++)
+	pch->pch_shallow_free(ARRELEM(acolls, parrsz, i));
+}
+
+/* Too little input to be worth splitting: the main cpu sorts it all.
+ * Returns 1 if the caller is done. */
+static int
+sort_small(void *acolls, int ncolls, int ncpus, int lcpu,
+	   const pc_handler_t * pch, pair_cmp_t pcmp)
+{
+    if (ncpus > 1 && total_len >= ncpus * ncpus * ncpus)
+	return 0;
+    if (lcpu != main_lcpu)
+	return 1;
+    const int psz = pch->pch_get_pair_size();
+    const int parrsz = pch->pch_get_parr_size();
+    for (int i = 0; i < ncolls; i++) {
+	void *coll = ARRELEM(acolls, parrsz, i);
+	memcpy(ARRELEM(output, psz, coll_start[i]),
+	       pch->pch_get_arr_elems(coll),
+	       (coll_start[i + 1] - coll_start[i]) * psz);
+    }
+    qsort(output, total_len, psz, pcmp);
+    return 1;
+}
+
+/* The main cpu hands the output to the first collection.  The input
+ * collections have been freed by free_lcpu, unless the sort was small. */
+static void
+sort_finish(void *acolls, int ncolls, int lcpu, const pc_handler_t * pch,
+	    int small)
+{
+    if (lcpu != main_lcpu)
+	return;
+    if (small)
+	free_arr_colls(acolls, ncolls, pch);
+    pch->pch_set_elems(acolls, (void *) output, total_len);
+    free(coll_start);
+    free(counts);
+    coll_start = NULL;
+    counts = NULL;
+}
+
+/* Run body for each input pair with global index i in [start, end) */
+#define FOREACH_PAIR(acolls, pch, start, end, i, pair, body)		\
+do {									\
+    if ((start) >= (end))						\
+	break;								\
+    const int __psz = (pch)->pch_get_pair_size();			\
+    const int __parrsz = (pch)->pch_get_parr_size();			\
+    int __c = 0;							\
+    while (coll_start[__c + 1] <= (start))				\
+	__c++;								\
+    char *__elems = (pch)->pch_get_arr_elems(				\
+		    ARRELEM(acolls, __parrsz, __c));			\
+    for (int i = (start); i < (end); i++) {				\
+	while (i >= coll_start[__c + 1]) {				\
+	    __c++;							\
+	    __elems = (pch)->pch_get_arr_elems(				\
+		      ARRELEM(acolls, __parrsz, __c));			\
+	}								\
+	void *pair = __elems + (i - coll_start[__c]) * __psz;		\
+	body;								\
+    }									\
+} while (0)
+
+/* This cpu's share of the input */
+static void
+sort_slice(int ncpus, int lcpu, int *start, int *end)
+{
+    int w = (total_len + ncpus - 1) / ncpus;
+    *start = min(w * lcpu, total_len);
+    *end = min(w * (lcpu + 1), total_len);
+}
+
+/* Given every cpu's partition sizes, compute where this cpu writes each
+ * of its partitions (pos) and, optionally, where each partition starts
+ * in the output (pstart, with nparts + 1 entries). */
+static void
+part_offsets(int ncpus, int lcpu, int *pos, int *pstart)
+{
+    int base = 0;
+    for (int p = 0; p < nparts; p++) {
+	if (pstart)
+	    pstart[p] = base;
+	pos[p] = base;
+	for (int c = 0; c < ncpus; c++) {
+	    if (c < lcpu)
+		pos[p] += counts[c * nparts + p];
+	    base += counts[c * nparts + p];
+	}
+    }
+    if (pstart)
+	pstart[nparts] = base;
+}
+
+static inline int
+radix_digit(uint64_t prefix)
+{
+    return (prefix >> shift) & (radix_nbkts - 1);
+}
+
+void
+radixsort(void *acolls, int ncolls, int ncpus, int lcpu,
+	  const pc_handler_t * pch, pair_cmp_t pcmp, key_prefix_t kprefix)
+{
+    const int psz = pch->pch_get_pair_size();
+    if (lcpu == main_lcpu)
+	sort_init(acolls, ncolls, ncpus, pch, radix_nbkts);
+    mr_barrier(lcpu, ncpus);
+    if (sort_small(acolls, ncolls, ncpus, lcpu, pch, pcmp)) {
+	sort_finish(acolls, ncolls, lcpu, pch, 1);
+	return;
+    }
+
+    // Compute the prefix of each local pair once, and the local range
+    int start, end;
+    sort_slice(ncpus, lcpu, &start, &end);
+    uint64_t *prefix = malloc((end - start + 1) * sizeof(uint64_t));
+    uint64_t lmin = ~0ULL, lmax = 0;
+    FOREACH_PAIR(acolls, pch, start, end, i, pair, {
+	uint64_t p = kprefix(pch->pch_get_key(pair));
+	prefix[i - start] = p;
+	lmin = min(lmin, p);
+	lmax = max(lmax, p);
+    });
+    ranges[lcpu].min = lmin;
+    ranges[lcpu].max = lmax;
+    mr_barrier(lcpu, ncpus);
+
+    // Partition on the highest bits that are not the same for all keys
+    if (lcpu == main_lcpu) {
+	uint64_t gmin = ~0ULL, gmax = 0;
+	for (int i = 0; i < ncpus; i++) {
+	    gmin = min(gmin, ranges[i].min);
+	    gmax = max(gmax, ranges[i].max);
+	}
+	int hb = (gmin == gmax) ? 0 : 64 - __builtin_clzll(gmin ^ gmax);
+	shift = hb > radix_bits ? hb - radix_bits : 0;
+    }
+    uint32_t *hist = &counts[lcpu * radix_nbkts];
+    memset(hist, 0, radix_nbkts * sizeof(uint32_t));
+    mr_barrier(lcpu, ncpus);
+    for (int i = 0; i < end - start; i++)
+	hist[radix_digit(prefix[i])]++;
+    mr_barrier(lcpu, ncpus);
+
+    // Scatter through per-partition line buffers
+    int *pos = malloc(radix_nbkts * sizeof(int));
+    int *pstart = malloc((radix_nbkts + 1) * sizeof(int));
+    part_offsets(ncpus, lcpu, pos, pstart);
+    const int per_line = max(1, wc_line / psz);
+    char *wcbuf = malloc(radix_nbkts * per_line * psz);
+    uint8_t *wcn = calloc(radix_nbkts, sizeof(uint8_t));
+    FOREACH_PAIR(acolls, pch, start, end, i, pair, {
+	int d = radix_digit(prefix[i - start]);
+	char *line = wcbuf + d * per_line * psz;
+	memcpy(line + wcn[d] * psz, pair, psz);
+	if (++wcn[d] == per_line) {
+	    memcpy(ARRELEM(output, psz, pos[d]), line, per_line * psz);
+	    pos[d] += per_line;
+	    wcn[d] = 0;
+	}
+    });
+    for (int d = 0; d < radix_nbkts; d++)
+	if (wcn[d])
+	    memcpy(ARRELEM(output, psz, pos[d]), wcbuf + d * per_line * psz,
+		   wcn[d] * psz);
+    free(wcn);
+    free(wcbuf);
+    free(prefix);
+    mr_barrier(lcpu, ncpus);
+    if (lcpu == free_lcpu)
+	free_arr_colls(acolls, ncolls, pch);
+
+    // Sort within each partition.  A cpu takes the partitions that
+    // start in its share of the output.
+    for (int d = 0; d < radix_nbkts; d++) {
+	int n = pstart[d + 1] - pstart[d];
+	if (n > 1 && (int64_t) pstart[d] * ncpus / total_len == lcpu)
+	    qsort(ARRELEM(output, psz, pstart[d]), n, psz, pcmp);
+    }
+    free(pos);
+    free(pstart);
+    mr_barrier(lcpu, ncpus);
+    sort_finish(acolls, ncolls, lcpu, pch, 0);
+}
+
+/* Index of the first of the nparts - 1 splitters that is > pair */
+static int
+sample_part(const void *pair, int psz, pair_cmp_t pcmp)
+{
+    int lo = 0, hi = nparts - 1;
+    while (lo < hi) {
+	int mid = (lo + hi) / 2;
+	if (pcmp(ARRELEM(samples, psz, mid), pair) > 0)
+	    hi = mid;
+	else
+	    lo = mid + 1;
+    }
+    return lo;
+}
+
+void
+samplesort(void *acolls, int ncolls, int ncpus, int lcpu,
+	   const pc_handler_t * pch, pair_cmp_t pcmp)
+{
+    const int psz = pch->pch_get_pair_size();
+    if (lcpu == main_lcpu) {
+	sort_init(acolls, ncolls, ncpus, pch, ncpus);
+	// About log2(n) samples per cpu keeps partitions within a small
+	// factor of n / ncpus with high probability.
+	oversample = 64 - __builtin_clzll((uint64_t) total_len | 1);
+	oversample = max(min_oversample, min(max_oversample, oversample));
+	samples = malloc(ncpus * oversample * psz);
+    }
+    mr_barrier(lcpu, ncpus);
+    if (sort_small(acolls, ncolls, ncpus, lcpu, pch, pcmp)) {
+	if (lcpu == main_lcpu)
+	    free((void *) samples);
+	sort_finish(acolls, ncolls, lcpu, pch, 1);
+	return;
+    }
+
+    int start, end;
+    sort_slice(ncpus, lcpu, &start, &end);
+    uint32_t seed = lcpu + 1;
+    for (int k = 0; k < oversample; k++) {
+	int i = start + rnd(&seed) % (end - start);
+	FOREACH_PAIR(acolls, pch, i, i + 1, j, pair, {
+	    memcpy(ARRELEM(samples, psz, lcpu * oversample + k), pair, psz);
+	});
+    }
+    mr_barrier(lcpu, ncpus);
+
+    // Pick ncpus - 1 evenly spaced splitters from the sorted samples
+    if (lcpu == main_lcpu) {
+	qsort((void *) samples, ncpus * oversample, psz, pcmp);
+	for (int i = 0; i < ncpus - 1; i++)
+	    memcpy(ARRELEM(samples, psz, i),
+		   ARRELEM(samples, psz, (i + 1) * oversample), psz);
+    }
+    mr_barrier(lcpu, ncpus);
+
+    uint16_t *part = malloc((end - start + 1) * sizeof(uint16_t));
+    uint32_t *cnt = &counts[lcpu * nparts];
+    memset(cnt, 0, nparts * sizeof(uint32_t));
+    FOREACH_PAIR(acolls, pch, start, end, i, pair, {
+	int p = sample_part(pair, psz, pcmp);
+	part[i - start] = p;
+	cnt[p]++;
+    });
+    mr_barrier(lcpu, ncpus);
+
+    int *pos = malloc(nparts * sizeof(int));
+    int *pstart = malloc((nparts + 1) * sizeof(int));
+    part_offsets(ncpus, lcpu, pos, pstart);
+    FOREACH_PAIR(acolls, pch, start, end, i, pair, {
+	int p = part[i - start];
+	memcpy(ARRELEM(output, psz, pos[p]++), pair, psz);
+    });
+    free(part);
+    mr_barrier(lcpu, ncpus);
+    if (lcpu == free_lcpu)
+	free_arr_colls(acolls, ncolls, pch);
+
+    // Each cpu sorts one partition
+    qsort(ARRELEM(output, psz, pstart[lcpu]),
+	  pstart[lcpu + 1] - pstart[lcpu], psz, pcmp);
+    free(pos);
+    free(pstart);
+    mr_barrier(lcpu, ncpus);
+    if (lcpu == main_lcpu)
+	free((void *) samples);
+    sort_finish(acolls, ncolls, lcpu, pch, 0);
+}
+
+uint64_t
+intkey_prefix(const void *key)
+{
+    return (uint64_t) (intptr_t) key ^ (1ULL << 63);
+}
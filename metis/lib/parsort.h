@@ -0,0 +1,23 @@
+#ifndef PARSORT_H
+#define PARSORT_H
+
+#include "pchandler.h"
+
+/* Parallel sorts of an array of collections, alternatives to psrs for
+ * the final merge.  Like psrs, all of cpus [0, ncpus) must call them;
+ * the sorted output is put into the first collection of acolls. */
+
+/* MSD radix partition on the key prefix, then a comparison sort within
+ * each partition.  pcmp must order pairs by key. */
+void radixsort(void *acolls, int ncolls, int ncpus, int lcpu,
+	       const pc_handler_t * pch, pair_cmp_t pcmp,
+	       key_prefix_t kprefix);
+/* Partition by splitters chosen from a random sample, then sort each
+ * partition */
+void samplesort(void *acolls, int ncolls, int ncpus, int lcpu,
+		const pc_handler_t * pch, pair_cmp_t pcmp);
+
+/* key prefix for keys that are signed integers cast to pointers */
+uint64_t intkey_prefix(const void *key);
+
+#endif
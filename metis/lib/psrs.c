@@ -4,6 +4,7 @@
 #include "reduce.h"
 #include "bench.h"
 #include "bsearch.h"
+#include "barrier.h"
 
 enum { main_lcpu = 0 };
 
@@ -12,46 +13,12 @@ enum				// the cpu which frees the reduce buckets. Can be any one but the main c
     free_lcpu = 1
 };
 
-static union {
-    char __pad[JOS_CLINE];
-    volatile int v;
-} ready[JOS_NCPU];
-
 static volatile int total_len = 0;
 static volatile void *pivots = 0;
 static volatile void *output = 0;
 static volatile int subsize[JOS_NCPU * (JOS_NCPU + 1)];
 static volatile int partsize[JOS_NCPU];
 static volatile void *lpairs[JOS_NCPU];
-enum { STOP, START };
-static volatile int status = STOP;
-
-static void
-psrs_barrier(int lcpu, int ncpus)
-{
-    if (lcpu != main_lcpu) {
-	while (status != START) ;
-	ready[lcpu].v = 1;
-	mfence();
-	while (status != STOP) ;
-	ready[lcpu].v = 0;
-    } else {
-	status = START;
-	mfence();
-	for (int i = 0; i < ncpus; i++) {
-	    if (i == main_lcpu)
-		continue;
-	    while (!ready[i].v) ;
-	}
-	status = STOP;
-	mfence();
-	for (int i = 0; i < ncpus; i++) {
-	    if (i == main_lcpu)
-		continue;
-	    while (ready[i].v) ;
-	}
-    }
-}
 
 /* Divide array[start, end] into subarrays using [pivots[fp], pivots[lp]],
  * so that subsize[at + i] is the first element that is > pivots[i]
@@ -220,7 +187,7 @@ psrs(void *acolls, int ncolls, int ncpus, int lcpu,
 	pivots = malloc(JOS_NCPU * (JOS_NCPU - 1) * psz);
 	memset((void *) pivots, 0, JOS_NCPU * (JOS_NCPU - 1) * psz);
     }
-    psrs_barrier(lcpu, ncpus);
+    mr_barrier(lcpu, ncpus);
     // get the [start, end] subarray
     int w = (total_len + ncpus - 1) / ncpus;
     int start = w * lcpu;
@@ -264,7 +231,7 @@ psrs(void *acolls, int ncolls, int ncpus, int lcpu,
 		   ARRELEM(localpairs, psz, copied - 1), psz);
 	}
     }
-    psrs_barrier(lcpu, ncpus);
+    mr_barrier(lcpu, ncpus);
     if (lcpu == main_lcpu) {
 	// sort p * (p - 1) pivots.
 	qsort((void *) pivots, ncpus * (ncpus - 1), psz, pcmp);
@@ -272,18 +239,18 @@ psrs(void *acolls, int ncolls, int ncpus, int lcpu,
 	for (int i = 0; i < ncpus - 1; i++)
 	    memcpy(ARRELEM(pivots, psz, i + 1),
 		   ARRELEM(pivots, psz, i * ncpus + ncpus / 2), psz);
-	psrs_barrier(lcpu, ncpus);
+	mr_barrier(lcpu, ncpus);
     } else {
 	if (lcpu == free_lcpu)
 	    free_arr_colls(acolls, ncolls, pch);
-	psrs_barrier(lcpu, ncpus);
+	mr_barrier(lcpu, ncpus);
     }
     // divide the local list into p sublists by the (p - 1) pivots received from main cpu
     subsize[lcpu * (ncpus + 1)] = 0;
     subsize[lcpu * (ncpus + 1) + ncpus] = copied;
     sublists(localpairs, 0, copied - 1, (int *) &subsize[lcpu * (ncpus + 1)],
 	     (const void *) pivots, 1, ncpus - 1, pcmp, psz);
-    psrs_barrier(lcpu, ncpus);
+    mr_barrier(lcpu, ncpus);
     // decides the size of the lcpu-th sublist
     partsize[lcpu] = 0;
     for (int i = 0; i < ncpus; i++) {
@@ -297,7 +264,7 @@ psrs(void *acolls, int ncolls, int ncpus, int lcpu,
 	pch->pch_set_elems(ARRELEM(acolls, parrsz, 0), (void *) output,
 			   total_len);
     }
-    psrs_barrier(lcpu, ncpus);
+    mr_barrier(lcpu, ncpus);
     // merge (and reduce if required) each partition in parallel
     if (!doreduce) {
 	// determines the position in the final results for local partition
@@ -309,6 +276,6 @@ psrs(void *acolls, int ncolls, int ncpus, int lcpu,
     } else {
 	reduce_or_group(pch, (void **) lpairs, (int *) subsize, lcpu, ncpus);
     }
-    psrs_barrier(lcpu, ncpus);
+    mr_barrier(lcpu, ncpus);
     free(localpairs);
 }
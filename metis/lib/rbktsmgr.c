@@ -4,12 +4,18 @@
 #include "bench.h"
 #include "mr-conf.h"
 #include "mergesort.h"
+#include "parsort.h"
 
 extern app_arg_t the_app;
 static const pc_handler_t *rbkt_pch = NULL;
 static key_cmp_t JSHARED_ATTR keycmp = NULL;
+static key_prefix_t JSHARED_ATTR keyprefix = NULL;
+static int JSHARED_ATTR mergebackend = merge_psrs;
+/* The backend the last merge actually used, or -1 */
+static int JSHARED_ATTR mergeused = -1;
 static void *rbkts = NULL;
 static int nbkts = 0;
+static int lazy_init = 0;
 static JTLS int cur_task;
 
 void
@@ -19,9 +25,23 @@ rbkts_set_pch(const pc_handler_t * pch)
 }
 
 void
-rbkts_set_util(key_cmp_t kcmp)
+rbkts_set_util(key_cmp_t kcmp, key_prefix_t kprefix)
 {
     keycmp = kcmp;
+    keyprefix = kprefix;
+}
+
+void
+rbkts_set_merge(int backend)
+{
+    assert(backend >= 0 && backend < merge_nbackends);
+    mergebackend = backend;
+}
+
+int
+rbkts_merge_used(void)
+{
+    return mergeused;
 }
 
 void *
@@ -30,11 +50,19 @@ rbkts_get(int ibkt)
     return ((char *) rbkts) + ibkt * rbkt_pch->pch_get_parr_size();
 }
 
+/* If lazy, each bucket is initialized by the reduce task that fills
+ * it, so that its memory is first touched on the reducing core's node
+ * instead of the main core's. */
 void
-rbkts_init(int n)
+rbkts_init(int n, int lazy)
 {
-    rbkts = calloc(n, rbkt_pch->pch_get_parr_size());
     nbkts = n;
+    lazy_init = lazy;
+    if (lazy) {
+	rbkts = malloc(n * rbkt_pch->pch_get_parr_size());
+	return;
+    }
+    rbkts = calloc(n, rbkt_pch->pch_get_parr_size());
     for (int i = 0; i < n; i++)
 	rbkt_pch->pch_init(rbkts_get(i));
 }
@@ -76,6 +104,8 @@ void
 rbkts_set_reduce_task(int itask)
 {
     cur_task = itask;
+    if (lazy_init)
+	rbkt_pch->pch_init(rbkts_get(itask));
 }
 
 void
@@ -110,10 +140,23 @@ rbkts_sort(int ibkt)
 void
 rbkts_merge(int ncpus, int lcpu)
 {
-    if (use_psrs)
+    /* Radix sort needs a key prefix that orders pairs the way the
+     * output does, so it falls back to PSRS otherwise.  Every CPU
+     * makes the same choice, so they all store the same mergeused. */
+    if (use_psrs && mergebackend == merge_radix && keyprefix &&
+	!the_app.any.outcmp) {
+	mergeused = merge_radix;
+	radixsort(rbkts, nbkts, ncpus, lcpu, rbkt_pch, rbkts_pair_cmp,
+		  keyprefix);
+    } else if (use_psrs && mergebackend == merge_samplesort) {
+	mergeused = merge_samplesort;
+	samplesort(rbkts, nbkts, ncpus, lcpu, rbkt_pch, rbkts_pair_cmp);
+    } else if (use_psrs) {
+	mergeused = merge_psrs;
 	psrs(rbkts, nbkts, ncpus, lcpu, rbkt_pch, rbkts_pair_cmp, 0);
-    else
+    } else {
 	mergesort(rbkts, nbkts, rbkt_pch, ncpus, lcpu, rbkts_pair_cmp);
+    }
 }
 
 static const pc_handler_t *cmppch;
@@ -0,0 +1,141 @@
+#include <stdint.h>
+#include <string.h>
+#include "strkey.h"
+#include "bench.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+
+/* An unaligned 16-byte load from p may run past the end of the key.
+ * That is harmless as long as it doesn't cross into the next page,
+ * which might not be mapped. */
+INLINE_ATTR int
+load16_safe(const void *p)
+{
+    return ((uintptr_t) p & (JOS_PAGESIZE - 1)) <= JOS_PAGESIZE - 16;
+}
+
+/* Load the first n (0 <= n <= 16) bytes at p, zeroing the rest */
+INLINE_ATTR __m128i
+load_partial(const char *p, int n)
+{
+    __m128i v;
+    if (load16_safe(p)) {
+	v = _mm_loadu_si128((const __m128i *) p);
+    } else {
+	char buf[16] = { 0 };
+	memcpy(buf, p, n);
+	v = _mm_loadu_si128((const __m128i *) buf);
+    }
+    const __m128i idx = _mm_setr_epi8(0, 1, 2, 3, 4, 5, 6, 7,
+				      8, 9, 10, 11, 12, 13, 14, 15);
+    return _mm_and_si128(v, _mm_cmpgt_epi8(_mm_set1_epi8(n), idx));
+}
+
+INLINE_ATTR uint64_t
+mix64(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
+}
+
+unsigned
+strkey_hash(void *key, int key_size)
+{
+    const char *p = (const char *) key;
+    uint64_t h = 0x9e3779b97f4a7c15ULL ^ (uint64_t) key_size;
+    for (; key_size > 0; p += 16, key_size -= 16) {
+	__m128i v = key_size >= 16 ?
+	    _mm_loadu_si128((const __m128i *) p) : load_partial(p, key_size);
+	uint64_t lo = _mm_cvtsi128_si64(v);
+	uint64_t hi = _mm_cvtsi128_si64(_mm_unpackhi_epi64(v, v));
+	h = mix64(h ^ lo) + hi;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+    }
+    h = mix64(h);
+    return (unsigned) (h ^ (h >> 32));
+}
+
+int
+strkey_cmp(const void *s1, const void *s2)
+{
+    const unsigned char *a = (const unsigned char *) s1;
+    const unsigned char *b = (const unsigned char *) s2;
+    const __m128i zero = _mm_setzero_si128();
+    for (;;) {
+	if (!load16_safe(a) || !load16_safe(b)) {
+	    // Byte at a time up to the page boundary
+	    for (int i = 0; i < 16; i++, a++, b++)
+		if (*a != *b || !*a)
+		    return *a - *b;
+	    continue;
+	}
+	__m128i va = _mm_loadu_si128((const __m128i *) a);
+	__m128i vb = _mm_loadu_si128((const __m128i *) b);
+	// Bits for bytes that differ or end the string
+	int m = (_mm_movemask_epi8(_mm_cmpeq_epi8(va, vb)) ^ 0xffff) |
+	    _mm_movemask_epi8(_mm_cmpeq_epi8(va, zero));
+	if (m) {
+	    int i = __builtin_ctz(m);
+	    return a[i] - b[i];
+	}
+	a += 16;
+	b += 16;
+    }
+}
+
+uint64_t
+strkey_prefix(const void *key)
+{
+    const char *p = (const char *) key;
+    __m128i v;
+    if (load16_safe(p)) {
+	v = _mm_loadu_si128((const __m128i *) p);
+	// Zero everything from the terminator on
+	int z = _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128()));
+	if (z)
+	    v = load_partial(p, __builtin_ctz(z));
+    } else {
+	char buf[8] = { 0 };
+	for (int i = 0; i < 8 && p[i]; i++)
+	    buf[i] = p[i];
+	v = _mm_loadl_epi64((const __m128i *) buf);
+    }
+    return __builtin_bswap64(_mm_cvtsi128_si64(v));
+}
+
+#else
+
+unsigned
+strkey_hash(void *key, int key_size)
+{
+    size_t hash = 5381;
+    char *str = (char *) key;
+
+    for (int i = 0; i < key_size; i++)
+	hash = ((hash << 5) + hash) + ((unsigned) str[i]);
+    return hash % ((unsigned) (-1));
+}
+
+int
+strkey_cmp(const void *s1, const void *s2)
+{
+    return strcmp((const char *) s1, (const char *) s2);
+}
+
+uint64_t
+strkey_prefix(const void *key)
+{
+    const unsigned char *p = (const unsigned char *) key;
+    uint64_t prefix = 0;
+    int end = 0;
+    for (int i = 0; i < 8; i++) {
+	end = end || !p[i];
+	prefix = (prefix << 8) | (end ? 0 : p[i]);
+    }
+    return prefix;
+}
+
+#endif
@@ -0,0 +1,16 @@
+#ifndef STRKEY_H
+#define STRKEY_H
+
+#include <stdint.h>
+
+/* Hashing and comparison for short keys, 16 bytes at a time with SSE2
+ * when available. */
+
+// hash key_size bytes of key; the default partition function
+unsigned strkey_hash(void *key, int key_size);
+// compare two NUL-terminated keys, like strcmp
+int strkey_cmp(const void *s1, const void *s2);
+// the first 8 bytes of a NUL-terminated key, for radix sorting
+uint64_t strkey_prefix(const void *key);
+
+#endif
@@ -1,5 +1,4 @@
 #pragma once
-#define NPROC        64  // maximum number of processes
 #define KSTACKSIZE 32768 // size of per-process kernel stack
 #define NOFILE      100  // open files per process
 #define NFILE       100  // open files per system
@@ -13,12 +12,12 @@
 #define UNIX_PATH_MAX 128
 #define NEPOCH        4
 #define CACHELINE    64  // cache line size
-#define CPUKSTACKS   (NPROC + NCPU*2)
 #define VICTIMAGE 1000000 // cycles a proc executes before an eligible victim
 #define VERBOSE       0  // print kernel diagnostics
 #define SPINLOCK_DEBUG DEBUG // Debug spin locks
 #define RCU_TYPE_DEBUG DEBUG
-#define LOCKSTAT      DEBUG
+#define LOCKSTAT      1  // Lock statistics (off until started via /dev/lockstat)
+#define KTRACE        1  // Kernel tracepoints (off until started via /dev/trace)
 #define ALLOC_MEMSET  DEBUG
 #define BUDDY_DEBUG   DEBUG
 #define REFCACHE_DEBUG DEBUG
@@ -36,6 +35,13 @@
 //  batched_shootdown
 //  core_tracking_shootdown
 #define TLB_SCHEME    core_tracking_shootdown
+// If 1, munmap doesn't wait for remote TLB shootdowns to finish and
+// the unmapped pages are freed once they have.  Only has an effect
+// with mmu_per_core_page_table.
+#define TLB_ASYNC_SHOOTDOWN 1
+// If 1, cache the parsed segment layout of executables on their
+// mfile, so repeated execs of the same file skip reading it.
+#define EXEC_IMAGE_CACHE 1
 // Physical page reference counting scheme.  One of:
 //  :: for shared reference counters
 //  refcache:: for refcache counters
@@ -43,6 +49,21 @@
 #define PAGE_REFCOUNT refcache::
 // The maximum number of recently freed pages to cache per core.
 #define KALLOC_HOT_PAGES 128
+// Multi-page blocks of orders 1 through KALLOC_CACHE_ORDERS are also
+// cached per core, KALLOC_CACHE_BLOCKS of each order.  Order 3 covers
+// kernel stacks.
+#define KALLOC_CACHE_ORDERS 3
+#define KALLOC_CACHE_BLOCKS 16
+// The largest buddy block is 4 KB << BUDDY_MAX_ORDER.  18 allows 1 GB
+// blocks (and so 2 MB ones) in memory regions large enough to hold
+// them; smaller regions use smaller maximum blocks.
+#define BUDDY_MAX_ORDER 18
+// If 1, run a thread per NUMA node that migrates movable pages out of
+// fragmented pageblocks to rebuild large free blocks.
+#define KALLOC_COMPACT 1
+// If 1, run a thread per NUMA node that runs the registered shrinkers
+// when the node's free memory drops below its low watermark.
+#define KALLOC_RECLAIM 1
 // How to balance memory load.  If 1, dynamically load balance pages
 // between buddy allocators.  If 0, directly steal and return memory
 // from remote buddy allocators.
@@ -52,6 +73,9 @@
 #define KALLOC_BUDDY_PER_CPU 1
 // Whether or not to load balance in the scheduler.
 #define SCHED_LOAD_BALANCE 0
+// Whether fork and spawn start new processes on a lightly loaded core
+// near the memory they will use, rather than on the parent's core.
+#define SCHED_PLACE_NEW 1
 // Reference counting scheme for inode's nlink.  One of:
 //  :: for shared reference counters
 //  refcache:: for refcache counters
@@ -2,13 +2,14 @@
 
 #include "compiler.h"
 #include <sys/types.h>
+#include <uk/spawn.h>
 
 typedef struct {
   void *base;
   size_t pos, max;
 } posix_spawn_file_actions_t;
 
-typedef struct { } posix_spawnattr_t;
+typedef struct __posix_spawnattr posix_spawnattr_t;
 
 BEGIN_DECLS
 
@@ -24,5 +25,13 @@ int posix_spawn_file_actions_addopen(
   int oflag, mode_t mode);
 int posix_spawn_file_actions_destroy(posix_spawn_file_actions_t *file_actions);
 int posix_spawn_file_actions_init(posix_spawn_file_actions_t *file_actions);
+int posix_spawnattr_init(posix_spawnattr_t *attr);
+int posix_spawnattr_destroy(posix_spawnattr_t *attr);
+int posix_spawnattr_getflags(const posix_spawnattr_t *attr, short *flags);
+int posix_spawnattr_setflags(posix_spawnattr_t *attr, short flags);
+// Request a CPU or NUMA node for the child.  These also set the
+// corresponding POSIX_SPAWN_SET*_NP flag.
+int posix_spawnattr_setcpu_np(posix_spawnattr_t *attr, int cpu);
+int posix_spawnattr_setnode_np(posix_spawnattr_t *attr, int node);
 
 END_DECLS
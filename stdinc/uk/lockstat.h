@@ -1,23 +1,40 @@
+#pragma once
+
 #include "ilist.hh"
 
 #define LOCKSTAT_MAGIC 0xb4cd79c1b2e46f40ull
 
 #if __cplusplus
 
-struct cpulockstat {
-  u64 acquires;
-  u64 contends;
-  u64 locking;
-  u64 locked;
+// Histograms have a bucket per power of two cycles.  Bucket i counts
+// waits or holds of [2^i, 2^(i+1)) cycles, except that bucket 0 also
+// counts 0 and the last bucket counts everything longer.
+#define LOCKSTAT_BUCKETS   32
+// The number of return addresses recorded for a call site.
+#define LOCKSTAT_DEPTH     4
+// The number of contending call sites reported per lock class.
+#define LOCKSTAT_SITES     8
 
-  u64 locking_ts;
-  u64 locked_ts;
-  __padout__;
-} __mpalign__;
+// A call site that waited for a lock.
+struct lockstat_site {
+  u64 pcs[LOCKSTAT_DEPTH];
+  u64 contends;
+  u64 wait;                     // Total cycles waited
+};
 
+// Statistics for one lock class, summed over all CPUs.  This is what
+// /dev/lockstat returns.
 struct lockstat {
   char name[16];
-  struct cpulockstat cpu[NCPU] __mpalign__;
+  u64 acquires;
+  u64 contends;
+  u64 locking;                  // Total cycles waited
+  u64 locked;                   // Total cycles held
+  u64 wait_hist[LOCKSTAT_BUCKETS];
+  u64 hold_hist[LOCKSTAT_BUCKETS];
+  // The call sites that waited longest, most first.  Unused slots
+  // have contends == 0.
+  struct lockstat_site sites[LOCKSTAT_SITES];
 };
 
 #else
@@ -30,3 +30,24 @@ struct __posix_spawn_file_action_dup2
   __posix_spawn_file_action_hdr hdr;
   int fildes, newfildes;
 };
+
+// Standard posix_spawnattr flags.  The kernel has no user IDs,
+// process groups, signal dispositions, or scheduling policies, so it
+// accepts these and otherwise ignores them.
+#define POSIX_SPAWN_RESETIDS      0x01
+#define POSIX_SPAWN_SETPGROUP     0x02
+#define POSIX_SPAWN_SETSIGDEF     0x04
+#define POSIX_SPAWN_SETSIGMASK    0x08
+#define POSIX_SPAWN_SETSCHEDPARAM 0x10
+#define POSIX_SPAWN_SETSCHEDULER  0x20
+
+// Non-portable posix_spawnattr flags
+#define POSIX_SPAWN_SETCPU_NP   0x1000  // Start the child on cpu
+#define POSIX_SPAWN_SETNODE_NP  0x2000  // Start the child on node
+
+struct __posix_spawnattr
+{
+  short flags;
+  int cpu;
+  int node;
+};
@@ -0,0 +1,26 @@
+// User/kernel shared per-syscall statistics
+#pragma once
+
+// Histograms have a bucket per power of two cycles.  Bucket i counts
+// calls that took [2^i, 2^(i+1)) cycles, except that bucket 0 also
+// counts 0 and the last bucket counts everything longer.
+#define SYSCALLSTAT_BUCKETS 32
+
+// Statistics for one system call, summed over all CPUs.  Reading
+// /dev/syscallstat returns one of these for each system call number,
+// including unused numbers, which have an empty name.
+struct syscallstat {
+  char name[24];
+  u64 num;
+  u64 count;
+  u64 cycles;                   // Total cycles in the call
+  u64 hist[SYSCALLSTAT_BUCKETS];
+};
+
+// Commands written to /dev/syscallstat.  SYSCALLSTAT_PID is followed
+// by a decimal process ID; statistics are then gathered only for that
+// process, or for all processes if it is 0.
+#define SYSCALLSTAT_START  '1'
+#define SYSCALLSTAT_STOP   '2'
+#define SYSCALLSTAT_CLEAR  '3'
+#define SYSCALLSTAT_PID    'p'
@@ -0,0 +1,11 @@
+// User/kernel shared CPU topology
+#pragma once
+
+// Reading /dev/topology returns one of these for each CPU, indexed by
+// CPU ID.
+struct cputopo {
+  u32 cpu;
+  u32 node;                     // NUMA node index
+  u32 hwid;                     // Local APIC ID
+  u32 pad;
+};
@@ -15,3 +15,8 @@ enum stat_flags {
 #define SEEK_SET 0
 #define SEEK_CUR 1
 #define SEEK_END 2
+
+// sysconf names (Linux's values)
+#define _SC_PAGESIZE         30
+#define _SC_NPROCESSORS_CONF 83
+#define _SC_NPROCESSORS_ONLN 84
@@ -0,0 +1,202 @@
+// Convert a kernel trace recorded by ktrace to Chrome trace-event JSON,
+// which chrome://tracing and Perfetto can display.
+//
+// The output has two groups of tracks.  "CPUs" has one track per CPU
+// showing which process was running, reconstructed from sched_switch
+// events.  "Processes" has one track per kernel process with its
+// tracepoint durations and instants.  Durations follow the process
+// rather than the CPU because a process may sleep and migrate in the
+// middle of one (e.g., futex_wait).
+
+#define __STDC_FORMAT_MACROS
+
+#include <inttypes.h>
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+
+#include <algorithm>
+#include <map>
+#include <vector>
+
+#include "include/trace.h"
+
+struct event_info
+{
+  const char *name;
+  char phase;
+  const char *arg[2];
+};
+
+static const event_info events[] = {
+#define X(name, cat, ph, a0, a1) { #name, ph, { a0, a1 } },
+  TRACE_EVENTS(X)
+#undef X
+};
+
+// Chrome "pid"s for the two groups of tracks
+enum { GROUP_CPUS = 0, GROUP_PROCS = 1 };
+// Track for records with no current process
+#define NOPROC_TID(cpu) (1000000 + (cpu))
+
+static void __attribute__((noreturn))
+die(const char* errstr, ...)
+{
+  va_list ap;
+
+  va_start(ap, errstr);
+  vfprintf(stderr, errstr, ap);
+  va_end(ap);
+  fprintf(stderr, "\n");
+  exit(EXIT_FAILURE);
+}
+
+static std::vector<trace_rec> recs;
+static uint64_t base_tsc;
+static double tsc_per_us;
+static const char *sep = "";
+
+static double
+to_us(uint64_t tsc)
+{
+  return (tsc - base_tsc) / tsc_per_us;
+}
+
+static void
+emit(const char *fmt, ...)
+{
+  va_list ap;
+
+  printf("%s\n  {", sep);
+  va_start(ap, fmt);
+  vprintf(fmt, ap);
+  va_end(ap);
+  printf("}");
+  sep = ",";
+}
+
+static void
+emit_meta(int pid, int64_t tid, const char *what, const char *name)
+{
+  if (tid < 0)
+    emit("\"ph\":\"M\",\"pid\":%d,\"name\":\"%s\",\"args\":{\"name\":\"%s\"}",
+         pid, what, name);
+  else
+    emit("\"ph\":\"M\",\"pid\":%d,\"tid\":%" PRId64 ",\"name\":\"%s\","
+         "\"args\":{\"name\":\"%s\"}", pid, tid, what, name);
+}
+
+static void
+read_trace(const char *path)
+{
+  FILE *fp = fopen(path, "rb");
+  if (!fp)
+    die("%s: %s", path, strerror(errno));
+  trace_rec r;
+  while (fread(&r, sizeof(r), 1, fp) == 1) {
+    if (r.event >= TRACE_NEVENTS)
+      die("%s: bad event %u", path, r.event);
+    recs.push_back(r);
+  }
+  fclose(fp);
+
+  // Records from each CPU are in order, but CPUs are interleaved.
+  std::stable_sort(recs.begin(), recs.end(),
+                   [](const trace_rec &a, const trace_rec &b) {
+                     return a.tsc < b.tsc;
+                   });
+}
+
+int
+main(int ac, char **av)
+{
+  if (ac < 2 || ac > 3)
+    die("usage: %s ktrace-file [tsc-MHz] > trace.json", av[0]);
+
+  read_trace(av[1]);
+  if (recs.empty())
+    die("%s: no records", av[1]);
+
+  if (ac == 3)
+    tsc_per_us = atof(av[2]);
+  for (auto &r : recs) {
+    if (r.event == TRACE_EV_clock && !tsc_per_us)
+      tsc_per_us = r.arg[0] / 1e6;
+  }
+  if (!tsc_per_us)
+    die("%s: no clock record; give the TSC frequency in MHz", av[1]);
+  base_tsc = recs[0].tsc;
+
+  printf("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+  emit_meta(GROUP_CPUS, -1, "process_name", "CPUs");
+  emit_meta(GROUP_PROCS, -1, "process_name", "Processes");
+
+  // The running process on each CPU, as (pid, since)
+  std::map<int, std::pair<uint32_t, uint64_t> > running;
+  std::map<int64_t, bool> tracks;
+  uint64_t end_tsc = recs.back().tsc;
+
+  for (auto &r : recs) {
+    const event_info &ev = events[r.event];
+
+    if (r.event == TRACE_EV_clock)
+      continue;
+
+    if (r.event == TRACE_EV_lost) {
+      emit("\"name\":\"lost\",\"ph\":\"i\",\"s\":\"g\",\"ts\":%.3f,"
+           "\"pid\":%d,\"tid\":%d,\"args\":{\"cpu\":%u,\"count\":%" PRIu64 "}",
+           to_us(r.tsc), GROUP_CPUS, r.cpu, r.cpu, r.arg[0]);
+      continue;
+    }
+
+    if (r.event == TRACE_EV_sched_switch) {
+      auto it = running.find(r.cpu);
+      if (it != running.end() && it->second.first == r.arg[0])
+        emit("\"name\":\"pid %u\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+             "\"pid\":%d,\"tid\":%u",
+             it->second.first, to_us(it->second.second),
+             to_us(r.tsc) - to_us(it->second.second), GROUP_CPUS, r.cpu);
+      running[r.cpu] = std::make_pair((uint32_t)r.arg[1], r.tsc);
+    }
+
+    int64_t tid = r.pid ? r.pid : NOPROC_TID(r.cpu);
+    if (!tracks[tid]) {
+      char name[32];
+      if (r.pid)
+        snprintf(name, sizeof(name), "pid %u", r.pid);
+      else
+        snprintf(name, sizeof(name), "cpu %u (no process)", r.cpu);
+      emit_meta(GROUP_PROCS, tid, "thread_name", name);
+      tracks[tid] = true;
+    }
+
+    printf("%s\n  {\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":%d,"
+           "\"tid\":%" PRId64, sep, ev.name, ev.phase, to_us(r.tsc),
+           GROUP_PROCS, tid);
+    if (ev.phase == 'i')
+      printf(",\"s\":\"t\"");
+    printf(",\"args\":{\"cpu\":%u", r.cpu);
+    for (int i = 0; i < 2; i++)
+      if (ev.arg[i])
+        printf(",\"%s\":%" PRIu64, ev.arg[i], r.arg[i]);
+    printf("}}");
+    sep = ",";
+  }
+
+  // Close out whatever was still running when the trace ended
+  for (auto &it : running)
+    emit("\"name\":\"pid %u\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+         "\"pid\":%d,\"tid\":%d",
+         it.second.first, to_us(it.second.second),
+         to_us(end_tsc) - to_us(it.second.second), GROUP_CPUS, it.first);
+  for (auto &it : running) {
+    char name[16];
+    snprintf(name, sizeof(name), "cpu %d", it.first);
+    emit_meta(GROUP_CPUS, it.first, "thread_name", name);
+  }
+
+  printf("\n]}\n");
+  return 0;
+}
@@ -238,6 +238,73 @@ print_entry(Addr2line &addr2line, uint64_t count, uint64_t total,
   printf("\n");
 }
 
+// Symbolize one frame of a folded stack.  Frames that are addresses
+// become the function (and any functions inlined into it) at that
+// address, outermost first.  Anything else is returned unchanged.
+static std::string
+symbolize_frame(const char *frame, Addr2line *kernel, Addr2line *user)
+{
+  char *end;
+  if (strncmp(frame, "0x", 2) != 0)
+    return frame;
+  uint64_t pc = strtoull(frame, &end, 16);
+  bool kframe = strcmp(end, "_[k]") == 0;
+  Addr2line *a = kframe ? kernel : user;
+  std::vector<line_info> li;
+  if (!a || (*end && !kframe) || a->lookup(pc, &li) < 0 || li.empty() ||
+      li[0].func == "??")
+    return frame;
+
+  std::string out;
+  for (auto it = li.rbegin(); it != li.rend(); ++it) {
+    if (!out.empty())
+      out += ';';
+    out += it->func;
+    if (kframe)
+      out += "_[k]";
+  }
+  return out;
+}
+
+// Rewrite the addresses in a folded stack file from stackprof as
+// function names.  Kernel frames are looked up in kelf and user frames
+// in uelf, if given.
+static void
+symbolize_folded(const char *path, const char *kelf, const char *uelf)
+{
+  FILE *f = fopen(path, "r");
+  if (!f)
+    edie("%s", path);
+
+  Addr2line kernel(kelf);
+  Addr2line *user = uelf ? new Addr2line(uelf) : nullptr;
+  std::unordered_map<std::string, std::string> cache;
+
+  char *line = nullptr;
+  size_t cap = 0;
+  while (getline(&line, &cap, f) > 0) {
+    char *count = strrchr(line, ' ');
+    if (!count)
+      continue;
+    *count++ = 0;
+    std::string out;
+    for (char *frame = strtok(line, ";"); frame;
+         frame = strtok(nullptr, ";")) {
+      auto it = cache.find(frame);
+      if (it == cache.end())
+        it = cache.emplace(frame, symbolize_frame(frame, &kernel, user)).first;
+      if (!out.empty())
+        out += ';';
+      out += it->second;
+    }
+    printf("%s %s", out.c_str(), count);
+  }
+
+  free(line);
+  delete user;
+  fclose(f);
+}
+
 static void
 selfless(void)
 {
@@ -283,8 +350,14 @@ main(int ac, char **av)
   char *x;
   int fd;
 
+  if (ac >= 4 && strcmp(av[1], "-f") == 0) {
+    symbolize_folded(av[2], av[3], ac > 4 ? av[4] : nullptr);
+    return 0;
+  }
+
   if (ac < 3) {
-    fprintf(stderr, "usage: %s sample-file elf-file\n", av[0]);
+    fprintf(stderr, "usage: %s sample-file elf-file\n"
+            "       %s -f folded-file kernel-elf [user-elf]\n", av[0], av[0]);
     exit(EXIT_FAILURE);
   }
 
@@ -30,6 +30,7 @@ def main():
         print "#include \"kernel.hh\""
         print "#include <uk/unistd.h>"
         print "#include <uk/signal.h>"
+        print "#include <uk/spawn.h>"
         print
         for syscall in syscalls:
             print "extern %s %s(%s);" % (syscall.rettype, syscall.kname,